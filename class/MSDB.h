@@ -3,3 +3,15 @@
 #import "MSDatabaseAdditions.h"
 #import "MSDatabaseQueue.h"
 #import "MSDatabasePool.h"
+#import "MSDatabasePageCursor.h"
+#import "MSDatabaseFullTextSearch.h"
+#import "MSDatabaseSpatialIndex.h"
+#import "MSDatabaseMaterializedAggregate.h"
+#import "MSDatabaseWatchdog.h"
+#import "MSDatabaseIOStatistics.h"
+#import "MSDatabaseLogger.h"
+#import "MSDatabaseRetryPolicy.h"
+#import "MSDatabasePartitionedTable.h"
+#import "MSDatabaseExpiry.h"
+#import "MSDatabaseSession.h"
+#import "MSDatabaseTypedBinding.h"
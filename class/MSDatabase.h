@@ -10,6 +10,9 @@
 #import "sqlite3.h"
 #import "MSResultSet.h"
 #import "MSDatabasePool.h"
+#import "MSDatabaseIOStatistics.h"
+#import "MSDatabaseLogger.h"
+#import "MSDatabaseSession.h"
 
 
 #if ! __has_feature(objc_arc)
@@ -49,6 +52,96 @@
 
 typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary);
 
+/** How `NSDate` values are written by `bindObject:` and read back by `<[MSResultSet dateForColumnIndex:]>`.
+ 
+ @see dateStorage
+ */
+
+typedef NS_ENUM(NSInteger, MSDBDateStorage) {
+    /** `REAL` seconds since 1970, or text through the date formatter if one is set. This is the default. */
+    MSDBDateStorageTimeInterval = 0,
+    /** `INTEGER` milliseconds since 1970. */
+    MSDBDateStorageEpochMilliseconds,
+    /** `REAL` Julian day number, the same representation as SQLite's `julianday()`. */
+    MSDBDateStorageJulianDay,
+    /** `TEXT` of the fixed form `YYYY-MM-DDTHH:MM:SS.sssZ`, always in UTC. */
+    MSDBDateStorageISO8601,
+};
+
+/** Binds `value` to parameter `idx` of `statement` for a registered type codec.
+ 
+ @return The result of the `sqlite3_bind_*` call. Anything but `SQLITE_OK` fails the statement being executed.
+ 
+ @see registerTypeCodecForClass:binder:decoder:
+ */
+
+typedef int(^MSDBTypeBinderBlock)(id value, sqlite3_stmt *statement, int idx);
+
+/** Decodes column `idx` of the current row of `statement` for a registered type codec.
+ 
+ @return The decoded object, or `nil` if the column is `NULL` or cannot be decoded.
+ 
+ @see registerTypeCodecForClass:binder:decoder:
+ */
+
+typedef id(^MSDBTypeDecoderBlock)(sqlite3_stmt *statement, int idx);
+
+#define MSDBISO8601DateBufferLength 32
+
+/** Format a time interval since 1970 as `YYYY-MM-DDTHH:MM:SS.sssZ`.
+ 
+ @param interval Seconds since 1970, rounded to the nearest millisecond.
+ @param buffer At least `MSDBISO8601DateBufferLength` bytes; receives a NUL terminated string.
+ 
+ @return The length of the formatted string, or `0` if the year falls outside 0000-9999.
+ */
+
+int MSDBFormatISO8601Date(NSTimeInterval interval, char *buffer);
+
+/** Parse an ISO-8601 date without going through `NSDateFormatter`.
+ 
+ Accepts `YYYY-MM-DD`, optionally followed by `T` or a space and `HH:MM`, `:SS`, a fraction of a second and a `Z` or `±HH[:MM]` offset. Dates without an offset are taken as UTC.
+ 
+ @param text The UTF-8 text; need not be NUL terminated.
+ @param length Number of bytes in `text`.
+ @param outInterval Receives seconds since 1970.
+ 
+ @return `YES` if the whole of `text` was parsed.
+ */
+
+BOOL MSDBParseISO8601Date(const char *text, int length, NSTimeInterval *outInterval);
+
+/** Compress a value into MSDB's compressed value format.
+ 
+ The result is an 8 byte header (`MSZ`, a kind byte, and the big-endian uncompressed length) followed by a zlib stream.
+ 
+ @param bytes The value to compress.
+ @param length Number of bytes in `bytes`.
+ @param kind `'t'` if the value is text, `'b'` if it is a blob; decompression hands this back.
+ @param level zlib compression level, `Z_DEFAULT_COMPRESSION` (-1) or 1-9.
+ @param outLength Receives the length of the compressed value.
+ 
+ @return A buffer to be released with `sqlite3_free`, or `NULL` if compression failed or would not make the value smaller.
+ */
+
+unsigned char *MSDBCompressBytes(const void *bytes, int length, int kind, int level, int *outLength);
+
+/** Decompress a value produced by `MSDBCompressBytes`.
+ 
+ @param bytes The stored value.
+ @param length Number of bytes in `bytes`.
+ @param outKind Receives `'t'` or `'b'`; may be `NULL`.
+ @param outLength Receives the length of the original value.
+ 
+ @return A NUL terminated buffer to be released with `sqlite3_free`, or `NULL` if `bytes` is not a compressed value or is corrupt.
+ */
+
+unsigned char *MSDBDecompressBytes(const void *bytes, int length, int *outKind, int *outLength);
+
+/** The kind byte (`'t'` or `'b'`) of a compressed value, or `0` if `bytes` does not carry the compressed value header, or carries it with an implausible original length. */
+
+int MSDBCompressedValueKind(const void *bytes, int length);
+
 
 /** A SQLite ([http://sqlite.org/](http://sqlite.org/)) Objective-C wrapper.
  
@@ -98,6 +191,32 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
     NSMutableSet        *_openFunctions;
 
     NSDateFormatter     *_dateFormat;
+    MSDBDateStorage     _dateStorage;
+    
+    NSMutableArray      *_typeCodecs;
+    NSMapTable          *_typeCodecCache;
+    
+    NSMutableDictionary *_compressedColumns;
+    BOOL                _decompressesValues;
+    
+    NSTimeInterval      _lastUseTime;
+    sqlite3_stmt        *_validationStatement;
+    
+    BOOL                _instrumentsIO;
+    struct MSDBIOShim   *_ioShim;
+    
+    BOOL                _loadedIntoMemory;
+    unsigned char       _fileFormatVersions[2];
+    unsigned int        _writtenDataVersion;
+    
+    unsigned long long  _contentionCount;
+    
+    NSMutableSet        *_openSessions;
+    
+    CFMutableArrayRef   _recycledStatements;
+    NSUInteger          _recycleLimit;
+    unsigned long long  _statementAllocations;
+    unsigned long long  _statementReuses;
 }
 
 ///-----------------
@@ -124,6 +243,17 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 
 @property (atomic, retain) NSMutableDictionary *cachedStatements;
 
+/** When the connection was last handed back to its `<MSDatabaseQueue>` or `<MSDatabasePool>`, as `timeIntervalSinceReferenceDate`; `0` if never */
+
+@property (atomic, assign) NSTimeInterval lastUseTime;
+
+/** Whether the connection counts its disk I/O; set it before `<open>` or `<openWithFlags:>`. Defaults to `NO`.
+ 
+ An instrumented connection opens through its own shim VFS, which wraps the default VFS and counts and times the reads, writes and syncs of every file the connection opens: the database, its journal or WAL, and temporary files. The counters are read with `<ioStatistics>` and `<ioStatisticsByFile>`, and live until the connection closes. The cost is two clock reads and a few relaxed atomic adds per I/O call.
+ */
+
+@property (atomic, assign) BOOL instrumentsIO;
+
 ///---------------------
 /// @name Initialization
 ///---------------------
@@ -245,13 +375,56 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
  This will confirm whether:
  
  - is database open
- - if open, it will try a simple SELECT statement and confirm that it succeeds.
+ - if open, whether its main database is still attached
+ - if so, it will step a `SELECT 1` statement, prepared once per connection, and confirm that it returns a row.
+ 
+ The check neither reads the schema nor goes through `<executeQuery:>`, so it costs the same however many tables the database has, and is cheap enough to run on every pool checkout.
 
  @return `YES` if everything succeeds, `NO` on failure.
  */
 
 - (BOOL)goodConnection;
 
+#if SQLITE_VERSION_NUMBER >= 3036000
+
+/** Open a connection that serves every query from a copy of the database in memory.
+ 
+ The file at `<databasePath>` is copied, through the backup API and so consistently even in WAL mode, into an in-memory database created with `sqlite3_deserialize`. Unless opening read-only, any WAL beside the file is checkpointed into it first. Queries then never touch the file system. Changes stay in memory until `<writeBackToDisk:>`, which `<close>` does not call.
+ 
+ Meant for small, read-mostly databases that this connection owns: other connections to the file see neither the in-memory changes nor, until they reopen, the file a write-back puts in place.
+ 
+ @param flags As for `<openWithFlags:>`. With `SQLITE_OPEN_READONLY` the in-memory copy is read-only too; with `SQLITE_OPEN_CREATE`, a missing file starts an empty database, created on the first write-back.
+ 
+ @return `YES` if successful, `NO` on error.
+ 
+ @see writeBackToDisk:
+ */
+
+- (BOOL)openInMemoryWithFlags:(int)flags;
+
+/** Whether the connection was opened with `<openInMemoryWithFlags:>` */
+
+- (BOOL)isLoadedIntoMemory;
+
+/** Whether the in-memory copy changed since it was loaded or last written back. */
+
+- (BOOL)hasUnwrittenChanges;
+
+/** Write the in-memory copy over the file at `<databasePath>`.
+ 
+ The image is written to a temporary file in the same directory, synced, and renamed over the database, so that the file on disk is always either the old or the new database, even after a crash. The file keeps its journal mode.
+ 
+ A WAL left beside the file, by a crash or by another connection, is checkpointed and truncated first: its frames would otherwise be replayed over the new database the next time it is opened. If that is not possible, because another connection is still reading from the WAL, nothing is written.
+ 
+ @param outErr On failure, the error.
+ 
+ @return `YES` on success; `NO` if the connection is not in memory, a transaction is open, the WAL could not be emptied, or writing failed.
+ */
+
+- (BOOL)writeBackToDisk:(NSError **)outErr;
+
+#endif
+
 
 ///----------------------
 /// @name Perform updates
@@ -398,6 +571,21 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 
 - (BOOL)executeUpdate:(NSString*)sql withVAList: (va_list)args;
 
+/** Execute single update statement through the statement cache
+ 
+ Behaves like `<executeUpdate:withArgumentsInArray:>`, but the prepared statement is always kept in the statement cache and reused, even when `<shouldCacheStatements>` is off.
+ 
+ @param sql The SQL to be performed, with optional `?` placeholders.
+ 
+ @param arguments A `NSArray` of objects to be used when binding values to the `?` placeholders in the SQL statement.
+ 
+ @return `YES` upon success; `NO` upon failure.
+ 
+ @see executeCachedQuery:withArgumentsInArray:
+ */
+
+- (BOOL)executeCachedUpdate:(NSString*)sql withArgumentsInArray:(NSArray *)arguments;
+
 /** Execute multiple SQL statements
  
  This executes a series of SQL statements that are combined in a single string (e.g. the SQL generated by the `sqlite3` command line `.dump` command). This accepts no value parameters, but rather simply expects a single string with multiple SQL statements, each terminated with a semicolon. This uses `sqlite3_exec`. 
@@ -557,6 +745,21 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 // Documentation forthcoming.
 - (MSResultSet *)executeQuery:(NSString*)sql withVAList: (va_list)args;
 
+/** Execute select statement through the statement cache
+ 
+ Behaves like `<executeQuery:withArgumentsInArray:>`, but the prepared statement is always kept in the statement cache and reused on later calls with the same SQL, even when `<shouldCacheStatements>` is off. Use it for hot statements issued by helpers that should not change the connection's caching policy.
+ 
+ @param sql The SELECT statement to be performed, with optional `?` placeholders.
+ 
+ @param arguments A `NSArray` of objects to be used when binding values to the `?` placeholders in the SQL statement.
+ 
+ @return A `<MSResultSet>` for the result set upon success; `nil` upon failure.
+ 
+ @see executeCachedUpdate:withArgumentsInArray:
+ */
+
+- (MSResultSet *)executeCachedQuery:(NSString *)sql withArgumentsInArray:(NSArray *)arguments;
+
 ///-------------------
 /// @name Transactions
 ///-------------------
@@ -645,6 +848,15 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 
 - (BOOL)hasOpenResultSets;
 
+/** SQL of the result sets that are still open, for diagnosing result sets that were never closed
+ 
+ @return Array of `NSString` queries; empty if there are no open result sets.
+ 
+ @see hasOpenResultSets
+ */
+
+- (NSArray *)queriesOfOpenResultSets;
+
 /** Return whether should cache statements or not
  
  @return `YES` if should cache statements; `NO` if not.
@@ -659,6 +871,38 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 
 - (void)setShouldCacheStatements:(BOOL)value;
 
+/** How many statement wrappers of uncached queries the connection keeps for reuse. `0` turns recycling off. Defaults to 4.
+ 
+ A query not served from the statement cache otherwise allocates an `MSStatement` to wrap its prepared statement, and frees it when its result set closes. Instead, the closing result set hands the wrapper back to its connection, which gives it to the next uncached query. The wrapper belongs to its result set alone, so nobody else can see it come back; do not keep `<[MSResultSet statement]>` of an uncached query past `<[MSResultSet close]>`.
+ 
+ Result sets themselves are not recycled: the caller, its autorelease pools and any `__weak` reference may still hold one after it is closed. Measure the effect with `<benchmarkRecyclingWithQuery:iterations:>`.
+ */
+
+@property (atomic, assign) NSUInteger recycleLimit;
+
+/** Statement wrappers allocated by this connection */
+
+@property (atomic, readonly) unsigned long long statementAllocations;
+
+/** Uncached queries that got a recycled statement wrapper instead */
+
+@property (atomic, readonly) unsigned long long statementReuses;
+
+/** Run a query repeatedly, first with recycling off, then on, and count the statement wrappers allocated.
+ 
+ Each run executes `sql` `iterations` times, steps through every row, and closes the result set, in an autorelease pool per iteration. Wrappers are only recycled for uncached queries, so turn `<shouldCacheStatements>` off first to see a difference. `<recycleLimit>` is restored afterwards, `1` being used for the second run if it was `0`.
+ 
+    NSDictionary *report = [db benchmarkRecyclingWithQuery:@"select name from users where id = 1" iterations:10000];
+    // report[@"statementAllocationsWithRecycling"] is 1, against 10000 without
+ 
+ @param sql The query, without arguments.
+ @param iterations How many times to run it in each run.
+ 
+ @return `NSNumber` values under `statementAllocationsWithoutRecycling`, `statementAllocationsWithRecycling`, `secondsWithoutRecycling` and `secondsWithRecycling`.
+ */
+
+- (NSDictionary *)benchmarkRecyclingWithQuery:(NSString *)sql iterations:(NSUInteger)iterations;
+
 
 ///-------------------------
 /// @name Encryption methods
@@ -798,6 +1042,13 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 - (void)setMaxBusyRetryTimeInterval:(NSTimeInterval)timeoutInSeconds;
 - (NSTimeInterval)maxBusyRetryTimeInterval;
 
+/** Number of statements on this connection that failed to prepare or step with `SQLITE_BUSY` or `SQLITE_LOCKED`, including those that gave up after `<maxBusyRetryTimeInterval>`.
+ 
+ `<MSDatabaseRetryPolicy>` compares it before and after a transaction block to tell whether the block lost a lock, whatever the block did with the failure.
+ */
+
+@property (atomic, readonly) unsigned long long contentionCount;
+
 
 #if SQLITE_VERSION_NUMBER >= 3007000
 
@@ -1029,6 +1280,269 @@ typedef int(^MSDBExecuteStatementsCallbackBlock)(NSDictionary *resultsDictionary
 
 - (NSString *)stringFromDate:(NSDate *)date;
 
+/** How `NSDate` values are stored in and read back from the database.
+ 
+ Any mode other than `MSDBDateStorageTimeInterval` bypasses the date formatter entirely, on both bind and read, so the same representation is always used in both directions. The ISO-8601 form is produced and parsed by hand-written C routines rather than `NSDateFormatter`, and sorts correctly as text.
+ 
+ Example:
+ 
+    db.dateStorage = MSDBDateStorageEpochMilliseconds;
+    [db executeUpdate:@"insert into events (ts) values (?)", [NSDate date]];
+ 
+ @see MSDBDateStorage
+ @see setDateFormat:
+ */
+
+@property (atomic, assign) MSDBDateStorage dateStorage;
+
+/** Convert a column value stored with the current `<dateStorage>` into an `NSDate`.
+ 
+ @param statement The statement positioned on a row.
+ @param columnIdx Zero-based index for column.
+ 
+ @return The `NSDate`; `nil` if the column is `NULL` or cannot be decoded.
+ */
+
+- (NSDate *)dateFromStatement:(sqlite3_stmt *)statement column:(int)columnIdx;
+
+///------------------
+/// @name Type codecs
+///------------------
+
+/** Register a binder and decoder for objects of a class.
+ 
+ Objects that are instances of `cls` (or of a subclass) are bound with `binder` instead of the default `NSData`/`NSDate`/`NSNumber`/`description` handling, and `<[MSResultSet objectOfClass:forColumnIndex:]>` decodes them with `decoder`. Codecs are consulted before the built-in types, so a codec for `NSDecimalNumber` takes precedence over the `NSNumber` handling. The most recently registered codec wins when more than one matches.
+ 
+ Lookups are cached per class pointer, so after the first object of a given class is bound, finding its codec costs a single hash lookup.
+ 
+ For example, to store `NSURL` values as their absolute string:
+ 
+    [db registerTypeCodecForClass:[NSURL class] binder:^int(id value, sqlite3_stmt *statement, int idx) {
+        return sqlite3_bind_text(statement, idx, [[value absoluteString] UTF8String], -1, SQLITE_TRANSIENT);
+    } decoder:^id(sqlite3_stmt *statement, int idx) {
+        const char *c = (const char *)sqlite3_column_text(statement, idx);
+        return c ? [NSURL URLWithString:[NSString stringWithUTF8String:c]] : nil;
+    }];
+ 
+ @param cls The class handled by the codec.
+ @param binder Block used to bind values; may be `nil` to only decode.
+ @param decoder Block used to decode values; may be `nil` to only bind.
+ 
+ @see unregisterTypeCodecForClass:
+ @see registerUUIDTypeCodec
+ @see registerDecimalNumberTypeCodecWithScale:
+ */
+
+- (void)registerTypeCodecForClass:(Class)cls binder:(MSDBTypeBinderBlock)binder decoder:(MSDBTypeDecoderBlock)decoder;
+
+/** Remove the codec registered for exactly `cls`.
+ 
+ @param cls The class passed to `<registerTypeCodecForClass:binder:decoder:>`.
+ */
+
+- (void)unregisterTypeCodecForClass:(Class)cls;
+
+/** Store `NSUUID` values as 16-byte blobs.
+ 
+ The decoder also accepts the textual form, so columns written with the old `description` fallback can still be read.
+ 
+ @see [MSResultSet UUIDForColumnIndex:]
+ */
+
+- (void)registerUUIDTypeCodec;
+
+/** Store `NSDecimalNumber` values as `INTEGER` scaled by `10^scale`.
+ 
+ With a scale of `2`, `12.34` is stored as `1234`. Values are rounded to `scale` decimal places on bind. A value that does not fit in a signed 64 bit integer once scaled is not bound: an error is logged and the `executeUpdate:` or `executeQuery:` fails without running the statement.
+ 
+ @param scale Number of decimal places to keep.
+ 
+ @see [MSResultSet decimalNumberForColumnIndex:]
+ */
+
+- (void)registerDecimalNumberTypeCodecWithScale:(short)scale;
+
+/** The decoder that would be used for objects of `cls`, or `nil` if none is registered.
+ 
+ @param cls The class to decode.
+ */
+
+- (MSDBTypeDecoderBlock)typeDecoderForClass:(Class)cls;
+
+///------------------
+/// @name Compression
+///------------------
+
+/** Compress values bound for a column once they reach a size threshold.
+ 
+ MSDB cannot tell which column a bare `?` is bound to, so compression applies to named parameters whose name matches the column (`:payload`, `@payload` or `$payload`), whether bound from a dictionary, an array or a variable argument list. For `?` placeholders, wrap the parameter in the `msdb_compress()` SQL function instead (see `<registerCompressionFunctions>`).
+ 
+ Text and blobs are compressed with zlib and stored as blobs with a small header. Values that do not shrink are stored as is. Enabling compression for any column also turns on `<decompressesValues>`.
+ 
+    [db enableCompressionForColumn:@"payload" threshold:512];
+    [db executeUpdate:@"insert into events (id, payload) values (:id, :payload)" withParameterDictionary:@{@"id": @1, @"payload": json}];
+ 
+ @param columnName The column (and parameter) name; matched case-insensitively.
+ @param threshold Minimum size in bytes before a value is compressed.
+ 
+ @warning MSDB must be linked against zlib (`libz`).
+ */
+
+- (void)enableCompressionForColumn:(NSString *)columnName threshold:(NSUInteger)threshold;
+
+/** Stop compressing values bound for a column. Values already stored stay compressed and are still decompressed on read.
+ 
+ @param columnName The column name passed to `<enableCompressionForColumn:threshold:>`.
+ */
+
+- (void)disableCompressionForColumn:(NSString *)columnName;
+
+/** Whether `<[MSResultSet dataForColumnIndex:]>`, `<[MSResultSet stringForColumnIndex:]>` and `<[MSResultSet objectForColumnIndex:]>` recognize and decompress compressed values.
+ 
+ Off by default so that ordinary blobs are never inspected. `<enableCompressionForColumn:threshold:>` and `<registerCompressionFunctions>` turn it on.
+ */
+
+@property (atomic, assign) BOOL decompressesValues;
+
+/** Register the `msdb_compress(value [, level])` and `msdb_decompress(value)` SQL functions on this connection.
+ 
+ `msdb_compress` returns the compressed form of a text or blob value, or the value unchanged if it would not shrink. `msdb_decompress` returns the original text or blob for a compressed value and passes everything else through, so it is safe on mixed columns:
+ 
+    update events set payload = msdb_compress(payload) where length(payload) > 512;
+    select json_extract(msdb_decompress(payload), '$.kind') from events;
+ 
+ @return `YES` if the functions were registered; `NO` if the database is not open.
+ */
+
+- (BOOL)registerCompressionFunctions;
+
+///----------------------------------
+/// @name Query planner statistics
+///----------------------------------
+
+/** Run `PRAGMA optimize`, letting SQLite re-analyze only the tables whose statistics are stale.
+ 
+ `PRAGMA optimize` looks at the queries this connection has run and runs `ANALYZE` on tables that would benefit, so it is cheapest right before a long-lived connection closes. `analysisLimit` caps the rows each index is sampled with (`PRAGMA analysis_limit`, SQLite 3.32 and later) so that the pass stays short on large tables; the connection's previous limit is restored afterwards.
+ 
+ @param analysisLimit Approximate number of rows examined per index; `0` for no limit. SQLite recommends a few hundred.
+ 
+ @return `YES` on success; `NO` on failure.
+ 
+ @see analyze
+ */
+
+- (BOOL)optimizeWithAnalysisLimit:(int)analysisLimit;
+
+/** Run a full `ANALYZE` of every table and index, without an analysis limit.
+ 
+ After a bulk load the existing statistics, or the lack of any, can lead the query planner to the wrong index until `PRAGMA optimize` catches up. A full `ANALYZE` costs a scan of every index, but leaves exact statistics; other connections pick them up when they next prepare a statement.
+ 
+ @return `YES` on success; `NO` on failure.
+ 
+ @see optimizeWithAnalysisLimit:
+ */
+
+- (BOOL)analyze;
+
+///----------------------
+/// @name Warm-up
+///----------------------
+
+/** Read tables and indexes through this connection, so that their pages are in the OS page cache and in this connection's page cache.
+ 
+ A table is read with a `count(*)` over its b-tree, an index with a full scan of the index; overflow pages of large values are not read. Pages stay in the connection's cache only as far as `PRAGMA cache_size` allows, so preload the objects your hot queries touch rather than the whole file.
+ 
+ @param names Names of tables and indexes in the main database; `nil` for all of them. Partial indexes and virtual tables are skipped.
+ @param outErr On failure, the first error; names that do not exist are reported but do not stop the others.
+ 
+ @return `YES` if every object was read; `NO` otherwise.
+ */
+
+- (BOOL)preloadObjects:(NSArray *)names error:(NSError **)outErr;
+
+/** Prepare statements ahead of use and keep them in the statement cache.
+ 
+ `<executeCachedQuery:withArgumentsInArray:>` and `<executeCachedUpdate:withArgumentsInArray:>`, and the other execute methods while `<shouldCacheStatements>` is on, then find these statements already compiled. Statements that are cached already are left alone.
+ 
+ @param queries SQL strings, exactly as they will later be executed.
+ @param outErr On failure, the error preparing the first statement that failed.
+ 
+ @return `YES` if every statement was prepared; `NO` otherwise.
+ */
+
+- (BOOL)prepareStatementsForQueries:(NSArray *)queries error:(NSError **)outErr;
+
+///----------------------
+/// @name I/O statistics
+///----------------------
+
+/** The disk I/O of every file this connection has opened, added up.
+ 
+ @return A snapshot of the counters; `nil` unless the connection is open with `<instrumentsIO>`.
+ */
+
+- (MSDatabaseIOStatistics *)ioStatistics;
+
+/** The disk I/O of each file this connection has opened, main database first.
+ 
+ Files opened more than once, such as a rollback journal, are counted under one entry. Temporary files without a name share an entry whose `path` is `nil`.
+ 
+ @return `MSDatabaseIOStatistics` snapshots; `nil` unless the connection is open with `<instrumentsIO>`.
+ */
+
+- (NSArray *)ioStatisticsByFile;
+
+/** Zero the I/O counters of the connection and of each of its files. */
+
+- (void)resetIOStatistics;
+
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+
+///----------------------
+/// @name Change capture
+///----------------------
+
+/** Start recording the changes made through this connection to some tables, to extract them later as a changeset or patchset.
+
+ See `<MSDatabaseSession>`. Only available when SQLite is built with `SQLITE_ENABLE_SESSION` and `SQLITE_ENABLE_PREUPDATE_HOOK`.
+
+ @param tables Names of the `main` tables to record; `nil` records every table, including those created later. More can be added with `<[MSDatabaseSession attachTable:error:]>`.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return The session, recording; `nil` on failure.
+ */
+
+- (MSDatabaseSession *)startSessionForTables:(NSArray *)tables error:(NSError **)outErr;
+
+/** Apply a changeset or patchset, in one savepoint.
+
+ Each change is applied to the row with the same primary key. A change that cannot be applied as recorded, because the row is missing, differs from the old values in the changeset, or breaks a constraint, is passed to `handler`; changes are omitted or replaced one by one, or the whole changeset is rolled back.
+
+ @param changeset The changeset or patchset, e.g. from `<[MSDatabaseSession changeset:]>`.
+ @param handler Decides each conflict; `nil` aborts on the first one.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` if every change was applied or omitted; `NO` if nothing was applied.
+ */
+
+- (BOOL)applyChangeset:(NSData *)changeset conflictHandler:(MSDBChangesetConflictHandler)handler error:(NSError **)outErr;
+
+/** Apply the changes of a changeset or patchset to some tables only.
+
+ @param changeset The changeset or patchset.
+ @param filter Called once per table in the changeset; return `NO` to skip its changes. `nil` applies every table.
+ @param handler Decides each conflict; `nil` aborts on the first one.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` if every change was applied or omitted; `NO` if nothing was applied.
+
+ @see applyChangeset:conflictHandler:error:
+ */
+
+- (BOOL)applyChangeset:(NSData *)changeset tableFilter:(BOOL (^)(NSString *table))filter conflictHandler:(MSDBChangesetConflictHandler)handler error:(NSError **)outErr;
+
+#endif
+
 @end
 
 
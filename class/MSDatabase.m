@@ -7,13 +7,62 @@
 //
 
 #import "MSDatabase.h"
+#import "MSDatabaseAdditions.h"
 #import "unistd.h"
 #import <objc/runtime.h>
+#import <math.h>
+#import <zlib.h>
+#import <fcntl.h>
+#import <sys/stat.h>
+#import <errno.h>
 
 @interface MSDatabase ()
 
 - (MSResultSet *)executeQuery:(NSString *)sql withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args;
 - (BOOL)executeUpdate:(NSString*)sql error:(NSError**)outErr withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args;
+- (void)noteResultCode:(int)rc;
+- (MSStatement *)newStatementWithHandle:(sqlite3_stmt *)pStmt;
+
+@end
+
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+
+@interface MSDatabaseSession ()
+- (instancetype)initWithDatabase:(MSDatabase *)db schema:(NSString *)schema error:(NSError **)outErr;
+@end
+
+@interface MSDBChangesetConflict ()
+- (instancetype)initWithIterator:(sqlite3_changeset_iter *)iterator type:(MSDBChangesetConflictType)type;
+- (void)invalidate;
+@end
+
+#endif
+
+/* A registered binder/decoder pair; see registerTypeCodecForClass:binder:decoder: */
+@interface MSDBTypeCodec : NSObject {
+    Class                   _codecClass;
+    MSDBTypeBinderBlock     _binder;
+    MSDBTypeDecoderBlock    _decoder;
+}
+
+@property (nonatomic, assign) Class codecClass;
+@property (nonatomic, copy) MSDBTypeBinderBlock binder;
+@property (nonatomic, copy) MSDBTypeDecoderBlock decoder;
+
+@end
+
+@implementation MSDBTypeCodec
+@synthesize codecClass=_codecClass;
+@synthesize binder=_binder;
+@synthesize decoder=_decoder;
+
+- (void)dealloc {
+    MSDBRelease(_binder);
+    MSDBRelease(_decoder);
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
 
 @end
 
@@ -23,6 +72,10 @@
 @synthesize crashOnErrors=_crashOnErrors;
 @synthesize checkedOut=_checkedOut;
 @synthesize traceExecution=_traceExecution;
+@synthesize dateStorage=_dateStorage;
+@synthesize decompressesValues=_decompressesValues;
+@synthesize lastUseTime=_lastUseTime;
+@synthesize instrumentsIO=_instrumentsIO;
 
 #pragma mark MSDatabase instantiation and deallocation
 
@@ -42,11 +95,13 @@
     
     if (self) {
         _databasePath               = [aPath copy];
-        _openResultSets             = [[NSMutableSet alloc] init];
+        // Non-retaining, compared by pointer: tracking a result set allocates no NSValue, and one in dealloc can still remove itself.
+        _openResultSets             = (__bridge_transfer NSMutableSet *)CFSetCreateMutable(NULL, 0, NULL);
         _db                         = nil;
         _logsErrors                 = YES;
         _crashOnErrors              = NO;
         _maxBusyRetryTimeInterval   = 2;
+        _recycleLimit               = 4;
     }
     
     return self;
@@ -64,6 +119,14 @@
     MSDBRelease(_dateFormat);
     MSDBRelease(_databasePath);
     MSDBRelease(_openFunctions);
+    MSDBRelease(_typeCodecs);
+    MSDBRelease(_typeCodecCache);
+    MSDBRelease(_compressedColumns);
+    MSDBRelease(_openSessions);
+    
+    if (_recycledStatements) {
+        CFRelease(_recycledStatements);
+    }
     
 #if ! __has_feature(objc_arc)
     [super dealloc];
@@ -142,9 +205,16 @@
         return YES;
     }
     
+#if SQLITE_VERSION_NUMBER >= 3005000
+    // Only sqlite3_open_v2 takes a VFS.
+    if (_instrumentsIO) {
+        return [self openWithFlags:SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE];
+    }
+#endif
+    
     int err = sqlite3_open([self sqlitePath], &_db );
     if(err != SQLITE_OK) {
-        NSLog(@"error opening!: %d", err);
+        MSDBLogError(@"error opening!: %d", err);
         return NO;
     }
     
@@ -163,12 +233,160 @@
         return YES;
     }
 
-    int err = sqlite3_open_v2([self sqlitePath], &_db, flags, NULL /* Name of VFS module to use */);
+    if (_instrumentsIO && !_ioShim) {
+        _ioShim = MSDBIOShimCreate();
+    }
+    
+    // With no shim, NULL: the default VFS.
+    int err = sqlite3_open_v2([self sqlitePath], &_db, flags, MSDBIOShimName(_ioShim));
     if(err != SQLITE_OK) {
-        NSLog(@"error opening!: %d", err);
+        MSDBLogError(@"error opening!: %d", err);
+        
+        // SQLite returns a handle even on most failures, and close releases the shim with it; without one, release it here.
+        if (!_db && _ioShim) {
+            MSDBIOShimDestroy(_ioShim);
+            _ioShim = 0x00;
+        }
+        
+        return NO;
+    }
+    
+    if (_maxBusyRetryTimeInterval > 0.0) {
+        // set the handler
+        [self setMaxBusyRetryTimeInterval:_maxBusyRetryTimeInterval];
+    }
+    
+    return YES;
+}
+#endif
+
+#if SQLITE_VERSION_NUMBER >= 3036000
+
+static unsigned int MSDBDataVersion(sqlite3 *db) {
+    unsigned int version = 0;
+    sqlite3_file_control(db, "main", SQLITE_FCNTL_DATA_VERSION, &version);
+    return version;
+}
+
+// YES once no WAL frames sit beside the file, checkpointing them into it if need be. A file renamed over the
+// database would otherwise have those stale frames replayed over it by the next connection to open it.
+static BOOL MSDBCheckpointWAL(const char *path) {
+    
+    char *walPath = NULL;
+    struct stat wal;
+    
+    if (asprintf(&walPath, "%s-wal", path) < 0) {
+        return NO;
+    }
+    
+    BOOL empty = stat(walPath, &wal) != 0 || wal.st_size == 0;
+    
+    if (!empty) {
+        sqlite3 *disk = NULL;
+        
+        // Truncates the WAL only if no other connection is reading from it.
+        if (sqlite3_open_v2(path, &disk, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK) {
+            sqlite3_exec(disk, "PRAGMA wal_checkpoint(TRUNCATE)", NULL, NULL, NULL);
+        }
+        
+        sqlite3_close(disk);
+        
+        empty = stat(walPath, &wal) != 0 || wal.st_size == 0;
+    }
+    
+    free(walPath);
+    
+    return empty;
+}
+
+- (BOOL)openInMemoryWithFlags:(int)flags {
+    
+    if (_db) {
+        return YES;
+    }
+    
+    if (![_databasePath length]) {
+        MSDBLogError(@"Only a database file can be loaded into memory");
+        return NO;
+    }
+    
+    BOOL exists = [[NSFileManager defaultManager] fileExistsAtPath:_databasePath];
+    
+    if (!exists && !(flags & SQLITE_OPEN_CREATE)) {
+        MSDBLogError(@"error opening!: no database at %@", _databasePath);
+        return NO;
+    }
+    
+    int memoryFlags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | (flags & (SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_FULLMUTEX));
+    int err = sqlite3_open_v2(":memory:", &_db, memoryFlags, NULL);
+    
+    if (err == SQLITE_OK) {
+        // An empty, growable memdb: it owns a contiguous image that writeBackToDisk: can hand to write() as is.
+        err = sqlite3_deserialize(_db, "main", NULL, 0, 0, SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE);
+    }
+    
+    _fileFormatVersions[0] = _fileFormatVersions[1] = 1;
+    
+    if (err == SQLITE_OK && exists) {
+        
+        // The load reads through the WAL either way; emptying it now lets writeBackToDisk: go ahead later.
+        if (flags & SQLITE_OPEN_READWRITE) {
+            MSDBCheckpointWAL([self sqlitePath]);
+        }
+        
+        sqlite3 *disk = NULL;
+        err = sqlite3_open_v2([self sqlitePath], &disk, SQLITE_OPEN_READONLY, NULL);
+        
+        if (err == SQLITE_OK) {
+            sqlite3_backup *backup = sqlite3_backup_init(_db, "main", disk, "main");
+            
+            if (backup) {
+                int rc = sqlite3_backup_step(backup, -1);
+                err = sqlite3_backup_finish(backup);
+                if (err == SQLITE_OK && rc != SQLITE_DONE) {
+                    err = rc;
+                }
+            }
+            else {
+                err = sqlite3_errcode(_db);
+            }
+        }
+        
+        sqlite3_close(disk);
+    }
+    
+    if (err == SQLITE_OK && exists) {
+        
+        // A memdb cannot run in WAL mode, and refuses pages whose header says it does. Load a copy
+        // marked for rollback journaling; writeBackToDisk: restores the file's own mode.
+        sqlite3_int64 size = 0;
+        unsigned char *image = sqlite3_serialize(_db, "main", &size, SQLITE_SERIALIZE_NOCOPY);
+        unsigned char *copy = (image && size > 19) ? sqlite3_malloc64((sqlite3_uint64)size) : NULL;
+        
+        if (copy) {
+            memcpy(copy, image, (size_t)size);
+            _fileFormatVersions[0] = copy[18];
+            _fileFormatVersions[1] = copy[19];
+            copy[18] = copy[19] = 1;
+            
+            int deserializeFlags = SQLITE_DESERIALIZE_FREEONCLOSE | SQLITE_DESERIALIZE_RESIZEABLE | ((flags & SQLITE_OPEN_READWRITE) ? 0 : SQLITE_DESERIALIZE_READONLY);
+            err = sqlite3_deserialize(_db, "main", copy, size, size, deserializeFlags);
+        }
+        else if (size > 0) {
+            err = SQLITE_NOMEM;
+        }
+    }
+    
+    if (err != SQLITE_OK) {
+        MSDBLogError(@"error loading %@ into memory: %d", _databasePath, err);
+        sqlite3_close(_db);
+        _db = 0x00;
         return NO;
     }
     
+    _loadedIntoMemory   = YES;
+    _writtenDataVersion = MSDBDataVersion(_db);
+    
     if (_maxBusyRetryTimeInterval > 0.0) {
         // set the handler
         [self setMaxBusyRetryTimeInterval:_maxBusyRetryTimeInterval];
@@ -176,6 +394,134 @@
     
     return YES;
 }
+
+- (BOOL)isLoadedIntoMemory {
+    return _db && _loadedIntoMemory;
+}
+
+- (BOOL)hasUnwrittenChanges {
+    return [self isLoadedIntoMemory] && MSDBDataVersion(_db) != _writtenDataVersion;
+}
+
+static BOOL MSDBWriteAll(int fd, const unsigned char *bytes, size_t length) {
+    
+    while (length > 0) {
+        ssize_t written = write(fd, bytes, length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return NO;
+        }
+        bytes  += written;
+        length -= (size_t)written;
+    }
+    
+    return YES;
+}
+
+- (BOOL)writeBackToDisk:(NSError **)outErr {
+    
+    if (![self isLoadedIntoMemory]) {
+        if (outErr) {
+            *outErr = [self errorWithMessage:@"The database is not loaded into memory"];
+        }
+        return NO;
+    }
+    
+    // Mid-transaction, the image holds uncommitted pages.
+    if (!sqlite3_get_autocommit(_db)) {
+        if (outErr) {
+            *outErr = [self errorWithMessage:@"Cannot write back to disk inside a transaction"];
+        }
+        return NO;
+    }
+    
+    sqlite3_int64 size = 0;
+    unsigned char *image = sqlite3_serialize(_db, "main", &size, SQLITE_SERIALIZE_NOCOPY);
+    
+    if (!image && size > 0) {
+        if (outErr) {
+            *outErr = [self errorWithMessage:@"Could not serialize the in-memory database"];
+        }
+        return NO;
+    }
+    
+    const char *path = [_databasePath fileSystemRepresentation];
+    
+    if (!MSDBCheckpointWAL(path)) {
+        MSDBLogError(@"error writing %@ back to disk: its WAL could not be checkpointed", _databasePath);
+        if (outErr) {
+            *outErr = [self errorWithMessage:@"Cannot write back to disk while another connection uses the database's WAL"];
+        }
+        return NO;
+    }
+    
+    char *temporaryPath = NULL;
+    
+    if (asprintf(&temporaryPath, "%s.msdb-XXXXXX", path) < 0) {
+        temporaryPath = NULL;
+    }
+    
+    int fd = temporaryPath ? mkstemp(temporaryPath) : -1;
+    BOOL success = fd >= 0;
+    struct stat existing;
+    
+    // mkstemp creates the file 0600; keep the permissions the database had.
+    if (success && stat(path, &existing) == 0) {
+        fchmod(fd, existing.st_mode & 07777);
+    }
+    
+    if (success && size > 19) {
+        // The header as the file had it, so that a WAL database stays in WAL mode.
+        success = MSDBWriteAll(fd, image, 18)
+               && MSDBWriteAll(fd, _fileFormatVersions, 2)
+               && MSDBWriteAll(fd, image + 20, (size_t)size - 20);
+    }
+    else if (success) {
+        success = MSDBWriteAll(fd, image, (size_t)size);
+    }
+    
+    success = success && fsync(fd) == 0;
+    
+    int error = success ? 0 : errno;
+    
+    // A file nobody else has open: closing it releases no one's locks.
+    if (fd >= 0 && close(fd) != 0 && success) {
+        success = NO;
+        error   = errno;
+    }
+    
+    if (success && rename(temporaryPath, path) != 0) {
+        success = NO;
+        error   = errno;
+    }
+    
+    if (success) {
+        // Make the rename itself durable.
+        int directory = open([[_databasePath stringByDeletingLastPathComponent] fileSystemRepresentation], O_RDONLY);
+        if (directory >= 0) {
+            fsync(directory);
+            close(directory);
+        }
+        
+        _writtenDataVersion = MSDBDataVersion(_db);
+    }
+    else {
+        MSDBLogError(@"error writing %@ back to disk: %s", _databasePath, strerror(error));
+        if (fd >= 0) {
+            unlink(temporaryPath);
+        }
+        if (outErr) {
+            *outErr = [NSError errorWithDomain:NSPOSIXErrorDomain code:error userInfo:nil];
+        }
+    }
+    
+    free(temporaryPath);
+    
+    return success;
+}
+
 #endif
 
 
@@ -183,11 +529,19 @@
     
     [self clearCachedStatements];
     [self closeOpenResultSets];
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+    [self closeOpenSessions];
+#endif
     
     if (!_db) {
         return YES;
     }
     
+    if (_validationStatement) {
+        sqlite3_finalize(_validationStatement);
+        _validationStatement = 0x00;
+    }
+    
     int  rc;
     BOOL retry;
     BOOL triedFinalizingOpenStatements = NO;
@@ -200,19 +554,26 @@
                 triedFinalizingOpenStatements = YES;
                 sqlite3_stmt *pStmt;
                 while ((pStmt = sqlite3_next_stmt(_db, nil)) !=0) {
-                    NSLog(@"Closing leaked statement");
+                    MSDBLogInfo(@"Closing leaked statement");
                     sqlite3_finalize(pStmt);
                     retry = YES;
                 }
             }
         }
         else if (SQLITE_OK != rc) {
-            NSLog(@"error closing!: %d", rc);
+            MSDBLogError(@"error closing!: %d", rc);
         }
     }
     while (retry);
     
+    // A connection that failed to close may still call into its VFS.
+    if (SQLITE_OK == rc && _ioShim) {
+        MSDBIOShimDestroy(_ioShim);
+        _ioShim = 0x00;
+    }
+    
     _db = nil;
+    _loadedIntoMemory = NO;
     return YES;
 }
 
@@ -242,7 +603,7 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
         int requestedSleepInMillseconds = (int) arc4random_uniform(50) + 50;
         int actualSleepInMilliseconds = sqlite3_sleep(requestedSleepInMillseconds);
         if (actualSleepInMilliseconds != requestedSleepInMillseconds) {
-            NSLog(@"WARNING: Requested sleep of %i milliseconds, but SQLite returned %i. Maybe SQLite wasn't built with HAVE_USLEEP=1?", requestedSleepInMillseconds, actualSleepInMilliseconds);
+            MSDBLogWarning(@"Requested sleep of %i milliseconds, but SQLite returned %i. Maybe SQLite wasn't built with HAVE_USLEEP=1?", requestedSleepInMillseconds, actualSleepInMilliseconds);
         }
         return 1;
     }
@@ -258,178 +619,1229 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
         return;
     }
     
-    if (timeout > 0) {
-        sqlite3_busy_handler(_db, &MSDBDatabaseBusyHandler, (__bridge void *)(self));
+    if (timeout > 0) {
+        sqlite3_busy_handler(_db, &MSDBDatabaseBusyHandler, (__bridge void *)(self));
+    }
+    else {
+        // turn it off otherwise
+        sqlite3_busy_handler(_db, nil, nil);
+    }
+}
+
+- (NSTimeInterval)maxBusyRetryTimeInterval {
+    return _maxBusyRetryTimeInterval;
+}
+
+
+// we no longer make busyRetryTimeout public
+// but for folks who don't bother noticing that the interface to MSDatabase changed,
+// we'll still implement the method so they don't get suprise crashes
+- (int)busyRetryTimeout {
+    MSDBLogWarning(@"MSDB: busyRetryTimeout no longer works, please use maxBusyRetryTimeInterval");
+    return -1;
+}
+
+- (void)setBusyRetryTimeout:(int)i {
+    MSDBLogWarning(@"MSDB: setBusyRetryTimeout does nothing, please use setMaxBusyRetryTimeInterval:");
+}
+
+#pragma mark Result set functions
+
+- (BOOL)hasOpenResultSets {
+    return [_openResultSets count] > 0;
+}
+
+- (NSArray *)queriesOfOpenResultSets {
+    
+    NSMutableArray *queries = [NSMutableArray arrayWithCapacity:[_openResultSets count]];
+    
+    for (MSResultSet *rs in _openResultSets) {
+        [queries addObject:[rs query] ? [rs query] : @""];
+    }
+    
+    return queries;
+}
+
+- (void)closeOpenResultSets {
+    
+    //Copy the set so we don't get mutation errors
+    NSArray *openResultSets = [_openResultSets allObjects];
+    for (MSResultSet *rs in openResultSets) {
+        
+        [rs setParentDB:nil];
+        [rs close];
+        
+        [_openResultSets removeObject:rs];
+    }
+}
+
+// Used by work that drives a statement off the calling thread (see MSResultSet's prefetching
+// enumeration): while held, every other statement on this connection trips warnInUse.
+- (BOOL)beginExclusiveStatementUse {
+    
+    if (_isExecutingStatement) {
+        [self warnInUse];
+        return NO;
+    }
+    
+    _isExecutingStatement = YES;
+    
+    return YES;
+}
+
+- (void)endExclusiveStatementUse {
+    _isExecutingStatement = NO;
+}
+
+- (void)resultSetDidClose:(MSResultSet *)resultSet {
+    [_openResultSets removeObject:resultSet];
+}
+
+#pragma mark Cached statements
+
+- (void)clearCachedStatements {
+    
+    for (NSMutableSet *statements in [_cachedStatements objectEnumerator]) {
+        [statements makeObjectsPerformSelector:@selector(close)];
+    }
+    
+    [_cachedStatements removeAllObjects];
+}
+
+- (MSStatement*)cachedStatementForQuery:(NSString*)query {
+    
+    NSMutableSet* statements = [_cachedStatements objectForKey:query];
+    
+    // A plain loop rather than objectsPassingTest:, which builds a set on every lookup.
+    for (MSStatement *statement in statements) {
+        if (![statement inUse]) {
+            return statement;
+        }
+    }
+    
+    return nil;
+}
+
+
+- (void)setCachedStatement:(MSStatement*)statement forQuery:(NSString*)query {
+    
+    if (!_cachedStatements) {
+        // executeCachedQuery:/executeCachedUpdate: cache even when shouldCacheStatements is off.
+        [self setCachedStatements:[NSMutableDictionary dictionary]];
+    }
+    
+    query = [query copy]; // in case we got handed in a mutable string...
+    [statement setQuery:query];
+    
+    NSMutableSet* statements = [_cachedStatements objectForKey:query];
+    if (!statements) {
+        statements = [NSMutableSet set];
+    }
+    
+    [statements addObject:statement];
+    
+    [_cachedStatements setObject:statements forKey:query];
+    
+    MSDBRelease(query);
+}
+
+#pragma mark Recycling
+
+- (NSUInteger)recycleLimit {
+    return _recycleLimit;
+}
+
+- (void)setRecycleLimit:(NSUInteger)recycleLimit {
+    
+    _recycleLimit = recycleLimit;
+    
+    if (_recycledStatements && (NSUInteger)CFArrayGetCount(_recycledStatements) > recycleLimit) {
+        CFArrayReplaceValues(_recycledStatements, CFRangeMake((CFIndex)recycleLimit, CFArrayGetCount(_recycledStatements) - (CFIndex)recycleLimit), NULL, 0);
+    }
+}
+
+- (unsigned long long)statementAllocations {
+    return _statementAllocations;
+}
+
+- (unsigned long long)statementReuses {
+    return _statementReuses;
+}
+
+- (NSDictionary *)benchmarkRecyclingWithQuery:(NSString *)sql iterations:(NSUInteger)iterations {
+    
+    NSUInteger recycleLimit = _recycleLimit;
+    NSMutableDictionary *report = [NSMutableDictionary dictionaryWithCapacity:4];
+    
+    for (int recycling = 0; recycling < 2; recycling++) {
+        
+        [self setRecycleLimit:recycling ? MAX(recycleLimit, (NSUInteger)1) : 0];
+        
+        unsigned long long allocations = _statementAllocations;
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        
+        for (NSUInteger i = 0; i < iterations; i++) {
+            @autoreleasepool {
+                MSResultSet *rs = [self executeQuery:sql];
+                while ([rs next]) {
+                }
+                [rs close];
+            }
+        }
+        
+        NSString *suffix = recycling ? @"WithRecycling" : @"WithoutRecycling";
+        [report setObject:[NSNumber numberWithUnsignedLongLong:_statementAllocations - allocations] forKey:[@"statementAllocations" stringByAppendingString:suffix]];
+        [report setObject:[NSNumber numberWithDouble:CFAbsoluteTimeGetCurrent() - start] forKey:[@"seconds" stringByAppendingString:suffix]];
+    }
+    
+    [self setRecycleLimit:recycleLimit];
+    
+    return report;
+}
+
+- (MSStatement *)newStatementWithHandle:(sqlite3_stmt *)pStmt {
+    
+    MSStatement *statement = nil;
+    CFIndex count = _recycledStatements ? CFArrayGetCount(_recycledStatements) : 0;
+    
+    if (count > 0) {
+        // Like alloc, leaves the caller owning it.
+        statement = (__bridge MSStatement *)CFArrayGetValueAtIndex(_recycledStatements, count - 1);
+        MSDBRetain(statement);
+        CFArrayRemoveValueAtIndex(_recycledStatements, count - 1);
+        
+        [statement setUseCount:0];
+        _statementReuses++;
+    }
+    else {
+        statement = [[MSStatement alloc] init];
+        _statementAllocations++;
+    }
+    
+    [statement setStatement:pStmt];
+    
+    return statement;
+}
+
+// Called by a closing result set, which owned `statement`: nobody else was given it, so it can be handed out again.
+- (void)recycleStatement:(MSStatement *)statement {
+    
+    // Cached statements have a query and stay in the cache; only wrappers of one-off statements come back here.
+    if (!statement || [statement query] || !_recycleLimit) {
+        return;
+    }
+    
+    if (!_recycledStatements) {
+        _recycledStatements = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+    }
+    
+    if ((NSUInteger)CFArrayGetCount(_recycledStatements) >= _recycleLimit) {
+        return;
+    }
+    
+    // Finalize now, as dealloc would have; the wrapper is all that is kept.
+    [statement close];
+    CFArrayAppendValue(_recycledStatements, (__bridge CFTypeRef)statement);
+}
+
+#pragma mark Key routines
+
+- (BOOL)rekey:(NSString*)key {
+    NSData *keyData = [NSData dataWithBytes:(void *)[key UTF8String] length:(NSUInteger)strlen([key UTF8String])];
+    
+    return [self rekeyWithData:keyData];
+}
+
+- (BOOL)rekeyWithData:(NSData *)keyData {
+#ifdef SQLITE_HAS_CODEC
+    if (!keyData) {
+        return NO;
+    }
+    
+    int rc = sqlite3_rekey(_db, [keyData bytes], (int)[keyData length]);
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"error on rekey: %d (%@)", rc, [self lastErrorMessage]);
+    }
+    
+    return (rc == SQLITE_OK);
+#else
+    return NO;
+#endif
+}
+
+- (BOOL)setKey:(NSString*)key {
+    NSData *keyData = [NSData dataWithBytes:[key UTF8String] length:(NSUInteger)strlen([key UTF8String])];
+    
+    return [self setKeyWithData:keyData];
+}
+
+- (BOOL)setKeyWithData:(NSData *)keyData {
+#ifdef SQLITE_HAS_CODEC
+    if (!keyData) {
+        return NO;
+    }
+    
+    int rc = sqlite3_key(_db, [keyData bytes], (int)[keyData length]);
+    
+    return (rc == SQLITE_OK);
+#else
+    return NO;
+#endif
+}
+
+#pragma mark Date routines
+
++ (NSDateFormatter *)storeableDateFormat:(NSString *)format {
+    
+    NSDateFormatter *result = MSDBReturnAutoreleased([[NSDateFormatter alloc] init]);
+    result.dateFormat = format;
+    result.timeZone = [NSTimeZone timeZoneForSecondsFromGMT:0];
+    result.locale = MSDBReturnAutoreleased([[NSLocale alloc] initWithLocaleIdentifier:@"en_US"]);
+    return result;
+}
+
+
+- (BOOL)hasDateFormatter {
+    return _dateFormat != nil;
+}
+
+- (void)setDateFormat:(NSDateFormatter *)format {
+    MSDBAutorelease(_dateFormat);
+    _dateFormat = MSDBReturnRetained(format);
+}
+
+- (NSDate *)dateFromString:(NSString *)s {
+    return [_dateFormat dateFromString:s];
+}
+
+- (NSString *)stringFromDate:(NSDate *)date {
+    return [_dateFormat stringFromDate:date];
+}
+
+// Days since 1970-01-01 for a proleptic Gregorian civil date (H. Hinnant's days_from_civil).
+static int64_t MSDBDaysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+static void MSDBCivilFromDays(int64_t z, int64_t *y, unsigned *m, unsigned *d) {
+    z += 719468;
+    int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    unsigned doe = (unsigned)(z - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    *d = doy - (153 * mp + 2) / 5 + 1;
+    *m = mp < 10 ? mp + 3 : mp - 9;
+    *y = (int64_t)yoe + era * 400 + (*m <= 2);
+}
+
+int MSDBFormatISO8601Date(NSTimeInterval interval, char *buffer) {
+    
+    int64_t millis = (int64_t)llround(interval * 1000.0);
+    int64_t days   = millis / 86400000;
+    int64_t rem    = millis % 86400000;
+    
+    if (rem < 0) {
+        rem  += 86400000;
+        days -= 1;
+    }
+    
+    int64_t year;
+    unsigned month, day;
+    MSDBCivilFromDays(days, &year, &month, &day);
+    
+    if (year < 0 || year > 9999) {
+        buffer[0] = '\0';
+        return 0;
+    }
+    
+    unsigned ms = (unsigned)(rem % 1000);
+    unsigned s  = (unsigned)(rem / 1000);
+    
+    char *p = buffer;
+    unsigned y = (unsigned)year;
+    *p++ = (char)('0' + y / 1000); *p++ = (char)('0' + y / 100 % 10); *p++ = (char)('0' + y / 10 % 10); *p++ = (char)('0' + y % 10);
+    *p++ = '-';
+    *p++ = (char)('0' + month / 10); *p++ = (char)('0' + month % 10);
+    *p++ = '-';
+    *p++ = (char)('0' + day / 10); *p++ = (char)('0' + day % 10);
+    *p++ = 'T';
+    *p++ = (char)('0' + s / 36000); *p++ = (char)('0' + s / 3600 % 10);
+    *p++ = ':';
+    *p++ = (char)('0' + s / 60 % 60 / 10); *p++ = (char)('0' + s / 60 % 10);
+    *p++ = ':';
+    *p++ = (char)('0' + s % 60 / 10); *p++ = (char)('0' + s % 60 % 10);
+    *p++ = '.';
+    *p++ = (char)('0' + ms / 100); *p++ = (char)('0' + ms / 10 % 10); *p++ = (char)('0' + ms % 10);
+    *p++ = 'Z';
+    *p   = '\0';
+    
+    return (int)(p - buffer);
+}
+
+static BOOL MSDBParseDigits(const char **cursor, const char *end, int count, int *outValue) {
+    
+    const char *p = *cursor;
+    int value = 0;
+    
+    if (end - p < count) {
+        return NO;
+    }
+    
+    for (int i = 0; i < count; i++, p++) {
+        if (*p < '0' || *p > '9') {
+            return NO;
+        }
+        value = value * 10 + (*p - '0');
+    }
+    
+    *cursor   = p;
+    *outValue = value;
+    return YES;
+}
+
+BOOL MSDBParseISO8601Date(const char *text, int length, NSTimeInterval *outInterval) {
+    
+    if (!text || length <= 0) {
+        return NO;
+    }
+    
+    const char *p   = text;
+    const char *end = text + length;
+    int year, month, day, hour = 0, minute = 0, second = 0, offset = 0;
+    double fraction = 0;
+    
+    if (!MSDBParseDigits(&p, end, 4, &year) || p == end || *p++ != '-' ||
+        !MSDBParseDigits(&p, end, 2, &month) || p == end || *p++ != '-' ||
+        !MSDBParseDigits(&p, end, 2, &day)) {
+        return NO;
+    }
+    
+    if (month < 1 || month > 12 || day < 1 || day > 31) {
+        return NO;
+    }
+    
+    if (p < end && (*p == 'T' || *p == 't' || *p == ' ')) {
+        p++;
+        
+        if (!MSDBParseDigits(&p, end, 2, &hour) || p == end || *p++ != ':' ||
+            !MSDBParseDigits(&p, end, 2, &minute)) {
+            return NO;
+        }
+        
+        if (p < end && *p == ':') {
+            p++;
+            if (!MSDBParseDigits(&p, end, 2, &second)) {
+                return NO;
+            }
+            
+            if (p < end && (*p == '.' || *p == ',')) {
+                p++;
+                const char *digits = p;
+                int64_t numerator = 0, denominator = 1;
+                while (p < end && *p >= '0' && *p <= '9') {
+                    if (denominator < 1000000000) {
+                        numerator    = numerator * 10 + (*p - '0');
+                        denominator *= 10;
+                    }
+                    p++;
+                }
+                if (p == digits) {
+                    return NO;
+                }
+                fraction = (double)numerator / (double)denominator;
+            }
+        }
+        
+        if (hour > 24 || minute > 59 || second > 60) {
+            return NO;
+        }
+        
+        if (p < end && (*p == 'Z' || *p == 'z')) {
+            p++;
+        }
+        else if (p < end && (*p == '+' || *p == '-')) {
+            int sign = (*p++ == '-') ? -1 : 1;
+            int offsetHours, offsetMinutes = 0;
+            if (!MSDBParseDigits(&p, end, 2, &offsetHours)) {
+                return NO;
+            }
+            if (p < end && *p == ':') {
+                p++;
+            }
+            if (p < end && !MSDBParseDigits(&p, end, 2, &offsetMinutes)) {
+                return NO;
+            }
+            offset = sign * (offsetHours * 3600 + offsetMinutes * 60);
+        }
+    }
+    
+    if (p != end) {
+        return NO;
+    }
+    
+    int64_t days = MSDBDaysFromCivil(year, (unsigned)month, (unsigned)day);
+    
+    *outInterval = (double)(days * 86400 + hour * 3600 + minute * 60 + second - offset) + fraction;
+    return YES;
+}
+
+- (int)bindDate:(NSDate *)date toColumn:(int)idx inStatement:(sqlite3_stmt*)pStmt {
+    
+    NSTimeInterval interval = [date timeIntervalSince1970];
+    
+    switch (_dateStorage) {
+        case MSDBDateStorageEpochMilliseconds:
+            return sqlite3_bind_int64(pStmt, idx, (sqlite3_int64)llround(interval * 1000.0));
+        case MSDBDateStorageJulianDay:
+            return sqlite3_bind_double(pStmt, idx, interval / 86400.0 + 2440587.5);
+        case MSDBDateStorageISO8601: {
+            char buffer[MSDBISO8601DateBufferLength];
+            int length = MSDBFormatISO8601Date(interval, buffer);
+            if (length > 0) {
+                return sqlite3_bind_text(pStmt, idx, buffer, length, SQLITE_TRANSIENT);
+            }
+            return sqlite3_bind_null(pStmt, idx);
+        }
+        default:
+            if (self.hasDateFormatter)
+                return sqlite3_bind_text(pStmt, idx, [[self stringFromDate:date] UTF8String], -1, SQLITE_STATIC);
+            else
+                return sqlite3_bind_double(pStmt, idx, interval);
+    }
+}
+
+- (NSDate *)dateFromStatement:(sqlite3_stmt *)statement column:(int)columnIdx {
+    
+    if (columnIdx < 0 || sqlite3_column_type(statement, columnIdx) == SQLITE_NULL) {
+        return nil;
+    }
+    
+    switch (_dateStorage) {
+        case MSDBDateStorageEpochMilliseconds:
+            return [NSDate dateWithTimeIntervalSince1970:(NSTimeInterval)sqlite3_column_int64(statement, columnIdx) / 1000.0];
+        case MSDBDateStorageJulianDay:
+            return [NSDate dateWithTimeIntervalSince1970:(sqlite3_column_double(statement, columnIdx) - 2440587.5) * 86400.0];
+        case MSDBDateStorageISO8601: {
+            const char *text = (const char *)sqlite3_column_text(statement, columnIdx);
+            NSTimeInterval interval;
+            if (!MSDBParseISO8601Date(text, sqlite3_column_bytes(statement, columnIdx), &interval)) {
+                return nil;
+            }
+            return [NSDate dateWithTimeIntervalSince1970:interval];
+        }
+        default:
+            break;
+    }
+    
+    if (_dateFormat) {
+        const char *c = (const char *)sqlite3_column_text(statement, columnIdx);
+        return c ? [self dateFromString:[NSString stringWithUTF8String:c]] : nil;
+    }
+    
+    return [NSDate dateWithTimeIntervalSince1970:sqlite3_column_double(statement, columnIdx)];
+}
+
+#pragma mark Type codecs
+
+- (void)registerTypeCodecForClass:(Class)cls binder:(MSDBTypeBinderBlock)binder decoder:(MSDBTypeDecoderBlock)decoder {
+    
+    NSParameterAssert(cls);
+    
+    if (!_typeCodecs) {
+        _typeCodecs     = [[NSMutableArray alloc] init];
+        _typeCodecCache = MSDBReturnRetained([NSMapTable mapTableWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+                                                                    valueOptions:NSPointerFunctionsStrongMemory]);
+    }
+    
+    [self unregisterTypeCodecForClass:cls];
+    
+    MSDBTypeCodec *codec = [[MSDBTypeCodec alloc] init];
+    [codec setCodecClass:cls];
+    [codec setBinder:binder];
+    [codec setDecoder:decoder];
+    
+    [_typeCodecs addObject:codec];
+    [_typeCodecCache removeAllObjects];
+    
+    MSDBRelease(codec);
+}
+
+- (void)unregisterTypeCodecForClass:(Class)cls {
+    
+    NSUInteger idx = [_typeCodecs indexOfObjectPassingTest:^BOOL(MSDBTypeCodec *codec, NSUInteger i, BOOL *stop) {
+        return [codec codecClass] == cls;
+    }];
+    
+    if (idx != NSNotFound) {
+        [_typeCodecs removeObjectAtIndex:idx];
+        [_typeCodecCache removeAllObjects];
+    }
+}
+
+// The cache holds [NSNull null] for classes that have no codec, so misses are O(1) too.
+- (MSDBTypeCodec *)typeCodecForClass:(Class)cls {
+    
+    if (![_typeCodecs count]) {
+        return nil;
+    }
+    
+    id codec = [_typeCodecCache objectForKey:cls];
+    
+    if (!codec) {
+        codec = [NSNull null];
+        
+        for (MSDBTypeCodec *candidate in [_typeCodecs reverseObjectEnumerator]) {
+            if ([cls isSubclassOfClass:[candidate codecClass]]) {
+                codec = candidate;
+                break;
+            }
+        }
+        
+        [_typeCodecCache setObject:codec forKey:cls];
+    }
+    
+    return (codec == [NSNull null]) ? nil : codec;
+}
+
+- (MSDBTypeDecoderBlock)typeDecoderForClass:(Class)cls {
+    return [[self typeCodecForClass:cls] decoder];
+}
+
+- (void)registerUUIDTypeCodec {
+    
+    [self registerTypeCodecForClass:[NSUUID class] binder:^int(id value, sqlite3_stmt *statement, int idx) {
+        uuid_t bytes;
+        [(NSUUID *)value getUUIDBytes:bytes];
+        return sqlite3_bind_blob(statement, idx, bytes, (int)sizeof(uuid_t), SQLITE_TRANSIENT);
+    } decoder:^id(sqlite3_stmt *statement, int idx) {
+        
+        int type = sqlite3_column_type(statement, idx);
+        
+        if (type == SQLITE_BLOB && sqlite3_column_bytes(statement, idx) == (int)sizeof(uuid_t)) {
+            return MSDBReturnAutoreleased([[NSUUID alloc] initWithUUIDBytes:sqlite3_column_blob(statement, idx)]);
+        }
+        
+        if (type == SQLITE_TEXT) {
+            NSString *s = [NSString stringWithUTF8String:(const char *)sqlite3_column_text(statement, idx)];
+            return MSDBReturnAutoreleased([[NSUUID alloc] initWithUUIDString:s]);
+        }
+        
+        return nil;
+    }];
+}
+
+- (void)registerDecimalNumberTypeCodecWithScale:(short)scale {
+    
+    NSDecimal maximum = [[NSDecimalNumber decimalNumberWithMantissa:LLONG_MAX exponent:0 isNegative:NO] decimalValue];
+    NSDecimal minimum = [[NSDecimalNumber decimalNumberWithMantissa:(unsigned long long)LLONG_MAX + 1 exponent:0 isNegative:YES] decimalValue];
+    
+    [self registerTypeCodecForClass:[NSDecimalNumber class] binder:^int(id value, sqlite3_stmt *statement, int idx) {
+        
+        NSDecimal decimal = [(NSDecimalNumber *)value decimalValue];
+        NSDecimal scaled, rounded;
+        
+        if (NSDecimalMultiplyByPowerOf10(&scaled, &decimal, scale, NSRoundPlain) == NSCalculationNoError) {
+            NSDecimalRound(&rounded, &scaled, 0, NSRoundPlain);
+        }
+        else {
+            rounded = [[NSDecimalNumber notANumber] decimalValue];
+        }
+        
+        // Outside the int64 range, longLongValue would wrap or clamp; fail the statement rather than store a wrong amount.
+        BOOL fits = !NSDecimalIsNotANumber(&rounded) &&
+                    NSDecimalCompare(&rounded, &maximum) != NSOrderedDescending &&
+                    NSDecimalCompare(&rounded, &minimum) != NSOrderedAscending;
+        
+        // The digits are read exactly, rather than through the double longLongValue goes through, which keeps only 53 bits.
+        const char *digits = fits ? [NSDecimalString(&rounded, nil) UTF8String] : "";
+        char *end = NULL;
+        
+        errno = 0;
+        long long integer = strtoll(digits, &end, 10);
+        
+        if (!fits || errno == ERANGE || end == digits || *end != '\0') {
+            MSDBLogError(@"%@ does not fit in a 64 bit integer with scale %d", value, scale);
+            return SQLITE_RANGE;
+        }
+        
+        return sqlite3_bind_int64(statement, idx, integer);
+        
+    } decoder:^id(sqlite3_stmt *statement, int idx) {
+        
+        int type = sqlite3_column_type(statement, idx);
+        
+        if (type == SQLITE_INTEGER) {
+            sqlite3_int64 v = sqlite3_column_int64(statement, idx);
+            unsigned long long mantissa = (v < 0) ? (unsigned long long)(-(v + 1)) + 1 : (unsigned long long)v;
+            return [NSDecimalNumber decimalNumberWithMantissa:mantissa exponent:(short)-scale isNegative:(v < 0)];
+        }
+        
+        if (type == SQLITE_NULL) {
+            return nil;
+        }
+        
+        // REAL or TEXT written before the codec was registered.
+        return [NSDecimalNumber decimalNumberWithString:[NSString stringWithUTF8String:(const char *)sqlite3_column_text(statement, idx)]];
+    }];
+}
+
+#pragma mark Compression
+
+#define MSDBCompressedHeaderLength 8
+
+// Deflate cannot expand a stream more than about 1032 times.
+#define MSDBCompressedMaximumRatio 1032
+
+static const unsigned char MSDBCompressedMagic[3] = { 'M', 'S', 'Z' };
+
+int MSDBCompressedValueKind(const void *bytes, int length) {
+    
+    const unsigned char *p = bytes;
+    
+    if (!p || length < MSDBCompressedHeaderLength || memcmp(p, MSDBCompressedMagic, sizeof(MSDBCompressedMagic)) != 0) {
+        return 0;
+    }
+    
+    if (p[3] != 't' && p[3] != 'b') {
+        return 0;
+    }
+    
+    // A plain value may start with the header by chance: the length it claims must be one compression could have produced, or decoding it would allocate up to 4 GB.
+    uint64_t originalLength     = ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+    uint64_t compressedLength   = (uint64_t)(length - MSDBCompressedHeaderLength);
+    
+    if (originalLength <= (uint64_t)length || originalLength >= INT_MAX || originalLength > compressedLength * MSDBCompressedMaximumRatio) {
+        return 0;
+    }
+    
+    return p[3];
+}
+
+unsigned char *MSDBCompressBytes(const void *bytes, int length, int kind, int level, int *outLength) {
+    
+    if (!bytes || length <= 0) {
+        return NULL;
+    }
+    
+    uLong bound = compressBound((uLong)length);
+    unsigned char *buffer = sqlite3_malloc64(MSDBCompressedHeaderLength + bound);
+    
+    if (!buffer) {
+        return NULL;
+    }
+    
+    uLongf compressedLength = bound;
+    
+    if (compress2(buffer + MSDBCompressedHeaderLength, &compressedLength, bytes, (uLong)length, level) != Z_OK ||
+        compressedLength + MSDBCompressedHeaderLength >= (uLong)length) {
+        // Not worth it; the caller stores the value as is.
+        sqlite3_free(buffer);
+        return NULL;
+    }
+    
+    memcpy(buffer, MSDBCompressedMagic, sizeof(MSDBCompressedMagic));
+    buffer[3] = (unsigned char)kind;
+    buffer[4] = (unsigned char)((unsigned)length >> 24);
+    buffer[5] = (unsigned char)((unsigned)length >> 16);
+    buffer[6] = (unsigned char)((unsigned)length >> 8);
+    buffer[7] = (unsigned char)((unsigned)length);
+    
+    *outLength = (int)(compressedLength + MSDBCompressedHeaderLength);
+    return buffer;
+}
+
+unsigned char *MSDBDecompressBytes(const void *bytes, int length, int *outKind, int *outLength) {
+    
+    int kind = MSDBCompressedValueKind(bytes, length);
+    
+    if (!kind) {
+        return NULL;
+    }
+    
+    const unsigned char *p = bytes;
+    uLongf originalLength = ((uLong)p[4] << 24) | ((uLong)p[5] << 16) | ((uLong)p[6] << 8) | (uLong)p[7];
+    
+    // One spare byte so text can be NUL terminated in place.
+    unsigned char *buffer = sqlite3_malloc64(originalLength + 1);
+    
+    if (!buffer) {
+        return NULL;
+    }
+    
+    uLongf actualLength = originalLength;
+    
+    if (uncompress(buffer, &actualLength, p + MSDBCompressedHeaderLength, (uLong)(length - MSDBCompressedHeaderLength)) != Z_OK ||
+        actualLength != originalLength) {
+        sqlite3_free(buffer);
+        return NULL;
+    }
+    
+    buffer[originalLength] = '\0';
+    
+    if (outKind) {
+        *outKind = kind;
+    }
+    
+    *outLength = (int)originalLength;
+    return buffer;
+}
+
+static void MSDBCompressSQLFunction(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    
+    int type = sqlite3_value_type(argv[0]);
+    
+    if (type != SQLITE_TEXT && type != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    
+    const void *bytes = (type == SQLITE_TEXT) ? (const void *)sqlite3_value_text(argv[0]) : sqlite3_value_blob(argv[0]);
+    int length        = sqlite3_value_bytes(argv[0]);
+    int level         = (argc > 1) ? sqlite3_value_int(argv[1]) : Z_DEFAULT_COMPRESSION;
+    int compressedLength;
+    
+    unsigned char *compressed = MSDBCompressedValueKind(bytes, length) ? NULL : MSDBCompressBytes(bytes, length, (type == SQLITE_TEXT) ? 't' : 'b', level, &compressedLength);
+    
+    if (!compressed) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    
+    sqlite3_result_blob(context, compressed, compressedLength, sqlite3_free);
+}
+
+static void MSDBDecompressSQLFunction(sqlite3_context *context, int argc, sqlite3_value **argv) {
+    
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    
+    const void *bytes = sqlite3_value_blob(argv[0]);
+    int length        = sqlite3_value_bytes(argv[0]);
+    
+    if (!MSDBCompressedValueKind(bytes, length)) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    
+    int kind, originalLength;
+    unsigned char *original = MSDBDecompressBytes(bytes, length, &kind, &originalLength);
+    
+    if (!original) {
+        sqlite3_result_error(context, "msdb_decompress: corrupt compressed value", -1);
+    }
+    else if (kind == 't') {
+        sqlite3_result_text(context, (const char *)original, originalLength, sqlite3_free);
+    }
+    else {
+        sqlite3_result_blob(context, original, originalLength, sqlite3_free);
+    }
+}
+
+- (void)enableCompressionForColumn:(NSString *)columnName threshold:(NSUInteger)threshold {
+    
+    NSParameterAssert(columnName);
+    
+    if (!_compressedColumns) {
+        _compressedColumns = [[NSMutableDictionary alloc] init];
+    }
+    
+    [_compressedColumns setObject:[NSNumber numberWithUnsignedInteger:threshold] forKey:[columnName lowercaseString]];
+    _decompressesValues = YES;
+}
+
+- (void)disableCompressionForColumn:(NSString *)columnName {
+    
+    [_compressedColumns removeObjectForKey:[columnName lowercaseString]];
+    
+    if (![_compressedColumns count]) {
+        MSDBRelease(_compressedColumns);
+        _compressedColumns = nil;
+    }
+}
+
+- (BOOL)registerCompressionFunctions {
+    
+    if (![self databaseExists]) {
+        return NO;
+    }
+    
+    int flags = SQLITE_UTF8;
+#ifdef SQLITE_DETERMINISTIC
+    flags |= SQLITE_DETERMINISTIC;
+#endif
+    
+    int rc = sqlite3_create_function(_db, "msdb_compress", 1, flags, 0x00, &MSDBCompressSQLFunction, 0x00, 0x00);
+    
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(_db, "msdb_compress", 2, flags, 0x00, &MSDBCompressSQLFunction, 0x00, 0x00);
+    }
+    
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_create_function(_db, "msdb_decompress", 1, flags, 0x00, &MSDBDecompressSQLFunction, 0x00, 0x00);
+    }
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"error registering compression functions: %d", rc);
+        return NO;
+    }
+    
+    _decompressesValues = YES;
+    
+    return YES;
+}
+
+// Compresses obj into parameter idx if the parameter is named after a column registered with
+// enableCompressionForColumn:threshold:. Returns NO if the value should be bound normally.
+- (BOOL)bindCompressedObject:(id)obj toColumn:(int)idx inStatement:(sqlite3_stmt*)pStmt {
+    
+    const char *name = sqlite3_bind_parameter_name(pStmt, idx);
+    
+    if (!name || !name[0] || !name[1]) {
+        return NO;
+    }
+    
+    NSNumber *threshold = [_compressedColumns objectForKey:[[NSString stringWithUTF8String:name + 1] lowercaseString]];
+    
+    if (!threshold) {
+        return NO;
+    }
+    
+    const void *bytes;
+    int length;
+    int kind;
+    
+    if ([obj isKindOfClass:[NSData class]]) {
+        bytes  = [obj bytes];
+        length = (int)[obj length];
+        kind   = 'b';
+    }
+    else if ([obj isKindOfClass:[NSString class]]) {
+        bytes  = [obj UTF8String];
+        length = (int)strlen(bytes);
+        kind   = 't';
+    }
+    else {
+        return NO;
+    }
+    
+    if ((NSUInteger)length < [threshold unsignedIntegerValue]) {
+        return NO;
+    }
+    
+    int compressedLength;
+    unsigned char *compressed = MSDBCompressBytes(bytes, length, kind, Z_DEFAULT_COMPRESSION, &compressedLength);
+    
+    if (!compressed) {
+        return NO;
+    }
+    
+    sqlite3_bind_blob(pStmt, idx, compressed, compressedLength, sqlite3_free);
+    
+    return YES;
+}
+
+#pragma mark State of database
+
+#pragma mark Query planner statistics
+
+- (int)analysisLimit {
+    
+    MSResultSet *rs = [self executeQuery:@"PRAGMA analysis_limit"];
+    int limit = [rs next] ? [rs intForColumnIndex:0] : 0;
+    [rs close];
+    
+    return limit;
+}
+
+- (BOOL)runWithAnalysisLimit:(int)analysisLimit statement:(NSString *)sql {
+    
+    if (![self databaseExists]) {
+        return NO;
+    }
+    
+    // Older SQLite versions ignore the pragma, and report a limit of 0.
+    int previousLimit = [self analysisLimit];
+    
+    if (previousLimit != analysisLimit) {
+        [self executeStatements:[NSString stringWithFormat:@"PRAGMA analysis_limit=%d", analysisLimit]];
+    }
+    
+    BOOL success = [self executeStatements:sql];
+    
+    if (!success) {
+        MSDBLogError(@"%@ failed: %@", sql, [self lastErrorMessage]);
     }
-    else {
-        // turn it off otherwise
-        sqlite3_busy_handler(_db, nil, nil);
+    
+    if (previousLimit != analysisLimit) {
+        [self executeStatements:[NSString stringWithFormat:@"PRAGMA analysis_limit=%d", previousLimit]];
     }
+    
+    return success;
 }
 
-- (NSTimeInterval)maxBusyRetryTimeInterval {
-    return _maxBusyRetryTimeInterval;
-}
-
-
-// we no longer make busyRetryTimeout public
-// but for folks who don't bother noticing that the interface to MSDatabase changed,
-// we'll still implement the method so they don't get suprise crashes
-- (int)busyRetryTimeout {
-    NSLog(@"%s:%d", __FUNCTION__, __LINE__);
-    NSLog(@"MSDB: busyRetryTimeout no longer works, please use maxBusyRetryTimeInterval");
-    return -1;
+- (BOOL)optimizeWithAnalysisLimit:(int)analysisLimit {
+    return [self runWithAnalysisLimit:analysisLimit statement:@"PRAGMA optimize"];
 }
 
-- (void)setBusyRetryTimeout:(int)i {
-    NSLog(@"%s:%d", __FUNCTION__, __LINE__);
-    NSLog(@"MSDB: setBusyRetryTimeout does nothing, please use setMaxBusyRetryTimeInterval:");
+- (BOOL)analyze {
+    return [self runWithAnalysisLimit:0 statement:@"ANALYZE"];
 }
 
-#pragma mark Result set functions
-
-- (BOOL)hasOpenResultSets {
-    return [_openResultSets count] > 0;
-}
+#pragma mark Warm-up
 
-- (void)closeOpenResultSets {
+- (BOOL)preloadObjects:(NSArray *)names error:(NSError **)outErr {
     
-    //Copy the set so we don't get mutation errors
-    NSSet *openSetCopy = MSDBReturnAutoreleased([_openResultSets copy]);
-    for (NSValue *rsInWrappedInATastyValueMeal in openSetCopy) {
-        MSResultSet *rs = (MSResultSet *)[rsInWrappedInATastyValueMeal pointerValue];
+    if (![self databaseExists]) {
+        return NO;
+    }
+    
+    // Virtual tables have no b-tree of their own (rootpage 0); their shadow tables are listed separately.
+    MSResultSet *rs = [self executeQuery:@"SELECT type, name, tbl_name, sql FROM sqlite_master WHERE type IN ('table', 'index') AND rootpage > 0"];
+    NSMutableDictionary *objects = [NSMutableDictionary dictionary];
+    
+    while ([rs next]) {
+        NSString *type  = [rs stringForColumnIndex:0];
+        NSString *name  = [rs stringForColumnIndex:1];
+        NSString *table = [rs stringForColumnIndex:2];
+        NSString *sql   = [rs stringForColumnIndex:3];
+        NSString *query = nil;
         
-        [rs setParentDB:nil];
-        [rs close];
+        if ([type isEqualToString:@"table"]) {
+            // OP_Count walks every page of the table's b-tree; NOT INDEXED keeps it off a smaller index.
+            query = [NSString stringWithFormat:@"SELECT count(*) FROM %@ NOT INDEXED", MSDBQuoteIdentifier(name)];
+        }
+        else if (!sql || [sql rangeOfString:@"\\sWHERE\\s" options:NSCaseInsensitiveSearch | NSRegularExpressionSearch].location == NSNotFound) {
+            // A WHERE term stops the count optimization, which would otherwise pick its own index.
+            query = [NSString stringWithFormat:@"SELECT count(*) FROM %@ INDEXED BY %@ WHERE 1", MSDBQuoteIdentifier(table), MSDBQuoteIdentifier(name)];
+        }
         
-        [_openResultSets removeObject:rsInWrappedInATastyValueMeal];
+        // Automatic indexes have no SQL. Partial indexes cannot be forced for a plain scan; they are left cold.
+        if (query) {
+            [objects setObject:query forKey:name];
+        }
     }
-}
-
-- (void)resultSetDidClose:(MSResultSet *)resultSet {
-    NSValue *setValue = [NSValue valueWithNonretainedObject:resultSet];
     
-    [_openResultSets removeObject:setValue];
-}
-
-#pragma mark Cached statements
-
-- (void)clearCachedStatements {
+    [rs close];
     
-    for (NSMutableSet *statements in [_cachedStatements objectEnumerator]) {
-        [statements makeObjectsPerformSelector:@selector(close)];
+    NSError *err = nil;
+    
+    for (NSString *name in (names ? names : [objects allKeys])) {
+        
+        NSString *query = [objects objectForKey:name];
+        
+        if (!query) {
+            MSDBLogWarning(@"Cannot preload %@: no table or full index by that name", name);
+            err = err ? err : [self errorWithMessage:[NSString stringWithFormat:@"No table or full index named %@", name]];
+            continue;
+        }
+        
+        rs = [self executeQuery:query];
+        
+        if (![rs next]) {
+            err = err ? err : [self lastError];
+        }
+        
+        [rs close];
     }
     
-    [_cachedStatements removeAllObjects];
+    if (err && outErr) {
+        *outErr = err;
+    }
+    
+    return err == nil;
 }
 
-- (MSStatement*)cachedStatementForQuery:(NSString*)query {
+- (BOOL)prepareStatementsForQueries:(NSArray *)queries error:(NSError **)outErr {
     
-    NSMutableSet* statements = [_cachedStatements objectForKey:query];
+    if (![self databaseExists]) {
+        return NO;
+    }
     
-    return [[statements objectsPassingTest:^BOOL(MSStatement* statement, BOOL *stop) {
+    for (NSString *sql in queries) {
+        
+        if ([self cachedStatementForQuery:sql]) {
+            continue;
+        }
+        
+        sqlite3_stmt *pStmt = 0x00;
         
-        *stop = ![statement inUse];
-        return *stop;
+        if (sqlite3_prepare_v2(_db, [sql UTF8String], -1, &pStmt, 0x00) != SQLITE_OK) {
+            MSDBLogError(@"Could not prepare %@: %@", sql, [self lastErrorMessage]);
+            if (outErr) {
+                *outErr = [self lastError];
+            }
+            sqlite3_finalize(pStmt);
+            return NO;
+        }
         
-    }] anyObject];
+        MSStatement *statement = [self newStatementWithHandle:pStmt];
+        [self setCachedStatement:statement forQuery:sql];
+        MSDBRelease(statement);
+    }
+    
+    return YES;
 }
 
+#pragma mark I/O statistics
 
-- (void)setCachedStatement:(MSStatement*)statement forQuery:(NSString*)query {
-    
-    query = [query copy]; // in case we got handed in a mutable string...
-    [statement setQuery:query];
-    
-    NSMutableSet* statements = [_cachedStatements objectForKey:query];
-    if (!statements) {
-        statements = [NSMutableSet set];
-    }
-    
-    [statements addObject:statement];
-    
-    [_cachedStatements setObject:statements forKey:query];
-    
-    MSDBRelease(query);
+- (MSDatabaseIOStatistics *)ioStatistics {
+    return MSDBIOShimStatistics(_ioShim);
 }
 
-#pragma mark Key routines
+- (NSArray *)ioStatisticsByFile {
+    return MSDBIOShimFileStatistics(_ioShim);
+}
 
-- (BOOL)rekey:(NSString*)key {
-    NSData *keyData = [NSData dataWithBytes:(void *)[key UTF8String] length:(NSUInteger)strlen([key UTF8String])];
-    
-    return [self rekeyWithData:keyData];
+- (void)resetIOStatistics {
+    MSDBIOShimReset(_ioShim);
 }
 
-- (BOOL)rekeyWithData:(NSData *)keyData {
-#ifdef SQLITE_HAS_CODEC
-    if (!keyData) {
-        return NO;
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+
+#pragma mark Change capture
+
+- (MSDatabaseSession *)startSessionForTables:(NSArray *)tables error:(NSError **)outErr {
+    
+    if (![self databaseExists]) {
+        return nil;
     }
     
-    int rc = sqlite3_rekey(_db, [keyData bytes], (int)[keyData length]);
+    MSDatabaseSession *session = [[MSDatabaseSession alloc] initWithDatabase:self schema:@"main" error:outErr];
     
-    if (rc != SQLITE_OK) {
-        NSLog(@"error on rekey: %d", rc);
-        NSLog(@"%@", [self lastErrorMessage]);
+    if (!session) {
+        return nil;
     }
     
-    return (rc == SQLITE_OK);
-#else
-    return NO;
-#endif
-}
-
-- (BOOL)setKey:(NSString*)key {
-    NSData *keyData = [NSData dataWithBytes:[key UTF8String] length:(NSUInteger)strlen([key UTF8String])];
+    if (!_openSessions) {
+        _openSessions = [[NSMutableSet alloc] init];
+    }
     
-    return [self setKeyWithData:keyData];
-}
-
-- (BOOL)setKeyWithData:(NSData *)keyData {
-#ifdef SQLITE_HAS_CODEC
-    if (!keyData) {
-        return NO;
+    [_openSessions addObject:[NSValue valueWithNonretainedObject:session]];
+    
+    if (!tables && ![session attachTable:nil error:outErr]) {
+        [session close];
+        MSDBRelease(session);
+        return nil;
     }
     
-    int rc = sqlite3_key(_db, [keyData bytes], (int)[keyData length]);
+    for (NSString *table in tables) {
+        if (![session attachTable:table error:outErr]) {
+            [session close];
+            MSDBRelease(session);
+            return nil;
+        }
+    }
     
-    return (rc == SQLITE_OK);
-#else
-    return NO;
-#endif
+    return MSDBReturnAutoreleased(session);
 }
 
-#pragma mark Date routines
+- (void)sessionDidClose:(MSDatabaseSession *)session {
+    [_openSessions removeObject:[NSValue valueWithNonretainedObject:session]];
+}
 
-+ (NSDateFormatter *)storeableDateFormat:(NSString *)format {
+- (void)closeOpenSessions {
     
-    NSDateFormatter *result = MSDBReturnAutoreleased([[NSDateFormatter alloc] init]);
-    result.dateFormat = format;
-    result.timeZone = [NSTimeZone timeZoneForSecondsFromGMT:0];
-    result.locale = MSDBReturnAutoreleased([[NSLocale alloc] initWithLocaleIdentifier:@"en_US"]);
-    return result;
+    // A session must be deleted before its connection closes.
+    NSSet *openSetCopy = MSDBReturnAutoreleased([_openSessions copy]);
+    for (NSValue *sessionValue in openSetCopy) {
+        [(MSDatabaseSession *)[sessionValue pointerValue] close];
+    }
 }
 
+// Blocks of one applyChangeset: call, borrowed for its duration.
+typedef struct MSDBChangesetApplyContext {
+    __unsafe_unretained BOOL (^filter)(NSString *table);
+    __unsafe_unretained MSDBChangesetConflictHandler handler;
+} MSDBChangesetApplyContext;
 
-- (BOOL)hasDateFormatter {
-    return _dateFormat != nil;
+static int MSDBChangesetFilter(void *context, const char *table) {
+    
+    MSDBChangesetApplyContext *applyContext = (MSDBChangesetApplyContext *)context;
+    
+    @autoreleasepool {
+        return applyContext->filter([NSString stringWithUTF8String:table]) ? 1 : 0;
+    }
 }
 
-- (void)setDateFormat:(NSDateFormatter *)format {
-    MSDBAutorelease(_dateFormat);
-    _dateFormat = MSDBReturnRetained(format);
+static int MSDBChangesetConflictCallback(void *context, int type, sqlite3_changeset_iter *iterator) {
+    
+    MSDBChangesetApplyContext *applyContext = (MSDBChangesetApplyContext *)context;
+    
+    if (!applyContext->handler) {
+        return SQLITE_CHANGESET_ABORT;
+    }
+    
+    MSDBChangesetConflictResolution resolution;
+    
+    @autoreleasepool {
+        
+        MSDBChangesetConflict *conflict = [[MSDBChangesetConflict alloc] initWithIterator:iterator type:(MSDBChangesetConflictType)type];
+        
+        resolution = applyContext->handler(conflict);
+        
+        [conflict invalidate];
+        MSDBRelease(conflict);
+    }
+    
+    // SQLite treats any other answer as misuse, and gives up on the whole changeset anyway.
+    if (resolution == MSDBChangesetConflictResolutionReplace && type != SQLITE_CHANGESET_DATA && type != SQLITE_CHANGESET_CONFLICT) {
+        MSDBLogWarning(@"A changeset conflict of type %d cannot be resolved by replacing; aborting", type);
+        return SQLITE_CHANGESET_ABORT;
+    }
+    
+    return (int)resolution;
 }
 
-- (NSDate *)dateFromString:(NSString *)s {
-    return [_dateFormat dateFromString:s];
+- (BOOL)applyChangeset:(NSData *)changeset conflictHandler:(MSDBChangesetConflictHandler)handler error:(NSError **)outErr {
+    return [self applyChangeset:changeset tableFilter:nil conflictHandler:handler error:outErr];
 }
 
-- (NSString *)stringFromDate:(NSDate *)date {
-    return [_dateFormat stringFromDate:date];
+- (BOOL)applyChangeset:(NSData *)changeset tableFilter:(BOOL (^)(NSString *table))filter conflictHandler:(MSDBChangesetConflictHandler)handler error:(NSError **)outErr {
+    
+    if (![self databaseExists]) {
+        return NO;
+    }
+    
+    if (_isExecutingStatement) {
+        [self warnInUse];
+        return NO;
+    }
+    
+    _isExecutingStatement = YES;
+    
+    MSDBChangesetApplyContext context;
+    context.filter  = filter;
+    context.handler = handler;
+    
+    int rc = sqlite3changeset_apply(_db, (int)[changeset length], (void *)[changeset bytes], filter ? MSDBChangesetFilter : 0x00, MSDBChangesetConflictCallback, &context);
+    
+    _isExecutingStatement = NO;
+    
+    [self noteResultCode:rc];
+    
+    if (rc != SQLITE_OK) {
+        // An aborted changeset leaves no error on the connection; describe the code itself.
+        NSString *message = [NSString stringWithUTF8String:sqlite3_errstr(rc)];
+        MSDBLogError(@"Could not apply a changeset: %d \"%@\"", rc, message);
+        if (outErr) {
+            *outErr = [NSError errorWithDomain:@"MSDatabase" code:rc userInfo:[NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey]];
+        }
+        return NO;
+    }
+    
+    return YES;
 }
 
-#pragma mark State of database
+#endif
 
 - (BOOL)goodConnection {
     
@@ -437,18 +1849,25 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
         return NO;
     }
     
-    MSResultSet *rs = [self executeQuery:@"select name from sqlite_master where type='table'"];
+#if SQLITE_VERSION_NUMBER >= 3007011
+    if (sqlite3_db_readonly(_db, "main") < 0) {
+        return NO;
+    }
+#endif
     
-    if (rs) {
-        [rs close];
-        return YES;
+    // Stepped directly rather than through executeQuery:, so it is not traced, cached or tracked as an open result set.
+    if (!_validationStatement && sqlite3_prepare_v2(_db, "SELECT 1", -1, &_validationStatement, 0x00) != SQLITE_OK) {
+        return NO;
     }
     
-    return NO;
+    int rc = sqlite3_step(_validationStatement);
+    sqlite3_reset(_validationStatement);
+    
+    return rc == SQLITE_ROW;
 }
 
 - (void)warnInUse {
-    NSLog(@"The MSDatabase %@ is currently in use.", self);
+    MSDBLogWarning(@"The MSDatabase %@ is currently in use.", self);
     
 #ifndef NS_BLOCK_ASSERTIONS
     if (_crashOnErrors) {
@@ -462,7 +1881,7 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     
     if (!_db) {
             
-        NSLog(@"The MSDatabase %@ is not open.", self);
+        MSDBLogWarning(@"The MSDatabase %@ is not open.", self);
         
     #ifndef NS_BLOCK_ASSERTIONS
         if (_crashOnErrors) {
@@ -493,6 +1912,17 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     return sqlite3_errcode(_db);
 }
 
+- (unsigned long long)contentionCount {
+    return _contentionCount;
+}
+
+- (void)noteResultCode:(int)rc {
+    // Extended codes such as SQLITE_BUSY_SNAPSHOT, which never reach the busy handler, count too.
+    if ((rc & 0xff) == SQLITE_BUSY || (rc & 0xff) == SQLITE_LOCKED) {
+        _contentionCount++;
+    }
+}
+
 - (NSError*)errorWithMessage:(NSString*)message {
     NSDictionary* errorMessage = [NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey];
     
@@ -538,13 +1968,21 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
 
 #pragma mark SQL manipulation
 
-- (void)bindObject:(id)obj toColumn:(int)idx inStatement:(sqlite3_stmt*)pStmt {
+- (int)bindObject:(id)obj toColumn:(int)idx inStatement:(sqlite3_stmt*)pStmt {
+    
+    MSDBTypeCodec *codec = nil;
+    int rc = SQLITE_OK;
     
     if ((!obj) || ((NSNull *)obj == [NSNull null])) {
-        sqlite3_bind_null(pStmt, idx);
+        rc = sqlite3_bind_null(pStmt, idx);
     }
     
-    // FIXME - someday check the return codes on these binds.
+    else if (_compressedColumns && [self bindCompressedObject:obj toColumn:idx inStatement:pStmt]) {
+        // bound as a compressed blob
+    }
+    else if (_typeCodecs && (codec = [self typeCodecForClass:object_getClass(obj)]) && [codec binder]) {
+        rc = [codec binder](obj, pStmt, idx);
+    }
     else if ([obj isKindOfClass:[NSData class]]) {
         const void *bytes = [obj bytes];
         if (!bytes) {
@@ -552,62 +1990,61 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             // Don't pass a NULL pointer, or sqlite will bind a SQL null instead of a blob.
             bytes = "";
         }
-        sqlite3_bind_blob(pStmt, idx, bytes, (int)[obj length], SQLITE_STATIC);
+        rc = sqlite3_bind_blob(pStmt, idx, bytes, (int)[obj length], SQLITE_STATIC);
     }
     else if ([obj isKindOfClass:[NSDate class]]) {
-        if (self.hasDateFormatter)
-            sqlite3_bind_text(pStmt, idx, [[self stringFromDate:obj] UTF8String], -1, SQLITE_STATIC);
-        else
-            sqlite3_bind_double(pStmt, idx, [obj timeIntervalSince1970]);
+        rc = [self bindDate:obj toColumn:idx inStatement:pStmt];
     }
     else if ([obj isKindOfClass:[NSNumber class]]) {
         
         if (strcmp([obj objCType], @encode(char)) == 0) {
-            sqlite3_bind_int(pStmt, idx, [obj charValue]);
+            rc = sqlite3_bind_int(pStmt, idx, [obj charValue]);
         }
         else if (strcmp([obj objCType], @encode(unsigned char)) == 0) {
-            sqlite3_bind_int(pStmt, idx, [obj unsignedCharValue]);
+            rc = sqlite3_bind_int(pStmt, idx, [obj unsignedCharValue]);
         }
         else if (strcmp([obj objCType], @encode(short)) == 0) {
-            sqlite3_bind_int(pStmt, idx, [obj shortValue]);
+            rc = sqlite3_bind_int(pStmt, idx, [obj shortValue]);
         }
         else if (strcmp([obj objCType], @encode(unsigned short)) == 0) {
-            sqlite3_bind_int(pStmt, idx, [obj unsignedShortValue]);
+            rc = sqlite3_bind_int(pStmt, idx, [obj unsignedShortValue]);
         }
         else if (strcmp([obj objCType], @encode(int)) == 0) {
-            sqlite3_bind_int(pStmt, idx, [obj intValue]);
+            rc = sqlite3_bind_int(pStmt, idx, [obj intValue]);
         }
         else if (strcmp([obj objCType], @encode(unsigned int)) == 0) {
-            sqlite3_bind_int64(pStmt, idx, (long long)[obj unsignedIntValue]);
+            rc = sqlite3_bind_int64(pStmt, idx, (long long)[obj unsignedIntValue]);
         }
         else if (strcmp([obj objCType], @encode(long)) == 0) {
-            sqlite3_bind_int64(pStmt, idx, [obj longValue]);
+            rc = sqlite3_bind_int64(pStmt, idx, [obj longValue]);
         }
         else if (strcmp([obj objCType], @encode(unsigned long)) == 0) {
-            sqlite3_bind_int64(pStmt, idx, (long long)[obj unsignedLongValue]);
+            rc = sqlite3_bind_int64(pStmt, idx, (long long)[obj unsignedLongValue]);
         }
         else if (strcmp([obj objCType], @encode(long long)) == 0) {
-            sqlite3_bind_int64(pStmt, idx, [obj longLongValue]);
+            rc = sqlite3_bind_int64(pStmt, idx, [obj longLongValue]);
         }
         else if (strcmp([obj objCType], @encode(unsigned long long)) == 0) {
-            sqlite3_bind_int64(pStmt, idx, (long long)[obj unsignedLongLongValue]);
+            rc = sqlite3_bind_int64(pStmt, idx, (long long)[obj unsignedLongLongValue]);
         }
         else if (strcmp([obj objCType], @encode(float)) == 0) {
-            sqlite3_bind_double(pStmt, idx, [obj floatValue]);
+            rc = sqlite3_bind_double(pStmt, idx, [obj floatValue]);
         }
         else if (strcmp([obj objCType], @encode(double)) == 0) {
-            sqlite3_bind_double(pStmt, idx, [obj doubleValue]);
+            rc = sqlite3_bind_double(pStmt, idx, [obj doubleValue]);
         }
         else if (strcmp([obj objCType], @encode(BOOL)) == 0) {
-            sqlite3_bind_int(pStmt, idx, ([obj boolValue] ? 1 : 0));
+            rc = sqlite3_bind_int(pStmt, idx, ([obj boolValue] ? 1 : 0));
         }
         else {
-            sqlite3_bind_text(pStmt, idx, [[obj description] UTF8String], -1, SQLITE_STATIC);
+            rc = sqlite3_bind_text(pStmt, idx, [[obj description] UTF8String], -1, SQLITE_STATIC);
         }
     }
     else {
-        sqlite3_bind_text(pStmt, idx, [[obj description] UTF8String], -1, SQLITE_STATIC);
+        rc = sqlite3_bind_text(pStmt, idx, [[obj description] UTF8String], -1, SQLITE_STATIC);
     }
+    
+    return rc;
 }
 
 - (void)extractSQL:(NSString *)sql argumentsList:(va_list)args intoString:(NSMutableString *)cleanedSQL arguments:(NSMutableArray *)arguments {
@@ -737,6 +2174,10 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
 }
 
 - (MSResultSet *)executeQuery:(NSString *)sql withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args {
+    return [self executeQuery:sql withArgumentsInArray:arrayArgs orDictionary:dictionaryArgs orVAList:args cacheStatement:_shouldCacheStatements];
+}
+
+- (MSResultSet *)executeQuery:(NSString *)sql withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args cacheStatement:(BOOL)cacheStatement {
     
     if (![self databaseExists]) {
         return 0x00;
@@ -755,10 +2196,10 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     MSResultSet *rs         = 0x00;
     
     if (_traceExecution && sql) {
-        NSLog(@"%@ executeQuery: %@", self, sql);
+        MSDBLogDebug(@"%@ executeQuery: %@", self, sql);
     }
     
-    if (_shouldCacheStatements) {
+    if (cacheStatement) {
         statement = [self cachedStatementForQuery:sql];
         pStmt = statement ? [statement statement] : 0x00;
         [statement reset];
@@ -769,10 +2210,10 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
         rc      = sqlite3_prepare_v2(_db, [sql UTF8String], -1, &pStmt, 0);
         
         if (SQLITE_OK != rc) {
+            [self noteResultCode:rc];
+            
             if (_logsErrors) {
-                NSLog(@"DB Error: %d \"%@\"", [self lastErrorCode], [self lastErrorMessage]);
-                NSLog(@"DB Query: %@", sql);
-                NSLog(@"DB Path: %@", _databasePath);
+                MSDBLogError(@"DB Error: %d \"%@\" preparing %@ (%@)", [self lastErrorCode], [self lastErrorMessage], sql, _databasePath);
             }
             
             if (_crashOnErrors) {
@@ -799,7 +2240,7 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             NSString *parameterName = [[NSString alloc] initWithFormat:@":%@", dictionaryKey];
 
             if (_traceExecution) {
-                NSLog(@"%@ = %@", parameterName, [dictionaryArgs objectForKey:dictionaryKey]);
+                MSDBLogDebug(@"%@ = %@", parameterName, [dictionaryArgs objectForKey:dictionaryKey]);
             }
             
             // Get the index for the parameter name.
@@ -809,12 +2250,16 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             
             if (namedIdx > 0) {
                 // Standard binding from here.
-                [self bindObject:[dictionaryArgs objectForKey:dictionaryKey] toColumn:namedIdx inStatement:pStmt];
+                rc = [self bindObject:[dictionaryArgs objectForKey:dictionaryKey] toColumn:namedIdx inStatement:pStmt];
                 // increment the binding count, so our check below works out
                 idx++;
+                
+                if (SQLITE_OK != rc) {
+                    break;
+                }
             }
             else {
-                NSLog(@"Could not find index for %@", dictionaryKey);
+                MSDBLogWarning(@"Could not find index for %@", dictionaryKey);
             }
         }
     }
@@ -835,21 +2280,40 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             
             if (_traceExecution) {
                 if ([obj isKindOfClass:[NSData class]]) {
-                    NSLog(@"data: %ld bytes", (unsigned long)[(NSData*)obj length]);
+                    MSDBLogDebug(@"data: %ld bytes", (unsigned long)[(NSData*)obj length]);
                 }
                 else {
-                    NSLog(@"obj: %@", obj);
+                    MSDBLogDebug(@"obj: %@", obj);
                 }
             }
             
             idx++;
             
-            [self bindObject:obj toColumn:idx inStatement:pStmt];
+            rc = [self bindObject:obj toColumn:idx inStatement:pStmt];
+            
+            if (SQLITE_OK != rc) {
+                break;
+            }
+        }
+    }
+    
+    // A value that could not be bound, such as a decimal out of range, fails the statement rather than leaving its parameter NULL.
+    if (SQLITE_OK != rc) {
+        MSDBLogError(@"Error: could not bind argument %d (%d) (%@) (executeQuery)", idx, rc, sql);
+        
+        if (statement) {
+            [statement reset];
+        }
+        else {
+            sqlite3_finalize(pStmt);
         }
+        
+        _isExecutingStatement = NO;
+        return nil;
     }
     
     if (idx != queryCount) {
-        NSLog(@"Error: the bind count is not correct for the # of variables (executeQuery)");
+        MSDBLogError(@"Error: the bind count is not correct for the # of variables (executeQuery)");
         sqlite3_finalize(pStmt);
         _isExecutingStatement = NO;
         return nil;
@@ -858,10 +2322,9 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     MSDBRetain(statement); // to balance the release below
     
     if (!statement) {
-        statement = [[MSStatement alloc] init];
-        [statement setStatement:pStmt];
+        statement = [self newStatementWithHandle:pStmt];
         
-        if (_shouldCacheStatements && sql) {
+        if (cacheStatement && sql) {
             [self setCachedStatement:statement forQuery:sql];
         }
     }
@@ -870,8 +2333,7 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     rs = [MSResultSet resultSetWithStatement:statement usingParentDatabase:self];
     [rs setQuery:sql];
     
-    NSValue *openResultSet = [NSValue valueWithNonretainedObject:rs];
-    [_openResultSets addObject:openResultSet];
+    [_openResultSets addObject:rs];
     
     [statement setUseCount:[statement useCount] + 1];
     
@@ -913,9 +2375,17 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     return [self executeQuery:sql withArgumentsInArray:nil orDictionary:nil orVAList:args];
 }
 
+- (MSResultSet *)executeCachedQuery:(NSString *)sql withArgumentsInArray:(NSArray *)arguments {
+    return [self executeQuery:sql withArgumentsInArray:arguments orDictionary:nil orVAList:nil cacheStatement:YES];
+}
+
 #pragma mark Execute updates
 
 - (BOOL)executeUpdate:(NSString*)sql error:(NSError**)outErr withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args {
+    return [self executeUpdate:sql error:outErr withArgumentsInArray:arrayArgs orDictionary:dictionaryArgs orVAList:args cacheStatement:_shouldCacheStatements];
+}
+
+- (BOOL)executeUpdate:(NSString*)sql error:(NSError**)outErr withArgumentsInArray:(NSArray*)arrayArgs orDictionary:(NSDictionary *)dictionaryArgs orVAList:(va_list)args cacheStatement:(BOOL)cacheStatement {
     
     if (![self databaseExists]) {
         return NO;
@@ -933,10 +2403,10 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     MSStatement *cachedStmt  = 0x00;
     
     if (_traceExecution && sql) {
-        NSLog(@"%@ executeUpdate: %@", self, sql);
+        MSDBLogDebug(@"%@ executeUpdate: %@", self, sql);
     }
     
-    if (_shouldCacheStatements) {
+    if (cacheStatement) {
         cachedStmt = [self cachedStatementForQuery:sql];
         pStmt = cachedStmt ? [cachedStmt statement] : 0x00;
         [cachedStmt reset];
@@ -946,10 +2416,10 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
         rc = sqlite3_prepare_v2(_db, [sql UTF8String], -1, &pStmt, 0);
         
         if (SQLITE_OK != rc) {
+            [self noteResultCode:rc];
+            
             if (_logsErrors) {
-                NSLog(@"DB Error: %d \"%@\"", [self lastErrorCode], [self lastErrorMessage]);
-                NSLog(@"DB Query: %@", sql);
-                NSLog(@"DB Path: %@", _databasePath);
+                MSDBLogError(@"DB Error: %d \"%@\" preparing %@ (%@)", [self lastErrorCode], [self lastErrorMessage], sql, _databasePath);
             }
             
             if (_crashOnErrors) {
@@ -981,7 +2451,7 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             NSString *parameterName = [[NSString alloc] initWithFormat:@":%@", dictionaryKey];
             
             if (_traceExecution) {
-                NSLog(@"%@ = %@", parameterName, [dictionaryArgs objectForKey:dictionaryKey]);
+                MSDBLogDebug(@"%@ = %@", parameterName, [dictionaryArgs objectForKey:dictionaryKey]);
             }
             // Get the index for the parameter name.
             int namedIdx = sqlite3_bind_parameter_index(pStmt, [parameterName UTF8String]);
@@ -990,13 +2460,17 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             
             if (namedIdx > 0) {
                 // Standard binding from here.
-                [self bindObject:[dictionaryArgs objectForKey:dictionaryKey] toColumn:namedIdx inStatement:pStmt];
+                rc = [self bindObject:[dictionaryArgs objectForKey:dictionaryKey] toColumn:namedIdx inStatement:pStmt];
                 
                 // increment the binding count, so our check below works out
                 idx++;
+                
+                if (SQLITE_OK != rc) {
+                    break;
+                }
             }
             else {
-                NSLog(@"Could not find index for %@", dictionaryKey);
+                MSDBLogWarning(@"Could not find index for %@", dictionaryKey);
             }
         }
     }
@@ -1017,22 +2491,45 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
             
             if (_traceExecution) {
                 if ([obj isKindOfClass:[NSData class]]) {
-                    NSLog(@"data: %ld bytes", (unsigned long)[(NSData*)obj length]);
+                    MSDBLogDebug(@"data: %ld bytes", (unsigned long)[(NSData*)obj length]);
                 }
                 else {
-                    NSLog(@"obj: %@", obj);
+                    MSDBLogDebug(@"obj: %@", obj);
                 }
             }
             
             idx++;
             
-            [self bindObject:obj toColumn:idx inStatement:pStmt];
+            rc = [self bindObject:obj toColumn:idx inStatement:pStmt];
+            
+            if (SQLITE_OK != rc) {
+                break;
+            }
         }
     }
     
+    // A value that could not be bound, such as a decimal out of range, fails the statement rather than leaving its parameter NULL.
+    if (SQLITE_OK != rc) {
+        MSDBLogError(@"Error: could not bind argument %d (%d) (%@) (executeUpdate)", idx, rc, sql);
+        
+        if (cachedStmt) {
+            [cachedStmt reset];
+        }
+        else {
+            sqlite3_finalize(pStmt);
+        }
+        
+        if (outErr) {
+            NSString *message = [NSString stringWithFormat:@"Could not bind argument %d", idx];
+            *outErr = [NSError errorWithDomain:@"MSDatabase" code:rc userInfo:[NSDictionary dictionaryWithObject:message forKey:NSLocalizedDescriptionKey]];
+        }
+        
+        _isExecutingStatement = NO;
+        return NO;
+    }
     
     if (idx != queryCount) {
-        NSLog(@"Error: the bind count (%d) is not correct for the # of variables in the query (%d) (%@) (executeUpdate)", idx, queryCount, sql);
+        MSDBLogError(@"Error: the bind count (%d) is not correct for the # of variables in the query (%d) (%@) (executeUpdate)", idx, queryCount, sql);
         sqlite3_finalize(pStmt);
         _isExecutingStatement = NO;
         return NO;
@@ -1044,27 +2541,26 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     
     rc      = sqlite3_step(pStmt);
     
+    [self noteResultCode:rc];
+    
     if (SQLITE_DONE == rc) {
         // all is well, let's return.
     }
     else if (SQLITE_ERROR == rc) {
         if (_logsErrors) {
-            NSLog(@"Error calling sqlite3_step (%d: %s) SQLITE_ERROR", rc, sqlite3_errmsg(_db));
-            NSLog(@"DB Query: %@", sql);
+            MSDBLogError(@"Error calling sqlite3_step (%d: %s) SQLITE_ERROR: %@", rc, sqlite3_errmsg(_db), sql);
         }
     }
     else if (SQLITE_MISUSE == rc) {
         // uh oh.
         if (_logsErrors) {
-            NSLog(@"Error calling sqlite3_step (%d: %s) SQLITE_MISUSE", rc, sqlite3_errmsg(_db));
-            NSLog(@"DB Query: %@", sql);
+            MSDBLogError(@"Error calling sqlite3_step (%d: %s) SQLITE_MISUSE: %@", rc, sqlite3_errmsg(_db), sql);
         }
     }
     else {
         // wtf?
         if (_logsErrors) {
-            NSLog(@"Unknown error calling sqlite3_step (%d: %s) eu", rc, sqlite3_errmsg(_db));
-            NSLog(@"DB Query: %@", sql);
+            MSDBLogError(@"Unknown error calling sqlite3_step (%d: %s) eu: %@", rc, sqlite3_errmsg(_db), sql);
         }
     }
     
@@ -1072,10 +2568,8 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
         NSAssert(NO, @"A executeUpdate is being called with a query string '%@'", sql);
     }
     
-    if (_shouldCacheStatements && !cachedStmt) {
-        cachedStmt = [[MSStatement alloc] init];
-        
-        [cachedStmt setStatement:pStmt];
+    if (cacheStatement && !cachedStmt) {
+        cachedStmt = [self newStatementWithHandle:pStmt];
         
         [self setCachedStatement:cachedStmt forQuery:sql];
         
@@ -1097,8 +2591,7 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     
     if (closeErrorCode != SQLITE_OK) {
         if (_logsErrors) {
-            NSLog(@"Unknown error finalizing or resetting statement (%d: %s)", closeErrorCode, sqlite3_errmsg(_db));
-            NSLog(@"DB Query: %@", sql);
+            MSDBLogError(@"Unknown error finalizing or resetting statement (%d: %s): %@", closeErrorCode, sqlite3_errmsg(_db), sql);
         }
     }
     
@@ -1129,6 +2622,10 @@ static int MSDBDatabaseBusyHandler(void *f, int count) {
     return [self executeUpdate:sql error:nil withArgumentsInArray:nil orDictionary:nil orVAList:args];
 }
 
+- (BOOL)executeCachedUpdate:(NSString*)sql withArgumentsInArray:(NSArray *)arguments {
+    return [self executeUpdate:sql error:nil withArgumentsInArray:arguments orDictionary:nil orVAList:nil cacheStatement:YES];
+}
+
 - (BOOL)executeUpdateWithFormat:(NSString*)format, ... {
     va_list args;
     va_start(args, format);
@@ -1176,7 +2673,7 @@ int MSDBExecuteBulkSQLCallback(void *theBlockAsVoid, int columns, char **values,
     rc = sqlite3_exec([self sqliteHandle], [sql UTF8String], block ? MSDBExecuteBulkSQLCallback : nil, (__bridge void *)(block), &errmsg);
     
     if (errmsg && [self logsErrors]) {
-        NSLog(@"Error inserting batch: %s", errmsg);
+        MSDBLogError(@"Error inserting batch: %s", errmsg);
         sqlite3_free(errmsg);
     }
 
@@ -278,3 +278,9 @@
 - (void)setUserVersion:(uint32_t)version;
 
 @end
+
+
+/* `identifier` as an SQL identifier: in double quotes, with any double quote doubled. Used by MSDatabase and the
+   classes built on it to put table, column and index names into generated SQL; not meant to be called directly. */
+
+NSString *MSDBQuoteIdentifier(NSString *identifier);
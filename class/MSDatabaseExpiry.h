@@ -0,0 +1,139 @@
+//  MSDatabaseExpiry.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MSDatabase;
+
+/** A table whose rows an `<MSDatabaseExpiry>` deletes once they are older than `<timeToLive>`, with the progress made so far.
+
+ All properties are safe to read from any thread while expiry runs.
+ */
+
+@interface MSDatabaseExpiryRule : NSObject {
+    NSString            *_table;
+    NSString            *_timeColumn;
+    NSTimeInterval      _timeToLive;
+    
+    NSString            *_boundSQL;
+    NSString            *_deleteSQL;
+    NSString            *_lastRowidSQL;
+    NSString            *_oldestTimeSQL;
+    
+    long long           _cursor;
+    NSUInteger          _batchSize;
+    BOOL                _caughtUp;
+    
+    unsigned long long  _deletedRows;
+    unsigned long long  _batches;
+    NSTimeInterval      _lastBatchDuration;
+    unsigned long long  _estimatedBacklog;
+    NSTimeInterval      _lag;
+}
+
+/** The table */
+
+@property (atomic, readonly) NSString *table;
+
+/** Column holding each row's time, in seconds since 1970 */
+
+@property (atomic, readonly) NSString *timeColumn;
+
+/** How long a row is kept, in seconds */
+
+@property (atomic, readonly) NSTimeInterval timeToLive;
+
+/** Rows the next batch will scan; adapted after each batch to the expiry's `targetHoldTime` */
+
+@property (atomic, readonly) NSUInteger batchSize;
+
+/** Whether the last sweep reached rows that have not expired yet */
+
+@property (atomic, readonly) BOOL caughtUp;
+
+/** Rows deleted */
+
+@property (atomic, readonly) unsigned long long deletedRows;
+
+/** Batches run */
+
+@property (atomic, readonly) unsigned long long batches;
+
+/** Time the last batch's `DELETE` held the write lock, in seconds */
+
+@property (atomic, readonly) NSTimeInterval lastBatchDuration;
+
+/** Expired rows still to delete, extrapolated from the last batch; `0` once caught up */
+
+@property (atomic, readonly) unsigned long long estimatedBacklog;
+
+/** How long ago the first row in rowid order expired, in seconds, as of the last batch; `0` if it has not */
+
+@property (atomic, readonly) NSTimeInterval lag;
+
+@end
+
+/** Deletes expired rows from tables that cannot be partitioned, a small batch at a time.
+
+ `DELETE FROM events WHERE ts < ?` over a large backlog holds the write lock until the last row is gone. Expiry instead deletes a rowid range at a time:
+
+    DELETE FROM events WHERE rowid > :cursor AND rowid <= :cursor_plus_batch AND ts < :cutoff
+
+ Each batch scans at most `batchSize` rows through the rowid b-tree, whatever the indexes, and is its own short transaction. The batch size is scaled after each batch so that the `DELETE` takes about `<targetHoldTime>`, and readers and writers get the lock between batches.
+
+ A sweep starts at the lowest rowid and moves forward while batches find expired rows; when a batch finds none, the rule is caught up and the next sweep starts over. This suits tables whose rows are inserted roughly in time order, as logs and caches are; an expired row far behind younger ones waits until the rows before it expire. Tables must have a rowid.
+
+ `<[MSDatabaseQueue expiry]>` and `<[MSDatabasePool expiry]>` run batches between the blocks of their callers every `expiryInterval`, and sooner while there is a backlog.
+ */
+
+@interface MSDatabaseExpiry : NSObject {
+    NSMutableArray      *_rules;
+    NSTimeInterval      _targetHoldTime;
+}
+
+/** Write-lock hold time each batch aims for, in seconds. Defaults to 0.01. */
+
+@property (atomic, assign) NSTimeInterval targetHoldTime;
+
+/** The rules, as `<MSDatabaseExpiryRule>` objects */
+
+@property (atomic, readonly) NSArray *rules;
+
+/** Sum of the rules' `estimatedBacklog` */
+
+@property (atomic, readonly) unsigned long long estimatedBacklog;
+
+/** Start expiring rows of a table.
+
+ @param table The table.
+ @param timeColumn Column holding each row's time, in seconds since 1970. Batches are faster with an index on it, but do not need one.
+ @param timeToLive How long a row is kept, in seconds.
+
+ @return The rule, replacing any earlier one for the same table.
+ */
+
+- (MSDatabaseExpiryRule *)addRuleForTable:(NSString *)table timeColumn:(NSString *)timeColumn timeToLive:(NSTimeInterval)timeToLive;
+
+/** Stop expiring rows of a table.
+
+ @param table The table.
+ */
+
+- (void)removeRuleForTable:(NSString *)table;
+
+/** Run one batch for each rule that is not caught up, or starts a new sweep.
+
+ Called by `<MSDatabaseQueue>` and `<MSDatabasePool>`; call it yourself to drive expiry from your own schedule. A batch that fails, for example with `SQLITE_BUSY`, is retried on the next call.
+
+ @param db The database; must not be inside a transaction, or the batches will not release the lock.
+
+ @return `YES` if a rule still has a backlog.
+ */
+
+- (BOOL)runBatchesInDatabase:(MSDatabase *)db;
+
+@end
@@ -0,0 +1,286 @@
+//  MSDatabaseExpiry.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseExpiry.h"
+#import "MSDatabase.h"
+#import "MSDatabaseAdditions.h"
+#import <time.h>
+
+#define MSDBExpiryMinimumBatchSize  16
+#define MSDBExpiryMaximumBatchSize  100000
+#define MSDBExpiryInitialBatchSize  500
+
+static NSTimeInterval MSDBExpiryNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (NSTimeInterval)ts.tv_sec + (NSTimeInterval)ts.tv_nsec / NSEC_PER_SEC;
+}
+
+@interface MSDatabaseExpiryRule ()
+
+- (instancetype)initWithTable:(NSString *)table timeColumn:(NSString *)timeColumn timeToLive:(NSTimeInterval)timeToLive;
+- (BOOL)runBatchInDatabase:(MSDatabase *)db targetHoldTime:(NSTimeInterval)targetHoldTime;
+
+@end
+
+@implementation MSDatabaseExpiryRule
+
+@synthesize table=_table;
+@synthesize timeColumn=_timeColumn;
+@synthesize timeToLive=_timeToLive;
+
+- (instancetype)initWithTable:(NSString *)table timeColumn:(NSString *)timeColumn timeToLive:(NSTimeInterval)timeToLive {
+    
+    self = [super init];
+    
+    if (self) {
+        
+        _table          = [table copy];
+        _timeColumn     = [timeColumn copy];
+        _timeToLive     = timeToLive;
+        _batchSize      = MSDBExpiryInitialBatchSize;
+        
+        NSString *quotedTable   = MSDBQuoteIdentifier(table);
+        NSString *quotedColumn  = MSDBQuoteIdentifier(timeColumn);
+        
+        // The upper end of the next batch's rowid range, and how many rows the range holds.
+        _boundSQL       = [[NSString alloc] initWithFormat:@"SELECT max(rowid), count(*) FROM (SELECT rowid FROM %@ WHERE rowid > ? ORDER BY rowid LIMIT ?)", quotedTable];
+        _deleteSQL      = [[NSString alloc] initWithFormat:@"DELETE FROM %@ WHERE rowid > ? AND rowid <= ? AND %@ < ?", quotedTable, quotedColumn];
+        _lastRowidSQL   = [[NSString alloc] initWithFormat:@"SELECT max(rowid) FROM %@", quotedTable];
+        _oldestTimeSQL  = [[NSString alloc] initWithFormat:@"SELECT %@ FROM %@ ORDER BY rowid LIMIT 1", quotedColumn, quotedTable];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_table);
+    MSDBRelease(_timeColumn);
+    MSDBRelease(_boundSQL);
+    MSDBRelease(_deleteSQL);
+    MSDBRelease(_lastRowidSQL);
+    MSDBRelease(_oldestTimeSQL);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ %@.%@ ttl %.0fs: %llu deleted in %llu batches, ~%llu behind", [super description], _table, _timeColumn, _timeToLive, [self deletedRows], [self batches], [self estimatedBacklog]];
+}
+
+- (NSUInteger)batchSize {
+    @synchronized(self) {
+        return _batchSize;
+    }
+}
+
+- (BOOL)caughtUp {
+    @synchronized(self) {
+        return _caughtUp;
+    }
+}
+
+- (unsigned long long)deletedRows {
+    @synchronized(self) {
+        return _deletedRows;
+    }
+}
+
+- (unsigned long long)batches {
+    @synchronized(self) {
+        return _batches;
+    }
+}
+
+- (NSTimeInterval)lastBatchDuration {
+    @synchronized(self) {
+        return _lastBatchDuration;
+    }
+}
+
+- (unsigned long long)estimatedBacklog {
+    @synchronized(self) {
+        return _estimatedBacklog;
+    }
+}
+
+- (NSTimeInterval)lag {
+    @synchronized(self) {
+        return _lag;
+    }
+}
+
+// Returns YES if the sweep should go on.
+- (BOOL)runBatchInDatabase:(MSDatabase *)db targetHoldTime:(NSTimeInterval)targetHoldTime {
+    
+    long long cursor;
+    NSUInteger batchSize;
+    
+    @synchronized(self) {
+        cursor      = _cursor;
+        batchSize   = _batchSize;
+    }
+    
+    NSTimeInterval cutoff = [[NSDate date] timeIntervalSince1970] - _timeToLive;
+    
+    MSResultSet *rs = [db executeCachedQuery:_boundSQL withArgumentsInArray:[NSArray arrayWithObjects:[NSNumber numberWithLongLong:cursor], [NSNumber numberWithUnsignedInteger:batchSize], nil]];
+    
+    if (![rs next]) {
+        [rs close];
+        return NO;
+    }
+    
+    BOOL reachedEnd     = [rs columnIndexIsNull:0];
+    long long upper     = [rs longLongIntForColumnIndex:0];
+    long long scanned   = [rs longLongIntForColumnIndex:1];
+    
+    [rs close];
+    
+    int deleted = 0;
+    NSTimeInterval duration = 0;
+    
+    if (!reachedEnd) {
+        
+        NSTimeInterval start = MSDBExpiryNow();
+        
+        if (![db executeCachedUpdate:_deleteSQL withArgumentsInArray:[NSArray arrayWithObjects:[NSNumber numberWithLongLong:cursor], [NSNumber numberWithLongLong:upper], [NSNumber numberWithDouble:cutoff], nil]]) {
+            return NO;
+        }
+        
+        duration = MSDBExpiryNow() - start;
+        deleted = [db changes];
+    }
+    
+    // Keep going while batches find expired rows; a full batch with none means we reached live rows.
+    BOOL more = (deleted > 0 && scanned >= (long long)batchSize);
+    
+    long long lastRowid = 0;
+    NSTimeInterval oldestTime = cutoff;
+    
+    if (more) {
+        rs = [db executeCachedQuery:_lastRowidSQL withArgumentsInArray:[NSArray array]];
+        if ([rs next]) {
+            lastRowid = [rs longLongIntForColumnIndex:0];
+        }
+        [rs close];
+    }
+    
+    rs = [db executeCachedQuery:_oldestTimeSQL withArgumentsInArray:[NSArray array]];
+    if ([rs next] && ![rs columnIndexIsNull:0]) {
+        oldestTime = [rs doubleForColumnIndex:0];
+    }
+    [rs close];
+    
+    @synchronized(self) {
+        
+        if (!reachedEnd) {
+            
+            // Scale toward the target, at most doubling or halving at a time so that one slow commit does not collapse the batch.
+            double scale = duration > 0 ? targetHoldTime / duration : 2;
+            scale = MAX(0.5, MIN(2, scale));
+            
+            _batchSize = (NSUInteger)MAX(MSDBExpiryMinimumBatchSize, MIN(MSDBExpiryMaximumBatchSize, batchSize * scale));
+            _batches++;
+            _deletedRows += (unsigned long long)deleted;
+            _lastBatchDuration = duration;
+        }
+        
+        _cursor             = more ? upper : 0;
+        _caughtUp           = !more;
+        _estimatedBacklog   = more ? (unsigned long long)((double)MAX(lastRowid - upper, 0) * deleted / scanned) : 0;
+        _lag                = MAX(0, cutoff - oldestTime);
+    }
+    
+    return more;
+}
+
+@end
+
+@implementation MSDatabaseExpiry
+
+@synthesize targetHoldTime=_targetHoldTime;
+
+- (instancetype)init {
+    
+    self = [super init];
+    
+    if (self) {
+        _rules          = [[NSMutableArray alloc] init];
+        _targetHoldTime = 0.01;
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_rules);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSArray *)rules {
+    @synchronized(self) {
+        return [NSArray arrayWithArray:_rules];
+    }
+}
+
+- (unsigned long long)estimatedBacklog {
+    
+    unsigned long long backlog = 0;
+    
+    for (MSDatabaseExpiryRule *rule in [self rules]) {
+        backlog += [rule estimatedBacklog];
+    }
+    
+    return backlog;
+}
+
+- (MSDatabaseExpiryRule *)addRuleForTable:(NSString *)table timeColumn:(NSString *)timeColumn timeToLive:(NSTimeInterval)timeToLive {
+    
+    NSParameterAssert(table);
+    NSParameterAssert(timeColumn);
+    
+    MSDatabaseExpiryRule *rule = [[MSDatabaseExpiryRule alloc] initWithTable:table timeColumn:timeColumn timeToLive:timeToLive];
+    
+    @synchronized(self) {
+        [self removeRuleForTable:table];
+        [_rules addObject:rule];
+    }
+    
+    return MSDBReturnAutoreleased(rule);
+}
+
+- (void)removeRuleForTable:(NSString *)table {
+    @synchronized(self) {
+        NSUInteger idx = [_rules indexOfObjectPassingTest:^BOOL(MSDatabaseExpiryRule *rule, NSUInteger i, BOOL *stop) {
+            return [[rule table] isEqualToString:table];
+        }];
+        if (idx != NSNotFound) {
+            [_rules removeObjectAtIndex:idx];
+        }
+    }
+}
+
+- (BOOL)runBatchesInDatabase:(MSDatabase *)db {
+    
+    NSTimeInterval targetHoldTime = [self targetHoldTime];
+    BOOL more = NO;
+    
+    for (MSDatabaseExpiryRule *rule in [self rules]) {
+        if ([rule runBatchInDatabase:db targetHoldTime:targetHoldTime]) {
+            more = YES;
+        }
+    }
+    
+    return more;
+}
+
+@end
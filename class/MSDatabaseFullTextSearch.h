@@ -0,0 +1,142 @@
+//  MSDatabaseFullTextSearch.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "MSDatabase.h"
+
+
+/** Category of FTS5 full-text search helpers for `<MSDatabase>` class.
+ 
+ An index is an [external content](https://www.sqlite.org/fts5.html#external_content_tables) FTS5 table: it stores only the token index and reads the text from the ordinary table, which triggers keep it in sync with. Searching with `MATCH` is then an index lookup instead of a `LIKE '%term%'` scan.
+ 
+    [db createFullTextIndex:@"notes_fts" onTable:@"notes" columns:@[@"title", @"body"] tokenizer:@"unicode61 remove_diacritics 2" error:&err];
+ 
+    MSResultSet *rs = [db searchFullTextIndex:@"notes_fts" matching:[MSDatabase fullTextQueryForText:userInput] snippetColumn:1 limit:20];
+    while ([rs next]) {
+        sqlite_int64 noteID = [rs longLongIntForColumn:@"rowid"];
+        NSString *snippet   = [rs stringForColumn:@"snippet"];
+    }
+ 
+ SQLite must be built with FTS5, which is the case on current Apple platforms.
+ 
+ ### See also
+
+ - `<MSDatabase>`
+ */
+
+@interface MSDatabase (MSDatabaseFullTextSearch)
+
+///---------------------------------
+/// @name Creating full-text indexes
+///---------------------------------
+
+/** Create an FTS5 index over columns of a table, kept current by triggers.
+ 
+ Creates the external content FTS5 table `indexName` together with `AFTER INSERT`, `AFTER UPDATE` and `AFTER DELETE` triggers on `tableName`, then indexes any rows already in the table. Everything is created with `IF NOT EXISTS` inside a savepoint, so calling this again is harmless.
+ 
+ @param indexName The name of the FTS5 table to create.
+ @param tableName The table whose text is indexed; its `rowid` identifies each hit.
+ @param columns Names of the text columns to index. Column `0` of `<searchFullTextIndex:matching:snippetColumn:limit:>` is the first of these.
+ @param tokenizer An FTS5 `tokenize` option such as `@"porter unicode61"`, or `nil` for the default.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)createFullTextIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns tokenizer:(NSString *)tokenizer error:(NSError **)outErr;
+
+/** Drop an index created by `<createFullTextIndex:onTable:columns:tokenizer:error:>` together with its triggers.
+ 
+ @param indexName The name of the FTS5 table.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)dropFullTextIndex:(NSString *)indexName error:(NSError **)outErr;
+
+/** Rebuild an index from scratch in batches, then optimize it.
+ 
+ Clears the index and re-inserts the content table's rows in `rowid` order, `batchSize` rows per statement, then merges the index into a single b-tree with FTS5's `optimize` command, which makes subsequent queries faster. Use this after bulk loads done with the triggers dropped, or to recover from a damaged index.
+ 
+ Everything runs inside one savepoint, which joins the caller's transaction if there is one: the sync triggers of other writers cannot interleave with a half-rebuilt index, and a failure leaves the index as it was.
+ 
+ @param indexName The name of the FTS5 table.
+ @param tableName The content table.
+ @param columns The indexed columns, as passed when the index was created.
+ @param batchSize Rows per statement; `0` for 10000.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ 
+ @warning The write lock is held until the whole index is rebuilt.
+ */
+
+- (BOOL)rebuildFullTextIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns batchSize:(NSUInteger)batchSize error:(NSError **)outErr;
+
+/** Merge an index's segments into one with FTS5's `optimize` command.
+ 
+ @param indexName The name of the FTS5 table.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)optimizeFullTextIndex:(NSString *)indexName;
+
+///------------------
+/// @name Searching
+///------------------
+
+/** Ranked full-text search.
+ 
+ Runs through a cached statement, so repeated searches against the same index are not re-prepared. The result set has these columns, best match first:
+ 
+ - `rowid` - the `rowid` of the matching row in the content table
+ - `rank` - the `bm25()` score; lower is better
+ - `snippet` - an excerpt of `snippetColumn` around the matches, with matches wrapped in `<b>`…`</b>`
+ - `highlight` - the whole of `snippetColumn` with matches wrapped in `<b>`…`</b>`
+ 
+ @param indexName The name of the FTS5 table.
+ @param match An FTS5 query expression. Escape user input with `<fullTextQueryForText:>`.
+ @param snippetColumn Zero-based index, among the indexed columns, of the column used for `snippet` and `highlight`.
+ @param limit Maximum number of hits.
+ 
+ @return `MSResultSet` of hits; `nil` on error.
+ 
+ @see searchFullTextIndex:matching:snippetColumn:startMark:endMark:limit:
+ */
+
+- (MSResultSet *)searchFullTextIndex:(NSString *)indexName matching:(NSString *)match snippetColumn:(int)snippetColumn limit:(NSUInteger)limit;
+
+/** Ranked full-text search with custom highlight markers.
+ 
+ @param indexName The name of the FTS5 table.
+ @param match An FTS5 query expression.
+ @param snippetColumn Zero-based index, among the indexed columns, of the column used for `snippet` and `highlight`.
+ @param startMark Text inserted before each match.
+ @param endMark Text inserted after each match.
+ @param limit Maximum number of hits.
+ 
+ @return `MSResultSet` of hits; `nil` on error.
+ 
+ @see searchFullTextIndex:matching:snippetColumn:limit:
+ */
+
+- (MSResultSet *)searchFullTextIndex:(NSString *)indexName matching:(NSString *)match snippetColumn:(int)snippetColumn startMark:(NSString *)startMark endMark:(NSString *)endMark limit:(NSUInteger)limit;
+
+/** Turn arbitrary text into an FTS5 query that matches rows containing all of its words.
+ 
+ Each whitespace separated word becomes a quoted string, so characters that are FTS5 syntax (`"`, `*`, `-`, `:`, `AND`, …) are matched literally. The last word is a prefix query, which suits search-as-you-type.
+ 
+ @param text The text typed by the user.
+ 
+ @return An FTS5 query expression; `nil` if `text` has no words.
+ */
+
++ (NSString *)fullTextQueryForText:(NSString *)text;
+
+@end
@@ -0,0 +1,212 @@
+//  MSDatabaseFullTextSearch.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseFullTextSearch.h"
+#import "MSDatabaseAdditions.h"
+
+@interface MSDatabase (PrivateStuff)
+- (NSError*)errorWithMessage:(NSString*)message;
+@end
+
+#define MSDBFullTextDefaultBatchSize 10000
+#define MSDBFullTextSnippetTokens 16
+
+static NSString *MSDBFullTextQuoteLiteral(NSString *literal) {
+    return [NSString stringWithFormat:@"'%@'", [literal stringByReplacingOccurrencesOfString:@"'" withString:@"''"]];
+}
+
+// `prefix` + each quoted column, joined by ", ". E.g. "new." gives `new."title", new."body"`.
+static NSString *MSDBFullTextColumnList(NSArray *columns, NSString *prefix) {
+    NSMutableArray *quoted = [NSMutableArray arrayWithCapacity:[columns count]];
+    for (NSString *column in columns) {
+        [quoted addObject:[prefix stringByAppendingString:MSDBQuoteIdentifier(column)]];
+    }
+    return [quoted componentsJoinedByString:@", "];
+}
+
+@implementation MSDatabase (MSDatabaseFullTextSearch)
+
+- (BOOL)fullTextSetError:(NSError **)outErr {
+    if (outErr) {
+        *outErr = [self lastError];
+    }
+    return NO;
+}
+
+- (BOOL)createFullTextIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns tokenizer:(NSString *)tokenizer error:(NSError **)outErr {
+    
+    if (![columns count]) {
+        MSDBLogWarning(@"No columns given for full-text index %@", indexName);
+        if (outErr) {
+            *outErr = [self errorWithMessage:@"No columns given for full-text index"];
+        }
+        return NO;
+    }
+    
+    NSString *idx      = MSDBQuoteIdentifier(indexName);
+    NSString *table    = MSDBQuoteIdentifier(tableName);
+    NSString *cols     = MSDBFullTextColumnList(columns, @"");
+    NSString *newCols  = MSDBFullTextColumnList(columns, @"new.");
+    NSString *oldCols  = MSDBFullTextColumnList(columns, @"old.");
+    BOOL existed       = [self tableExists:indexName];
+    
+    NSMutableString *sql = [NSMutableString string];
+    [sql appendFormat:@"CREATE VIRTUAL TABLE IF NOT EXISTS %@ USING fts5(%@, content=%@, content_rowid='rowid'%@);\n",
+     idx, cols, MSDBFullTextQuoteLiteral(tableName),
+     tokenizer ? [NSString stringWithFormat:@", tokenize=%@", MSDBFullTextQuoteLiteral(tokenizer)] : @""];
+    
+    // The 'delete' command has to be given the old values, so that FTS5 can find the tokens to remove.
+    [sql appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER INSERT ON %@ BEGIN INSERT INTO %@(rowid, %@) VALUES (new.rowid, %@); END;\n",
+     MSDBQuoteIdentifier([indexName stringByAppendingString:@"_ai"]), table, idx, cols, newCols];
+    [sql appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER DELETE ON %@ BEGIN INSERT INTO %@(%@, rowid, %@) VALUES ('delete', old.rowid, %@); END;\n",
+     MSDBQuoteIdentifier([indexName stringByAppendingString:@"_ad"]), table, idx, idx, cols, oldCols];
+    [sql appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER UPDATE ON %@ BEGIN INSERT INTO %@(%@, rowid, %@) VALUES ('delete', old.rowid, %@); INSERT INTO %@(rowid, %@) VALUES (new.rowid, %@); END;\n",
+     MSDBQuoteIdentifier([indexName stringByAppendingString:@"_au"]), table, idx, idx, cols, oldCols, idx, cols, newCols];
+    
+    if (!existed) {
+        [sql appendFormat:@"INSERT INTO %@(%@) VALUES ('rebuild');\n", idx, idx];
+    }
+    
+    NSString *savepoint = @"msdb_fts_create";
+    if (![self startSavePointWithName:savepoint error:outErr]) {
+        return NO;
+    }
+    
+    if (![self executeStatements:sql]) {
+        NSError *err = [self lastError];
+        [self rollbackToSavePointWithName:savepoint error:nil];
+        [self releaseSavePointWithName:savepoint error:nil];
+        if (outErr) {
+            *outErr = err;
+        }
+        return NO;
+    }
+    
+    return [self releaseSavePointWithName:savepoint error:outErr];
+}
+
+- (BOOL)dropFullTextIndex:(NSString *)indexName error:(NSError **)outErr {
+    
+    NSMutableString *sql = [NSMutableString string];
+    for (NSString *suffix in [NSArray arrayWithObjects:@"_ai", @"_ad", @"_au", nil]) {
+        [sql appendFormat:@"DROP TRIGGER IF EXISTS %@;\n", MSDBQuoteIdentifier([indexName stringByAppendingString:suffix])];
+    }
+    [sql appendFormat:@"DROP TABLE IF EXISTS %@;\n", MSDBQuoteIdentifier(indexName)];
+    
+    if (![self executeStatements:sql]) {
+        return [self fullTextSetError:outErr];
+    }
+    return YES;
+}
+
+- (BOOL)rebuildFullTextIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns batchSize:(NSUInteger)batchSize error:(NSError **)outErr {
+    
+    if (!batchSize) {
+        batchSize = MSDBFullTextDefaultBatchSize;
+    }
+    
+    NSString *idx   = MSDBQuoteIdentifier(indexName);
+    NSString *table = MSDBQuoteIdentifier(tableName);
+    NSString *cols  = MSDBFullTextColumnList(columns, @"");
+    
+    // Batches are bounded by rowid rather than OFFSET, so each one is a range seek on the content table.
+    NSString *boundSQL  = [NSString stringWithFormat:@"SELECT max(rowid) FROM (SELECT rowid FROM %@ WHERE rowid > ? ORDER BY rowid LIMIT ?)", table];
+    NSString *insertSQL = [NSString stringWithFormat:@"INSERT INTO %@(rowid, %@) SELECT rowid, %@ FROM %@ WHERE rowid > ? AND rowid <= ?", idx, cols, cols, table];
+    
+    // One savepoint for the whole rebuild: were the batches committed separately, rows written meanwhile through the sync triggers would be indexed twice, or deleted from the index before being re-indexed.
+    NSString *savepoint = @"msdb_fts_rebuild";
+    if (![self startSavePointWithName:savepoint error:outErr]) {
+        return NO;
+    }
+    
+    BOOL success = [self executeUpdate:[NSString stringWithFormat:@"INSERT INTO %@(%@) VALUES ('delete-all')", idx, idx]];
+    
+    sqlite_int64 lastRowid = LLONG_MIN;
+    
+    while (success) {
+        
+        MSResultSet *rs = [self executeCachedQuery:boundSQL withArgumentsInArray:[NSArray arrayWithObjects:[NSNumber numberWithLongLong:lastRowid], [NSNumber numberWithUnsignedInteger:batchSize], nil]];
+        if (!rs) {
+            success = NO;
+            break;
+        }
+        
+        BOOL done = ![rs next] || [rs columnIndexIsNull:0];
+        sqlite_int64 upperRowid = done ? 0 : [rs longLongIntForColumnIndex:0];
+        [rs close];
+        
+        if (done) {
+            break;
+        }
+        
+        success = [self executeCachedUpdate:insertSQL withArgumentsInArray:[NSArray arrayWithObjects:[NSNumber numberWithLongLong:lastRowid], [NSNumber numberWithLongLong:upperRowid], nil]];
+        
+        lastRowid = upperRowid;
+    }
+    
+    if (success) {
+        success = [self optimizeFullTextIndex:indexName];
+    }
+    
+    if (!success) {
+        NSError *err = [self lastError];
+        [self rollbackToSavePointWithName:savepoint error:nil];
+        [self releaseSavePointWithName:savepoint error:nil];
+        if (outErr) {
+            *outErr = err;
+        }
+        return NO;
+    }
+    
+    return [self releaseSavePointWithName:savepoint error:outErr];
+}
+
+- (BOOL)optimizeFullTextIndex:(NSString *)indexName {
+    NSString *idx = MSDBQuoteIdentifier(indexName);
+    return [self executeUpdate:[NSString stringWithFormat:@"INSERT INTO %@(%@) VALUES ('optimize')", idx, idx]];
+}
+
+- (MSResultSet *)searchFullTextIndex:(NSString *)indexName matching:(NSString *)match snippetColumn:(int)snippetColumn limit:(NSUInteger)limit {
+    return [self searchFullTextIndex:indexName matching:match snippetColumn:snippetColumn startMark:@"<b>" endMark:@"</b>" limit:limit];
+}
+
+- (MSResultSet *)searchFullTextIndex:(NSString *)indexName matching:(NSString *)match snippetColumn:(int)snippetColumn startMark:(NSString *)startMark endMark:(NSString *)endMark limit:(NSUInteger)limit {
+    
+    if (!match) {
+        return nil;
+    }
+    
+    // Only the table name is formatted in, so there is one cached statement per index; everything else is bound.
+    NSString *idx = MSDBQuoteIdentifier(indexName);
+    NSString *sql = [NSString stringWithFormat:@"SELECT rowid, bm25(%@) AS rank, snippet(%@, ?1, ?2, ?3, '…', ?4) AS snippet, highlight(%@, ?1, ?2, ?3) AS highlight FROM %@ WHERE %@ MATCH ?5 ORDER BY rank LIMIT ?6",
+                     idx, idx, idx, idx, idx];
+    
+    NSArray *arguments = [NSArray arrayWithObjects:[NSNumber numberWithInt:snippetColumn], startMark ? startMark : @"", endMark ? endMark : @"",
+                          [NSNumber numberWithInt:MSDBFullTextSnippetTokens], match, [NSNumber numberWithUnsignedInteger:limit], nil];
+    
+    return [self executeCachedQuery:sql withArgumentsInArray:arguments];
+}
+
++ (NSString *)fullTextQueryForText:(NSString *)text {
+    
+    NSMutableArray *terms = [NSMutableArray array];
+    for (NSString *word in [text componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]]) {
+        if ([word length]) {
+            [terms addObject:[NSString stringWithFormat:@"\"%@\"", [word stringByReplacingOccurrencesOfString:@"\"" withString:@"\"\""]]];
+        }
+    }
+    
+    if (![terms count]) {
+        return nil;
+    }
+    
+    [terms replaceObjectAtIndex:[terms count] - 1 withObject:[[terms lastObject] stringByAppendingString:@"*"]];
+    
+    return [terms componentsJoinedByString:@" "];
+}
+
+@end
@@ -0,0 +1,139 @@
+//
+//  MSDatabaseIOStatistics.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/** Number of buckets in each `<MSDatabaseIOStatistics>` latency histogram */
+
+#define MSDBIOHistogramBucketCount 32
+
+struct MSDBIOShim;
+
+/** Point-in-time copy of the disk I/O counted for an `<MSDatabase>` opened with `<[MSDatabase instrumentsIO]>`, for the whole connection or for one of its files.
+
+ The connection opens through a shim VFS that wraps the default one and times every `xRead`, `xWrite` and `xSync`. Latencies are collected in histograms with power-of-two buckets of microseconds: bucket `0` counts calls under 1µs, and bucket `i` counts calls from 2^(i-1) up to 2^i µs. The last bucket also counts everything longer.
+
+ Pages SQLite reads through a memory map (`PRAGMA mmap_size`) do not go through `xRead`, and are not counted.
+ */
+
+@interface MSDatabaseIOStatistics : NSObject {
+    NSString            *_path;
+    int                 _openFlags;
+    unsigned long long  _reads;
+    unsigned long long  _writes;
+    unsigned long long  _syncs;
+    unsigned long long  _bytesRead;
+    unsigned long long  _bytesWritten;
+    NSTimeInterval      _readTime;
+    NSTimeInterval      _writeTime;
+    NSTimeInterval      _syncTime;
+    NSArray             *_readTimeHistogram;
+    NSArray             *_writeTimeHistogram;
+    NSArray             *_syncTimeHistogram;
+}
+
+/** Path of the file; `nil` for the connection's totals and for temporary files SQLite opens without a name */
+
+@property (atomic, readonly) NSString *path;
+
+/** `SQLITE_OPEN_MAIN_DB`, `SQLITE_OPEN_MAIN_JOURNAL`, `SQLITE_OPEN_WAL`, `SQLITE_OPEN_TEMP_DB`… flag the file was first opened with; `0` for the connection's totals */
+
+@property (atomic, readonly) int openFlags;
+
+/** `xRead` calls */
+
+@property (atomic, readonly) unsigned long long reads;
+
+/** `xWrite` calls */
+
+@property (atomic, readonly) unsigned long long writes;
+
+/** `xSync` calls */
+
+@property (atomic, readonly) unsigned long long syncs;
+
+/** Bytes requested by `xRead` calls */
+
+@property (atomic, readonly) unsigned long long bytesRead;
+
+/** Bytes passed to `xWrite` calls */
+
+@property (atomic, readonly) unsigned long long bytesWritten;
+
+/** Time spent in `xRead`, in seconds */
+
+@property (atomic, readonly) NSTimeInterval readTime;
+
+/** Time spent in `xWrite`, in seconds */
+
+@property (atomic, readonly) NSTimeInterval writeTime;
+
+/** Time spent in `xSync`, in seconds */
+
+@property (atomic, readonly) NSTimeInterval syncTime;
+
+/** `MSDBIOHistogramBucketCount` `NSNumber` counts of `xRead` latencies */
+
+@property (atomic, readonly) NSArray *readTimeHistogram;
+
+/** `MSDBIOHistogramBucketCount` `NSNumber` counts of `xWrite` latencies */
+
+@property (atomic, readonly) NSArray *writeTimeHistogram;
+
+/** `MSDBIOHistogramBucketCount` `NSNumber` counts of `xSync` latencies */
+
+@property (atomic, readonly) NSArray *syncTimeHistogram;
+
+/** Upper bound, in seconds, of the latencies counted in a histogram bucket.
+
+ @param bucket Bucket index, from `0` to `MSDBIOHistogramBucketCount - 1`.
+
+ @return The bucket's upper bound; `DBL_MAX` for the last bucket.
+ */
+
++ (NSTimeInterval)upperBoundOfHistogramBucket:(NSUInteger)bucket;
+
+/** Estimate a percentile of `xRead` latencies.
+
+ @param percentile From `0` to `100`, e.g. `99` for the 99th percentile.
+
+ @return Upper bound, in seconds, of the bucket holding the percentile; `0` if nothing was recorded.
+ */
+
+- (NSTimeInterval)readTimeAtPercentile:(double)percentile;
+
+/** Estimate a percentile of `xWrite` latencies.
+
+ @param percentile From `0` to `100`, e.g. `99` for the 99th percentile.
+
+ @return Upper bound, in seconds, of the bucket holding the percentile; `0` if nothing was recorded.
+ */
+
+- (NSTimeInterval)writeTimeAtPercentile:(double)percentile;
+
+/** Estimate a percentile of `xSync` latencies.
+
+ @param percentile From `0` to `100`, e.g. `99` for the 99th percentile.
+
+ @return Upper bound, in seconds, of the bucket holding the percentile; `0` if nothing was recorded.
+ */
+
+- (NSTimeInterval)syncTimeAtPercentile:(double)percentile;
+
+@end
+
+
+/* The shim VFS behind [MSDatabase instrumentsIO]. Each connection registers its own instance, under the
+   returned name, so that every file it opens is attributed to it. Used by MSDatabase; not meant to be called directly. */
+
+struct MSDBIOShim *MSDBIOShimCreate(void);
+const char *MSDBIOShimName(struct MSDBIOShim *shim);
+void MSDBIOShimDestroy(struct MSDBIOShim *shim);
+MSDatabaseIOStatistics *MSDBIOShimStatistics(struct MSDBIOShim *shim);
+NSArray *MSDBIOShimFileStatistics(struct MSDBIOShim *shim);
+void MSDBIOShimReset(struct MSDBIOShim *shim);
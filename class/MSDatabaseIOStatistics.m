@@ -0,0 +1,605 @@
+//
+//  MSDatabaseIOStatistics.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseIOStatistics.h"
+#import "MSDatabase.h"
+#import <stdatomic.h>
+#import <pthread.h>
+#import <time.h>
+#import <float.h>
+#import <math.h>
+
+// Updated with relaxed atomics from whichever thread uses the connection; read without a lock.
+struct MSDBIOCounters {
+    _Atomic(uint64_t)   reads;
+    _Atomic(uint64_t)   writes;
+    _Atomic(uint64_t)   syncs;
+    _Atomic(uint64_t)   bytesRead;
+    _Atomic(uint64_t)   bytesWritten;
+    _Atomic(uint64_t)   readTotal;          // microseconds
+    _Atomic(uint64_t)   writeTotal;
+    _Atomic(uint64_t)   syncTotal;
+    _Atomic(uint64_t)   readHistogram[MSDBIOHistogramBucketCount];
+    _Atomic(uint64_t)   writeHistogram[MSDBIOHistogramBucketCount];
+    _Atomic(uint64_t)   syncHistogram[MSDBIOHistogramBucketCount];
+};
+
+// Counters of one file name, kept for the life of the connection: journals are opened and closed per transaction.
+typedef struct MSDBIOFileEntry {
+    struct MSDBIOFileEntry  *next;
+    char                    *path;          // NULL for temporary files
+    int                     openFlags;
+    struct MSDBIOCounters   counters;
+} MSDBIOFileEntry;
+
+// The vfs must come first: SQLite hands it back to xOpen, which casts it to the shim.
+struct MSDBIOShim {
+    sqlite3_vfs             vfs;
+    sqlite3_vfs             *real;
+    char                    name[64];
+    BOOL                    registered;
+    pthread_mutex_t         lock;           // guards files
+    MSDBIOFileEntry         *files;
+    struct MSDBIOCounters   counters;
+};
+
+// An open file: our header, then the real VFS's file at the next 8-byte boundary.
+typedef struct MSDBIOFile {
+    sqlite3_file            base;
+    sqlite3_file            *real;
+    struct MSDBIOShim       *shim;
+    MSDBIOFileEntry         *entry;
+} MSDBIOFile;
+
+#define MSDBIOFileHeaderSize ((sizeof(MSDBIOFile) + 7) & ~(size_t)7)
+
+static _Atomic(uint64_t) MSDBIONextShim = 1;
+
+static uint64_t MSDBIONowMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void MSDBIOCount(_Atomic(uint64_t) *counter, uint64_t amount) {
+    atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+static void MSDBIORecordDuration(_Atomic(uint64_t) *histogram, _Atomic(uint64_t) *total, uint64_t micros) {
+    
+    unsigned bucket = micros ? (unsigned)(64 - __builtin_clzll(micros)) : 0;
+    if (bucket >= MSDBIOHistogramBucketCount) {
+        bucket = MSDBIOHistogramBucketCount - 1;
+    }
+    
+    MSDBIOCount(&histogram[bucket], 1);
+    MSDBIOCount(total, micros);
+}
+
+static void MSDBIORecordRead(MSDBIOFile *file, int amount, uint64_t micros) {
+    struct MSDBIOCounters *all[2] = { &file->shim->counters, &file->entry->counters };
+    for (int i = 0; i < 2; i++) {
+        MSDBIOCount(&all[i]->reads, 1);
+        MSDBIOCount(&all[i]->bytesRead, (uint64_t)amount);
+        MSDBIORecordDuration(all[i]->readHistogram, &all[i]->readTotal, micros);
+    }
+}
+
+static void MSDBIORecordWrite(MSDBIOFile *file, int amount, uint64_t micros) {
+    struct MSDBIOCounters *all[2] = { &file->shim->counters, &file->entry->counters };
+    for (int i = 0; i < 2; i++) {
+        MSDBIOCount(&all[i]->writes, 1);
+        MSDBIOCount(&all[i]->bytesWritten, (uint64_t)amount);
+        MSDBIORecordDuration(all[i]->writeHistogram, &all[i]->writeTotal, micros);
+    }
+}
+
+static void MSDBIORecordSync(MSDBIOFile *file, uint64_t micros) {
+    struct MSDBIOCounters *all[2] = { &file->shim->counters, &file->entry->counters };
+    for (int i = 0; i < 2; i++) {
+        MSDBIOCount(&all[i]->syncs, 1);
+        MSDBIORecordDuration(all[i]->syncHistogram, &all[i]->syncTotal, micros);
+    }
+}
+
+#pragma mark File methods
+
+static int MSDBIOClose(sqlite3_file *pFile) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xClose(file->real);
+}
+
+static int MSDBIORead(sqlite3_file *pFile, void *buffer, int amount, sqlite3_int64 offset) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    uint64_t start = MSDBIONowMicros();
+    int rc = file->real->pMethods->xRead(file->real, buffer, amount, offset);
+    MSDBIORecordRead(file, amount, MSDBIONowMicros() - start);
+    return rc;
+}
+
+static int MSDBIOWrite(sqlite3_file *pFile, const void *buffer, int amount, sqlite3_int64 offset) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    uint64_t start = MSDBIONowMicros();
+    int rc = file->real->pMethods->xWrite(file->real, buffer, amount, offset);
+    MSDBIORecordWrite(file, amount, MSDBIONowMicros() - start);
+    return rc;
+}
+
+static int MSDBIOTruncate(sqlite3_file *pFile, sqlite3_int64 size) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xTruncate(file->real, size);
+}
+
+static int MSDBIOSync(sqlite3_file *pFile, int flags) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    uint64_t start = MSDBIONowMicros();
+    int rc = file->real->pMethods->xSync(file->real, flags);
+    MSDBIORecordSync(file, MSDBIONowMicros() - start);
+    return rc;
+}
+
+static int MSDBIOFileSize(sqlite3_file *pFile, sqlite3_int64 *size) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xFileSize(file->real, size);
+}
+
+static int MSDBIOLock(sqlite3_file *pFile, int lock) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xLock(file->real, lock);
+}
+
+static int MSDBIOUnlock(sqlite3_file *pFile, int lock) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xUnlock(file->real, lock);
+}
+
+static int MSDBIOCheckReservedLock(sqlite3_file *pFile, int *result) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xCheckReservedLock(file->real, result);
+}
+
+static int MSDBIOFileControl(sqlite3_file *pFile, int op, void *arg) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xFileControl(file->real, op, arg);
+}
+
+static int MSDBIOSectorSize(sqlite3_file *pFile) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xSectorSize(file->real);
+}
+
+static int MSDBIODeviceCharacteristics(sqlite3_file *pFile) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xDeviceCharacteristics(file->real);
+}
+
+static int MSDBIOShmMap(sqlite3_file *pFile, int region, int size, int extend, void volatile **pp) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xShmMap(file->real, region, size, extend, pp);
+}
+
+static int MSDBIOShmLock(sqlite3_file *pFile, int offset, int n, int flags) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xShmLock(file->real, offset, n, flags);
+}
+
+static void MSDBIOShmBarrier(sqlite3_file *pFile) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    file->real->pMethods->xShmBarrier(file->real);
+}
+
+static int MSDBIOShmUnmap(sqlite3_file *pFile, int deleteFlag) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xShmUnmap(file->real, deleteFlag);
+}
+
+static int MSDBIOFetch(sqlite3_file *pFile, sqlite3_int64 offset, int amount, void **pp) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xFetch(file->real, offset, amount, pp);
+}
+
+static int MSDBIOUnfetch(sqlite3_file *pFile, sqlite3_int64 offset, void *p) {
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    return file->real->pMethods->xUnfetch(file->real, offset, p);
+}
+
+// One table per io_methods version, so that SQLite only calls what the wrapped file implements.
+#define MSDBIOMethods(version) { \
+    version, MSDBIOClose, MSDBIORead, MSDBIOWrite, MSDBIOTruncate, MSDBIOSync, MSDBIOFileSize, \
+    MSDBIOLock, MSDBIOUnlock, MSDBIOCheckReservedLock, MSDBIOFileControl, MSDBIOSectorSize, \
+    MSDBIODeviceCharacteristics, MSDBIOShmMap, MSDBIOShmLock, MSDBIOShmBarrier, MSDBIOShmUnmap, \
+    MSDBIOFetch, MSDBIOUnfetch }
+
+static const sqlite3_io_methods MSDBIOMethodsByVersion[3] = { MSDBIOMethods(1), MSDBIOMethods(2), MSDBIOMethods(3) };
+
+#pragma mark VFS methods
+
+static MSDBIOFileEntry *MSDBIOFileEntryForPath(struct MSDBIOShim *shim, const char *path, int flags) {
+    
+    pthread_mutex_lock(&shim->lock);
+    
+    MSDBIOFileEntry *entry = shim->files;
+    
+    // Unnamed temporary files share one entry.
+    while (entry && !(path ? entry->path && !strcmp(entry->path, path) : !entry->path)) {
+        entry = entry->next;
+    }
+    
+    if (!entry && (entry = calloc(1, sizeof(MSDBIOFileEntry)))) {
+        entry->path         = path ? strdup(path) : NULL;
+        entry->openFlags    = flags & (SQLITE_OPEN_MAIN_DB | SQLITE_OPEN_TEMP_DB | SQLITE_OPEN_TRANSIENT_DB | SQLITE_OPEN_MAIN_JOURNAL | SQLITE_OPEN_TEMP_JOURNAL | SQLITE_OPEN_SUBJOURNAL | SQLITE_OPEN_WAL);
+        entry->next         = shim->files;
+        shim->files         = entry;
+    }
+    
+    pthread_mutex_unlock(&shim->lock);
+    
+    return entry;
+}
+
+static int MSDBIOOpen(sqlite3_vfs *vfs, const char *zName, sqlite3_file *pFile, int flags, int *outFlags) {
+    
+    struct MSDBIOShim *shim = (struct MSDBIOShim *)vfs;
+    MSDBIOFile *file = (MSDBIOFile *)pFile;
+    
+    memset(file, 0, sizeof(MSDBIOFile));
+    file->real  = (sqlite3_file *)((char *)pFile + MSDBIOFileHeaderSize);
+    file->shim  = shim;
+    file->entry = MSDBIOFileEntryForPath(shim, zName, flags);
+    
+    if (!file->entry) {
+        return SQLITE_NOMEM;
+    }
+    
+    int rc = shim->real->xOpen(shim->real, zName, file->real, flags, outFlags);
+    
+    // SQLite calls xClose whenever pMethods is set, even after a failed open.
+    if (file->real->pMethods) {
+        int version = file->real->pMethods->iVersion;
+        file->base.pMethods = &MSDBIOMethodsByVersion[version < 1 ? 0 : version > 3 ? 2 : version - 1];
+    }
+    
+    return rc;
+}
+
+static int MSDBIODelete(sqlite3_vfs *vfs, const char *zName, int syncDir) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xDelete(real, zName, syncDir);
+}
+
+static int MSDBIOAccess(sqlite3_vfs *vfs, const char *zName, int flags, int *result) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xAccess(real, zName, flags, result);
+}
+
+static int MSDBIOFullPathname(sqlite3_vfs *vfs, const char *zName, int nOut, char *zOut) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xFullPathname(real, zName, nOut, zOut);
+}
+
+static void *MSDBIODlOpen(sqlite3_vfs *vfs, const char *zPath) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xDlOpen(real, zPath);
+}
+
+static void MSDBIODlError(sqlite3_vfs *vfs, int nByte, char *zErrMsg) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    real->xDlError(real, nByte, zErrMsg);
+}
+
+static void (*MSDBIODlSym(sqlite3_vfs *vfs, void *handle, const char *zSymbol))(void) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xDlSym(real, handle, zSymbol);
+}
+
+static void MSDBIODlClose(sqlite3_vfs *vfs, void *handle) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    real->xDlClose(real, handle);
+}
+
+static int MSDBIORandomness(sqlite3_vfs *vfs, int nByte, char *zOut) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xRandomness(real, nByte, zOut);
+}
+
+static int MSDBIOSleep(sqlite3_vfs *vfs, int microseconds) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xSleep(real, microseconds);
+}
+
+static int MSDBIOCurrentTime(sqlite3_vfs *vfs, double *now) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xCurrentTime(real, now);
+}
+
+static int MSDBIOGetLastError(sqlite3_vfs *vfs, int nByte, char *zOut) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xGetLastError ? real->xGetLastError(real, nByte, zOut) : 0;
+}
+
+static int MSDBIOCurrentTimeInt64(sqlite3_vfs *vfs, sqlite3_int64 *now) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xCurrentTimeInt64(real, now);
+}
+
+static int MSDBIOSetSystemCall(sqlite3_vfs *vfs, const char *zName, sqlite3_syscall_ptr pCall) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xSetSystemCall(real, zName, pCall);
+}
+
+static sqlite3_syscall_ptr MSDBIOGetSystemCall(sqlite3_vfs *vfs, const char *zName) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xGetSystemCall(real, zName);
+}
+
+static const char *MSDBIONextSystemCall(sqlite3_vfs *vfs, const char *zName) {
+    sqlite3_vfs *real = ((struct MSDBIOShim *)vfs)->real;
+    return real->xNextSystemCall(real, zName);
+}
+
+#pragma mark Shim lifetime
+
+struct MSDBIOShim *MSDBIOShimCreate(void) {
+    
+    sqlite3_vfs *real = sqlite3_vfs_find(NULL);
+    
+    if (!real) {
+        MSDBLogError(@"No default VFS to instrument");
+        return NULL;
+    }
+    
+    struct MSDBIOShim *shim = calloc(1, sizeof(struct MSDBIOShim));
+    
+    if (!shim) {
+        return NULL;
+    }
+    
+    snprintf(shim->name, sizeof(shim->name), "msdb-io-%llu", (unsigned long long)atomic_fetch_add(&MSDBIONextShim, 1));
+    pthread_mutex_init(&shim->lock, NULL);
+    shim->real = real;
+    
+    sqlite3_vfs *vfs        = &shim->vfs;
+    vfs->iVersion           = real->iVersion < 3 ? real->iVersion : 3;
+    vfs->szOsFile           = (int)MSDBIOFileHeaderSize + real->szOsFile;
+    vfs->mxPathname         = real->mxPathname;
+    vfs->zName              = shim->name;
+    vfs->xOpen              = MSDBIOOpen;
+    vfs->xDelete            = MSDBIODelete;
+    vfs->xAccess            = MSDBIOAccess;
+    vfs->xFullPathname      = MSDBIOFullPathname;
+    vfs->xDlOpen            = MSDBIODlOpen;
+    vfs->xDlError           = MSDBIODlError;
+    vfs->xDlSym             = MSDBIODlSym;
+    vfs->xDlClose           = MSDBIODlClose;
+    vfs->xRandomness        = MSDBIORandomness;
+    vfs->xSleep             = MSDBIOSleep;
+    vfs->xCurrentTime       = MSDBIOCurrentTime;
+    vfs->xGetLastError      = MSDBIOGetLastError;
+    vfs->xCurrentTimeInt64  = MSDBIOCurrentTimeInt64;
+    vfs->xSetSystemCall     = MSDBIOSetSystemCall;
+    vfs->xGetSystemCall     = MSDBIOGetSystemCall;
+    vfs->xNextSystemCall    = MSDBIONextSystemCall;
+    
+    // Not the default: only connections that ask for it by name open through it.
+    if (sqlite3_vfs_register(vfs, 0) != SQLITE_OK) {
+        MSDBLogError(@"Could not register VFS %s", shim->name);
+        MSDBIOShimDestroy(shim);
+        return NULL;
+    }
+    
+    shim->registered = YES;
+    
+    return shim;
+}
+
+const char *MSDBIOShimName(struct MSDBIOShim *shim) {
+    return shim ? shim->name : NULL;
+}
+
+void MSDBIOShimDestroy(struct MSDBIOShim *shim) {
+    
+    if (!shim) {
+        return;
+    }
+    
+    if (shim->registered) {
+        sqlite3_vfs_unregister(&shim->vfs);
+    }
+    
+    MSDBIOFileEntry *entry = shim->files;
+    
+    while (entry) {
+        MSDBIOFileEntry *next = entry->next;
+        free(entry->path);
+        free(entry);
+        entry = next;
+    }
+    
+    pthread_mutex_destroy(&shim->lock);
+    free(shim);
+}
+
+static void MSDBIOResetCounters(struct MSDBIOCounters *counters) {
+    
+    _Atomic(uint64_t) *scalars[] = { &counters->reads, &counters->writes, &counters->syncs, &counters->bytesRead, &counters->bytesWritten, &counters->readTotal, &counters->writeTotal, &counters->syncTotal };
+    
+    for (size_t i = 0; i < sizeof(scalars) / sizeof(*scalars); i++) {
+        atomic_store_explicit(scalars[i], 0, memory_order_relaxed);
+    }
+    
+    for (int i = 0; i < MSDBIOHistogramBucketCount; i++) {
+        atomic_store_explicit(&counters->readHistogram[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&counters->writeHistogram[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&counters->syncHistogram[i], 0, memory_order_relaxed);
+    }
+}
+
+void MSDBIOShimReset(struct MSDBIOShim *shim) {
+    
+    if (!shim) {
+        return;
+    }
+    
+    MSDBIOResetCounters(&shim->counters);
+    
+    pthread_mutex_lock(&shim->lock);
+    for (MSDBIOFileEntry *entry = shim->files; entry; entry = entry->next) {
+        MSDBIOResetCounters(&entry->counters);
+    }
+    pthread_mutex_unlock(&shim->lock);
+}
+
+
+@interface MSDatabaseIOStatistics ()
+
+- (instancetype)initWithCounters:(struct MSDBIOCounters *)counters path:(const char *)path openFlags:(int)openFlags;
+
+@end
+
+MSDatabaseIOStatistics *MSDBIOShimStatistics(struct MSDBIOShim *shim) {
+    
+    if (!shim) {
+        return nil;
+    }
+    
+    return MSDBReturnAutoreleased([[MSDatabaseIOStatistics alloc] initWithCounters:&shim->counters path:NULL openFlags:0]);
+}
+
+NSArray *MSDBIOShimFileStatistics(struct MSDBIOShim *shim) {
+    
+    if (!shim) {
+        return nil;
+    }
+    
+    NSMutableArray *statistics = [NSMutableArray array];
+    
+    pthread_mutex_lock(&shim->lock);
+    for (MSDBIOFileEntry *entry = shim->files; entry; entry = entry->next) {
+        MSDatabaseIOStatistics *file = [[MSDatabaseIOStatistics alloc] initWithCounters:&entry->counters path:entry->path openFlags:entry->openFlags];
+        // Newest first in the list; oldest, the main database, first in the result.
+        [statistics insertObject:file atIndex:0];
+        MSDBRelease(file);
+    }
+    pthread_mutex_unlock(&shim->lock);
+    
+    return statistics;
+}
+
+
+@implementation MSDatabaseIOStatistics
+
+@synthesize path=_path;
+@synthesize openFlags=_openFlags;
+@synthesize reads=_reads;
+@synthesize writes=_writes;
+@synthesize syncs=_syncs;
+@synthesize bytesRead=_bytesRead;
+@synthesize bytesWritten=_bytesWritten;
+@synthesize readTime=_readTime;
+@synthesize writeTime=_writeTime;
+@synthesize syncTime=_syncTime;
+@synthesize readTimeHistogram=_readTimeHistogram;
+@synthesize writeTimeHistogram=_writeTimeHistogram;
+@synthesize syncTimeHistogram=_syncTimeHistogram;
+
+static NSArray *MSDBIOHistogramArray(_Atomic(uint64_t) *histogram) {
+    NSMutableArray *counts = [NSMutableArray arrayWithCapacity:MSDBIOHistogramBucketCount];
+    for (int i = 0; i < MSDBIOHistogramBucketCount; i++) {
+        [counts addObject:[NSNumber numberWithUnsignedLongLong:atomic_load_explicit(&histogram[i], memory_order_relaxed)]];
+    }
+    return counts;
+}
+
+- (instancetype)initWithCounters:(struct MSDBIOCounters *)c path:(const char *)path openFlags:(int)openFlags {
+    
+    self = [super init];
+    
+    if (self) {
+        _path               = path ? [[NSString alloc] initWithUTF8String:path] : nil;
+        _openFlags          = openFlags;
+        _reads              = atomic_load_explicit(&c->reads, memory_order_relaxed);
+        _writes             = atomic_load_explicit(&c->writes, memory_order_relaxed);
+        _syncs              = atomic_load_explicit(&c->syncs, memory_order_relaxed);
+        _bytesRead          = atomic_load_explicit(&c->bytesRead, memory_order_relaxed);
+        _bytesWritten       = atomic_load_explicit(&c->bytesWritten, memory_order_relaxed);
+        _readTime           = atomic_load_explicit(&c->readTotal, memory_order_relaxed) / 1e6;
+        _writeTime          = atomic_load_explicit(&c->writeTotal, memory_order_relaxed) / 1e6;
+        _syncTime           = atomic_load_explicit(&c->syncTotal, memory_order_relaxed) / 1e6;
+        _readTimeHistogram  = MSDBReturnRetained(MSDBIOHistogramArray(c->readHistogram));
+        _writeTimeHistogram = MSDBReturnRetained(MSDBIOHistogramArray(c->writeHistogram));
+        _syncTimeHistogram  = MSDBReturnRetained(MSDBIOHistogramArray(c->syncHistogram));
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_path);
+    MSDBRelease(_readTimeHistogram);
+    MSDBRelease(_writeTimeHistogram);
+    MSDBRelease(_syncTimeHistogram);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
++ (NSTimeInterval)upperBoundOfHistogramBucket:(NSUInteger)bucket {
+    
+    if (bucket >= MSDBIOHistogramBucketCount - 1) {
+        return DBL_MAX;
+    }
+    
+    return ldexp(1.0, (int)bucket) / 1e6;
+}
+
+static NSTimeInterval MSDBIOPercentile(NSArray *histogram, double percentile) {
+    
+    unsigned long long total = 0;
+    for (NSNumber *count in histogram) {
+        total += [count unsignedLongLongValue];
+    }
+    
+    if (!total) {
+        return 0;
+    }
+    
+    double rank = fmin(fmax(percentile, 0), 100) / 100.0 * total;
+    unsigned long long seen = 0;
+    
+    for (NSUInteger bucket = 0; bucket < [histogram count]; bucket++) {
+        seen += [[histogram objectAtIndex:bucket] unsignedLongLongValue];
+        if (seen >= rank && seen > 0) {
+            return [MSDatabaseIOStatistics upperBoundOfHistogramBucket:bucket];
+        }
+    }
+    
+    return DBL_MAX;
+}
+
+- (NSTimeInterval)readTimeAtPercentile:(double)percentile {
+    return MSDBIOPercentile(_readTimeHistogram, percentile);
+}
+
+- (NSTimeInterval)writeTimeAtPercentile:(double)percentile {
+    return MSDBIOPercentile(_writeTimeHistogram, percentile);
+}
+
+- (NSTimeInterval)syncTimeAtPercentile:(double)percentile {
+    return MSDBIOPercentile(_syncTimeHistogram, percentile);
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ %@ reads: %llu (%llu bytes, %gs, p99 %gs), writes: %llu (%llu bytes, %gs, p99 %gs), syncs: %llu (%gs, p99 %gs)",
+            [super description], _path ? _path : @"(all files)",
+            _reads, _bytesRead, _readTime, [self readTimeAtPercentile:99],
+            _writes, _bytesWritten, _writeTime, [self writeTimeAtPercentile:99],
+            _syncs, _syncTime, [self syncTimeAtPercentile:99]];
+}
+
+@end
@@ -0,0 +1,120 @@
+//
+//  MSDatabaseLogger.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+/** Severity of a diagnostic message; a logger lets through messages at or below its `level`. */
+
+typedef NS_ENUM(NSInteger, MSDBLogLevel) {
+    /** Nothing is logged. */
+    MSDBLogLevelOff = 0,
+    /** A call failed: a statement did not prepare or step, a connection did not open. */
+    MSDBLogLevelError,
+    /** Something is likely wrong in the calling code: a missing column, a result set left open, a long hold. */
+    MSDBLogLevelWarning,
+    /** Expected but noteworthy events, such as `SQLITE_BUSY` or a pooled connection dropped. */
+    MSDBLogLevelInfo,
+    /** Output asked for explicitly, such as `traceExecution`. Never rate limited. */
+    MSDBLogLevelDebug,
+};
+
+/** Receives each message that passes the logger's level and rate limits.
+
+ @param level The message's level.
+ @param message The formatted message.
+ */
+
+typedef void (^MSDBLogHandler)(MSDBLogLevel level, NSString *message);
+
+struct MSDBLogState;
+
+/** Where MSDB sends its diagnostics.
+
+ Every message the library logs goes through `<sharedLogger>`. Messages below the logger's `<level>` cost a single comparison: their arguments are not even evaluated. Messages logged from the same call site more than `<messagesPerInterval>` times within `<rateLimitInterval>` are counted and dropped, so that a lock storm reporting `SQLITE_BUSY` on every step does not turn into a logging storm; the next message from that site to get through notes how many were suppressed.
+
+ By default, messages are formatted on the calling thread, put in a fixed-size ring buffer, and handed to the `<handler>` (or `NSLog`) on a background queue, so an error path never waits on the console. When the ring is full, new messages are dropped and counted.
+ */
+
+@interface MSDatabaseLogger : NSObject {
+    MSDBLogHandler          _handler;
+    BOOL                    _asynchronous;
+    NSUInteger              _messagesPerInterval;
+    NSTimeInterval          _rateLimitInterval;
+    struct MSDBLogState     *_state;
+    dispatch_queue_t        _deliveryQueue;
+    dispatch_source_t       _deliverySource;
+}
+
+/** The logger all of MSDB's diagnostics go through */
+
++ (MSDatabaseLogger *)sharedLogger;
+
+/** Most verbose level let through. Defaults to `MSDBLogLevelDebug`: everything the library logs, since debug output is only produced when asked for. */
+
+@property (atomic, assign) MSDBLogLevel level;
+
+/** Receives the messages, on the logger's queue unless `<asynchronous>` is off; `nil`, the default, writes them with `NSLog`. */
+
+@property (atomic, copy) MSDBLogHandler handler;
+
+/** Whether messages are delivered from a background queue through the ring buffer; `NO` delivers them on the logging thread. Defaults to `YES`. */
+
+@property (atomic, assign) BOOL asynchronous;
+
+/** How many messages one call site may log per `<rateLimitInterval>`; `0` turns rate limiting off. Defaults to 10. */
+
+@property (atomic, assign) NSUInteger messagesPerInterval;
+
+/** Length of the rate-limiting window, in seconds. Defaults to 1. */
+
+@property (atomic, assign) NSTimeInterval rateLimitInterval;
+
+/** Messages delivered to the handler */
+
+@property (atomic, readonly) unsigned long long loggedMessages;
+
+/** Messages dropped by rate limiting */
+
+@property (atomic, readonly) unsigned long long suppressedMessages;
+
+/** Messages dropped because the ring buffer was full */
+
+@property (atomic, readonly) unsigned long long droppedMessages;
+
+/** Log a message.
+
+ The format string also identifies the call site for rate limiting, so pass a literal.
+
+ @param level The message's level.
+ @param format A format string, as for `NSLog`.
+ @param args The format's arguments.
+ */
+
+- (void)logLevel:(MSDBLogLevel)level format:(NSString *)format arguments:(va_list)args;
+
+/** Block until every message logged so far has been delivered. */
+
+- (void)flush;
+
+@end
+
+/* Used by the MSDBLog macros; call those instead. */
+
+BOOL MSDBLogIsEnabled(MSDBLogLevel level);
+void MSDBLogMessage(MSDBLogLevel level, NSString *format, ...) NS_FORMAT_FUNCTION(2,3);
+
+#define MSDBLog(__level, __format, ...) do { \
+    if (MSDBLogIsEnabled(__level)) { \
+        MSDBLogMessage(__level, __format, ##__VA_ARGS__); \
+    } \
+} while (0)
+
+#define MSDBLogError(__format, ...)     MSDBLog(MSDBLogLevelError, __format, ##__VA_ARGS__)
+#define MSDBLogWarning(__format, ...)   MSDBLog(MSDBLogLevelWarning, __format, ##__VA_ARGS__)
+#define MSDBLogInfo(__format, ...)      MSDBLog(MSDBLogLevelInfo, __format, ##__VA_ARGS__)
+#define MSDBLogDebug(__format, ...)     MSDBLog(MSDBLogLevelDebug, __format, ##__VA_ARGS__)
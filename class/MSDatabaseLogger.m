@@ -0,0 +1,308 @@
+//
+//  MSDatabaseLogger.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseLogger.h"
+#import "MSDatabase.h"
+#import <stdatomic.h>
+#import <pthread.h>
+#import <time.h>
+
+#define MSDBLogRingCapacity     1024
+#define MSDBLogRateSlotCount    64
+
+typedef struct {
+    MSDBLogLevel    level;
+    const void      *message;       // a retained NSString
+} MSDBLogEntry;
+
+// Rate-limiting state of the call sites hashing to one slot; a new call site takes the slot over.
+typedef struct {
+    const void      *site;
+    uint64_t        windowStart;    // microseconds
+    NSUInteger      count;
+    uint64_t        suppressed;
+} MSDBLogRateSlot;
+
+// Guarded by lock, held only to move a pointer in or out of the ring or to bump a slot.
+struct MSDBLogState {
+    pthread_mutex_t     lock;
+    MSDBLogEntry        ring[MSDBLogRingCapacity];
+    NSUInteger          head;
+    NSUInteger          count;
+    MSDBLogRateSlot     slots[MSDBLogRateSlotCount];
+    _Atomic(uint64_t)   logged;
+    _Atomic(uint64_t)   suppressed;
+    _Atomic(uint64_t)   dropped;
+};
+
+// Read on every log call, so kept outside the logger object.
+static _Atomic(int) MSDBLogThreshold = MSDBLogLevelDebug;
+
+static uint64_t MSDBLogNowMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+BOOL MSDBLogIsEnabled(MSDBLogLevel level) {
+    return level != MSDBLogLevelOff && level <= atomic_load_explicit(&MSDBLogThreshold, memory_order_relaxed);
+}
+
+void MSDBLogMessage(MSDBLogLevel level, NSString *format, ...) {
+    va_list args;
+    va_start(args, format);
+    [[MSDatabaseLogger sharedLogger] logLevel:level format:format arguments:args];
+    va_end(args);
+}
+
+@implementation MSDatabaseLogger
+
+@synthesize handler=_handler;
+@synthesize asynchronous=_asynchronous;
+@synthesize messagesPerInterval=_messagesPerInterval;
+@synthesize rateLimitInterval=_rateLimitInterval;
+
++ (MSDatabaseLogger *)sharedLogger {
+    
+    static MSDatabaseLogger *sharedLogger = nil;
+    static dispatch_once_t once;
+    
+    dispatch_once(&once, ^{
+        sharedLogger = [[MSDatabaseLogger alloc] init];
+    });
+    
+    return sharedLogger;
+}
+
+- (instancetype)init {
+    
+    self = [super init];
+    
+    if (self) {
+        
+        _state = calloc(1, sizeof(struct MSDBLogState));
+        
+        if (!_state) {
+            MSDBRelease(self);
+            return nil;
+        }
+        
+        pthread_mutex_init(&_state->lock, NULL);
+        
+        _asynchronous           = YES;
+        _messagesPerInterval    = 10;
+        _rateLimitInterval      = 1;
+        
+        _deliveryQueue = dispatch_queue_create("MSDB.logger", NULL);
+        
+        // Coalesces the wake-ups of a burst into one pass over the ring.
+        __unsafe_unretained MSDatabaseLogger *unretainedSelf = self;
+        _deliverySource = dispatch_source_create(DISPATCH_SOURCE_TYPE_DATA_OR, 0, 0, _deliveryQueue);
+        dispatch_source_set_event_handler(_deliverySource, ^{
+            [unretainedSelf deliverPendingMessages];
+        });
+        dispatch_resume(_deliverySource);
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    
+    if (_deliverySource) {
+        dispatch_source_cancel(_deliverySource);
+        dispatch_sync(_deliveryQueue, ^{});
+        MSDBDispatchQueueRelease(_deliverySource);
+        _deliverySource = 0x00;
+    }
+    
+    if (_deliveryQueue) {
+        MSDBDispatchQueueRelease(_deliveryQueue);
+        _deliveryQueue = 0x00;
+    }
+    
+    if (_state) {
+        for (NSUInteger i = 0; i < _state->count; i++) {
+            CFRelease(_state->ring[(_state->head + i) % MSDBLogRingCapacity].message);
+        }
+        pthread_mutex_destroy(&_state->lock);
+        free(_state);
+    }
+    
+    MSDBRelease(_handler);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (MSDBLogLevel)level {
+    return (MSDBLogLevel)atomic_load_explicit(&MSDBLogThreshold, memory_order_relaxed);
+}
+
+- (void)setLevel:(MSDBLogLevel)level {
+    atomic_store_explicit(&MSDBLogThreshold, (int)level, memory_order_relaxed);
+}
+
+- (unsigned long long)loggedMessages {
+    return atomic_load_explicit(&_state->logged, memory_order_relaxed);
+}
+
+- (unsigned long long)suppressedMessages {
+    return atomic_load_explicit(&_state->suppressed, memory_order_relaxed);
+}
+
+- (unsigned long long)droppedMessages {
+    return atomic_load_explicit(&_state->dropped, memory_order_relaxed);
+}
+
+// NO if the call site used up its allowance; otherwise YES, with the count it had suppressed before.
+- (BOOL)admitSite:(const void *)site suppressedBefore:(uint64_t *)suppressedBefore {
+    
+    NSUInteger limit = [self messagesPerInterval];
+    
+    if (!limit) {
+        return YES;
+    }
+    
+    uint64_t now = MSDBLogNowMicros();
+    uint64_t window = (uint64_t)([self rateLimitInterval] * 1e6);
+    MSDBLogRateSlot *slot = &_state->slots[((uintptr_t)site >> 4) % MSDBLogRateSlotCount];
+    BOOL admitted = YES;
+    
+    pthread_mutex_lock(&_state->lock);
+    
+    if (slot->site != site) {
+        slot->site          = site;
+        slot->windowStart   = now;
+        slot->count         = 0;
+        slot->suppressed    = 0;
+    }
+    else if (now - slot->windowStart >= window) {
+        slot->windowStart   = now;
+        slot->count         = 0;
+    }
+    
+    if (slot->count < limit) {
+        slot->count++;
+        *suppressedBefore = slot->suppressed;
+        slot->suppressed = 0;
+    }
+    else {
+        slot->suppressed++;
+        admitted = NO;
+    }
+    
+    pthread_mutex_unlock(&_state->lock);
+    
+    if (!admitted) {
+        atomic_fetch_add_explicit(&_state->suppressed, 1, memory_order_relaxed);
+    }
+    
+    return admitted;
+}
+
+- (void)deliverMessage:(NSString *)message level:(MSDBLogLevel)level {
+    
+    MSDBLogHandler handler = [self handler];
+    
+    if (handler) {
+        handler(level, message);
+    }
+    else {
+        NSLog(@"%@", message);
+    }
+    
+    atomic_fetch_add_explicit(&_state->logged, 1, memory_order_relaxed);
+}
+
+// Runs on _deliveryQueue.
+- (void)deliverPendingMessages {
+    
+    for (;;) {
+        
+        MSDBLogEntry batch[64];
+        NSUInteger taken = 0;
+        
+        pthread_mutex_lock(&_state->lock);
+        while (_state->count && taken < 64) {
+            batch[taken++] = _state->ring[_state->head];
+            _state->head = (_state->head + 1) % MSDBLogRingCapacity;
+            _state->count--;
+        }
+        pthread_mutex_unlock(&_state->lock);
+        
+        if (!taken) {
+            return;
+        }
+        
+        @autoreleasepool {
+            for (NSUInteger i = 0; i < taken; i++) {
+                [self deliverMessage:(__bridge NSString *)batch[i].message level:batch[i].level];
+                CFRelease(batch[i].message);
+            }
+        }
+    }
+}
+
+- (void)logLevel:(MSDBLogLevel)level format:(NSString *)format arguments:(va_list)args {
+    
+    if (!MSDBLogIsEnabled(level)) {
+        return;
+    }
+    
+    uint64_t suppressedBefore = 0;
+    
+    // Decided before formatting, so a suppressed message costs no more than a hash and a lock.
+    if (level != MSDBLogLevelDebug && ![self admitSite:(__bridge const void *)format suppressedBefore:&suppressedBefore]) {
+        return;
+    }
+    
+    NSString *message = [[NSString alloc] initWithFormat:format arguments:args];
+    
+    if (suppressedBefore) {
+        NSString *annotated = [[NSString alloc] initWithFormat:@"%@ (%llu similar messages suppressed)", message, (unsigned long long)suppressedBefore];
+        MSDBRelease(message);
+        message = annotated;
+    }
+    
+    if (![self asynchronous]) {
+        [self deliverMessage:message level:level];
+        MSDBRelease(message);
+        return;
+    }
+    
+    BOOL queued = NO;
+    
+    pthread_mutex_lock(&_state->lock);
+    if (_state->count < MSDBLogRingCapacity) {
+        MSDBLogEntry *entry = &_state->ring[(_state->head + _state->count) % MSDBLogRingCapacity];
+        entry->level    = level;
+        entry->message  = CFBridgingRetain(message);
+        _state->count++;
+        queued = YES;
+    }
+    pthread_mutex_unlock(&_state->lock);
+    
+    MSDBRelease(message);
+    
+    if (queued) {
+        dispatch_source_merge_data(_deliverySource, 1);
+    }
+    else {
+        atomic_fetch_add_explicit(&_state->dropped, 1, memory_order_relaxed);
+    }
+}
+
+- (void)flush {
+    dispatch_sync(_deliveryQueue, ^{
+        [self deliverPendingMessages];
+    });
+}
+
+@end
@@ -0,0 +1,135 @@
+//  MSDatabaseMaterializedAggregate.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MSDatabase;
+
+/** A summary table of `COUNT` and `SUM` aggregates, kept current by triggers.
+ 
+ Dashboards that run `SELECT region, COUNT(*), SUM(amount) FROM orders GROUP BY region` on every refresh read the whole table each time. A materialized aggregate stores that result in an ordinary table with one row per group, and `AFTER INSERT`, `AFTER UPDATE` and `AFTER DELETE` triggers on the source table adjust the affected group as rows change. Reading the aggregate then costs one row per group.
+ 
+    MSDatabaseMaterializedAggregate *sales = [[MSDatabaseMaterializedAggregate alloc] initWithName:@"orders_by_region"
+                                                                                           table:@"orders"
+                                                                                    groupColumns:@[@"region"]
+                                                                                      aggregates:@{@"orders": @"COUNT(*)", @"revenue": @"SUM(amount)"}];
+    [sales installInDatabase:db error:&err];
+ 
+    MSResultSet *rs = [db executeQuery:@"select region, orders, revenue from orders_by_region"];
+ 
+ Only aggregates that can be maintained from the changed row alone are supported: `COUNT(*)`, `COUNT(column)` and `SUM(column)`, where `column` is the bare name of a column of the source table, not an expression. Averages are `SUM` divided by `COUNT`. `MIN` and `MAX` would need a rescan on delete and are not supported.
+ 
+ The summary table has the group columns, one column per aggregate, and `msdb_rows`, the number of source rows in the group. Groups whose last row is deleted are removed. Unlike SQL's `SUM`, a group whose values are all `NULL` sums to `0`.
+ 
+ Every write to the source table also writes the summary table, and writers of the same group contend for its row. That suits read-heavy aggregates over tables that are not written in tight loops.
+ 
+ ### See also
+ 
+ - `<MSDatabase>`
+ */
+
+@interface MSDatabaseMaterializedAggregate : NSObject {
+    NSString    *_name;
+    NSString    *_table;
+    NSArray     *_groupColumns;
+    NSArray     *_outputColumns;
+    NSArray     *_sourceColumns;
+
+    NSString    *_installSQL;
+    NSString    *_rebuildSQL;
+    NSString    *_verifySQL;
+    NSString    *_dropSQL;
+}
+
+/** The summary table's name */
+
+@property (atomic, readonly) NSString *name;
+
+/** The source table */
+
+@property (atomic, readonly) NSString *table;
+
+/** Columns of the source table to group by; empty for a single whole-table row */
+
+@property (atomic, readonly) NSArray *groupColumns;
+
+/** Names of the aggregate columns in the summary table, in column order */
+
+@property (atomic, readonly) NSArray *outputColumns;
+
+///---------------------
+/// @name Initialization
+///---------------------
+
+/** Create a description of a materialized aggregate.
+ 
+ Nothing is written to any database until `<installInDatabase:error:>`.
+ 
+ @param name The name of the summary table.
+ @param table The source table.
+ @param groupColumns Column names of the source table to group by; may be empty.
+ @param aggregates Dictionary mapping each summary column name to `@"COUNT(*)"`, `@"COUNT(column)"` or `@"SUM(column)"`. `column` must be the bare name of a column of the source table; expressions such as `SUM(price * qty)` are not supported.
+ 
+ @return The aggregate description; `nil` if an aggregate is not one of the supported forms. Column names are checked against the source table by `<installInDatabase:error:>`, `<rebuildInDatabase:error:>` and `<verifyInDatabase:mismatchedGroups:error:>`.
+ */
+
+- (instancetype)initWithName:(NSString *)name table:(NSString *)table groupColumns:(NSArray *)groupColumns aggregates:(NSDictionary *)aggregates;
+
+///---------------------
+/// @name Maintenance
+///---------------------
+
+/** Create the summary table and its triggers.
+ 
+ Everything is created with `IF NOT EXISTS` inside a savepoint. If the summary table did not exist yet it is filled from the source table with `<rebuildInDatabase:error:>`.
+ 
+ @param db The database holding the source table.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure, including when a grouped or aggregated column is not a column of the source table, in which case nothing is created.
+ */
+
+- (BOOL)installInDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+/** Drop the triggers and the summary table.
+ 
+ @param db The database holding the source table.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)dropFromDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+/** Recompute the summary table from the source table.
+ 
+ Runs the full `GROUP BY` once, inside a savepoint. Use it after loading data with the triggers dropped, or when `<verifyInDatabase:mismatchedGroups:error:>` reports drift.
+ 
+ @param db The database holding the source table.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)rebuildInDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+/** Compare the summary table with a fresh computation of the aggregate.
+ 
+ Costs the same full scan as a rebuild, but writes nothing.
+ 
+ @param db The database holding the source table.
+ @param mismatches Receives the number of groups missing from, left over in, or with a wrong value in the summary table; `0` when it agrees with the fresh computation. May be `NULL`.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` if the comparison ran; `NO` on failure.
+ 
+ `SUM` over `REAL` values is computed in a different order by the triggers and by the fresh query, so the last digits can differ: such sums agree when they are within a relative `1e-9` of the sum of the absolute values summed. Integer sums and counts must match exactly.
+ */
+
+- (BOOL)verifyInDatabase:(MSDatabase *)db mismatchedGroups:(NSUInteger *)mismatches error:(NSError **)outErr;
+
+@end
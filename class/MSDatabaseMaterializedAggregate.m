@@ -0,0 +1,333 @@
+//  MSDatabaseMaterializedAggregate.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseMaterializedAggregate.h"
+#import "MSDatabase.h"
+#import "MSDatabaseAdditions.h"
+
+#define MSDBAggregateRowsColumn @"\"msdb_rows\""
+
+// Relative difference under which two REAL sums count as equal, scaled by the sum of the absolute values summed.
+#define MSDBAggregateRealTolerance @"1e-9"
+
+// `prefix` + each quoted column, joined by `separator`.
+static NSString *MSDBAggregateJoin(NSArray *quotedColumns, NSString *prefix, NSString *separator) {
+    NSMutableArray *parts = [NSMutableArray arrayWithCapacity:[quotedColumns count]];
+    for (NSString *column in quotedColumns) {
+        [parts addObject:[prefix stringByAppendingString:column]];
+    }
+    return [parts componentsJoinedByString:separator];
+}
+
+@implementation MSDatabaseMaterializedAggregate
+
+@synthesize name=_name;
+@synthesize table=_table;
+@synthesize groupColumns=_groupColumns;
+@synthesize outputColumns=_outputColumns;
+
+- (instancetype)initWithName:(NSString *)name table:(NSString *)table groupColumns:(NSArray *)groupColumns aggregates:(NSDictionary *)aggregates {
+    
+    NSParameterAssert(name);
+    NSParameterAssert(table);
+    NSParameterAssert([aggregates count] > 0);
+    
+    self = [super init];
+    
+    if (self) {
+        
+        _name           = [name copy];
+        _table          = [table copy];
+        _groupColumns   = groupColumns ? [groupColumns copy] : [[NSArray alloc] init];
+        _outputColumns  = [[[aggregates allKeys] sortedArrayUsingSelector:@selector(compare:)] copy];
+        
+        NSRegularExpression *pattern = [NSRegularExpression regularExpressionWithPattern:@"^\\s*(COUNT|SUM)\\s*\\(\\s*(.+?)\\s*\\)\\s*$"
+                                                                                 options:NSRegularExpressionCaseInsensitive
+                                                                                   error:nil];
+        
+        NSString *summary   = MSDBQuoteIdentifier(name);
+        NSString *source    = MSDBQuoteIdentifier(table);
+        
+        NSMutableOrderedSet *sourceColumns = [NSMutableOrderedSet orderedSetWithArray:_groupColumns];
+        
+        NSMutableArray *groups = [NSMutableArray array];
+        for (NSString *column in _groupColumns) {
+            [groups addObject:MSDBQuoteIdentifier(column)];
+        }
+        
+        NSMutableArray *outputs         = [NSMutableArray array];
+        NSMutableArray *freshValues     = [NSMutableArray array];   // aggregate expressions over the source table
+        NSMutableArray *newDeltas       = [NSMutableArray array];   // "out = out + <contribution of new row>"
+        NSMutableArray *oldDeltas       = [NSMutableArray array];   // "out = out - <contribution of old row>"
+        NSMutableOrderedSet *watched    = [NSMutableOrderedSet orderedSetWithArray:groups];
+        NSMutableArray *checkedValues   = [NSMutableArray array];   // freshValues named after their outputs, plus magnitudes of sums
+        NSMutableArray *mismatches      = [NSMutableArray array];   // conditions on a stored row s and its fresh row f
+        
+        for (NSString *output in _outputColumns) {
+            
+            NSString *spec = [aggregates objectForKey:output];
+            NSTextCheckingResult *match = [spec isKindOfClass:[NSString class]] ? [pattern firstMatchInString:spec options:0 range:NSMakeRange(0, [spec length])] : nil;
+            
+            if (!match) {
+                MSDBLogWarning(@"Unsupported aggregate '%@' for %@; use COUNT(*), COUNT(column) or SUM(column)", spec, output);
+                MSDBRelease(self);
+                return nil;
+            }
+            
+            BOOL isSum          = [[[spec substringWithRange:[match rangeAtIndex:1]] uppercaseString] isEqualToString:@"SUM"];
+            NSString *argument  = [spec substringWithRange:[match rangeAtIndex:2]];
+            NSString *quoted    = MSDBQuoteIdentifier(output);
+            
+            if ([argument isEqualToString:@"*"]) {
+                
+                if (isSum) {
+                    MSDBLogWarning(@"Unsupported aggregate '%@' for %@; use COUNT(*), COUNT(column) or SUM(column)", spec, output);
+                    MSDBRelease(self);
+                    return nil;
+                }
+                
+                [freshValues addObject:@"COUNT(*)"];
+                [checkedValues addObject:[NSString stringWithFormat:@"COUNT(*) AS %@", quoted]];
+                [mismatches addObject:[NSString stringWithFormat:@"s.%@ IS NOT f.%@", quoted, quoted]];
+                [newDeltas addObject:[NSString stringWithFormat:@"%@ = %@ + 1", quoted, quoted]];
+                [oldDeltas addObject:[NSString stringWithFormat:@"%@ = %@ - 1", quoted, quoted]];
+            }
+            else {
+                
+                NSString *column = MSDBQuoteIdentifier(argument);
+                [watched addObject:column];
+                [sourceColumns addObject:argument];
+                
+                if (isSum) {
+                    // The triggers add and subtract REAL values in another order than the fresh SUM: compare those within a tolerance.
+                    NSString *magnitude = MSDBQuoteIdentifier([NSString stringWithFormat:@"msdb_magnitude_%lu", (unsigned long)[checkedValues count]]);
+                    [freshValues addObject:[NSString stringWithFormat:@"coalesce(SUM(%@), 0)", column]];
+                    [checkedValues addObject:[NSString stringWithFormat:@"coalesce(SUM(%@), 0) AS %@, coalesce(SUM(abs(%@)), 0) AS %@", column, quoted, column, magnitude]];
+                    [mismatches addObject:[NSString stringWithFormat:@"(s.%@ IS NOT f.%@ AND NOT ((typeof(s.%@) = 'real' OR typeof(f.%@) = 'real') AND abs(s.%@ - f.%@) <= %@ * max(f.%@, 1)))",
+                                           quoted, quoted, quoted, quoted, quoted, quoted, MSDBAggregateRealTolerance, magnitude]];
+                    [newDeltas addObject:[NSString stringWithFormat:@"%@ = %@ + coalesce(new.%@, 0)", quoted, quoted, column]];
+                    [oldDeltas addObject:[NSString stringWithFormat:@"%@ = %@ - coalesce(old.%@, 0)", quoted, quoted, column]];
+                }
+                else {
+                    [freshValues addObject:[NSString stringWithFormat:@"COUNT(%@)", column]];
+                    [checkedValues addObject:[NSString stringWithFormat:@"COUNT(%@) AS %@", column, quoted]];
+                    [mismatches addObject:[NSString stringWithFormat:@"s.%@ IS NOT f.%@", quoted, quoted]];
+                    [newDeltas addObject:[NSString stringWithFormat:@"%@ = %@ + (new.%@ IS NOT NULL)", quoted, quoted, column]];
+                    [oldDeltas addObject:[NSString stringWithFormat:@"%@ = %@ - (old.%@ IS NOT NULL)", quoted, quoted, column]];
+                }
+            }
+            
+            [outputs addObject:quoted];
+        }
+        
+        [newDeltas addObject:[NSString stringWithFormat:@"%@ = %@ + 1", MSDBAggregateRowsColumn, MSDBAggregateRowsColumn]];
+        [oldDeltas addObject:[NSString stringWithFormat:@"%@ = %@ - 1", MSDBAggregateRowsColumn, MSDBAggregateRowsColumn]];
+        
+        // Groups are matched with IS so that a NULL group value finds its row; with no groups there is a single row.
+        BOOL grouped        = [groups count] > 0;
+        NSString *groupList = grouped ? [[groups componentsJoinedByString:@", "] stringByAppendingString:@", "] : @"";
+        NSMutableArray *newMatch = [NSMutableArray array];
+        NSMutableArray *oldMatch = [NSMutableArray array];
+        for (NSString *group in groups) {
+            [newMatch addObject:[NSString stringWithFormat:@"%@ IS new.%@", group, group]];
+            [oldMatch addObject:[NSString stringWithFormat:@"%@ IS old.%@", group, group]];
+        }
+        NSString *matchNew = grouped ? [newMatch componentsJoinedByString:@" AND "] : @"1";
+        NSString *matchOld = grouped ? [oldMatch componentsJoinedByString:@" AND "] : @"1";
+        
+        NSString *addNew = [NSString stringWithFormat:
+                            @"INSERT INTO %@ (%@%@) SELECT %@0 WHERE NOT EXISTS (SELECT 1 FROM %@ WHERE %@); "
+                            @"UPDATE %@ SET %@ WHERE %@;",
+                            summary, groupList, MSDBAggregateRowsColumn, grouped ? [MSDBAggregateJoin(groups, @"new.", @", ") stringByAppendingString:@", "] : @"", summary, matchNew,
+                            summary, [newDeltas componentsJoinedByString:@", "], matchNew];
+        
+        NSString *removeOld = [NSString stringWithFormat:
+                               @"UPDATE %@ SET %@ WHERE %@; "
+                               @"DELETE FROM %@ WHERE %@ AND %@ = 0;",
+                               summary, [oldDeltas componentsJoinedByString:@", "], matchOld,
+                               summary, matchOld, MSDBAggregateRowsColumn];
+        
+        NSMutableString *install = [NSMutableString string];
+        [install appendFormat:@"CREATE TABLE IF NOT EXISTS %@ (%@%@ NOT NULL DEFAULT 0, %@ INTEGER NOT NULL DEFAULT 0);\n",
+         summary, groupList, MSDBAggregateJoin(outputs, @"", @" NOT NULL DEFAULT 0, "), MSDBAggregateRowsColumn];
+        if (grouped) {
+            [install appendFormat:@"CREATE UNIQUE INDEX IF NOT EXISTS %@ ON %@ (%@);\n",
+             MSDBQuoteIdentifier([name stringByAppendingString:@"_groups"]), summary, [groups componentsJoinedByString:@", "]];
+        }
+        [install appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER INSERT ON %@ BEGIN %@ END;\n",
+         MSDBQuoteIdentifier([name stringByAppendingString:@"_ai"]), source, addNew];
+        [install appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER DELETE ON %@ BEGIN %@ END;\n",
+         MSDBQuoteIdentifier([name stringByAppendingString:@"_ad"]), source, removeOld];
+        // Updates that touch none of the grouped or aggregated columns cannot change the summary.
+        if ([watched count]) {
+            [install appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER UPDATE OF %@ ON %@ BEGIN %@ %@ END;\n",
+             MSDBQuoteIdentifier([name stringByAppendingString:@"_au"]), [[watched array] componentsJoinedByString:@", "], source, removeOld, addNew];
+        }
+        
+        // GROUP BY NULL makes a whole-table aggregate of an empty table return no row, matching the empty summary.
+        NSString *fresh = [NSString stringWithFormat:@"SELECT %@%@, COUNT(*) FROM %@ GROUP BY %@",
+                           groupList, [freshValues componentsJoinedByString:@", "], source,
+                           grouped ? [groups componentsJoinedByString:@", "] : @"NULL"];
+        NSString *checked = [NSString stringWithFormat:@"SELECT %@%@, COUNT(*) AS %@ FROM %@ GROUP BY %@",
+                             groupList, [checkedValues componentsJoinedByString:@", "], MSDBAggregateRowsColumn, source,
+                             grouped ? [groups componentsJoinedByString:@", "] : @"NULL"];
+        
+        [mismatches addObject:[NSString stringWithFormat:@"s.%@ IS NOT f.%@", MSDBAggregateRowsColumn, MSDBAggregateRowsColumn]];
+        
+        NSMutableArray *sameGroup = [NSMutableArray array];
+        for (NSString *group in groups) {
+            [sameGroup addObject:[NSString stringWithFormat:@"s.%@ IS f.%@", group, group]];
+        }
+        NSString *matchGroup = grouped ? [sameGroup componentsJoinedByString:@" AND "] : @"1";
+        
+        NSMutableString *drop = [NSMutableString string];
+        for (NSString *suffix in [NSArray arrayWithObjects:@"_ai", @"_ad", @"_au", nil]) {
+            [drop appendFormat:@"DROP TRIGGER IF EXISTS %@;\n", MSDBQuoteIdentifier([name stringByAppendingString:suffix])];
+        }
+        [drop appendFormat:@"DROP TABLE IF EXISTS %@;\n", summary];
+        
+        _sourceColumns  = [[sourceColumns array] copy];
+        _installSQL     = [install copy];
+        _rebuildSQL = [[NSString alloc] initWithFormat:@"DELETE FROM %@; INSERT INTO %@ (%@%@, %@) %@;",
+                       summary, summary, groupList, [outputs componentsJoinedByString:@", "], MSDBAggregateRowsColumn, fresh];
+        // Groups found on one side only, plus groups whose values differ.
+        _verifySQL  = [[NSString alloc] initWithFormat:@"WITH s AS (SELECT * FROM %@), f AS (%@) SELECT "
+                       @"(SELECT COUNT(*) FROM s WHERE NOT EXISTS (SELECT 1 FROM f WHERE %@)) + "
+                       @"(SELECT COUNT(*) FROM f WHERE NOT EXISTS (SELECT 1 FROM s WHERE %@)) + "
+                       @"(SELECT COUNT(*) FROM s JOIN f ON %@ WHERE %@)",
+                       summary, checked, matchGroup, matchGroup, matchGroup, [mismatches componentsJoinedByString:@" OR "]];
+        _dropSQL    = [drop copy];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_name);
+    MSDBRelease(_table);
+    MSDBRelease(_groupColumns);
+    MSDBRelease(_outputColumns);
+    MSDBRelease(_sourceColumns);
+    MSDBRelease(_installSQL);
+    MSDBRelease(_rebuildSQL);
+    MSDBRelease(_verifySQL);
+    MSDBRelease(_dropSQL);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ %@ on %@", [super description], _name, _table];
+}
+
+// Run `sql` in a savepoint, rolling back on failure.
+- (BOOL)executeStatements:(NSString *)sql inSavePointNamed:(NSString *)savepoint database:(MSDatabase *)db error:(NSError **)outErr {
+    
+    if (![db startSavePointWithName:savepoint error:outErr]) {
+        return NO;
+    }
+    
+    if (![db executeStatements:sql]) {
+        NSError *err = [db lastError];
+        [db rollbackToSavePointWithName:savepoint error:nil];
+        [db releaseSavePointWithName:savepoint error:nil];
+        if (outErr) {
+            *outErr = err;
+        }
+        return NO;
+    }
+    
+    return [db releaseSavePointWithName:savepoint error:outErr];
+}
+
+// Every grouped or aggregated column must exist: SQLite reads an unknown quoted name in the summary queries as a string
+// literal, and the triggers would only fail when they fire, failing every write to the source table.
+- (BOOL)checkColumnsInDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    MSResultSet *rs = [db executeQuery:[NSString stringWithFormat:@"PRAGMA table_info(%@)", MSDBQuoteIdentifier(_table)]];
+    
+    if (!rs) {
+        if (outErr) {
+            *outErr = [db lastError];
+        }
+        return NO;
+    }
+    
+    NSMutableSet *columns = [NSMutableSet set];
+    while ([rs next]) {
+        [columns addObject:[[rs stringForColumnIndex:1] lowercaseString]];
+    }
+    
+    [rs close];
+    
+    for (NSString *column in _sourceColumns) {
+        
+        if (![columns containsObject:[column lowercaseString]]) {
+            NSString *problem = [NSString stringWithFormat:@"%@ has no column named %@; aggregates take bare column names", _table, column];
+            MSDBLogError(@"%@", problem);
+            if (outErr) {
+                *outErr = [NSError errorWithDomain:@"MSDatabase" code:SQLITE_ERROR userInfo:[NSDictionary dictionaryWithObject:problem forKey:NSLocalizedDescriptionKey]];
+            }
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)installInDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    if (![self checkColumnsInDatabase:db error:outErr]) {
+        return NO;
+    }
+    
+    NSString *sql = [db tableExists:_name] ? _installSQL : [_installSQL stringByAppendingString:_rebuildSQL];
+    
+    return [self executeStatements:sql inSavePointNamed:@"msdb_aggregate_install" database:db error:outErr];
+}
+
+- (BOOL)dropFromDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    return [self executeStatements:_dropSQL inSavePointNamed:@"msdb_aggregate_drop" database:db error:outErr];
+}
+
+- (BOOL)rebuildInDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    if (![self checkColumnsInDatabase:db error:outErr]) {
+        return NO;
+    }
+    
+    return [self executeStatements:_rebuildSQL inSavePointNamed:@"msdb_aggregate_rebuild" database:db error:outErr];
+}
+
+- (BOOL)verifyInDatabase:(MSDatabase *)db mismatchedGroups:(NSUInteger *)mismatches error:(NSError **)outErr {
+    
+    if (![self checkColumnsInDatabase:db error:outErr]) {
+        return NO;
+    }
+    
+    MSResultSet *rs = [db executeQuery:_verifySQL];
+    
+    if (![rs next]) {
+        [rs close];
+        if (outErr) {
+            *outErr = [db lastError];
+        }
+        return NO;
+    }
+    
+    if (mismatches) {
+        *mismatches = (NSUInteger)[rs longLongIntForColumnIndex:0];
+    }
+    
+    [rs close];
+    
+    return YES;
+}
+
+@end
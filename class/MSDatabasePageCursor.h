@@ -0,0 +1,151 @@
+//  MSDatabasePageCursor.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "sqlite3.h"
+
+@class MSDatabase;
+@class MSDatabaseQueue;
+@class MSDatabasePool;
+
+/** Keyset ("seek") pagination over a query.
+
+ Paging with `LIMIT/OFFSET` makes SQLite step over every skipped row, so page N costs N times page 1. `MSDatabasePageCursor` instead remembers the ordering key of the last row it returned and asks for rows after it:
+
+    SELECT * FROM (<base query>) WHERE (created, id) > (?, ?) ORDER BY created, id LIMIT ?
+
+ With an index on the key columns every page is a single index seek. The SQL is generated once, when the cursor is created, and runs through the statement cache of whichever connection it is used on.
+
+    MSDatabasePageCursor *cursor = [MSDatabasePageCursor cursorWithQuery:@"select id, created, title from items where archived = 0"
+                                                              keyColumns:@[@"created", @"id"]
+                                                                pageSize:50];
+    [cursor setPrefetchesNextPage:YES];
+
+    NSArray *page;
+    while ([(page = [cursor nextPageFromPool:pool]) count]) {
+        render(page);
+    }
+
+ The key columns must appear in the base query's result columns, must not be `NULL`, and together must be unique (add the primary key as the last key column). All key columns are ordered in the same direction. Row value comparisons need SQLite 3.15 or later.
+
+ A cursor is not thread-safe; use it from one thread at a time.
+
+ ### See also
+
+ - `<MSDatabase>`
+ - `<MSDatabasePool>`
+ */
+
+@interface MSDatabasePageCursor : NSObject {
+    NSString            *_query;
+    NSArray             *_keyColumns;
+    NSUInteger          _pageSize;
+    BOOL                _descending;
+    BOOL                _prefetchesNextPage;
+
+    NSString            *_firstPageSQL;
+    NSString            *_nextPageSQL;
+
+    NSArray             *_lastKey;
+    BOOL                _exhausted;
+
+    dispatch_group_t    _prefetchGroup;
+    NSArray             *_prefetchedPage;
+}
+
+/** The base query */
+
+@property (atomic, readonly) NSString *query;
+
+/** Ordering key columns, most significant first */
+
+@property (atomic, readonly) NSArray *keyColumns;
+
+/** Maximum number of rows per page */
+
+@property (atomic, readonly) NSUInteger pageSize;
+
+/** Whether all key columns are ordered descending. Defaults to `NO`. */
+
+@property (atomic, readonly) BOOL descending;
+
+/** Whether the cursor fetches the following page in the background while the caller works on the page just returned.
+
+ Prefetching applies to `<nextPageFromPool:>`, which reads the next page on another pooled connection, and to `<nextPageFromQueue:>`, which schedules the read on the queue from a background thread. Defaults to `NO`.
+ */
+
+@property (atomic, assign) BOOL prefetchesNextPage;
+
+/** Whether the last page has been returned */
+
+@property (atomic, readonly) BOOL exhausted;
+
+///---------------------
+/// @name Initialization
+///---------------------
+
+/** Create an ascending cursor.
+
+ @param query The base `SELECT` statement, without `ORDER BY` or `LIMIT`.
+ @param keyColumns Names of the ordering key columns, most significant first.
+ @param pageSize Maximum number of rows per page.
+
+ @return The `MSDatabasePageCursor` object.
+ */
+
++ (instancetype)cursorWithQuery:(NSString *)query keyColumns:(NSArray *)keyColumns pageSize:(NSUInteger)pageSize;
+
+/** Create a cursor.
+
+ @param query The base `SELECT` statement, without `ORDER BY` or `LIMIT`.
+ @param keyColumns Names of the ordering key columns, most significant first.
+ @param pageSize Maximum number of rows per page.
+ @param descending `YES` to page from the largest key down.
+
+ @return The `MSDatabasePageCursor` object.
+ */
+
+- (instancetype)initWithQuery:(NSString *)query keyColumns:(NSArray *)keyColumns pageSize:(NSUInteger)pageSize descending:(BOOL)descending;
+
+///-------------------
+/// @name Fetching pages
+///-------------------
+
+/** Fetch the next page on a database connection.
+
+ No prefetching is done, since an `<MSDatabase>` must only be used from one thread.
+
+ @param db An open database.
+
+ @return An `NSArray` of row dictionaries (as from `<[MSResultSet resultDictionary]>`); empty once the cursor is exhausted; `nil` on error.
+ */
+
+- (NSArray *)nextPageInDatabase:(MSDatabase *)db;
+
+/** Fetch the next page through a database queue.
+
+ @param queue The `MSDatabaseQueue` to read from.
+
+ @return An `NSArray` of row dictionaries; empty once the cursor is exhausted; `nil` on error.
+ */
+
+- (NSArray *)nextPageFromQueue:(MSDatabaseQueue *)queue;
+
+/** Fetch the next page from a database pool.
+
+ @param pool The `MSDatabasePool` to read from.
+
+ @return An `NSArray` of row dictionaries; empty once the cursor is exhausted; `nil` on error.
+ */
+
+- (NSArray *)nextPageFromPool:(MSDatabasePool *)pool;
+
+/** Start again from the first page, discarding any prefetched page. */
+
+- (void)reset;
+
+@end
@@ -0,0 +1,251 @@
+//  MSDatabasePageCursor.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabasePageCursor.h"
+#import "MSDatabase.h"
+#import "MSDatabaseQueue.h"
+#import "MSDatabasePool.h"
+#import "MSDatabaseAdditions.h"
+
+// Runs a block against some connection: the database itself, a queue, or a pooled connection.
+typedef void (^MSDBPageCursorRunner)(void (^work)(MSDatabase *db));
+
+@implementation MSDatabasePageCursor
+
+@synthesize query=_query;
+@synthesize keyColumns=_keyColumns;
+@synthesize pageSize=_pageSize;
+@synthesize descending=_descending;
+@synthesize prefetchesNextPage=_prefetchesNextPage;
+@synthesize exhausted=_exhausted;
+
++ (instancetype)cursorWithQuery:(NSString *)query keyColumns:(NSArray *)keyColumns pageSize:(NSUInteger)pageSize {
+    return MSDBReturnAutoreleased([[self alloc] initWithQuery:query keyColumns:keyColumns pageSize:pageSize descending:NO]);
+}
+
+- (instancetype)initWithQuery:(NSString *)query keyColumns:(NSArray *)keyColumns pageSize:(NSUInteger)pageSize descending:(BOOL)descending {
+    
+    NSParameterAssert(query);
+    NSParameterAssert([keyColumns count] > 0);
+    NSParameterAssert(pageSize > 0);
+    
+    self = [super init];
+    
+    if (self) {
+        _query          = [query copy];
+        _keyColumns     = [keyColumns copy];
+        _pageSize       = pageSize;
+        _descending     = descending;
+        _prefetchGroup  = dispatch_group_create();
+        
+        NSMutableArray *columns      = [NSMutableArray arrayWithCapacity:[keyColumns count]];
+        NSMutableArray *ordering     = [NSMutableArray arrayWithCapacity:[keyColumns count]];
+        NSMutableArray *placeholders = [NSMutableArray arrayWithCapacity:[keyColumns count]];
+        
+        for (NSString *column in keyColumns) {
+            NSString *quoted = MSDBQuoteIdentifier(column);
+            [columns addObject:quoted];
+            [ordering addObject:descending ? [quoted stringByAppendingString:@" DESC"] : quoted];
+            [placeholders addObject:@"?"];
+        }
+        
+        NSString *orderBy = [ordering componentsJoinedByString:@", "];
+        
+        _firstPageSQL = [[NSString alloc] initWithFormat:@"SELECT * FROM (%@) ORDER BY %@ LIMIT ?", query, orderBy];
+        _nextPageSQL  = [[NSString alloc] initWithFormat:@"SELECT * FROM (%@) WHERE (%@) %@ (%@) ORDER BY %@ LIMIT ?",
+                         query, [columns componentsJoinedByString:@", "], descending ? @"<" : @">", [placeholders componentsJoinedByString:@", "], orderBy];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    
+    // A prefetch in flight retains us, so by now it has finished.
+    MSDBRelease(_query);
+    MSDBRelease(_keyColumns);
+    MSDBRelease(_firstPageSQL);
+    MSDBRelease(_nextPageSQL);
+    MSDBRelease(_lastKey);
+    MSDBRelease(_prefetchedPage);
+    
+    if (_prefetchGroup) {
+        MSDBDispatchQueueRelease(_prefetchGroup);
+        _prefetchGroup = 0x00;
+    }
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ %@", [super description], _nextPageSQL];
+}
+
+#pragma mark Fetching
+
+- (NSArray *)fetchPageInDatabase:(MSDatabase *)db after:(NSArray *)lastKey {
+    
+    NSMutableArray *arguments = [NSMutableArray arrayWithCapacity:[_keyColumns count] + 1];
+    
+    if (lastKey) {
+        [arguments addObjectsFromArray:lastKey];
+    }
+    
+    [arguments addObject:[NSNumber numberWithUnsignedInteger:_pageSize]];
+    
+    MSResultSet *rs = [db executeCachedQuery:(lastKey ? _nextPageSQL : _firstPageSQL) withArgumentsInArray:arguments];
+    
+    if (!rs) {
+        return nil;
+    }
+    
+    NSMutableArray *rows = [NSMutableArray arrayWithCapacity:_pageSize];
+    
+    while ([rs next]) {
+        NSDictionary *row = [rs resultDictionary];
+        if (row) {
+            [rows addObject:row];
+        }
+    }
+    
+    [rs close];
+    
+    return rows;
+}
+
+// resultDictionary is keyed by the exact column names, so fall back to a case-insensitive match.
+- (NSArray *)keyForRow:(NSDictionary *)row {
+    
+    NSMutableArray *key = [NSMutableArray arrayWithCapacity:[_keyColumns count]];
+    
+    for (NSString *column in _keyColumns) {
+        
+        id value = [row objectForKey:column];
+        
+        if (!value) {
+            for (NSString *name in row) {
+                if ([name caseInsensitiveCompare:column] == NSOrderedSame) {
+                    value = [row objectForKey:name];
+                    break;
+                }
+            }
+        }
+        
+        if (!value) {
+            MSDBLogWarning(@"key column '%@' is not in the results of %@", column, _query);
+        }
+        
+        [key addObject:value ? value : [NSNull null]];
+    }
+    
+    return key;
+}
+
+- (void)advancePastPage:(NSArray *)page {
+    
+    if ([page count]) {
+        NSArray *key = [self keyForRow:[page lastObject]];
+        MSDBRelease(_lastKey);
+        _lastKey = MSDBReturnRetained(key);
+    }
+    
+    _exhausted = ([page count] < _pageSize);
+}
+
+- (NSArray *)nextPageUsingRunner:(MSDBPageCursorRunner)runner allowPrefetch:(BOOL)allowPrefetch {
+    
+    dispatch_group_wait(_prefetchGroup, DISPATCH_TIME_FOREVER);
+    
+    // _prefetchedPage comes back retained from the prefetch.
+    NSArray *page   = _prefetchedPage;
+    _prefetchedPage = nil;
+    
+    if (!page) {
+        
+        if (_exhausted) {
+            return [NSArray array];
+        }
+        
+        __block NSArray *fetched = nil;
+        NSArray *lastKey = _lastKey;
+        
+        runner(^(MSDatabase *db) {
+            fetched = [self fetchPageInDatabase:db after:lastKey];
+            MSDBRetain(fetched);
+        });
+        
+        page = fetched;
+    }
+    
+    MSDBAutorelease(page);
+    
+    if (!page) {
+        return nil;
+    }
+    
+    [self advancePastPage:page];
+    
+    if (allowPrefetch && _prefetchesNextPage && !_exhausted) {
+        
+        NSArray *lastKey = _lastKey;
+        MSDBRetain(lastKey);
+        MSDBRetain(self);
+        
+        dispatch_group_async(_prefetchGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            @autoreleasepool {
+                
+                __block NSArray *fetched = nil;
+                
+                runner(^(MSDatabase *db) {
+                    fetched = [self fetchPageInDatabase:db after:lastKey];
+                    MSDBRetain(fetched);
+                });
+                
+                self->_prefetchedPage = fetched;
+            }
+            
+            MSDBRelease(lastKey);
+            MSDBRelease(self);
+        });
+    }
+    
+    return page;
+}
+
+- (NSArray *)nextPageInDatabase:(MSDatabase *)db {
+    return [self nextPageUsingRunner:^(void (^work)(MSDatabase *connection)) {
+        work(db);
+    } allowPrefetch:NO];
+}
+
+- (NSArray *)nextPageFromQueue:(MSDatabaseQueue *)queue {
+    return [self nextPageUsingRunner:^(void (^work)(MSDatabase *connection)) {
+        [queue inDatabase:work];
+    } allowPrefetch:YES];
+}
+
+- (NSArray *)nextPageFromPool:(MSDatabasePool *)pool {
+    return [self nextPageUsingRunner:^(void (^work)(MSDatabase *connection)) {
+        [pool inDatabase:work];
+    } allowPrefetch:YES];
+}
+
+- (void)reset {
+    
+    dispatch_group_wait(_prefetchGroup, DISPATCH_TIME_FOREVER);
+    
+    MSDBRelease(_prefetchedPage);
+    _prefetchedPage = nil;
+    
+    MSDBRelease(_lastKey);
+    _lastKey = nil;
+    
+    _exhausted = NO;
+}
+
+@end
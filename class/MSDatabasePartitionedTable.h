@@ -0,0 +1,186 @@
+//  MSDatabasePartitionedTable.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MSDatabase;
+
+/** Length of the time ranges a `<MSDatabasePartitionedTable>` is split into, in UTC */
+
+typedef NS_ENUM(NSInteger, MSDBPartitionPeriod) {
+    /** One partition per hour */
+    MSDBPartitionPeriodHour,
+    /** One partition per day */
+    MSDBPartitionPeriodDay,
+    /** One partition per week, starting on Monday */
+    MSDBPartitionPeriodWeek,
+    /** One partition per calendar month */
+    MSDBPartitionPeriodMonth,
+};
+
+/** An append-only table split into one table per time period, read through a `UNION ALL` view.
+
+ Expiring old rows of an event log with `DELETE FROM events WHERE ts < ?` rewrites every page those rows are on, copies each of them to the WAL, and holds the write lock the whole time. When the rows are spread over per-period tables instead, expiring a period is a `DROP TABLE`: the table's pages go to the freelist without being rewritten, whatever the number of rows.
+
+    MSDatabasePartitionedTable *events = [[MSDatabasePartitionedTable alloc] initWithName:@"events"
+                                                                               timeColumn:@"ts"
+                                                                                   period:MSDBPartitionPeriodDay
+                                                                        columnDefinitions:@"ts REAL NOT NULL, kind TEXT, payload BLOB"
+                                                                           indexedColumns:@[@"ts", @"kind, ts"]];
+    [events installInDatabase:db error:&err];
+
+    [events insertValues:@{@"ts": [NSDate date], @"kind": @"click"} intoDatabase:db error:&err];
+
+    MSResultSet *rs = [db executeQuery:@"select kind, count(*) from events where ts >= ? group by kind", since];
+
+    [events dropPartitionsBeforeDate:[NSDate dateWithTimeIntervalSinceNow:-30 * 86400] inDatabase:db droppedPartitions:nil error:&err];
+
+ The time column holds seconds since 1970; `<insertValues:intoDatabase:error:>` stores an `NSDate` value that way. Partition `events_p20230515` holds the rows of that day, and is created, with an index for each entry of `indexedColumns`, by the first insert that needs it. The view `events` is rebuilt whenever a partition is created or dropped; SQLite pushes a query's `WHERE` clause into each of its arms, so a range on an indexed time column costs one index seek per partition. SQLite caps a compound `SELECT` at `SQLITE_LIMIT_COMPOUND_SELECT` terms, 500 by default; past that many partitions, the view nests its `UNION ALL` in subqueries of at most that many arms. An empty table, `events_template`, keeps the view valid when there are no partitions.
+
+ Rows must be inserted with `<insertValues:intoDatabase:error:>`, or into the table named by `<partitionForDate:>` after `<preparePartitionForDate:inDatabase:error:>`: the view cannot be written to. Updates and deletes go to the partition tables directly.
+
+ SQLite limits a compound `SELECT` to 500 arms by default, so keep fewer partitions than that, e.g. by choosing a longer period.
+
+ ### See also
+
+ - `<MSDatabase>`
+ */
+
+@interface MSDatabasePartitionedTable : NSObject {
+    NSString            *_name;
+    NSString            *_timeColumn;
+    MSDBPartitionPeriod _period;
+    NSString            *_columnDefinitions;
+    NSArray             *_indexedColumns;
+    
+    NSMutableSet        *_knownPartitions;
+}
+
+/** Name of the view over all partitions; partition tables are named after it */
+
+@property (atomic, readonly) NSString *name;
+
+/** Column holding each row's time, in seconds since 1970 */
+
+@property (atomic, readonly) NSString *timeColumn;
+
+/** Length of a partition */
+
+@property (atomic, readonly) MSDBPartitionPeriod period;
+
+/** Column definitions of every partition, as in `CREATE TABLE` */
+
+@property (atomic, readonly) NSString *columnDefinitions;
+
+/** Column lists indexed in every partition, e.g. `@"kind, ts"` */
+
+@property (atomic, readonly) NSArray *indexedColumns;
+
+///---------------------
+/// @name Initialization
+///---------------------
+
+/** Create a description of a partitioned table.
+
+ Nothing is written to any database until `<installInDatabase:error:>`.
+
+ @param name The name of the view; partition tables are named `name_p` followed by the UTC start of their period: `YYYYMMDDHH` for hours, `YYYYMMDD` for days and weeks, `YYYYMM` for months.
+ @param timeColumn The column routing each row to its partition.
+ @param period The length of a partition.
+ @param columnDefinitions Column definitions and table constraints, as in `CREATE TABLE`.
+ @param indexedColumns Column lists to index in every partition; may be `nil`.
+
+ @return The partitioned table description.
+ */
+
+- (instancetype)initWithName:(NSString *)name timeColumn:(NSString *)timeColumn period:(MSDBPartitionPeriod)period columnDefinitions:(NSString *)columnDefinitions indexedColumns:(NSArray *)indexedColumns;
+
+///---------------------
+/// @name Partitions
+///---------------------
+
+/** Name of the partition table holding a time.
+
+ @param date The time.
+
+ @return The partition's table name, whether or not it exists.
+ */
+
+- (NSString *)partitionForDate:(NSDate *)date;
+
+/** Names of the partition tables in a database.
+
+ @param db The database.
+
+ @return Partition table names, oldest first.
+ */
+
+- (NSArray *)partitionsInDatabase:(MSDatabase *)db;
+
+/** Create the partition holding a time, if it does not exist, and add it to the view.
+
+ @param date The time.
+ @param db The database.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return The partition's table name; `nil` on failure.
+ */
+
+- (NSString *)preparePartitionForDate:(NSDate *)date inDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+/** Insert a row into the partition its time falls in, creating the partition if needed.
+
+ Uses a cached statement per partition and column set.
+
+ @param values Dictionary mapping column names to values; must have a value for `<timeColumn>`, as an `NSDate` or a number of seconds since 1970.
+ @param db The database.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)insertValues:(NSDictionary *)values intoDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+///---------------------
+/// @name Maintenance
+///---------------------
+
+/** Create the template table and the view, if they do not exist.
+
+ @param db The database.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)installInDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+/** Drop every partition that ends at or before a time.
+
+ The partitions are listed, the view rebuilt and the tables dropped inside one savepoint. Each `DROP TABLE` moves the partition's pages to the freelist without reading the rows; run `PRAGMA incremental_vacuum` afterwards on a database with `auto_vacuum = INCREMENTAL` to give the space back to the file system.
+
+ @param date The time before which rows are expired. Rows in the partition holding `date` are kept.
+ @param db The database.
+ @param dropped Receives the names of the dropped partitions, none on failure; may be `nil`.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)dropPartitionsBeforeDate:(NSDate *)date inDatabase:(MSDatabase *)db droppedPartitions:(NSArray **)dropped error:(NSError **)outErr;
+
+/** Drop the view, the template table and every partition.
+
+ @param db The database.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)dropFromDatabase:(MSDatabase *)db error:(NSError **)outErr;
+
+@end
@@ -0,0 +1,466 @@
+//  MSDatabasePartitionedTable.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabasePartitionedTable.h"
+#import "MSDatabase.h"
+#import "MSDatabaseAdditions.h"
+#import <time.h>
+
+// Start, in UTC, of the period holding `t`.
+static time_t MSDBPartitionStart(time_t t, MSDBPartitionPeriod period) {
+    
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    
+    switch (period) {
+        case MSDBPartitionPeriodHour:
+            break;
+        case MSDBPartitionPeriodDay:
+            tm.tm_hour = 0;
+            break;
+        case MSDBPartitionPeriodWeek:
+            tm.tm_hour = 0;
+            tm.tm_mday -= (tm.tm_wday + 6) % 7;     // back to Monday; timegm normalizes
+            break;
+        case MSDBPartitionPeriodMonth:
+            tm.tm_hour = 0;
+            tm.tm_mday = 1;
+            break;
+    }
+    
+    return timegm(&tm);
+}
+
+// Start of the period following the one starting at `start`.
+static time_t MSDBPartitionNext(time_t start, MSDBPartitionPeriod period) {
+    
+    struct tm tm;
+    gmtime_r(&start, &tm);
+    
+    switch (period) {
+        case MSDBPartitionPeriodHour:
+            tm.tm_hour += 1;
+            break;
+        case MSDBPartitionPeriodDay:
+            tm.tm_mday += 1;
+            break;
+        case MSDBPartitionPeriodWeek:
+            tm.tm_mday += 7;
+            break;
+        case MSDBPartitionPeriodMonth:
+            tm.tm_mon += 1;
+            break;
+    }
+    
+    return timegm(&tm);
+}
+
+static const char *MSDBPartitionSuffixFormat(MSDBPartitionPeriod period) {
+    switch (period) {
+        case MSDBPartitionPeriodHour:
+            return "%Y%m%d%H";
+        case MSDBPartitionPeriodMonth:
+            return "%Y%m";
+        default:
+            return "%Y%m%d";
+    }
+}
+
+// Parses a partition name suffix back into the start of its period; NO if it is not one.
+static BOOL MSDBPartitionParseSuffix(NSString *suffix, MSDBPartitionPeriod period, time_t *start) {
+    
+    NSUInteger expectedLength = strlen(MSDBPartitionSuffixFormat(period)) + 2;     // %Y is four digits, the others two
+    
+    if ([suffix length] != expectedLength) {
+        return NO;
+    }
+    
+    const char *digits = [suffix UTF8String];
+    
+    for (NSUInteger i = 0; i < expectedLength; i++) {
+        if (digits[i] < '0' || digits[i] > '9') {
+            return NO;
+        }
+    }
+    
+    int fields[4] = {0, 1, 1, 0};   // year, month, day, hour
+    int width = 4;
+    
+    for (NSUInteger i = 0, field = 0; i < expectedLength; field++) {
+        int value = 0;
+        for (int j = 0; j < width; j++) {
+            value = value * 10 + (digits[i++] - '0');
+        }
+        fields[field] = value;
+        width = 2;
+    }
+    
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year  = fields[0] - 1900;
+    tm.tm_mon   = fields[1] - 1;
+    tm.tm_mday  = fields[2];
+    tm.tm_hour  = fields[3];
+    
+    *start = timegm(&tm);
+    
+    // Rejects out-of-range fields, which timegm would have normalized, and weeks not starting on Monday.
+    char check[16];
+    strftime(check, sizeof(check), MSDBPartitionSuffixFormat(period), &tm);
+    
+    return strcmp(check, digits) == 0 && MSDBPartitionStart(*start, period) == *start;
+}
+
+@implementation MSDatabasePartitionedTable
+
+@synthesize name=_name;
+@synthesize timeColumn=_timeColumn;
+@synthesize period=_period;
+@synthesize columnDefinitions=_columnDefinitions;
+@synthesize indexedColumns=_indexedColumns;
+
+- (instancetype)initWithName:(NSString *)name timeColumn:(NSString *)timeColumn period:(MSDBPartitionPeriod)period columnDefinitions:(NSString *)columnDefinitions indexedColumns:(NSArray *)indexedColumns {
+    
+    NSParameterAssert(name);
+    NSParameterAssert(timeColumn);
+    NSParameterAssert(columnDefinitions);
+    
+    self = [super init];
+    
+    if (self) {
+        _name               = [name copy];
+        _timeColumn         = [timeColumn copy];
+        _period             = period;
+        _columnDefinitions  = [columnDefinitions copy];
+        _indexedColumns     = indexedColumns ? [indexedColumns copy] : [[NSArray alloc] init];
+        _knownPartitions    = [[NSMutableSet alloc] init];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_name);
+    MSDBRelease(_timeColumn);
+    MSDBRelease(_columnDefinitions);
+    MSDBRelease(_indexedColumns);
+    MSDBRelease(_knownPartitions);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ %@ by %@", [super description], _name, _timeColumn];
+}
+
+- (NSString *)partitionPrefix {
+    return [_name stringByAppendingString:@"_p"];
+}
+
+- (NSString *)templateTable {
+    return [_name stringByAppendingString:@"_template"];
+}
+
+- (NSString *)partitionForDate:(NSDate *)date {
+    
+    time_t start = MSDBPartitionStart((time_t)floor([date timeIntervalSince1970]), _period);
+    
+    struct tm tm;
+    gmtime_r(&start, &tm);
+    
+    char suffix[16];
+    strftime(suffix, sizeof(suffix), MSDBPartitionSuffixFormat(_period), &tm);
+    
+    return [[self partitionPrefix] stringByAppendingString:[NSString stringWithUTF8String:suffix]];
+}
+
+- (NSArray *)partitionsInDatabase:(MSDatabase *)db {
+    
+    NSString *prefix = [self partitionPrefix];
+    NSMutableArray *partitions = [NSMutableArray array];
+    
+    MSResultSet *rs = [db executeQuery:@"SELECT name FROM sqlite_master WHERE type = 'table'"];
+    
+    while ([rs next]) {
+        
+        NSString *table = [rs stringForColumnIndex:0];
+        time_t start;
+        
+        if ([table hasPrefix:prefix] && MSDBPartitionParseSuffix([table substringFromIndex:[prefix length]], _period, &start)) {
+            [partitions addObject:table];
+        }
+    }
+    
+    [rs close];
+    
+    // Suffixes of one period all have the same length, so they sort by time.
+    return [partitions sortedArrayUsingSelector:@selector(compare:)];
+}
+
+// `arms` joined by UNION ALL. SQLite refuses a compound SELECT of more than SQLITE_LIMIT_COMPOUND_SELECT terms (500 by
+// default, about three weeks of hourly partitions), so longer unions are nested as subqueries of at most that many.
+static NSString *MSDBPartitionUnionAll(NSArray *arms, int limit) {
+    
+    while (limit > 1 && [arms count] > (NSUInteger)limit) {
+        
+        NSMutableArray *groups = [NSMutableArray arrayWithCapacity:[arms count] / (NSUInteger)limit + 1];
+        
+        for (NSUInteger i = 0; i < [arms count]; i += (NSUInteger)limit) {
+            NSArray *group = [arms subarrayWithRange:NSMakeRange(i, MIN((NSUInteger)limit, [arms count] - i))];
+            [groups addObject:[NSString stringWithFormat:@"SELECT * FROM (%@)", [group componentsJoinedByString:@" UNION ALL "]]];
+        }
+        
+        arms = groups;
+    }
+    
+    return [arms componentsJoinedByString:@" UNION ALL "];
+}
+
+- (NSString *)viewSQLForPartitions:(NSArray *)partitions inDatabase:(MSDatabase *)db {
+    
+    NSMutableArray *arms = [NSMutableArray arrayWithCapacity:[partitions count]];
+    
+    for (NSString *partition in partitions) {
+        [arms addObject:[NSString stringWithFormat:@"SELECT * FROM %@", MSDBQuoteIdentifier(partition)]];
+    }
+    
+    if (![arms count]) {
+        [arms addObject:[NSString stringWithFormat:@"SELECT * FROM %@", MSDBQuoteIdentifier([self templateTable])]];
+    }
+    
+    NSString *view = MSDBQuoteIdentifier(_name);
+    
+    // 0 when the limit is compiled out.
+    int limit = sqlite3_limit([db sqliteHandle], SQLITE_LIMIT_COMPOUND_SELECT, -1);
+    
+    return [NSString stringWithFormat:@"DROP VIEW IF EXISTS %@; CREATE VIEW %@ AS %@;", view, view, MSDBPartitionUnionAll(arms, limit)];
+}
+
+// Run `body` in a savepoint, rolling back if it returns NO.
+- (BOOL)inSavePointNamed:(NSString *)savepoint database:(MSDatabase *)db error:(NSError **)outErr block:(BOOL (^)(void))body {
+    
+    if (![db startSavePointWithName:savepoint error:outErr]) {
+        return NO;
+    }
+    
+    if (!body()) {
+        NSError *err = [db lastError];
+        [db rollbackToSavePointWithName:savepoint error:nil];
+        [db releaseSavePointWithName:savepoint error:nil];
+        if (outErr) {
+            *outErr = err;
+        }
+        return NO;
+    }
+    
+    return [db releaseSavePointWithName:savepoint error:outErr];
+}
+
+- (BOOL)installInDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    return [self inSavePointNamed:@"msdb_partition_install" database:db error:outErr block:^BOOL{
+        
+        NSString *createTemplate = [NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ (%@);", MSDBQuoteIdentifier([self templateTable]), self->_columnDefinitions];
+        
+        return [db executeStatements:createTemplate] && [db executeStatements:[self viewSQLForPartitions:[self partitionsInDatabase:db] inDatabase:db]];
+    }];
+}
+
+- (NSString *)preparePartitionForDate:(NSDate *)date inDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    NSString *partition = [self partitionForDate:date];
+    
+    @synchronized(self) {
+        if ([_knownPartitions containsObject:partition]) {
+            return partition;
+        }
+    }
+    
+    // Created by another connection, which also rebuilt the view.
+    if (![db tableExists:partition]) {
+        
+        BOOL created = [self inSavePointNamed:@"msdb_partition_create" database:db error:outErr block:^BOOL{
+            
+            NSString *quoted = MSDBQuoteIdentifier(partition);
+            NSMutableString *create = [NSMutableString stringWithFormat:@"CREATE TABLE IF NOT EXISTS %@ (%@);\n", quoted, self->_columnDefinitions];
+            
+            [self->_indexedColumns enumerateObjectsUsingBlock:^(NSString *columns, NSUInteger idx, BOOL *stop) {
+                [create appendFormat:@"CREATE INDEX IF NOT EXISTS %@ ON %@ (%@);\n",
+                 MSDBQuoteIdentifier([NSString stringWithFormat:@"%@_i%lu", partition, (unsigned long)idx]), quoted, columns];
+            }];
+            
+            return [db executeStatements:create] && [db executeStatements:[self viewSQLForPartitions:[self partitionsInDatabase:db] inDatabase:db]];
+        }];
+        
+        if (!created) {
+            return nil;
+        }
+    }
+    
+    @synchronized(self) {
+        [_knownPartitions addObject:partition];
+    }
+    
+    return partition;
+}
+
+- (BOOL)insertValues:(NSDictionary *)values intoDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    id time = [values objectForKey:_timeColumn];
+    NSDate *date = nil;
+    
+    if ([time isKindOfClass:[NSDate class]]) {
+        date = time;
+        time = [NSNumber numberWithDouble:[date timeIntervalSince1970]];
+    }
+    else if ([time isKindOfClass:[NSNumber class]]) {
+        date = [NSDate dateWithTimeIntervalSince1970:[time doubleValue]];
+    }
+    else {
+        NSString *problem = [NSString stringWithFormat:@"No time in column %@ to partition %@ by", _timeColumn, _name];
+        MSDBLogError(@"%@", problem);
+        if (outErr) {
+            *outErr = [NSError errorWithDomain:@"MSDatabase" code:SQLITE_MISUSE userInfo:[NSDictionary dictionaryWithObject:problem forKey:NSLocalizedDescriptionKey]];
+        }
+        return NO;
+    }
+    
+    // Sorted, so that rows with the same columns share a cached statement.
+    NSArray *columns = [[values allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    NSMutableArray *quotedColumns = [NSMutableArray arrayWithCapacity:[columns count]];
+    NSMutableArray *placeholders = [NSMutableArray arrayWithCapacity:[columns count]];
+    NSMutableArray *arguments = [NSMutableArray arrayWithCapacity:[columns count]];
+    
+    for (NSString *column in columns) {
+        [quotedColumns addObject:MSDBQuoteIdentifier(column)];
+        [placeholders addObject:@"?"];
+        [arguments addObject:[column isEqualToString:_timeColumn] ? time : [values objectForKey:column]];
+    }
+    
+    NSString *columnList = [quotedColumns componentsJoinedByString:@", "];
+    NSString *placeholderList = [placeholders componentsJoinedByString:@", "];
+    
+    // A second pass recreates a partition another connection dropped after it was cached here.
+    for (int attempt = 0; attempt < 2; attempt++) {
+        
+        NSString *partition = [self preparePartitionForDate:date inDatabase:db error:outErr];
+        
+        if (!partition) {
+            return NO;
+        }
+        
+        NSString *sql = [NSString stringWithFormat:@"INSERT INTO %@ (%@) VALUES (%@)", MSDBQuoteIdentifier(partition), columnList, placeholderList];
+        
+        if ([db executeCachedUpdate:sql withArgumentsInArray:arguments]) {
+            return YES;
+        }
+        
+        if (![[db lastErrorMessage] hasPrefix:@"no such table"]) {
+            break;
+        }
+        
+        @synchronized(self) {
+            [_knownPartitions removeObject:partition];
+        }
+    }
+    
+    if (outErr) {
+        *outErr = [db lastError];
+    }
+    
+    return NO;
+}
+
+- (BOOL)dropPartitionsBeforeDate:(NSDate *)date inDatabase:(MSDatabase *)db droppedPartitions:(NSArray **)dropped error:(NSError **)outErr {
+    
+    NSTimeInterval cutoff = [date timeIntervalSince1970];
+    NSUInteger prefixLength = [[self partitionPrefix] length];
+    NSMutableArray *expired = [NSMutableArray array];
+    
+    BOOL success = [self inSavePointNamed:@"msdb_partition_expire" database:db error:outErr block:^BOOL{
+        
+        // Listed inside the savepoint, like preparePartitionForDate:inDatabase:error: does, so that a partition another connection just created stays in the view.
+        NSMutableArray *kept = [NSMutableArray array];
+        
+        for (NSString *partition in [self partitionsInDatabase:db]) {
+            
+            time_t start;
+            MSDBPartitionParseSuffix([partition substringFromIndex:prefixLength], self->_period, &start);
+            
+            if (MSDBPartitionNext(start, self->_period) <= cutoff) {
+                [expired addObject:partition];
+            }
+            else {
+                [kept addObject:partition];
+            }
+        }
+        
+        if (![expired count]) {
+            return YES;
+        }
+        
+        // The view goes first, so that it never refers to a dropped table.
+        NSMutableString *sql = [NSMutableString stringWithString:[self viewSQLForPartitions:kept inDatabase:db]];
+        
+        for (NSString *partition in expired) {
+            [sql appendFormat:@"\nDROP TABLE IF EXISTS %@;", MSDBQuoteIdentifier(partition)];
+        }
+        
+        return [db executeStatements:sql];
+    }];
+    
+    if (!success) {
+        [expired removeAllObjects];
+    }
+    
+    if (dropped) {
+        *dropped = expired;
+    }
+    
+    if (success) {
+        @synchronized(self) {
+            for (NSString *partition in expired) {
+                [_knownPartitions removeObject:partition];
+            }
+        }
+    }
+    
+    return success;
+}
+
+- (BOOL)dropFromDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    NSArray *partitions = [self partitionsInDatabase:db];
+    
+    return [self inSavePointNamed:@"msdb_partition_drop" database:db error:outErr block:^BOOL{
+        
+        NSMutableString *sql = [NSMutableString stringWithFormat:@"DROP VIEW IF EXISTS %@;", MSDBQuoteIdentifier(self->_name)];
+        
+        for (NSString *partition in partitions) {
+            [sql appendFormat:@"\nDROP TABLE IF EXISTS %@;", MSDBQuoteIdentifier(partition)];
+        }
+        
+        [sql appendFormat:@"\nDROP TABLE IF EXISTS %@;", MSDBQuoteIdentifier([self templateTable])];
+        
+        if (![db executeStatements:sql]) {
+            return NO;
+        }
+        
+        @synchronized(self) {
+            [self->_knownPartitions removeAllObjects];
+        }
+        
+        return YES;
+    }];
+}
+
+@end
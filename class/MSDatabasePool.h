@@ -9,6 +9,17 @@
 #import "sqlite3.h"
 
 @class MSDatabase;
+@class MSDatabasePoolStatistics;
+@class MSDatabaseWatchdog;
+@class MSDatabaseCheckout;
+@class MSDatabaseRetryPolicy;
+@class MSDatabaseExpiry;
+
+struct MSDBPoolCounters;
+
+/** Number of buckets in the wait and hold time histograms of `<MSDatabasePoolStatistics>` */
+
+#define MSDBPoolHistogramBucketCount 32
 
 /** Pool of `<MSDatabase>` objects.
 
@@ -40,6 +51,32 @@
     
     NSUInteger          _maximumNumberOfDatabasesToCreate;
     int                 _openFlags;
+    
+    NSTimeInterval      _maintenanceInterval;
+    int                 _analysisLimit;
+    BOOL                _optimizesOnClose;
+    dispatch_queue_t    _maintenanceQueue;
+    dispatch_source_t   _maintenanceTimer;
+    
+    MSDatabaseExpiry    *_expiry;
+    NSTimeInterval      _expiryInterval;
+    dispatch_source_t   _expiryTimer;
+    NSMutableDictionary *_lastMaintenanceTimes;
+    
+    NSTimeInterval      _validationIdleThreshold;
+    
+    struct MSDBPoolCounters *_counters;
+    MSDatabaseWatchdog  *_watchdog;
+    
+    NSTimeInterval      _threadAffinityLease;
+    uint64_t            _identifier;
+    NSMutableArray      *_leases;
+    dispatch_source_t   _leaseTimer;
+    
+    NSArray             *_warmUpObjects;
+    NSArray             *_warmUpQueries;
+    
+    MSDatabaseRetryPolicy *_retryPolicy;
 }
 
 /** Database path */
@@ -58,6 +95,86 @@
 
 @property (atomic, readonly) int openFlags;
 
+/** How long a connection must have sat in the pool before checkout validates it with `<[MSDatabase goodConnection]>`; `0`, the default, never validates.
+ 
+ A connection that fails validation is closed and dropped, and checkout moves on to the next one or opens a new one. Connections returned more recently than the threshold are handed out without a check, so a busy pool pays nothing.
+ */
+
+@property (atomic, assign) NSTimeInterval validationIdleThreshold;
+
+/** How long a thread keeps its own connection after using it; `0`, the default, turns thread affinity off.
+ 
+ Without affinity, every `<inDatabase:>` takes the pool's lock twice and may get a different connection each time, with a cold page cache. With affinity, the first checkout on a thread leases the connection to that thread: it stays checked out after the block returns, and the thread's next checkouts reuse it through a thread-specific pointer and an atomic flag, without taking the lock.
+ 
+ A lease ends, and the connection goes back in the pool, when the thread has not used it for `threadAffinityLease` seconds, when the thread exits, when the pool reaches `<maximumNumberOfDatabasesToCreate>` and another thread needs a connection, or on `<releaseAllDatabases>`.
+ 
+ Each leased connection counts as checked out, so with affinity on the pool holds up to one connection per recently active thread. Suits a fixed set of worker threads; with GCD's changing threads, keep the lease short.
+ */
+
+@property (atomic, assign) NSTimeInterval threadAffinityLease;
+
+/** Checkouts that keep a connection longer than this many seconds are reported to `<watchdogHandler>`; `0`, the default, turns hold timing off.
+ 
+ Connections handed back with result sets still open are reported whatever the threshold, with the SQL of each open result set. A connection held by a forgotten result set is the usual cause of a starved pool.
+ 
+ @see MSDatabaseWatchdog
+ */
+
+@property (atomic, assign) NSTimeInterval longHoldThreshold;
+
+/** Receives watchdog reports; `nil`, the default, logs them as warnings through `<MSDatabaseLogger>`, subject to its level and rate limit. */
+
+@property (atomic, copy) void (^watchdogHandler)(MSDatabaseCheckout *checkout);
+
+/** How long a checked-in connection must sit idle before the pool runs `PRAGMA optimize` on it; `0`, the default, turns periodic maintenance off.
+ 
+ The pool checks every `maintenanceInterval` seconds on a background queue. Idle connections are checked out for the duration of the pass, so they are never handed to a caller mid-optimize; connections not used since their last pass are skipped.
+ 
+ @see [MSDatabase optimizeWithAnalysisLimit:]
+ */
+
+@property (atomic, assign) NSTimeInterval maintenanceInterval;
+
+/** Rules for deleting expired rows, run in small batches every `<expiryInterval>`.
+ 
+ @see MSDatabaseExpiry
+ */
+
+@property (atomic, readonly) MSDatabaseExpiry *expiry;
+
+/** How often `<expiry>` runs a batch for each rule; `0`, the default, turns background expiry off.
+ 
+ Batches run on a connection checked out of the pool, and are skipped when none is available. While a rule has a backlog, the next batch follows after about `targetHoldTime`, so that the lock stays free at least half the time; once every rule is caught up, batches go back to this interval.
+ */
+
+@property (atomic, assign) NSTimeInterval expiryInterval;
+
+/** `PRAGMA analysis_limit` used by periodic maintenance and by `<releaseAllDatabases>`. Defaults to 400. */
+
+@property (atomic, assign) int analysisLimit;
+
+/** Whether `<releaseAllDatabases>` runs `PRAGMA optimize` on each checked-in connection before closing it. Defaults to `YES`. */
+
+@property (atomic, assign) BOOL optimizesOnClose;
+
+/** Tables and indexes that `<warmUpConnections:error:>` reads into each connection's page cache; `nil`, the default, reads none.
+ 
+ @see [MSDatabase preloadObjects:error:]
+ */
+
+@property (atomic, copy) NSArray *warmUpObjects;
+
+/** SQL of hot statements that `<warmUpConnections:error:>` prepares on each connection, ready for `executeCachedQuery:withArgumentsInArray:` and `executeCachedUpdate:withArgumentsInArray:`.
+ 
+ @see [MSDatabase prepareStatementsForQueries:error:]
+ */
+
+@property (atomic, copy) NSArray *warmUpQueries;
+
+/** How `<inIdempotentTransaction:>` and `<inIdempotentDeferredTransaction:>` retry a transaction that lost a lock; `nil` runs them once, like `<inTransaction:>`. Defaults to a new `<MSDatabaseRetryPolicy>`, whose counters then cover this pool alone. */
+
+@property (atomic, retain) MSDatabaseRetryPolicy *retryPolicy;
+
 
 ///---------------------
 /// @name Initialization
@@ -126,7 +243,23 @@
 
 - (NSUInteger)countOfOpenDatabases;
 
-/** Release all databases in pool */
+/** Snapshot of the pool's telemetry counters
+ 
+ Counters are updated with atomic operations as the pool works and read here without taking the pool's lock, so this is safe to call from a monitoring timer however busy the pool is. Because each counter is read separately, a snapshot taken during a checkout may count it in some fields and not others.
+ 
+ @return A new `<MSDatabasePoolStatistics>` object.
+ */
+
+- (MSDatabasePoolStatistics *)statistics;
+
+/** Zero the telemetry counters and histograms. The high-water mark restarts from the number of connections open now; the open and checked-out gauges are kept. */
+
+- (void)resetStatistics;
+
+/** Release all databases in pool
+ 
+ Checked-in connections are optimized first when `<optimizesOnClose>` is set.
+ */
 
 - (void)releaseAllDatabases;
 
@@ -141,6 +274,16 @@
 
 - (void)inDatabase:(void (^)(MSDatabase *db))block;
 
+/** Synchronously perform database operations in pool, recording a call-site tag for the watchdog.
+
+ @param tag Identifies the caller in watchdog reports; `MSDBCallSiteTag` gives the file, line and method.
+ @param block The code to be run on the `MSDatabasePool` pool.
+ 
+ @see longHoldThreshold
+ */
+
+- (void)inDatabaseTagged:(NSString *)tag block:(void (^)(MSDatabase *db))block;
+
 /** Synchronously perform database operations in pool using transaction.
 
  @param block The code to be run on the `MSDatabasePool` pool.
@@ -148,6 +291,16 @@
 
 - (void)inTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
 
+/** Synchronously perform database operations in pool using transaction, recording a call-site tag for the watchdog.
+
+ @param tag Identifies the caller in watchdog reports; `MSDBCallSiteTag` gives the file, line and method.
+ @param block The code to be run on the `MSDatabasePool` pool.
+ 
+ @see longHoldThreshold
+ */
+
+- (void)inTransactionTagged:(NSString *)tag block:(void (^)(MSDatabase *db, BOOL *rollback))block;
+
 /** Synchronously perform database operations in pool using deferred transaction.
 
  @param block The code to be run on the `MSDatabasePool` pool.
@@ -155,6 +308,28 @@
 
 - (void)inDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
 
+/** Synchronously perform database operations in pool, using transactions, running the block again if the transaction loses a lock.
+ 
+ If a statement in the transaction fails with `SQLITE_BUSY` or `SQLITE_LOCKED`, the transaction is rolled back and, after a randomized wait with the connection handed back, the block runs again from the start, as `<retryPolicy>` allows. Only use this for blocks that have no effect outside the database, or whose effects are safe to repeat.
+ 
+ @param block The code to be run on the `MSDatabasePool` pool.
+ 
+ @return `NO` if the transaction was still contended on its last attempt; `YES` otherwise.
+ */
+
+- (BOOL)inIdempotentTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
+
+/** Synchronously perform database operations in pool, using deferred transactions, running the block again if the transaction loses a lock.
+ 
+ @param block The code to be run on the `MSDatabasePool` pool.
+ 
+ @return `NO` if the transaction was still contended on its last attempt; `YES` otherwise.
+ 
+ @see inIdempotentTransaction:
+ */
+
+- (BOOL)inIdempotentDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
+
 #if SQLITE_VERSION_NUMBER >= 3007000
 
 /** Synchronously perform database operations in pool using save point.
@@ -169,6 +344,39 @@
 - (NSError*)inSavePoint:(void (^)(MSDatabase *db, BOOL *rollback))block;
 #endif
 
+///---------------------------
+/// @name Planner maintenance
+///---------------------------
+
+/** Synchronously run a full `ANALYZE` on one of the pool's connections.
+ 
+ The statistics live in the database file, so the other connections pick them up when they next prepare a statement. Call this after a bulk load.
+ 
+ @return `YES` on success; `NO` on failure.
+ 
+ @see [MSDatabase analyze]
+ */
+
+- (BOOL)analyze;
+
+///--------------
+/// @name Warm-up
+///--------------
+
+/** Open connections and warm them up, so that the first requests after launch do not pay for cold caches.
+ 
+ Checks out `count` connections at once, opening new ones as needed, then on each, in parallel, reads `<warmUpObjects>` and prepares `<warmUpQueries>`. The connections go back into the pool when all of them are done. Opening itself happens under the pool's lock, one connection at a time.
+ 
+ The call blocks until the pool is warm; call it from a background queue at launch and treat its return as the pool being ready.
+ 
+ @param count Number of connections to warm; limited to `<maximumNumberOfDatabasesToCreate>` when that is set.
+ @param outErr On failure, the first error met.
+ 
+ @return `YES` if every connection opened and warmed up; `NO` otherwise. Connections that did open stay in the pool either way.
+ */
+
+- (BOOL)warmUpConnections:(NSUInteger)count error:(NSError **)outErr;
+
 @end
 
 
@@ -201,3 +409,121 @@
 
 @end
 
+
+
+/** Point-in-time copy of an `<MSDatabasePool>`'s telemetry, returned by `<[MSDatabasePool statistics]>`.
+ 
+ Durations are collected in histograms with power-of-two buckets of microseconds: bucket `0` counts durations under 1µs, and bucket `i` counts durations from 2^(i-1) up to 2^i µs, so percentiles are accurate to within a factor of two. The last bucket also counts everything longer.
+ 
+ *Wait time* runs from the start of a checkout to the moment the caller's block starts, including opening a new connection. *Hold time* runs from then until the connection is back in the pool.
+ */
+
+@interface MSDatabasePoolStatistics : NSObject {
+    unsigned long long  _checkouts;
+    unsigned long long  _affineCheckouts;
+    unsigned long long  _nilCheckouts;
+    unsigned long long  _delegateRejections;
+    unsigned long long  _connectionsCreated;
+    unsigned long long  _connectionsClosed;
+    unsigned long long  _highWaterMark;
+    long long           _openConnections;
+    long long           _checkedOut;
+    NSTimeInterval      _totalWaitTime;
+    NSTimeInterval      _maximumWaitTime;
+    NSTimeInterval      _totalHoldTime;
+    NSTimeInterval      _maximumHoldTime;
+    NSArray             *_waitTimeHistogram;
+    NSArray             *_holdTimeHistogram;
+}
+
+/** Checkouts that handed the caller a connection */
+
+@property (atomic, readonly) unsigned long long checkouts;
+
+/** Checkouts served by the calling thread's leased connection, without the pool's lock; included in `checkouts`
+ 
+ @see [MSDatabasePool threadAffinityLease]
+ */
+
+@property (atomic, readonly) unsigned long long affineCheckouts;
+
+/** Checkouts that handed the caller `nil`: the connection limit was reached, a connection failed to open, or the delegate rejected it */
+
+@property (atomic, readonly) unsigned long long nilCheckouts;
+
+/** Connections the delegate refused in `databasePool:shouldAddDatabaseToPool:` */
+
+@property (atomic, readonly) unsigned long long delegateRejections;
+
+/** Connections opened by the pool */
+
+@property (atomic, readonly) unsigned long long connectionsCreated;
+
+/** Connections dropped by the pool, whether rejected, failing validation or released */
+
+@property (atomic, readonly) unsigned long long connectionsClosed;
+
+/** Most connections open at once */
+
+@property (atomic, readonly) unsigned long long highWaterMark;
+
+/** Connections open when the snapshot was taken */
+
+@property (atomic, readonly) long long openConnections;
+
+/** Connections checked out when the snapshot was taken */
+
+@property (atomic, readonly) long long checkedOut;
+
+/** Sum of all checkout wait times, in seconds */
+
+@property (atomic, readonly) NSTimeInterval totalWaitTime;
+
+/** Longest checkout wait, in seconds */
+
+@property (atomic, readonly) NSTimeInterval maximumWaitTime;
+
+/** Sum of all hold times, in seconds */
+
+@property (atomic, readonly) NSTimeInterval totalHoldTime;
+
+/** Longest hold, in seconds */
+
+@property (atomic, readonly) NSTimeInterval maximumHoldTime;
+
+/** `MSDBPoolHistogramBucketCount` `NSNumber` counts of checkout wait times */
+
+@property (atomic, readonly) NSArray *waitTimeHistogram;
+
+/** `MSDBPoolHistogramBucketCount` `NSNumber` counts of hold times */
+
+@property (atomic, readonly) NSArray *holdTimeHistogram;
+
+/** Upper bound, in seconds, of the durations counted in a histogram bucket.
+ 
+ @param bucket Bucket index, from `0` to `MSDBPoolHistogramBucketCount - 1`.
+ 
+ @return The bucket's upper bound; `DBL_MAX` for the last bucket.
+ */
+
++ (NSTimeInterval)upperBoundOfHistogramBucket:(NSUInteger)bucket;
+
+/** Estimate a percentile of checkout wait times.
+ 
+ @param percentile From `0` to `100`, e.g. `99` for the 99th percentile.
+ 
+ @return Upper bound, in seconds, of the bucket holding the percentile; `0` if nothing was recorded.
+ */
+
+- (NSTimeInterval)waitTimeAtPercentile:(double)percentile;
+
+/** Estimate a percentile of hold times.
+ 
+ @param percentile From `0` to `100`, e.g. `99` for the 99th percentile.
+ 
+ @return Upper bound, in seconds, of the bucket holding the percentile; `0` if nothing was recorded.
+ */
+
+- (NSTimeInterval)holdTimeAtPercentile:(double)percentile;
+
+@end
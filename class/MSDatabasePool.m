@@ -7,11 +7,169 @@
 
 #import "MSDatabasePool.h"
 #import "MSDatabase.h"
+#import "MSDatabaseWatchdog.h"
+#import "MSDatabaseRetryPolicy.h"
+#import "MSDatabaseExpiry.h"
+#import <stdatomic.h>
+#import <time.h>
+#import <float.h>
+#import <math.h>
+#import <pthread.h>
+
+// Updated with relaxed atomics and read without the pool's lock; see -statistics.
+struct MSDBPoolCounters {
+    _Atomic(uint64_t)   checkouts;
+    _Atomic(uint64_t)   affineCheckouts;
+    _Atomic(uint64_t)   nilCheckouts;
+    _Atomic(uint64_t)   delegateRejections;
+    _Atomic(uint64_t)   connectionsCreated;
+    _Atomic(uint64_t)   connectionsClosed;
+    _Atomic(uint64_t)   highWaterMark;
+    _Atomic(int64_t)    openConnections;
+    _Atomic(int64_t)    checkedOut;
+    _Atomic(uint64_t)   waitTotal;          // microseconds
+    _Atomic(uint64_t)   waitMaximum;
+    _Atomic(uint64_t)   holdTotal;
+    _Atomic(uint64_t)   holdMaximum;
+    _Atomic(uint64_t)   waitHistogram[MSDBPoolHistogramBucketCount];
+    _Atomic(uint64_t)   holdHistogram[MSDBPoolHistogramBucketCount];
+};
+
+static uint64_t MSDBPoolNowMicros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void MSDBPoolCount(_Atomic(uint64_t) *counter, uint64_t amount) {
+    atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
+}
+
+static void MSDBPoolRaise(_Atomic(uint64_t) *maximum, uint64_t value) {
+    uint64_t current = atomic_load_explicit(maximum, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak_explicit(maximum, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+        // current now holds the latest maximum; retry while ours is still larger.
+    }
+}
+
+static void MSDBPoolRecordDuration(_Atomic(uint64_t) *histogram, _Atomic(uint64_t) *total, _Atomic(uint64_t) *maximum, uint64_t micros) {
+    
+    unsigned bucket = micros ? (unsigned)(64 - __builtin_clzll(micros)) : 0;
+    if (bucket >= MSDBPoolHistogramBucketCount) {
+        bucket = MSDBPoolHistogramBucketCount - 1;
+    }
+    
+    MSDBPoolCount(&histogram[bucket], 1);
+    MSDBPoolCount(total, micros);
+    MSDBPoolRaise(maximum, micros);
+}
+
+// Lease states. Only the owning thread moves a lease from Idle to InUse and back. The pool moves
+// Idle to Revoked when it takes the connection back, and so does the thread's exit;
+// releaseAllDatabases revokes leases in any state.
+enum {
+    MSDBPoolLeaseIdle,
+    MSDBPoolLeaseInUse,
+    MSDBPoolLeaseRevoked,
+};
+
+static _Atomic(uint64_t) MSDBPoolNextIdentifier = 1;
+
+// A connection kept checked out for one thread. Referenced from the thread's leases, under MSDBPoolLeaseKey, and from the pool's _leases.
+@interface MSDBPoolLease : NSObject {
+@public
+    MSDatabase          *_db;
+    uint64_t            _poolIdentifier;
+    _Atomic(int)        _state;
+    _Atomic(uint64_t)   _lastUse;       // MSDBPoolNowMicros()
+}
+@end
+
+@implementation MSDBPoolLease
+
+- (void)dealloc {
+    MSDBRelease(_db);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+@end
+
+static BOOL MSDBPoolLeaseTransition(MSDBPoolLease *lease, int from, int to) {
+    int expected = from;
+    return atomic_compare_exchange_strong(&lease->_state, &expected, to);
+}
+
+// pthread key destructor: the thread is exiting; let the pools' lease timers collect the connections.
+static void MSDBPoolLeasesThreadDidExit(void *value) {
+    
+    CFArrayRef leases = value;
+    
+    for (CFIndex i = 0; i < CFArrayGetCount(leases); i++) {
+        MSDBPoolLeaseTransition((__bridge MSDBPoolLease *)CFArrayGetValueAtIndex(leases, i), MSDBPoolLeaseIdle, MSDBPoolLeaseRevoked);
+    }
+    
+    CFRelease(leases);
+}
+
+// One key for every pool, as keys are few (PTHREAD_KEYS_MAX) and deleting one would leak what the threads still hold under it. Each thread's value is a CFMutableArray of its leases, at most one per pool.
+static pthread_key_t MSDBPoolLeaseKey;
+
+static BOOL MSDBPoolHasLeaseKey(void) {
+    
+    static BOOL created = NO;
+    static dispatch_once_t once;
+    
+    dispatch_once(&once, ^{
+        created = pthread_key_create(&MSDBPoolLeaseKey, &MSDBPoolLeasesThreadDidExit) == 0;
+    });
+    
+    return created;
+}
+
+// The calling thread's lease on the pool `poolIdentifier`, dropping revoked leases of any pool on the way.
+static MSDBPoolLease *MSDBPoolThreadLease(uint64_t poolIdentifier) {
+    
+    CFMutableArrayRef leases = pthread_getspecific(MSDBPoolLeaseKey);
+    
+    if (!leases) {
+        return nil;
+    }
+    
+    MSDBPoolLease *found = nil;
+    
+    for (CFIndex i = CFArrayGetCount(leases) - 1; i >= 0; i--) {
+        
+        MSDBPoolLease *lease = (__bridge MSDBPoolLease *)CFArrayGetValueAtIndex(leases, i);
+        
+        if (atomic_load(&lease->_state) == MSDBPoolLeaseRevoked) {
+            CFArrayRemoveValueAtIndex(leases, i);
+        }
+        else if (lease->_poolIdentifier == poolIdentifier) {
+            found = lease;
+        }
+    }
+    
+    return found;
+}
 
 @interface MSDatabasePool()
 
 - (void)pushDatabaseBackInPool:(MSDatabase*)db;
 - (MSDatabase*)db;
+- (MSDatabase *)leasedDatabase;
+- (void)leaseDatabase:(MSDatabase *)db;
+- (BOOL)returnLeasedDatabase:(MSDatabase *)db;
+- (MSDatabase *)reclaimIdleLeaseLocked;
+- (void)expireLeasesIdleFor:(NSTimeInterval)idleTime;
+
+@end
+
+@interface MSDatabasePoolStatistics ()
+
+- (instancetype)initWithCounters:(struct MSDBPoolCounters *)counters;
 
 @end
 
@@ -21,6 +179,12 @@
 @synthesize delegate=_delegate;
 @synthesize maximumNumberOfDatabasesToCreate=_maximumNumberOfDatabasesToCreate;
 @synthesize openFlags=_openFlags;
+@synthesize analysisLimit=_analysisLimit;
+@synthesize optimizesOnClose=_optimizesOnClose;
+@synthesize validationIdleThreshold=_validationIdleThreshold;
+@synthesize warmUpObjects=_warmUpObjects;
+@synthesize warmUpQueries=_warmUpQueries;
+@synthesize retryPolicy=_retryPolicy;
 
 
 + (instancetype)databasePoolWithPath:(NSString*)aPath {
@@ -41,6 +205,15 @@
         _databaseInPool     = MSDBReturnRetained([NSMutableArray array]);
         _databaseOutPool    = MSDBReturnRetained([NSMutableArray array]);
         _openFlags          = openFlags;
+        _analysisLimit      = 400;
+        _optimizesOnClose   = YES;
+        _lastMaintenanceTimes = [[NSMutableDictionary alloc] init];
+        _counters           = calloc(1, sizeof(struct MSDBPoolCounters));
+        _watchdog           = [[MSDatabaseWatchdog alloc] initWithName:aPath ? [aPath lastPathComponent] : @":memory:"];
+        _leases             = [[NSMutableArray alloc] init];
+        _retryPolicy        = [[MSDatabaseRetryPolicy alloc] init];
+        _expiry             = [[MSDatabaseExpiry alloc] init];
+        _identifier         = atomic_fetch_add(&MSDBPoolNextIdentifier, 1);
     }
     
     return self;
@@ -59,10 +232,55 @@
 
 - (void)dealloc {
     
+    // The timers fire on _maintenanceQueue, so once it is drained no handler is running or will run.
+    if (_maintenanceTimer) {
+        dispatch_source_cancel(_maintenanceTimer);
+        MSDBDispatchQueueRelease(_maintenanceTimer);
+        _maintenanceTimer = 0x00;
+    }
+    
+    if (_leaseTimer) {
+        dispatch_source_cancel(_leaseTimer);
+        MSDBDispatchQueueRelease(_leaseTimer);
+        _leaseTimer = 0x00;
+    }
+    
+    if (_expiryTimer) {
+        dispatch_source_cancel(_expiryTimer);
+        MSDBDispatchQueueRelease(_expiryTimer);
+        _expiryTimer = 0x00;
+    }
+    
+    if (_maintenanceQueue) {
+        dispatch_sync(_maintenanceQueue, ^{});
+    }
+    
+    // Threads still holding a lease drop it on their next checkout from any pool, or when they exit; its connection is closed now rather than then.
+    for (MSDBPoolLease *lease in _leases) {
+        if (MSDBPoolLeaseTransition(lease, MSDBPoolLeaseIdle, MSDBPoolLeaseRevoked)) {
+            [lease->_db close];
+            MSDBRelease(lease->_db);
+            lease->_db = nil;
+        }
+    }
+    MSDBRelease(_leases);
+    
+    if (_maintenanceQueue) {
+        MSDBDispatchQueueRelease(_maintenanceQueue);
+        _maintenanceQueue = 0x00;
+    }
+    
     _delegate = 0x00;
     MSDBRelease(_path);
     MSDBRelease(_databaseInPool);
     MSDBRelease(_databaseOutPool);
+    MSDBRelease(_lastMaintenanceTimes);
+    free(_counters);
+    MSDBRelease(_watchdog);
+    MSDBRelease(_warmUpObjects);
+    MSDBRelease(_warmUpQueries);
+    MSDBRelease(_retryPolicy);
+    MSDBRelease(_expiry);
     
     if (_lockQueue) {
         MSDBDispatchQueueRelease(_lockQueue);
@@ -90,6 +308,8 @@
             [[NSException exceptionWithName:@"Database already in pool" reason:@"The MSDatabase being put back into the pool is already present in the pool" userInfo:nil] raise];
         }
         
+        [db setLastUseTime:[NSDate timeIntervalSinceReferenceDate]];
+        atomic_fetch_sub_explicit(&self->_counters->checkedOut, 1, memory_order_relaxed);
         [self->_databaseInPool addObject:db];
         [self->_databaseOutPool removeObject:db];
         
@@ -104,6 +324,18 @@
     [self executeLocked:^() {
         db = [self->_databaseInPool lastObject];
         
+        // Only connections that sat idle past the threshold are validated; bad ones are closed and dropped.
+        NSTimeInterval threshold = self->_validationIdleThreshold;
+        while (db && threshold > 0 && [NSDate timeIntervalSinceReferenceDate] - [db lastUseTime] >= threshold && ![db goodConnection]) {
+            MSDBLogInfo(@"Dropping pooled database %@ that failed validation", db);
+            [db close];
+            MSDBPoolCount(&self->_counters->connectionsClosed, 1);
+            atomic_fetch_sub_explicit(&self->_counters->openConnections, 1, memory_order_relaxed);
+            [self->_lastMaintenanceTimes removeObjectForKey:[NSValue valueWithNonretainedObject:db]];
+            [self->_databaseInPool removeLastObject];
+            db = [self->_databaseInPool lastObject];
+        }
+        
         BOOL shouldNotifyDelegate = NO;
         
         if (db) {
@@ -115,14 +347,22 @@
             if (self->_maximumNumberOfDatabasesToCreate) {
                 NSUInteger currentCount = [self->_databaseOutPool count] + [self->_databaseInPool count];
                 
+                // At the limit, take back a connection that some thread is keeping but not using.
+                if (currentCount >= self->_maximumNumberOfDatabasesToCreate && (db = [self reclaimIdleLeaseLocked])) {
+                    currentCount = 0;
+                }
+                
                 if (currentCount >= self->_maximumNumberOfDatabasesToCreate) {
-                    NSLog(@"Maximum number of databases (%ld) has already been reached!", (long)currentCount);
+                    MSDBLogWarning(@"Maximum number of databases (%ld) has already been reached!", (long)currentCount);
+                    MSDBPoolCount(&self->_counters->nilCheckouts, 1);
                     return;
                 }
             }
             
-            db = [MSDatabase databaseWithPath:self->_path];
-            shouldNotifyDelegate = YES;
+            if (!db) {
+                db = [MSDatabase databaseWithPath:self->_path];
+                shouldNotifyDelegate = YES;
+            }
         }
         
         //This ensures that the db is opened before returning
@@ -131,10 +371,19 @@
 #else
         BOOL success = [db open];
 #endif
+        if (success && shouldNotifyDelegate) {
+            MSDBPoolCount(&self->_counters->connectionsCreated, 1);
+            int64_t open = atomic_fetch_add_explicit(&self->_counters->openConnections, 1, memory_order_relaxed) + 1;
+            MSDBPoolRaise(&self->_counters->highWaterMark, (uint64_t)open);
+        }
+        
         if (success) {
             if ([self->_delegate respondsToSelector:@selector(databasePool:shouldAddDatabaseToPool:)] && ![self->_delegate databasePool:self shouldAddDatabaseToPool:db]) {
                 [db close];
                 db = 0x00;
+                MSDBPoolCount(&self->_counters->delegateRejections, 1);
+                MSDBPoolCount(&self->_counters->connectionsClosed, 1);
+                atomic_fetch_sub_explicit(&self->_counters->openConnections, 1, memory_order_relaxed);
             }
             else {
                 //It should not get added in the pool twice if lastObject was found
@@ -148,14 +397,61 @@
             }
         }
         else {
-            NSLog(@"Could not open up the database at path %@", self->_path);
+            MSDBLogError(@"Could not open up the database at path %@", self->_path);
             db = 0x00;
         }
+        
+        if (db) {
+            MSDBPoolCount(&self->_counters->checkouts, 1);
+            atomic_fetch_add_explicit(&self->_counters->checkedOut, 1, memory_order_relaxed);
+        }
+        else {
+            MSDBPoolCount(&self->_counters->nilCheckouts, 1);
+        }
     }];
     
     return db;
 }
 
+// -db and -pushDatabaseBackInPool:, timed for the wait and hold histograms and watched by the watchdog.
+- (MSDatabase *)checkOutDatabaseTagged:(NSString *)tag checkout:(MSDatabaseCheckout **)checkout checkedOutAt:(uint64_t *)checkedOutAt {
+    
+    uint64_t start  = MSDBPoolNowMicros();
+    MSDatabase *db  = [self leasedDatabase];
+    
+    if (db) {
+        MSDBPoolCount(&_counters->checkouts, 1);
+        MSDBPoolCount(&_counters->affineCheckouts, 1);
+    }
+    else {
+        db = [self db];
+        [self leaseDatabase:db];
+    }
+    
+    *checkedOutAt   = MSDBPoolNowMicros();
+    *checkout       = [_watchdog beginCheckoutOfDatabase:db tag:tag];
+    
+    MSDBPoolRecordDuration(_counters->waitHistogram, &_counters->waitTotal, &_counters->waitMaximum, *checkedOutAt - start);
+    
+    return db;
+}
+
+- (void)checkInDatabase:(MSDatabase *)db checkout:(MSDatabaseCheckout *)checkout checkedOutAt:(uint64_t)checkedOutAt {
+    
+    if (!db) {
+        return;
+    }
+    
+    // Before the connection is back in the pool, where another thread could pick it up.
+    [_watchdog endCheckout:checkout ofDatabase:db];
+    
+    if (![self returnLeasedDatabase:db]) {
+        [self pushDatabaseBackInPool:db];
+    }
+    
+    MSDBPoolRecordDuration(_counters->holdHistogram, &_counters->holdTotal, &_counters->holdMaximum, MSDBPoolNowMicros() - checkedOutAt);
+}
+
 - (NSUInteger)countOfCheckedInDatabases {
     
     __block NSUInteger count;
@@ -188,27 +484,281 @@
     return count;
 }
 
+#pragma mark Thread affinity
+
+- (NSTimeInterval)threadAffinityLease {
+    @synchronized (self) {
+        return _threadAffinityLease;
+    }
+}
+
+- (void)setThreadAffinityLease:(NSTimeInterval)threadAffinityLease {
+    
+    @synchronized (self) {
+        
+        _threadAffinityLease = threadAffinityLease;
+        
+        if (_leaseTimer) {
+            dispatch_source_cancel(_leaseTimer);
+            MSDBDispatchQueueRelease(_leaseTimer);
+            _leaseTimer = 0x00;
+        }
+        
+        if (threadAffinityLease <= 0) {
+            [self expireLeasesIdleFor:0];
+            return;
+        }
+        
+        if (!MSDBPoolHasLeaseKey()) {
+            MSDBLogWarning(@"Could not create a thread-specific key; thread affinity stays off");
+            _threadAffinityLease = 0;
+            return;
+        }
+        
+        if (!_maintenanceQueue) {
+            _maintenanceQueue = dispatch_queue_create([[NSString stringWithFormat:@"MSDB.maintenance.%@", self] UTF8String], NULL);
+        }
+        
+        // Not retained: the timer would keep the pool alive. dealloc cancels it and drains _maintenanceQueue first.
+        __unsafe_unretained MSDatabasePool *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(MAX(threadAffinityLease / 2, 0.001) * NSEC_PER_SEC);
+        
+        _leaseTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _maintenanceQueue);
+        dispatch_source_set_timer(_leaseTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_leaseTimer, ^{
+            [unretainedSelf expireLeasesIdleFor:[unretainedSelf threadAffinityLease]];
+        });
+        dispatch_resume(_leaseTimer);
+    }
+}
+
+// The calling thread's lease on this pool, if any, claimed for use. Takes no lock.
+- (MSDatabase *)leasedDatabase {
+    
+    if (!MSDBPoolHasLeaseKey()) {
+        return nil;
+    }
+    
+    MSDBPoolLease *lease = MSDBPoolThreadLease(_identifier);
+    
+    // Fails for a nested checkout on this thread, the outer one using the lease, or if the pool revoked it since the scan; the next scan drops it.
+    if (lease && MSDBPoolLeaseTransition(lease, MSDBPoolLeaseIdle, MSDBPoolLeaseInUse)) {
+        return lease->_db;
+    }
+    
+    return nil;
+}
+
+// Turn a fresh checkout into the calling thread's lease, in use.
+- (void)leaseDatabase:(MSDatabase *)db {
+    
+    if (!db || !MSDBPoolHasLeaseKey() || [self threadAffinityLease] <= 0 || MSDBPoolThreadLease(_identifier)) {
+        return;
+    }
+    
+    MSDBPoolLease *lease = MSDBReturnAutoreleased([[MSDBPoolLease alloc] init]);
+    lease->_db = MSDBReturnRetained(db);
+    lease->_poolIdentifier = _identifier;
+    atomic_store(&lease->_state, MSDBPoolLeaseInUse);
+    atomic_store(&lease->_lastUse, MSDBPoolNowMicros());
+    
+    [self executeLocked:^() {
+        [self->_leases addObject:lease];
+    }];
+    
+    CFMutableArrayRef leases = pthread_getspecific(MSDBPoolLeaseKey);
+    
+    if (!leases) {
+        leases = CFArrayCreateMutable(NULL, 0, &kCFTypeArrayCallBacks);
+        pthread_setspecific(MSDBPoolLeaseKey, leases);
+    }
+    
+    CFArrayAppendValue(leases, (__bridge const void *)lease);
+}
+
+// If db is the calling thread's lease, keep it checked out for the thread and return YES.
+- (BOOL)returnLeasedDatabase:(MSDatabase *)db {
+    
+    if (!MSDBPoolHasLeaseKey()) {
+        return NO;
+    }
+    
+    MSDBPoolLease *lease = MSDBPoolThreadLease(_identifier);
+    
+    if (!lease || lease->_poolIdentifier != _identifier || lease->_db != db) {
+        return NO;
+    }
+    
+    [db setLastUseTime:[NSDate timeIntervalSinceReferenceDate]];
+    atomic_store(&lease->_lastUse, MSDBPoolNowMicros());
+    
+    // Fails if releaseAllDatabases revoked the lease meanwhile; the connection then goes back like any other.
+    return MSDBPoolLeaseTransition(lease, MSDBPoolLeaseInUse, MSDBPoolLeaseIdle);
+}
+
+// Called with the lock held, when the pool is at its limit. The connection stays in _databaseOutPool.
+- (MSDatabase *)reclaimIdleLeaseLocked {
+    
+    for (MSDBPoolLease *lease in _leases) {
+        if (MSDBPoolLeaseTransition(lease, MSDBPoolLeaseIdle, MSDBPoolLeaseRevoked)) {
+            // Outlives the lease, which _leases may hold the last reference to.
+            MSDatabase *db = lease->_db;
+            MSDBRetain(db);
+            MSDBAutorelease(db);
+            [_leases removeObjectIdenticalTo:lease];
+            // -db counts it as checked out again.
+            atomic_fetch_sub_explicit(&_counters->checkedOut, 1, memory_order_relaxed);
+            return db;
+        }
+    }
+    
+    return nil;
+}
+
+// Hand back connections whose thread exited or has not used them for `idleTime` seconds.
+- (void)expireLeasesIdleFor:(NSTimeInterval)idleTime {
+    
+    uint64_t now = MSDBPoolNowMicros();
+    uint64_t idleMicros = (uint64_t)(idleTime * 1e6);
+    NSMutableArray *expired = [NSMutableArray array];
+    
+    [self executeLocked:^() {
+        for (MSDBPoolLease *lease in self->_leases) {
+            // The owning thread may have stored a time later than `now` since it was read.
+            uint64_t lastUse = atomic_load(&lease->_lastUse);
+            BOOL stale = now >= lastUse && now - lastUse >= idleMicros;
+            if ((stale && MSDBPoolLeaseTransition(lease, MSDBPoolLeaseIdle, MSDBPoolLeaseRevoked)) || atomic_load(&lease->_state) == MSDBPoolLeaseRevoked) {
+                [expired addObject:lease];
+            }
+        }
+        for (MSDBPoolLease *lease in expired) {
+            [self->_leases removeObjectIdenticalTo:lease];
+        }
+    }];
+    
+    for (MSDBPoolLease *lease in expired) {
+        // releaseAllDatabases may have dropped it already.
+        __block BOOL stillOut = NO;
+        [self executeLocked:^() {
+            stillOut = [self->_databaseOutPool indexOfObjectIdenticalTo:lease->_db] != NSNotFound;
+        }];
+        if (stillOut) {
+            [self pushDatabaseBackInPool:lease->_db];
+        }
+    }
+}
+
+- (NSTimeInterval)longHoldThreshold {
+    return [_watchdog longHoldThreshold];
+}
+
+- (void)setLongHoldThreshold:(NSTimeInterval)longHoldThreshold {
+    [_watchdog setLongHoldThreshold:longHoldThreshold];
+}
+
+- (void (^)(MSDatabaseCheckout *))watchdogHandler {
+    return [_watchdog handler];
+}
+
+- (void)setWatchdogHandler:(void (^)(MSDatabaseCheckout *))watchdogHandler {
+    [_watchdog setHandler:watchdogHandler];
+}
+
+- (MSDatabasePoolStatistics *)statistics {
+    return MSDBReturnAutoreleased([[MSDatabasePoolStatistics alloc] initWithCounters:_counters]);
+}
+
+- (void)resetStatistics {
+    
+    struct MSDBPoolCounters *c = _counters;
+    
+    atomic_store_explicit(&c->checkouts, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->affineCheckouts, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->nilCheckouts, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->delegateRejections, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->connectionsCreated, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->connectionsClosed, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->waitTotal, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->waitMaximum, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->holdTotal, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->holdMaximum, 0, memory_order_relaxed);
+    
+    for (int i = 0; i < MSDBPoolHistogramBucketCount; i++) {
+        atomic_store_explicit(&c->waitHistogram[i], 0, memory_order_relaxed);
+        atomic_store_explicit(&c->holdHistogram[i], 0, memory_order_relaxed);
+    }
+    
+    int64_t open = atomic_load_explicit(&c->openConnections, memory_order_relaxed);
+    atomic_store_explicit(&c->highWaterMark, open > 0 ? (uint64_t)open : 0, memory_order_relaxed);
+}
+
 - (void)releaseAllDatabases {
+    
+    __block NSArray *checkedIn = nil;
+    NSMutableArray *leased = [NSMutableArray array];
+    
     [self executeLocked:^() {
+        for (MSDBPoolLease *lease in self->_leases) {
+            // The owning thread's leases keep an idle lease until its next checkout or exit, which may be never on a long-lived
+            // thread: take the connection from it now. A thread using its lease right now hands the connection back as an ordinary checkout.
+            if (MSDBPoolLeaseTransition(lease, MSDBPoolLeaseIdle, MSDBPoolLeaseRevoked)) {
+                [leased addObject:lease->_db];
+                MSDBRelease(lease->_db);
+                lease->_db = nil;
+            }
+            else {
+                atomic_store(&lease->_state, MSDBPoolLeaseRevoked);
+            }
+        }
+        [self->_leases removeAllObjects];
+        
+        checkedIn = MSDBReturnAutoreleased([self->_databaseInPool copy]);
+        NSUInteger dropped = [self->_databaseOutPool count] + [self->_databaseInPool count];
+        MSDBPoolCount(&self->_counters->connectionsClosed, dropped);
+        atomic_fetch_sub_explicit(&self->_counters->openConnections, (int64_t)dropped, memory_order_relaxed);
         [self->_databaseOutPool removeAllObjects];
         [self->_databaseInPool removeAllObjects];
+        [self->_lastMaintenanceTimes removeAllObjects];
     }];
+    
+    // Outside the lock: nobody else can reach these connections any more.
+    if ([self optimizesOnClose]) {
+        int analysisLimit = [self analysisLimit];
+        for (MSDatabase *db in checkedIn) {
+            [db optimizeWithAnalysisLimit:analysisLimit];
+        }
+        for (MSDatabase *db in leased) {
+            [db optimizeWithAnalysisLimit:analysisLimit];
+        }
+    }
+    
+    for (MSDatabase *db in leased) {
+        [db close];
+    }
 }
 
 - (void)inDatabase:(void (^)(MSDatabase *db))block {
+    [self inDatabaseTagged:nil block:block];
+}
+
+- (void)inDatabaseTagged:(NSString *)tag block:(void (^)(MSDatabase *db))block {
     
-    MSDatabase *db = [self db];
+    uint64_t checkedOutAt;
+    MSDatabaseCheckout *checkout;
+    MSDatabase *db = [self checkOutDatabaseTagged:tag checkout:&checkout checkedOutAt:&checkedOutAt];
     
     block(db);
     
-    [self pushDatabaseBackInPool:db];
+    [self checkInDatabase:db checkout:checkout checkedOutAt:checkedOutAt];
 }
 
-- (void)beginTransaction:(BOOL)useDeferred withBlock:(void (^)(MSDatabase *db, BOOL *rollback))block {
+- (void)beginTransaction:(BOOL)useDeferred tag:(NSString *)tag withBlock:(void (^)(MSDatabase *db, BOOL *rollback))block {
     
     BOOL shouldRollback = NO;
     
-    MSDatabase *db = [self db];
+    uint64_t checkedOutAt;
+    MSDatabaseCheckout *checkout;
+    MSDatabase *db = [self checkOutDatabaseTagged:tag checkout:&checkout checkedOutAt:&checkedOutAt];
     
     if (useDeferred) {
         [db beginDeferredTransaction];
@@ -227,15 +777,51 @@
         [db commit];
     }
     
-    [self pushDatabaseBackInPool:db];
+    [self checkInDatabase:db checkout:checkout checkedOutAt:checkedOutAt];
 }
 
 - (void)inDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
-    [self beginTransaction:YES withBlock:block];
+    [self beginTransaction:YES tag:nil withBlock:block];
 }
 
 - (void)inTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
-    [self beginTransaction:NO withBlock:block];
+    [self beginTransaction:NO tag:nil withBlock:block];
+}
+
+- (void)inTransactionTagged:(NSString *)tag block:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    [self beginTransaction:NO tag:tag withBlock:block];
+}
+
+- (BOOL)beginIdempotentTransaction:(BOOL)useDeferred withBlock:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    
+    MSDatabaseRetryPolicy *retryPolicy = [self retryPolicy];
+    
+    if (!retryPolicy) {
+        [self beginTransaction:useDeferred tag:nil withBlock:block];
+        return YES;
+    }
+    
+    // The connection goes back to the pool between attempts, so it is not held while backing off.
+    return [retryPolicy runAttempts:^BOOL(BOOL lastAttempt) {
+        
+        uint64_t checkedOutAt;
+        MSDatabaseCheckout *checkout;
+        MSDatabase *db = [self checkOutDatabaseTagged:nil checkout:&checkout checkedOutAt:&checkedOutAt];
+        
+        BOOL contended = MSDBRunTransactionAttempt(db, useDeferred, !lastAttempt, block);
+        
+        [self checkInDatabase:db checkout:checkout checkedOutAt:checkedOutAt];
+        
+        return contended;
+    }];
+}
+
+- (BOOL)inIdempotentTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    return [self beginIdempotentTransaction:NO withBlock:block];
+}
+
+- (BOOL)inIdempotentDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    return [self beginIdempotentTransaction:YES withBlock:block];
 }
 #if SQLITE_VERSION_NUMBER >= 3007000
 - (NSError*)inSavePoint:(void (^)(MSDatabase *db, BOOL *rollback))block {
@@ -246,12 +832,14 @@
     
     BOOL shouldRollback = NO;
     
-    MSDatabase *db = [self db];
+    uint64_t checkedOutAt;
+    MSDatabaseCheckout *checkout;
+    MSDatabase *db = [self checkOutDatabaseTagged:nil checkout:&checkout checkedOutAt:&checkedOutAt];
     
     NSError *err = 0x00;
     
     if (![db startSavePointWithName:name error:&err]) {
-        [self pushDatabaseBackInPool:db];
+        [self checkInDatabase:db checkout:checkout checkedOutAt:checkedOutAt];
         return err;
     }
     
@@ -263,10 +851,355 @@
     }
     [db releaseSavePointWithName:name error:&err];
     
-    [self pushDatabaseBackInPool:db];
+    [self checkInDatabase:db checkout:checkout checkedOutAt:checkedOutAt];
     
     return err;
 }
 #endif
 
+#pragma mark Planner maintenance
+
+- (NSTimeInterval)maintenanceInterval {
+    @synchronized (self) {
+        return _maintenanceInterval;
+    }
+}
+
+- (void)setMaintenanceInterval:(NSTimeInterval)maintenanceInterval {
+    
+    @synchronized (self) {
+        
+        _maintenanceInterval = maintenanceInterval;
+        
+        if (_maintenanceTimer) {
+            dispatch_source_cancel(_maintenanceTimer);
+            MSDBDispatchQueueRelease(_maintenanceTimer);
+            _maintenanceTimer = 0x00;
+        }
+        
+        if (maintenanceInterval <= 0) {
+            return;
+        }
+        
+        if (!_maintenanceQueue) {
+            _maintenanceQueue = dispatch_queue_create([[NSString stringWithFormat:@"MSDB.maintenance.%@", self] UTF8String], NULL);
+        }
+        
+        // Not retained: the timer would keep the pool alive. dealloc cancels it and drains _maintenanceQueue first.
+        __unsafe_unretained MSDatabasePool *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(maintenanceInterval * NSEC_PER_SEC);
+        
+        _maintenanceTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _maintenanceQueue);
+        dispatch_source_set_timer(_maintenanceTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_maintenanceTimer, ^{
+            [unretainedSelf performIdleMaintenance];
+        });
+        dispatch_resume(_maintenanceTimer);
+    }
+}
+
+// Runs on _maintenanceQueue.
+- (void)performIdleMaintenance {
+    
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSTimeInterval idleTime = [self maintenanceInterval];
+    __block NSMutableArray *idle = nil;
+    
+    // Check the idle connections out, so that -db cannot hand them to anyone while they are being optimized.
+    [self executeLocked:^() {
+        
+        for (MSDatabase *db in self->_databaseInPool) {
+            
+            NSTimeInterval lastUse = [db lastUseTime];
+            NSTimeInterval lastMaintenance = [[self->_lastMaintenanceTimes objectForKey:[NSValue valueWithNonretainedObject:db]] doubleValue];
+            
+            if (lastUse > lastMaintenance && now - lastUse >= idleTime) {
+                if (!idle) {
+                    idle = [NSMutableArray array];
+                }
+                [idle addObject:db];
+            }
+        }
+        
+        for (MSDatabase *db in idle) {
+            [self->_databaseInPool removeObjectIdenticalTo:db];
+            [self->_databaseOutPool addObject:db];
+        }
+    }];
+    
+    if (![idle count]) {
+        return;
+    }
+    
+    int analysisLimit = [self analysisLimit];
+    for (MSDatabase *db in idle) {
+        [db optimizeWithAnalysisLimit:analysisLimit];
+    }
+    
+    // Put them back without touching lastUseTime, which tracks callers' use only.
+    [self executeLocked:^() {
+        for (MSDatabase *db in idle) {
+            // releaseAllDatabases may have dropped the pool's connections in the meantime.
+            if ([self->_databaseOutPool indexOfObjectIdenticalTo:db] == NSNotFound) {
+                continue;
+            }
+            [self->_lastMaintenanceTimes setObject:[NSNumber numberWithDouble:now] forKey:[NSValue valueWithNonretainedObject:db]];
+            [self->_databaseOutPool removeObjectIdenticalTo:db];
+            [self->_databaseInPool addObject:db];
+        }
+    }];
+}
+
+#pragma mark TTL expiry
+
+- (MSDatabaseExpiry *)expiry {
+    return _expiry;
+}
+
+- (NSTimeInterval)expiryInterval {
+    @synchronized (self) {
+        return _expiryInterval;
+    }
+}
+
+- (void)setExpiryInterval:(NSTimeInterval)expiryInterval {
+    
+    @synchronized (self) {
+        
+        _expiryInterval = expiryInterval;
+        
+        if (_expiryTimer) {
+            dispatch_source_cancel(_expiryTimer);
+            MSDBDispatchQueueRelease(_expiryTimer);
+            _expiryTimer = 0x00;
+        }
+        
+        if (expiryInterval <= 0) {
+            return;
+        }
+        
+        if (!_maintenanceQueue) {
+            _maintenanceQueue = dispatch_queue_create([[NSString stringWithFormat:@"MSDB.maintenance.%@", self] UTF8String], NULL);
+        }
+        
+
+        // Not retained: the timer would keep the pool alive. dealloc cancels it and drains _maintenanceQueue first.
+        __unsafe_unretained MSDatabasePool *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(expiryInterval * NSEC_PER_SEC);
+        
+        _expiryTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _maintenanceQueue);
+        dispatch_source_set_timer(_expiryTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_expiryTimer, ^{
+            [unretainedSelf performExpiry];
+        });
+        dispatch_resume(_expiryTimer);
+    }
+}
+
+// With a backlog, the next batch comes after about one batch's hold time; otherwise after the regular interval.
+- (void)scheduleNextExpiry:(BOOL)backlogged {
+    
+    @synchronized (self) {
+        
+        if (!_expiryTimer) {
+            return;
+        }
+        
+        uint64_t interval   = (uint64_t)(_expiryInterval * NSEC_PER_SEC);
+        uint64_t delay      = backlogged ? (uint64_t)(MAX([_expiry targetHoldTime], 0.001) * NSEC_PER_SEC) : interval;
+        
+        dispatch_source_set_timer(_expiryTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)delay), interval, interval / 10);
+    }
+}
+
+// Runs on _maintenanceQueue.
+- (void)performExpiry {
+    
+    MSDatabase *db = [self db];
+    
+    if (!db) {
+        return;
+    }
+    
+    BOOL backlogged = [_expiry runBatchesInDatabase:db];
+    
+    [self pushDatabaseBackInPool:db];
+    
+    [self scheduleNextExpiry:backlogged];
+}
+
+- (BOOL)analyze {
+    
+    __block BOOL success = NO;
+    
+    [self inDatabase:^(MSDatabase *db) {
+        success = [db analyze];
+    }];
+    
+    return success;
+}
+
+#pragma mark Warm-up
+
+- (BOOL)warmUpConnections:(NSUInteger)count error:(NSError **)outErr {
+    
+    NSUInteger maximum = [self maximumNumberOfDatabasesToCreate];
+    
+    if (maximum && count > maximum) {
+        count = maximum;
+    }
+    
+    NSArray *objects = [self warmUpObjects];
+    NSArray *queries = [self warmUpQueries];
+    NSMutableArray *warmed = [NSMutableArray arrayWithCapacity:count];
+    __block NSError *err = nil;
+    __block BOOL allWarm = YES;
+    
+    // Every connection stays checked out until all are done, so each iteration gets a different one.
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t idx) {
+        
+        NSError *warmUpError = nil;
+        MSDatabase *db = [self db];
+        BOOL success = db && (!objects || [db preloadObjects:objects error:&warmUpError]) && [db prepareStatementsForQueries:queries error:&warmUpError];
+        
+        if (!db) {
+            warmUpError = [NSError errorWithDomain:@"MSDatabase" code:SQLITE_CANTOPEN userInfo:[NSDictionary dictionaryWithObject:@"Could not check out a connection to warm up" forKey:NSLocalizedDescriptionKey]];
+        }
+        
+        @synchronized (warmed) {
+            if (db) {
+                [warmed addObject:db];
+            }
+            if (!success && allWarm) {
+                // Retained past the worker's autorelease pool.
+                err = MSDBReturnRetained(warmUpError);
+                allWarm = NO;
+            }
+        }
+    });
+    
+    for (MSDatabase *db in warmed) {
+        [self pushDatabaseBackInPool:db];
+    }
+    
+    if (outErr) {
+        *outErr = err;
+    }
+    
+    MSDBAutorelease(err);
+    
+    return allWarm;
+}
+
+@end
+
+
+@implementation MSDatabasePoolStatistics
+
+@synthesize checkouts=_checkouts;
+@synthesize affineCheckouts=_affineCheckouts;
+@synthesize nilCheckouts=_nilCheckouts;
+@synthesize delegateRejections=_delegateRejections;
+@synthesize connectionsCreated=_connectionsCreated;
+@synthesize connectionsClosed=_connectionsClosed;
+@synthesize highWaterMark=_highWaterMark;
+@synthesize openConnections=_openConnections;
+@synthesize checkedOut=_checkedOut;
+@synthesize totalWaitTime=_totalWaitTime;
+@synthesize maximumWaitTime=_maximumWaitTime;
+@synthesize totalHoldTime=_totalHoldTime;
+@synthesize maximumHoldTime=_maximumHoldTime;
+@synthesize waitTimeHistogram=_waitTimeHistogram;
+@synthesize holdTimeHistogram=_holdTimeHistogram;
+
+static NSArray *MSDBPoolHistogramArray(_Atomic(uint64_t) *histogram) {
+    NSMutableArray *counts = [NSMutableArray arrayWithCapacity:MSDBPoolHistogramBucketCount];
+    for (int i = 0; i < MSDBPoolHistogramBucketCount; i++) {
+        [counts addObject:[NSNumber numberWithUnsignedLongLong:atomic_load_explicit(&histogram[i], memory_order_relaxed)]];
+    }
+    return counts;
+}
+
+- (instancetype)initWithCounters:(struct MSDBPoolCounters *)c {
+    
+    self = [super init];
+    
+    if (self) {
+        _checkouts          = atomic_load_explicit(&c->checkouts, memory_order_relaxed);
+        _affineCheckouts    = atomic_load_explicit(&c->affineCheckouts, memory_order_relaxed);
+        _nilCheckouts       = atomic_load_explicit(&c->nilCheckouts, memory_order_relaxed);
+        _delegateRejections = atomic_load_explicit(&c->delegateRejections, memory_order_relaxed);
+        _connectionsCreated = atomic_load_explicit(&c->connectionsCreated, memory_order_relaxed);
+        _connectionsClosed  = atomic_load_explicit(&c->connectionsClosed, memory_order_relaxed);
+        _highWaterMark      = atomic_load_explicit(&c->highWaterMark, memory_order_relaxed);
+        _openConnections    = atomic_load_explicit(&c->openConnections, memory_order_relaxed);
+        _checkedOut         = atomic_load_explicit(&c->checkedOut, memory_order_relaxed);
+        _totalWaitTime      = atomic_load_explicit(&c->waitTotal, memory_order_relaxed) / 1e6;
+        _maximumWaitTime    = atomic_load_explicit(&c->waitMaximum, memory_order_relaxed) / 1e6;
+        _totalHoldTime      = atomic_load_explicit(&c->holdTotal, memory_order_relaxed) / 1e6;
+        _maximumHoldTime    = atomic_load_explicit(&c->holdMaximum, memory_order_relaxed) / 1e6;
+        _waitTimeHistogram  = MSDBReturnRetained(MSDBPoolHistogramArray(c->waitHistogram));
+        _holdTimeHistogram  = MSDBReturnRetained(MSDBPoolHistogramArray(c->holdHistogram));
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_waitTimeHistogram);
+    MSDBRelease(_holdTimeHistogram);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
++ (NSTimeInterval)upperBoundOfHistogramBucket:(NSUInteger)bucket {
+    
+    if (bucket >= MSDBPoolHistogramBucketCount - 1) {
+        return DBL_MAX;
+    }
+    
+    return ldexp(1.0, (int)bucket) / 1e6;
+}
+
+static NSTimeInterval MSDBPoolPercentile(NSArray *histogram, double percentile) {
+    
+    unsigned long long total = 0;
+    for (NSNumber *count in histogram) {
+        total += [count unsignedLongLongValue];
+    }
+    
+    if (!total) {
+        return 0;
+    }
+    
+    double rank = fmin(fmax(percentile, 0), 100) / 100.0 * total;
+    unsigned long long seen = 0;
+    
+    for (NSUInteger bucket = 0; bucket < [histogram count]; bucket++) {
+        seen += [[histogram objectAtIndex:bucket] unsignedLongLongValue];
+        if (seen >= rank && seen > 0) {
+            return [MSDatabasePoolStatistics upperBoundOfHistogramBucket:bucket];
+        }
+    }
+    
+    return DBL_MAX;
+}
+
+- (NSTimeInterval)waitTimeAtPercentile:(double)percentile {
+    return MSDBPoolPercentile(_waitTimeHistogram, percentile);
+}
+
+- (NSTimeInterval)holdTimeAtPercentile:(double)percentile {
+    return MSDBPoolPercentile(_holdTimeHistogram, percentile);
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ checkouts: %llu (thread-affine: %llu, nil: %llu, rejected: %llu), connections: %lld open, %lld out, %llu created, %llu closed, high-water %llu, wait p50/p99/max: %g/%g/%gs, hold p50/p99/max: %g/%g/%gs",
+            [super description], _checkouts, _affineCheckouts, _nilCheckouts, _delegateRejections, _openConnections, _checkedOut, _connectionsCreated, _connectionsClosed, _highWaterMark,
+            [self waitTimeAtPercentile:50], [self waitTimeAtPercentile:99], _maximumWaitTime,
+            [self holdTimeAtPercentile:50], [self holdTimeAtPercentile:99], _maximumHoldTime];
+}
+
 @end
@@ -9,6 +9,10 @@
 #import "sqlite3.h"
 
 @class MSDatabase;
+@class MSDatabaseWatchdog;
+@class MSDatabaseCheckout;
+@class MSDatabaseRetryPolicy;
+@class MSDatabaseExpiry;
 
 /** To perform queries and updates on multiple threads, you'll want to use `MSDatabaseQueue`.
 
@@ -65,6 +69,28 @@
     dispatch_queue_t    _queue;
     MSDatabase          *_db;
     int                 _openFlags;
+    
+    NSTimeInterval      _maintenanceInterval;
+    int                 _analysisLimit;
+    BOOL                _optimizesOnClose;
+    dispatch_source_t   _maintenanceTimer;
+    NSTimeInterval      _lastMaintenanceTime;
+    
+    MSDatabaseExpiry    *_expiry;
+    NSTimeInterval      _expiryInterval;
+    dispatch_source_t   _expiryTimer;
+    
+    MSDatabaseWatchdog  *_watchdog;
+    
+    NSArray             *_warmUpObjects;
+    NSArray             *_warmUpQueries;
+    
+    MSDatabaseRetryPolicy *_retryPolicy;
+    
+    BOOL                _loadsIntoMemory;
+    NSTimeInterval      _writeBackInterval;
+    dispatch_source_t   _writeBackTimer;
+    NSError             *_lastWriteBackError;
 }
 
 /** Path of database */
@@ -75,6 +101,68 @@
 
 @property (atomic, readonly) int openFlags;
 
+/** How long the connection must sit idle before the queue runs `PRAGMA optimize` on it; `0`, the default, turns periodic maintenance off.
+ 
+ The queue checks every `maintenanceInterval` seconds. A connection that has not been used since its last maintenance pass, or is inside a transaction or has open result sets, is left alone.
+ 
+ @see [MSDatabase optimizeWithAnalysisLimit:]
+ */
+
+@property (atomic, assign) NSTimeInterval maintenanceInterval;
+
+/** Rules for deleting expired rows, run in small batches every `<expiryInterval>`.
+ 
+ @see MSDatabaseExpiry
+ */
+
+@property (atomic, readonly) MSDatabaseExpiry *expiry;
+
+/** How often `<expiry>` runs a batch for each rule; `0`, the default, turns background expiry off.
+ 
+ Batches run on the queue, between callers' blocks, and are skipped while the connection is inside a transaction or has open result sets. While a rule has a backlog, the next batch follows after about `targetHoldTime`, so that the lock stays free at least half the time; once every rule is caught up, batches go back to this interval.
+ */
+
+@property (atomic, assign) NSTimeInterval expiryInterval;
+
+/** Blocks that keep the connection longer than this many seconds are reported to `<watchdogHandler>`; `0`, the default, turns hold timing off.
+ 
+ Blocks that return with result sets still open are reported whatever the threshold, with the SQL of each open result set.
+ 
+ @see MSDatabaseWatchdog
+ */
+
+@property (atomic, assign) NSTimeInterval longHoldThreshold;
+
+/** Receives watchdog reports; `nil`, the default, logs them as warnings through `<MSDatabaseLogger>`, subject to its level and rate limit. */
+
+@property (atomic, copy) void (^watchdogHandler)(MSDatabaseCheckout *checkout);
+
+/** `PRAGMA analysis_limit` used by periodic maintenance and by `<close>`. Defaults to 400. */
+
+@property (atomic, assign) int analysisLimit;
+
+/** Whether `<close>` runs `PRAGMA optimize` before closing the connection. Defaults to `YES`. */
+
+@property (atomic, assign) BOOL optimizesOnClose;
+
+/** Tables and indexes that `<warmUp:>` reads into the connection's page cache; `nil`, the default, reads none.
+ 
+ @see [MSDatabase preloadObjects:error:]
+ */
+
+@property (atomic, copy) NSArray *warmUpObjects;
+
+/** SQL of hot statements that `<warmUp:>` prepares on the connection, ready for `executeCachedQuery:withArgumentsInArray:` and `executeCachedUpdate:withArgumentsInArray:`.
+ 
+ @see [MSDatabase prepareStatementsForQueries:error:]
+ */
+
+@property (atomic, copy) NSArray *warmUpQueries;
+
+/** How `<inIdempotentTransaction:>` and `<inIdempotentDeferredTransaction:>` retry a transaction that lost a lock; `nil` runs them once, like `<inTransaction:>`. Defaults to a new `<MSDatabaseRetryPolicy>`, whose counters then cover this queue alone. */
+
+@property (atomic, retain) MSDatabaseRetryPolicy *retryPolicy;
+
 ///----------------------------------------------------
 /// @name Initialization, opening, and closing of queue
 ///----------------------------------------------------
@@ -116,6 +204,37 @@
 
 - (instancetype)initWithPath:(NSString*)aPath flags:(int)openFlags;
 
+#if SQLITE_VERSION_NUMBER >= 3036000
+
+/** Create queue whose connection serves every query from a copy of the database in memory.
+ 
+ @param aPath The file path of the database.
+ @param openFlags Flags passed to the openInMemoryWithFlags method of the database
+ 
+ @return The `MSDatabaseQueue` object. `nil` on error.
+ 
+ @see [MSDatabase openInMemoryWithFlags:]
+ @see writeBackInterval
+ */
+
++ (instancetype)databaseQueueInMemoryWithPath:(NSString*)aPath flags:(int)openFlags;
+
+/** Create queue whose connection serves every query from a copy of the database in memory.
+ 
+ Changes are written back to the file by `<writeBackToDisk:>`, every `<writeBackInterval>` seconds if set, and by `<close>`.
+ 
+ @param aPath The file path of the database.
+ @param openFlags Flags passed to the openInMemoryWithFlags method of the database
+ 
+ @return The `MSDatabaseQueue` object. `nil` on error.
+ 
+ @see [MSDatabase openInMemoryWithFlags:]
+ */
+
+- (instancetype)initInMemoryWithPath:(NSString*)aPath flags:(int)openFlags;
+
+#endif
+
 /** Returns the Class of 'MSDatabase' subclass, that will be used to instantiate database object.
  
  Subclasses can override this method to return specified Class of 'MSDatabase' subclass.
@@ -125,10 +244,26 @@
 
 + (Class)databaseClass;
 
-/** Close database used by queue. */
+/** Close database used by queue.
+ 
+ Runs `PRAGMA optimize` first when `<optimizesOnClose>` is set. For a queue created in memory, writes the changes back first; if that fails, the connection stays open with the changes, and an error is logged. Use `<closeWithError:>` to learn about it.
+ */
 
 - (void)close;
 
+/** Close database used by queue, reporting a failed write-back.
+ 
+ For a queue created in memory, changes not yet written back exist only in memory. If writing them back fails, e.g. for lack of disk space, the connection is left open, so that nothing is lost and the close can be retried.
+ 
+ @param outErr On failure, the write-back error.
+ 
+ @return `YES` if the connection was closed; `NO` if it was kept open because the changes could not be written back.
+ 
+ @warning Releasing the queue without closing it drops unwritten changes.
+ */
+
+- (BOOL)closeWithError:(NSError **)outErr;
+
 ///-----------------------------------------------
 /// @name Dispatching database operations to queue
 ///-----------------------------------------------
@@ -140,6 +275,16 @@
 
 - (void)inDatabase:(void (^)(MSDatabase *db))block;
 
+/** Synchronously perform database operations on queue, recording a call-site tag for the watchdog.
+ 
+ @param tag Identifies the caller in watchdog reports; `MSDBCallSiteTag` gives the file, line and method.
+ @param block The code to be run on the queue of `MSDatabaseQueue`
+ 
+ @see longHoldThreshold
+ */
+
+- (void)inDatabaseTagged:(NSString *)tag block:(void (^)(MSDatabase *db))block;
+
 /** Synchronously perform database operations on queue, using transactions.
 
  @param block The code to be run on the queue of `MSDatabaseQueue`
@@ -147,6 +292,16 @@
 
 - (void)inTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
 
+/** Synchronously perform database operations on queue, using transactions, recording a call-site tag for the watchdog.
+ 
+ @param tag Identifies the caller in watchdog reports; `MSDBCallSiteTag` gives the file, line and method.
+ @param block The code to be run on the queue of `MSDatabaseQueue`
+ 
+ @see longHoldThreshold
+ */
+
+- (void)inTransactionTagged:(NSString *)tag block:(void (^)(MSDatabase *db, BOOL *rollback))block;
+
 /** Synchronously perform database operations on queue, using deferred transactions.
 
  @param block The code to be run on the queue of `MSDatabaseQueue`
@@ -154,6 +309,28 @@
 
 - (void)inDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
 
+/** Synchronously perform database operations on queue, using transactions, running the block again if the transaction loses a lock.
+ 
+ If a statement in the transaction fails with `SQLITE_BUSY` or `SQLITE_LOCKED`, the transaction is rolled back and, after a randomized wait with the connection handed back, the block runs again from the start, as `<retryPolicy>` allows. Only use this for blocks that have no effect outside the database, or whose effects are safe to repeat.
+ 
+ @param block The code to be run on the queue of `MSDatabaseQueue`
+ 
+ @return `NO` if the transaction was still contended on its last attempt; `YES` otherwise.
+ */
+
+- (BOOL)inIdempotentTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
+
+/** Synchronously perform database operations on queue, using deferred transactions, running the block again if the transaction loses a lock.
+ 
+ @param block The code to be run on the queue of `MSDatabaseQueue`
+ 
+ @return `NO` if the transaction was still contended on its last attempt; `YES` otherwise.
+ 
+ @see inIdempotentTransaction:
+ */
+
+- (BOOL)inIdempotentDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block;
+
 ///-----------------------------------------------
 /// @name Dispatching database operations to queue
 ///-----------------------------------------------
@@ -169,5 +346,63 @@
 - (NSError*)inSavePoint:(void (^)(MSDatabase *db, BOOL *rollback))block;
 #endif
 
+///---------------------------
+/// @name Planner maintenance
+///---------------------------
+
+/** Synchronously run a full `ANALYZE` on the queue's connection.
+ 
+ Call this after a bulk load, when the statistics `PRAGMA optimize` keeps up to date incrementally are far from the new data.
+ 
+ @return `YES` on success; `NO` on failure.
+ 
+ @see [MSDatabase analyze]
+ */
+
+- (BOOL)analyze;
+
+///--------------
+/// @name Warm-up
+///--------------
+
+/** Synchronously read `<warmUpObjects>` and prepare `<warmUpQueries>` on the queue's connection, so that the first requests after launch do not pay for cold caches.
+ 
+ @param outErr On failure, the first error met.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)warmUp:(NSError **)outErr;
+
+#if SQLITE_VERSION_NUMBER >= 3036000
+
+///-------------------------------
+/// @name Writing back to disk
+///-------------------------------
+
+/** For a queue created in memory, how often changes are written back to the file; `0`, the default, writes back only on `<writeBackToDisk:>` and `<close>`.
+ 
+ The write-back runs on the queue, between blocks, and only when the database changed since the last one. A pass that fails is logged, recorded in `<lastWriteBackError>`, and retried at the next interval.
+ */
+
+@property (atomic, assign) NSTimeInterval writeBackInterval;
+
+/** The error of the last write-back that failed, whether periodic, by `<writeBackToDisk:>` or by `<closeWithError:>`; `nil` once one succeeds. */
+
+@property (atomic, readonly) NSError *lastWriteBackError;
+
+/** Synchronously write the in-memory database back to its file, if it changed.
+ 
+ @param outErr On failure, the error.
+ 
+ @return `YES` if the file is up to date; `NO` if the queue is not in memory or writing failed.
+ 
+ @see [MSDatabase writeBackToDisk:]
+ */
+
+- (BOOL)writeBackToDisk:(NSError **)outErr;
+
+#endif
+
 @end
 
@@ -7,6 +7,9 @@
 
 #import "MSDatabaseQueue.h"
 #import "MSDatabase.h"
+#import "MSDatabaseWatchdog.h"
+#import "MSDatabaseRetryPolicy.h"
+#import "MSDatabaseExpiry.h"
 
 /*
  
@@ -23,10 +26,21 @@
  */
 static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey;
  
+#if SQLITE_VERSION_NUMBER >= 3036000
+@interface MSDatabaseQueue ()
+- (BOOL)writeBackDatabase:(MSDatabase *)db error:(NSError **)outErr;
+@end
+#endif
+
 @implementation MSDatabaseQueue
 
 @synthesize path = _path;
 @synthesize openFlags = _openFlags;
+@synthesize analysisLimit = _analysisLimit;
+@synthesize optimizesOnClose = _optimizesOnClose;
+@synthesize warmUpObjects = _warmUpObjects;
+@synthesize warmUpQueries = _warmUpQueries;
+@synthesize retryPolicy = _retryPolicy;
 
 + (instancetype)databaseQueueWithPath:(NSString*)aPath {
     
@@ -46,11 +60,37 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
     return q;
 }
 
+#if SQLITE_VERSION_NUMBER >= 3036000
++ (instancetype)databaseQueueInMemoryWithPath:(NSString*)aPath flags:(int)openFlags {
+    
+    MSDatabaseQueue *q = [[self alloc] initInMemoryWithPath:aPath flags:openFlags];
+    
+    MSDBAutorelease(q);
+    
+    return q;
+}
+#endif
+
 + (Class)databaseClass {
     return [MSDatabase class];
 }
 
-- (instancetype)initWithPath:(NSString*)aPath flags:(int)openFlags {
+- (BOOL)openDatabase:(MSDatabase *)db {
+    
+#if SQLITE_VERSION_NUMBER >= 3036000
+    if (_loadsIntoMemory) {
+        return [db openInMemoryWithFlags:_openFlags];
+    }
+#endif
+    
+#if SQLITE_VERSION_NUMBER >= 3005000
+    return [db openWithFlags:_openFlags];
+#else
+    return [db open];
+#endif
+}
+
+- (instancetype)initWithPath:(NSString*)aPath flags:(int)openFlags loadIntoMemory:(BOOL)loadIntoMemory {
     
     self = [super init];
     
@@ -59,13 +99,12 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
         _db = [[[self class] databaseClass] databaseWithPath:aPath];
         MSDBRetain(_db);
         
-#if SQLITE_VERSION_NUMBER >= 3005000
-        BOOL success = [_db openWithFlags:openFlags];
-#else
-        BOOL success = [_db open];
-#endif
+        _openFlags = openFlags;
+        _loadsIntoMemory = loadIntoMemory;
+        
+        BOOL success = [self openDatabase:_db];
         if (!success) {
-            NSLog(@"Could not create database queue for path %@", aPath);
+            MSDBLogError(@"Could not create database queue for path %@", aPath);
             MSDBRelease(self);
             return 0x00;
         }
@@ -74,12 +113,26 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
         
         _queue = dispatch_queue_create([[NSString stringWithFormat:@"MSDB.%@", self] UTF8String], NULL);
         dispatch_queue_set_specific(_queue, kDispatchQueueSpecificKey, (__bridge void *)self, NULL);
-        _openFlags = openFlags;
+        _analysisLimit = 400;
+        _optimizesOnClose = YES;
+        _retryPolicy = [[MSDatabaseRetryPolicy alloc] init];
+        _expiry = [[MSDatabaseExpiry alloc] init];
+        _watchdog = [[MSDatabaseWatchdog alloc] initWithName:aPath ? [aPath lastPathComponent] : @":memory:"];
     }
     
     return self;
 }
 
+- (instancetype)initWithPath:(NSString*)aPath flags:(int)openFlags {
+    return [self initWithPath:aPath flags:openFlags loadIntoMemory:NO];
+}
+
+#if SQLITE_VERSION_NUMBER >= 3036000
+- (instancetype)initInMemoryWithPath:(NSString*)aPath flags:(int)openFlags {
+    return [self initWithPath:aPath flags:openFlags loadIntoMemory:YES];
+}
+#endif
+
 - (instancetype)initWithPath:(NSString*)aPath {
     
     // default flags for sqlite3_open
@@ -93,8 +146,39 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
     
 - (void)dealloc {
     
+    // The timers fire on _queue, so once it is drained no handler is running or will run.
+    BOOL hadTimer = _maintenanceTimer || _writeBackTimer || _expiryTimer;
+    
+    if (_maintenanceTimer) {
+        dispatch_source_cancel(_maintenanceTimer);
+        MSDBDispatchQueueRelease(_maintenanceTimer);
+        _maintenanceTimer = 0x00;
+    }
+    
+    if (_writeBackTimer) {
+        dispatch_source_cancel(_writeBackTimer);
+        MSDBDispatchQueueRelease(_writeBackTimer);
+        _writeBackTimer = 0x00;
+    }
+    
+    if (_expiryTimer) {
+        dispatch_source_cancel(_expiryTimer);
+        MSDBDispatchQueueRelease(_expiryTimer);
+        _expiryTimer = 0x00;
+    }
+    
+    if (hadTimer) {
+        dispatch_sync(_queue, ^{});
+    }
+    
     MSDBRelease(_db);
     MSDBRelease(_path);
+    MSDBRelease(_watchdog);
+    MSDBRelease(_warmUpObjects);
+    MSDBRelease(_warmUpQueries);
+    MSDBRelease(_retryPolicy);
+    MSDBRelease(_expiry);
+    MSDBRelease(_lastWriteBackError);
     
     if (_queue) {
         MSDBDispatchQueueRelease(_queue);
@@ -106,26 +190,47 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
 }
 
 - (void)close {
+    [self closeWithError:nil];
+}
+
+- (BOOL)closeWithError:(NSError **)outErr {
+    
+    __block BOOL closed = YES;
+    __block NSError *err = nil;
+    
     MSDBRetain(self);
     dispatch_sync(_queue, ^() {
+        if (self->_optimizesOnClose && self->_db) {
+            [self->_db optimizeWithAnalysisLimit:self->_analysisLimit];
+        }
+#if SQLITE_VERSION_NUMBER >= 3036000
+        // The in-memory copy is all there is of any change since the last write-back: keep it open rather than lose them.
+        if ([self->_db hasUnwrittenChanges] && ![self writeBackDatabase:self->_db error:&err]) {
+            MSDBLogError(@"MSDatabaseQueue kept %@ open: its changes could not be written back (%@)", self->_path, err);
+            closed = NO;
+            return;
+        }
+#endif
         [self->_db close];
         MSDBRelease(_db);
         self->_db = 0x00;
     });
     MSDBRelease(self);
+    
+    if (outErr) {
+        *outErr = err;
+    }
+    
+    return closed;
 }
 
 - (MSDatabase*)database {
     if (!_db) {
         _db = MSDBReturnRetained([MSDatabase databaseWithPath:_path]);
         
-#if SQLITE_VERSION_NUMBER >= 3005000
-        BOOL success = [_db openWithFlags:_openFlags];
-#else
-        BOOL success = [_db open];
-#endif
+        BOOL success = [self openDatabase:_db];
         if (!success) {
-            NSLog(@"MSDatabaseQueue could not reopen database for path %@", _path);
+            MSDBLogError(@"MSDatabaseQueue could not reopen database for path %@", _path);
             MSDBRelease(_db);
             _db  = 0x00;
             return 0x00;
@@ -136,6 +241,10 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
 }
 
 - (void)inDatabase:(void (^)(MSDatabase *db))block {
+    [self inDatabaseTagged:nil block:block];
+}
+
+- (void)inDatabaseTagged:(NSString *)tag block:(void (^)(MSDatabase *db))block {
     /* Get the currently executing queue (which should probably be nil, but in theory could be another DB queue
      * and then check it against self to make sure we're not about to deadlock. */
     MSDatabaseQueue *currentSyncQueue = (__bridge id)dispatch_get_specific(kDispatchQueueSpecificKey);
@@ -146,30 +255,26 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
     dispatch_sync(_queue, ^() {
         
         MSDatabase *db = [self database];
+        MSDatabaseCheckout *checkout = [self->_watchdog beginCheckoutOfDatabase:db tag:tag];
+        
         block(db);
         
-        if ([db hasOpenResultSets]) {
-            NSLog(@"Warning: there is at least one open result set around after performing [MSDatabaseQueue inDatabase:]");
-            
-#if defined(DEBUG) && DEBUG
-            NSSet *openSetCopy = MSDBReturnAutoreleased([[db valueForKey:@"_openResultSets"] copy]);
-            for (NSValue *rsInWrappedInATastyValueMeal in openSetCopy) {
-                MSResultSet *rs = (MSResultSet *)[rsInWrappedInATastyValueMeal pointerValue];
-                NSLog(@"query: '%@'", [rs query]);
-            }
-#endif
-        }
+        [db setLastUseTime:[NSDate timeIntervalSinceReferenceDate]];
+        
+        // Reports a long hold, and any result set left open, with its SQL.
+        [self->_watchdog endCheckout:checkout ofDatabase:db];
     });
     
     MSDBRelease(self);
 }
 
 
-- (void)beginTransaction:(BOOL)useDeferred withBlock:(void (^)(MSDatabase *db, BOOL *rollback))block {
+- (void)beginTransaction:(BOOL)useDeferred tag:(NSString *)tag withBlock:(void (^)(MSDatabase *db, BOOL *rollback))block {
     MSDBRetain(self);
     dispatch_sync(_queue, ^() { 
         
         BOOL shouldRollback = NO;
+        MSDatabaseCheckout *checkout = [self->_watchdog beginCheckoutOfDatabase:[self database] tag:tag];
         
         if (useDeferred) {
             [[self database] beginDeferredTransaction];
@@ -186,17 +291,67 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
         else {
             [[self database] commit];
         }
+        
+        [[self database] setLastUseTime:[NSDate timeIntervalSinceReferenceDate]];
+        [self->_watchdog endCheckout:checkout ofDatabase:[self database]];
     });
     
     MSDBRelease(self);
 }
 
 - (void)inDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
-    [self beginTransaction:YES withBlock:block];
+    [self beginTransaction:YES tag:nil withBlock:block];
 }
 
 - (void)inTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
-    [self beginTransaction:NO withBlock:block];
+    [self beginTransaction:NO tag:nil withBlock:block];
+}
+
+- (void)inTransactionTagged:(NSString *)tag block:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    [self beginTransaction:NO tag:tag withBlock:block];
+}
+
+- (BOOL)beginIdempotentTransaction:(BOOL)useDeferred withBlock:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    
+    MSDatabaseRetryPolicy *retryPolicy = [self retryPolicy];
+    
+    if (!retryPolicy) {
+        [self beginTransaction:useDeferred tag:nil withBlock:block];
+        return YES;
+    }
+    
+    MSDBRetain(self);
+    
+    // Each attempt is a separate trip through the queue, so other blocks run while this one backs off.
+    BOOL success = [retryPolicy runAttempts:^BOOL(BOOL lastAttempt) {
+        
+        __block BOOL contended = NO;
+        
+        dispatch_sync(self->_queue, ^() {
+            
+            MSDatabase *db = [self database];
+            MSDatabaseCheckout *checkout = [self->_watchdog beginCheckoutOfDatabase:db tag:nil];
+            
+            contended = MSDBRunTransactionAttempt(db, useDeferred, !lastAttempt, block);
+            
+            [db setLastUseTime:[NSDate timeIntervalSinceReferenceDate]];
+            [self->_watchdog endCheckout:checkout ofDatabase:db];
+        });
+        
+        return contended;
+    }];
+    
+    MSDBRelease(self);
+    
+    return success;
+}
+
+- (BOOL)inIdempotentTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    return [self beginIdempotentTransaction:NO withBlock:block];
+}
+
+- (BOOL)inIdempotentDeferredTransaction:(void (^)(MSDatabase *db, BOOL *rollback))block {
+    return [self beginIdempotentTransaction:YES withBlock:block];
 }
 
 #if SQLITE_VERSION_NUMBER >= 3007000
@@ -210,6 +365,7 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
         NSString *name = [NSString stringWithFormat:@"savePoint%ld", savePointIdx++];
         
         BOOL shouldRollback = NO;
+        MSDatabaseCheckout *checkout = [self->_watchdog beginCheckoutOfDatabase:[self database] tag:nil];
         
         if ([[self database] startSavePointWithName:name error:&err]) {
             
@@ -222,10 +378,288 @@ static const void * const kDispatchQueueSpecificKey = &kDispatchQueueSpecificKey
             [[self database] releaseSavePointWithName:name error:&err];
             
         }
+        
+        [[self database] setLastUseTime:[NSDate timeIntervalSinceReferenceDate]];
+        [self->_watchdog endCheckout:checkout ofDatabase:[self database]];
     });
     MSDBRelease(self);
     return err;
 }
 #endif
 
+#pragma mark Watchdog
+
+- (NSTimeInterval)longHoldThreshold {
+    return [_watchdog longHoldThreshold];
+}
+
+- (void)setLongHoldThreshold:(NSTimeInterval)longHoldThreshold {
+    [_watchdog setLongHoldThreshold:longHoldThreshold];
+}
+
+- (void (^)(MSDatabaseCheckout *))watchdogHandler {
+    return [_watchdog handler];
+}
+
+- (void)setWatchdogHandler:(void (^)(MSDatabaseCheckout *))watchdogHandler {
+    [_watchdog setHandler:watchdogHandler];
+}
+
+#pragma mark Planner maintenance
+
+- (NSTimeInterval)maintenanceInterval {
+    @synchronized (self) {
+        return _maintenanceInterval;
+    }
+}
+
+- (void)setMaintenanceInterval:(NSTimeInterval)maintenanceInterval {
+    
+    @synchronized (self) {
+        
+        _maintenanceInterval = maintenanceInterval;
+        
+        if (_maintenanceTimer) {
+            dispatch_source_cancel(_maintenanceTimer);
+            MSDBDispatchQueueRelease(_maintenanceTimer);
+            _maintenanceTimer = 0x00;
+        }
+        
+        if (maintenanceInterval <= 0) {
+            return;
+        }
+        
+        // Not retained: the timer would keep the queue alive. dealloc cancels it and drains _queue first.
+        __unsafe_unretained MSDatabaseQueue *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(maintenanceInterval * NSEC_PER_SEC);
+        
+        _maintenanceTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_timer(_maintenanceTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_maintenanceTimer, ^{
+            [unretainedSelf performIdleMaintenance];
+        });
+        dispatch_resume(_maintenanceTimer);
+    }
+}
+
+// Runs on _queue.
+- (void)performIdleMaintenance {
+    
+    MSDatabase *db = _db;
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSTimeInterval lastUse = [db lastUseTime];
+    
+    if (!db || lastUse <= _lastMaintenanceTime || now - lastUse < [self maintenanceInterval]) {
+        return;
+    }
+    
+    if (!sqlite3_get_autocommit([db sqliteHandle]) || [db hasOpenResultSets]) {
+        return;
+    }
+    
+    [db optimizeWithAnalysisLimit:_analysisLimit];
+    _lastMaintenanceTime = now;
+}
+
+#pragma mark TTL expiry
+
+- (MSDatabaseExpiry *)expiry {
+    return _expiry;
+}
+
+- (NSTimeInterval)expiryInterval {
+    @synchronized (self) {
+        return _expiryInterval;
+    }
+}
+
+- (void)setExpiryInterval:(NSTimeInterval)expiryInterval {
+    
+    @synchronized (self) {
+        
+        _expiryInterval = expiryInterval;
+        
+        if (_expiryTimer) {
+            dispatch_source_cancel(_expiryTimer);
+            MSDBDispatchQueueRelease(_expiryTimer);
+            _expiryTimer = 0x00;
+        }
+        
+        if (expiryInterval <= 0) {
+            return;
+        }
+
+        // Not retained: the timer would keep the queue alive. dealloc cancels it and drains _queue first.
+        __unsafe_unretained MSDatabaseQueue *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(expiryInterval * NSEC_PER_SEC);
+        
+        _expiryTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_timer(_expiryTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_expiryTimer, ^{
+            [unretainedSelf performExpiry];
+        });
+        dispatch_resume(_expiryTimer);
+    }
+}
+
+// With a backlog, the next batch comes after about one batch's hold time; otherwise after the regular interval.
+- (void)scheduleNextExpiry:(BOOL)backlogged {
+    
+    @synchronized (self) {
+        
+        if (!_expiryTimer) {
+            return;
+        }
+        
+        uint64_t interval   = (uint64_t)(_expiryInterval * NSEC_PER_SEC);
+        uint64_t delay      = backlogged ? (uint64_t)(MAX([_expiry targetHoldTime], 0.001) * NSEC_PER_SEC) : interval;
+        
+        dispatch_source_set_timer(_expiryTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)delay), interval, interval / 10);
+    }
+}
+
+// Runs on _queue, so between callers' blocks.
+- (void)performExpiry {
+    
+    MSDatabase *db = _db;
+    
+    if (!db || !sqlite3_get_autocommit([db sqliteHandle]) || [db hasOpenResultSets]) {
+        return;
+    }
+    
+    [self scheduleNextExpiry:[_expiry runBatchesInDatabase:db]];
+}
+
+- (BOOL)analyze {
+    
+    __block BOOL success = NO;
+    
+    [self inDatabase:^(MSDatabase *db) {
+        success = [db analyze];
+    }];
+    
+    return success;
+}
+
+#if SQLITE_VERSION_NUMBER >= 3036000
+
+#pragma mark Writing back to disk
+
+- (NSTimeInterval)writeBackInterval {
+    @synchronized (self) {
+        return _writeBackInterval;
+    }
+}
+
+- (void)setWriteBackInterval:(NSTimeInterval)writeBackInterval {
+    
+    @synchronized (self) {
+        
+        _writeBackInterval = writeBackInterval;
+        
+        if (_writeBackTimer) {
+            dispatch_source_cancel(_writeBackTimer);
+            MSDBDispatchQueueRelease(_writeBackTimer);
+            _writeBackTimer = 0x00;
+        }
+        
+        if (writeBackInterval <= 0 || !_loadsIntoMemory) {
+            return;
+        }
+        
+        // Not retained: the timer would keep the queue alive. dealloc cancels it and drains _queue first.
+        __unsafe_unretained MSDatabaseQueue *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(writeBackInterval * NSEC_PER_SEC);
+        
+        _writeBackTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_timer(_writeBackTimer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_writeBackTimer, ^{
+            // Runs on _queue, between blocks; a transaction left open by a block makes it wait for the next pass.
+            MSDatabase *db = unretainedSelf->_db;
+            if ([db hasUnwrittenChanges] && sqlite3_get_autocommit([db sqliteHandle])) {
+                [unretainedSelf writeBackDatabase:db error:nil];
+            }
+        });
+        dispatch_resume(_writeBackTimer);
+    }
+}
+
+- (NSError *)lastWriteBackError {
+    
+    NSError *err;
+    
+    @synchronized (self) {
+        err = MSDBReturnRetained(_lastWriteBackError);
+    }
+    
+    return MSDBReturnAutoreleased(err);
+}
+
+// On _queue. Every write-back goes through here, so that lastWriteBackError tracks the latest one.
+- (BOOL)writeBackDatabase:(MSDatabase *)db error:(NSError **)outErr {
+    
+    NSError *err = nil;
+    BOOL success = [db writeBackToDisk:&err];
+    
+    @synchronized (self) {
+        MSDBRelease(_lastWriteBackError);
+        _lastWriteBackError = nil;
+        if (!success) {
+            _lastWriteBackError = MSDBReturnRetained(err);
+        }
+    }
+    
+    if (outErr) {
+        *outErr = err;
+    }
+    
+    return success;
+}
+
+- (BOOL)writeBackToDisk:(NSError **)outErr {
+    
+    __block BOOL success = NO;
+    __block NSError *err = nil;
+    
+    [self inDatabase:^(MSDatabase *db) {
+        NSError *writeBackError = nil;
+        success = [db isLoadedIntoMemory] && (![db hasUnwrittenChanges] || [self writeBackDatabase:db error:&writeBackError]);
+        err = MSDBReturnRetained(writeBackError);
+    }];
+    
+    if (outErr) {
+        *outErr = err;
+    }
+    
+    MSDBAutorelease(err);
+    
+    return success;
+}
+
+#endif
+
+#pragma mark Warm-up
+
+- (BOOL)warmUp:(NSError **)outErr {
+    
+    NSArray *objects = [self warmUpObjects];
+    NSArray *queries = [self warmUpQueries];
+    __block BOOL success = NO;
+    __block NSError *err = nil;
+    
+    [self inDatabase:^(MSDatabase *db) {
+        NSError *warmUpError = nil;
+        success = db && (!objects || [db preloadObjects:objects error:&warmUpError]) && [db prepareStatementsForQueries:queries error:&warmUpError];
+        err = MSDBReturnRetained(warmUpError);
+    }];
+    
+    if (outErr) {
+        *outErr = err;
+    }
+    
+    MSDBAutorelease(err);
+    
+    return success;
+}
+
 @end
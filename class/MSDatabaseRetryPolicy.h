@@ -0,0 +1,109 @@
+//
+//  MSDatabaseRetryPolicy.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MSDatabase;
+
+/** How `<[MSDatabaseQueue inIdempotentTransaction:]>` and `<[MSDatabasePool inIdempotentTransaction:]>` re-run a transaction that lost a lock.
+
+ When the busy handler gives up, the statement that waited fails with `SQLITE_BUSY` or `SQLITE_LOCKED`, and so does, sooner or later, the transaction around it. For a block that can safely run more than once, the queue or pool rolls the whole transaction back, waits, and runs the block again, up to `<maximumAttempts>` times. Contention then shows up as latency rather than as failed writes.
+
+ A transaction counts as contended when any statement in it, including `BEGIN` and `COMMIT`, fails with `SQLITE_BUSY` or `SQLITE_LOCKED`; see `<[MSDatabase contentionCount]>`. It is retried even if the block set `rollback`, since that is usually how a block reports a failed statement.
+
+ The wait before retry `n` is drawn at random between half and all of `<initialBackoff>` × `<backoffMultiplier>`^(n-1), capped at `<maximumBackoff>`, so that writers that collided do not collide again in lockstep. The connection is handed back while waiting.
+
+ A policy keeps counters of what it did, and may be shared between queues and pools.
+ */
+
+@interface MSDatabaseRetryPolicy : NSObject {
+    NSUInteger          _maximumAttempts;
+    NSTimeInterval      _initialBackoff;
+    NSTimeInterval      _maximumBackoff;
+    double              _backoffMultiplier;
+    
+    unsigned long long  _transactions;
+    unsigned long long  _retries;
+    unsigned long long  _recoveredTransactions;
+    unsigned long long  _exhaustedTransactions;
+    NSTimeInterval      _backoffTime;
+}
+
+/** Create a policy with the default settings.
+
+ @return The `MSDatabaseRetryPolicy` object.
+ */
+
++ (instancetype)retryPolicy;
+
+/** Attempts, including the first, before a contended transaction is left to fail. The last attempt commits or rolls back as `<[MSDatabaseQueue inTransaction:]>` would. Defaults to 5. */
+
+@property (atomic, assign) NSUInteger maximumAttempts;
+
+/** Longest wait before the first retry, in seconds. Defaults to 0.01. */
+
+@property (atomic, assign) NSTimeInterval initialBackoff;
+
+/** Longest wait before any retry, in seconds. Defaults to 1. */
+
+@property (atomic, assign) NSTimeInterval maximumBackoff;
+
+/** Growth of the wait from one retry to the next. Defaults to 2. */
+
+@property (atomic, assign) double backoffMultiplier;
+
+/** Transactions run under the policy */
+
+@property (atomic, readonly) unsigned long long transactions;
+
+/** Attempts after the first, over all transactions */
+
+@property (atomic, readonly) unsigned long long retries;
+
+/** Transactions that were contended, then went through on a later attempt */
+
+@property (atomic, readonly) unsigned long long recoveredTransactions;
+
+/** Transactions still contended on their last attempt */
+
+@property (atomic, readonly) unsigned long long exhaustedTransactions;
+
+/** Time spent waiting between attempts, in seconds */
+
+@property (atomic, readonly) NSTimeInterval backoffTime;
+
+/** Zero the counters. */
+
+- (void)resetStatistics;
+
+/** Wait before a retry.
+
+ @param retry `1` for the first retry.
+
+ @return A randomized wait, in seconds.
+ */
+
+- (NSTimeInterval)backoffBeforeRetry:(NSUInteger)retry;
+
+/** Run attempts until one is not contended or `<maximumAttempts>` is reached, waiting between them, and count the outcome.
+
+ @param attempt Runs one attempt; `lastAttempt` is `YES` when it will not be retried. Returns `YES` if the attempt was contended.
+
+ @return `YES` if the last attempt run was not contended.
+ */
+
+- (BOOL)runAttempts:(BOOL (^)(BOOL lastAttempt))attempt;
+
+@end
+
+
+/* One attempt of an idempotent transaction: begin, run the block, then commit or roll back. Returns YES if the
+   transaction was contended; when retryable, it is then rolled back whatever the block asked for.
+   Used by MSDatabaseQueue and MSDatabasePool; not meant to be called directly. */
+
+BOOL MSDBRunTransactionAttempt(MSDatabase *db, BOOL useDeferred, BOOL retryable, void (^block)(MSDatabase *db, BOOL *rollback));
@@ -0,0 +1,168 @@
+//
+//  MSDatabaseRetryPolicy.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseRetryPolicy.h"
+#import "MSDatabase.h"
+#import "unistd.h"
+
+BOOL MSDBRunTransactionAttempt(MSDatabase *db, BOOL useDeferred, BOOL retryable, void (^block)(MSDatabase *db, BOOL *rollback)) {
+    
+    BOOL shouldRollback = NO;
+    unsigned long long contentionCount = [db contentionCount];
+    
+    BOOL began = useDeferred ? [db beginDeferredTransaction] : [db beginTransaction];
+    
+    // BEGIN EXCLUSIVE could not get its lock: nothing has run yet.
+    if (!began && [db contentionCount] != contentionCount && retryable) {
+        return YES;
+    }
+    
+    block(db, &shouldRollback);
+    
+    BOOL contended = ([db contentionCount] != contentionCount);
+    
+    if (shouldRollback || (contended && retryable)) {
+        [db rollback];
+        return contended;
+    }
+    
+    [db commit];
+    
+    contended = ([db contentionCount] != contentionCount);
+    
+    // A COMMIT that got SQLITE_BUSY leaves the transaction open.
+    if (contended && !sqlite3_get_autocommit([db sqliteHandle])) {
+        [db rollback];
+    }
+    
+    return contended;
+}
+
+@implementation MSDatabaseRetryPolicy
+
+@synthesize maximumAttempts=_maximumAttempts;
+@synthesize initialBackoff=_initialBackoff;
+@synthesize maximumBackoff=_maximumBackoff;
+@synthesize backoffMultiplier=_backoffMultiplier;
+
++ (instancetype)retryPolicy {
+    return MSDBReturnAutoreleased([[self alloc] init]);
+}
+
+- (instancetype)init {
+    
+    self = [super init];
+    
+    if (self) {
+        _maximumAttempts    = 5;
+        _initialBackoff     = 0.01;
+        _maximumBackoff     = 1;
+        _backoffMultiplier  = 2;
+    }
+    
+    return self;
+}
+
+- (unsigned long long)transactions {
+    @synchronized(self) {
+        return _transactions;
+    }
+}
+
+- (unsigned long long)retries {
+    @synchronized(self) {
+        return _retries;
+    }
+}
+
+- (unsigned long long)recoveredTransactions {
+    @synchronized(self) {
+        return _recoveredTransactions;
+    }
+}
+
+- (unsigned long long)exhaustedTransactions {
+    @synchronized(self) {
+        return _exhaustedTransactions;
+    }
+}
+
+- (NSTimeInterval)backoffTime {
+    @synchronized(self) {
+        return _backoffTime;
+    }
+}
+
+- (void)resetStatistics {
+    @synchronized(self) {
+        _transactions           = 0;
+        _retries                = 0;
+        _recoveredTransactions  = 0;
+        _exhaustedTransactions  = 0;
+        _backoffTime            = 0;
+    }
+}
+
+- (NSTimeInterval)backoffBeforeRetry:(NSUInteger)retry {
+    
+    NSTimeInterval ceiling = [self initialBackoff] * pow(MAX([self backoffMultiplier], 1), (double)(MAX(retry, 1) - 1));
+    ceiling = MIN(ceiling, [self maximumBackoff]);
+    
+    // Between half and all of the ceiling: always some backoff, never in lockstep.
+    return ceiling / 2 + (ceiling / 2) * ((double)arc4random() / UINT32_MAX);
+}
+
+- (BOOL)runAttempts:(BOOL (^)(BOOL lastAttempt))attempt {
+    
+    NSUInteger maximumAttempts = MAX([self maximumAttempts], 1);
+    NSUInteger attempts = 0;
+    NSTimeInterval waited = 0;
+    BOOL contended;
+    
+    for (;;) {
+        
+        attempts++;
+        
+        BOOL lastAttempt = (attempts >= maximumAttempts);
+        
+        contended = attempt(lastAttempt);
+        
+        if (!contended || lastAttempt) {
+            break;
+        }
+        
+        NSTimeInterval backoff = [self backoffBeforeRetry:attempts];
+        
+        MSDBLogInfo(@"Transaction lost a lock; retrying in %.0fms (attempt %lu of %lu)", backoff * 1000, (unsigned long)attempts + 1, (unsigned long)maximumAttempts);
+        
+        usleep((useconds_t)(backoff * USEC_PER_SEC));
+        waited += backoff;
+    }
+    
+    if (contended) {
+        MSDBLogWarning(@"Transaction still contended after %lu attempts", (unsigned long)attempts);
+    }
+    
+    @synchronized(self) {
+        
+        _transactions++;
+        _retries += attempts - 1;
+        _backoffTime += waited;
+        
+        if (contended) {
+            _exhaustedTransactions++;
+        }
+        else if (attempts > 1) {
+            _recoveredTransactions++;
+        }
+    }
+    
+    return !contended;
+}
+
+@end
@@ -0,0 +1,232 @@
+//  MSDatabaseSession.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "sqlite3.h"
+
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+
+@class MSDatabase;
+@class MSDBChangesetConflict;
+
+/** Why `<[MSDatabase applyChangeset:conflictHandler:error:]>` could not apply a change as recorded */
+
+typedef NS_ENUM(int, MSDBChangesetConflictType) {
+    /** The row to update or delete exists, but its values are not those the change was recorded against */
+    MSDBChangesetConflictTypeData       = SQLITE_CHANGESET_DATA,
+    /** The row to update or delete does not exist */
+    MSDBChangesetConflictTypeNotFound   = SQLITE_CHANGESET_NOTFOUND,
+    /** The row to insert has the primary key of an existing row */
+    MSDBChangesetConflictTypeConflict   = SQLITE_CHANGESET_CONFLICT,
+    /** The change violates a `UNIQUE`, `CHECK` or `NOT NULL` constraint */
+    MSDBChangesetConflictTypeConstraint = SQLITE_CHANGESET_CONSTRAINT,
+    /** Once every change is applied, foreign keys are violated; the conflict has no row */
+    MSDBChangesetConflictTypeForeignKey = SQLITE_CHANGESET_FOREIGN_KEY,
+};
+
+/** What to do with a change that conflicts */
+
+typedef NS_ENUM(int, MSDBChangesetConflictResolution) {
+    /** Skip the change */
+    MSDBChangesetConflictResolutionOmit     = SQLITE_CHANGESET_OMIT,
+    /** Write the change over the conflicting row; only for `Data` and `Conflict` conflicts */
+    MSDBChangesetConflictResolutionReplace  = SQLITE_CHANGESET_REPLACE,
+    /** Stop, and roll back every change applied so far */
+    MSDBChangesetConflictResolutionAbort    = SQLITE_CHANGESET_ABORT,
+};
+
+/** Block deciding the fate of each change `<[MSDatabase applyChangeset:conflictHandler:error:]>` cannot apply as recorded. */
+
+typedef MSDBChangesetConflictResolution (^MSDBChangesetConflictHandler)(MSDBChangesetConflict *conflict);
+
+/** Records the changes made to some tables through one connection, to replay them on another database.
+
+ Syncing by comparing tables costs as much as the tables are large. A session instead hooks into the connection and notes, for each row written, its primary key and its values before and after; extracting a changeset then costs as much as the rows changed since the session started. A row changed many times is recorded once, with its first and last values, and a row inserted then deleted not at all.
+
+    MSDatabaseSession *session = [db startSessionForTables:@[@"notes", @"tags"] error:&err];
+
+    [db executeUpdate:@"update notes set body = ? where id = ?", body, noteID];
+    …
+
+    NSData *changes = [session patchset:&err];
+    [session close];
+
+    // On the other side:
+    [replica applyChangeset:changes conflictHandler:^MSDBChangesetConflictResolution(MSDBChangesetConflict *conflict) {
+        return conflict.type == MSDBChangesetConflictTypeData ? MSDBChangesetConflictResolutionReplace : MSDBChangesetConflictResolutionOmit;
+    } error:&err];
+
+ A changeset carries the old values of every changed row, so that conflicts are detected on the values, and can be inverted. A patchset carries only the primary key of deleted rows and the new values of updated columns: it is smaller, and enough when the replica follows the source, but conflicts are only detected on primary keys.
+
+ Only tables with an explicit `PRIMARY KEY` are recorded. Sessions need SQLite built with `SQLITE_ENABLE_SESSION` and `SQLITE_ENABLE_PREUPDATE_HOOK`; without them, this class and the `MSDatabase` methods using it are left out.
+
+ A session must be used on the thread, queue or pool checkout using its connection. Closing the connection closes its sessions.
+
+ ### See also
+
+ - `<[MSDatabase startSessionForTables:error:]>`
+ - `<[MSDatabase applyChangeset:conflictHandler:error:]>`
+ */
+
+@interface MSDatabaseSession : NSObject {
+    MSDatabase          *_database;
+    NSString            *_schema;
+    sqlite3_session     *_session;
+}
+
+/** The connection whose changes are recorded; `nil` once closed */
+
+@property (atomic, readonly) MSDatabase *database;
+
+/** The attached database recorded, e.g. `@"main"` */
+
+@property (atomic, readonly) NSString *schema;
+
+/** Whether changes are being recorded. Turn it off to make changes that should not be synced; changes recorded so far are kept. Defaults to `YES`. */
+
+@property (atomic, assign, getter=isEnabled) BOOL enabled;
+
+/** Whether changes recorded from now on are flagged as indirect, e.g. those made by triggers you will replay yourself on the other side. Defaults to `NO`. */
+
+@property (atomic, assign, getter=isIndirect) BOOL indirect;
+
+/** Whether no change has been recorded; cheap, unlike extracting a changeset */
+
+@property (atomic, readonly, getter=isEmpty) BOOL empty;
+
+/** Start recording a table.
+
+ @param table The table; `nil` records every table of `<schema>`, including those created later.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)attachTable:(NSString *)table error:(NSError **)outErr;
+
+/** The changes recorded so far, as a changeset.
+
+ The session goes on recording; each changeset holds every change since the session started.
+
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return The changeset, empty if nothing changed; `nil` on failure.
+ */
+
+- (NSData *)changeset:(NSError **)outErr;
+
+/** The changes recorded so far, as a patchset.
+
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return The patchset, empty if nothing changed; `nil` on failure.
+ */
+
+- (NSData *)patchset:(NSError **)outErr;
+
+/** Stop recording and free what was recorded. Called by `dealloc` and when the connection closes. */
+
+- (void)close;
+
+/** Combine changesets, or patchsets, into one, as if their changes had been recorded by a single session.
+
+ A row changed in several of them appears once, which makes batches of small changesets smaller to send and faster to apply.
+
+ @param changesets `NSData` changesets, oldest first; all changesets or all patchsets.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return The combined changeset; `nil` on failure.
+ */
+
++ (NSData *)concatenateChangesets:(NSArray *)changesets error:(NSError **)outErr;
+
+/** Invert a changeset: inserts become deletes, deletes inserts, and updates swap their old and new values. Applying the inverse undoes the changes.
+
+ @param changeset The changeset; patchsets cannot be inverted.
+ @param outErr Receives the error on failure; may be `nil`.
+
+ @return The inverse; `nil` on failure.
+ */
+
++ (NSData *)invertChangeset:(NSData *)changeset error:(NSError **)outErr;
+
+@end
+
+
+/** One change that `<[MSDatabase applyChangeset:conflictHandler:error:]>` could not apply as recorded, passed to its conflict handler.
+
+ The values are read from the changeset being applied, and can only be read inside the handler.
+ */
+
+@interface MSDBChangesetConflict : NSObject {
+    sqlite3_changeset_iter      *_iterator;
+    MSDBChangesetConflictType   _type;
+    NSString                    *_table;
+    int                         _columnCount;
+    int                         _operation;
+    BOOL                        _indirect;
+    int                         _foreignKeyViolations;
+}
+
+/** Why the change could not be applied */
+
+@property (atomic, readonly) MSDBChangesetConflictType type;
+
+/** The table changed; `nil` for a `ForeignKey` conflict */
+
+@property (atomic, readonly) NSString *table;
+
+/** Number of columns of the table, as recorded */
+
+@property (atomic, readonly) int columnCount;
+
+/** `SQLITE_INSERT`, `SQLITE_UPDATE` or `SQLITE_DELETE` */
+
+@property (atomic, readonly) int operation;
+
+/** Whether the change was recorded as indirect; see `<[MSDatabaseSession indirect]>` */
+
+@property (atomic, readonly, getter=isIndirect) BOOL indirect;
+
+/** Number of foreign key constraints left violated, for a `ForeignKey` conflict; `0` otherwise */
+
+@property (atomic, readonly) int foreignKeyViolations;
+
+/** Indexes of the table's primary key columns */
+
+@property (atomic, readonly) NSIndexSet *primaryKeyColumns;
+
+/** A column's value before the change, for updates and deletes.
+
+ @param columnIdx The column index.
+
+ @return `NSNumber`, `NSString`, `NSData`, or `NSNull` for `NULL`; `nil` if the changeset has no old value for the column, as for columns an update did not change.
+ */
+
+- (id)valueBeforeChangeAtIndex:(int)columnIdx;
+
+/** A column's value after the change, for inserts and updates.
+
+ @param columnIdx The column index.
+
+ @return `NSNumber`, `NSString`, `NSData`, or `NSNull` for `NULL`; `nil` if the changeset has no new value for the column, as for columns an update did not change.
+ */
+
+- (id)valueAfterChangeAtIndex:(int)columnIdx;
+
+/** A column's value in the row already in the database, for `Data` and `Conflict` conflicts.
+
+ @param columnIdx The column index.
+
+ @return `NSNumber`, `NSString`, `NSData`, or `NSNull` for `NULL`; `nil` for other conflicts.
+ */
+
+- (id)conflictingValueAtIndex:(int)columnIdx;
+
+@end
+
+#endif
@@ -0,0 +1,383 @@
+//  MSDatabaseSession.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseSession.h"
+#import "MSDatabase.h"
+
+#if defined(SQLITE_ENABLE_SESSION) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+
+@interface MSDatabase ()
+- (void)sessionDidClose:(MSDatabaseSession *)session;
+@end
+
+@interface MSDatabaseSession ()
+- (instancetype)initWithDatabase:(MSDatabase *)db schema:(NSString *)schema error:(NSError **)outErr;
+@end
+
+@interface MSDBChangesetConflict ()
+- (instancetype)initWithIterator:(sqlite3_changeset_iter *)iterator type:(MSDBChangesetConflictType)type;
+- (void)invalidate;
+@end
+
+static NSError *MSDBSessionError(int rc, NSString *message) {
+    
+    NSString *description = [NSString stringWithFormat:@"%@: %s", message, sqlite3_errstr(rc)];
+    
+    return [NSError errorWithDomain:@"MSDatabase" code:rc userInfo:[NSDictionary dictionaryWithObject:description forKey:NSLocalizedDescriptionKey]];
+}
+
+// Copies out a changeset's buffer, which SQLite allocated, and frees it.
+static NSData *MSDBSessionDataWithBuffer(void *buffer, int length) {
+    
+    NSData *data = [NSData dataWithBytes:buffer length:(NSUInteger)length];
+    
+    sqlite3_free(buffer);
+    
+    return data;
+}
+
+static id MSDBSessionObjectForValue(sqlite3_value *value) {
+    
+    if (!value) {
+        return nil;
+    }
+    
+    switch (sqlite3_value_type(value)) {
+        case SQLITE_INTEGER:
+            return [NSNumber numberWithLongLong:sqlite3_value_int64(value)];
+        case SQLITE_FLOAT:
+            return [NSNumber numberWithDouble:sqlite3_value_double(value)];
+        case SQLITE_TEXT: {
+            NSString *string = [[NSString alloc] initWithBytes:sqlite3_value_text(value) length:(NSUInteger)sqlite3_value_bytes(value) encoding:NSUTF8StringEncoding];
+            return MSDBReturnAutoreleased(string);
+        }
+        case SQLITE_BLOB:
+            return [NSData dataWithBytes:sqlite3_value_blob(value) length:(NSUInteger)sqlite3_value_bytes(value)];
+        default:
+            return [NSNull null];
+    }
+}
+
+@implementation MSDatabaseSession
+
+@synthesize database=_database;
+@synthesize schema=_schema;
+
+- (instancetype)initWithDatabase:(MSDatabase *)db schema:(NSString *)schema error:(NSError **)outErr {
+    
+    self = [super init];
+    
+    if (self) {
+        
+        int rc = sqlite3session_create([db sqliteHandle], [schema UTF8String], &_session);
+        
+        if (rc != SQLITE_OK) {
+            MSDBLogError(@"Could not start a session on %@: %s", schema, sqlite3_errstr(rc));
+            if (outErr) {
+                *outErr = MSDBSessionError(rc, @"Could not start a session");
+            }
+            MSDBRelease(self);
+            return nil;
+        }
+        
+        _database   = MSDBReturnRetained(db);
+        _schema     = [schema copy];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    [self close];
+    MSDBRelease(_schema);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (BOOL)isEnabled {
+    return _session && sqlite3session_enable(_session, -1);
+}
+
+- (void)setEnabled:(BOOL)enabled {
+    if (_session) {
+        sqlite3session_enable(_session, enabled ? 1 : 0);
+    }
+}
+
+- (BOOL)isIndirect {
+    return _session && sqlite3session_indirect(_session, -1);
+}
+
+- (void)setIndirect:(BOOL)indirect {
+    if (_session) {
+        sqlite3session_indirect(_session, indirect ? 1 : 0);
+    }
+}
+
+- (BOOL)isEmpty {
+    return !_session || sqlite3session_isempty(_session);
+}
+
+- (BOOL)attachTable:(NSString *)table error:(NSError **)outErr {
+    
+    if (!_session) {
+        if (outErr) {
+            *outErr = MSDBSessionError(SQLITE_MISUSE, @"The session is closed");
+        }
+        return NO;
+    }
+    
+    int rc = sqlite3session_attach(_session, [table UTF8String]);
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"Could not record table %@: %s", table, sqlite3_errstr(rc));
+        if (outErr) {
+            *outErr = MSDBSessionError(rc, @"Could not record table");
+        }
+        return NO;
+    }
+    
+    return YES;
+}
+
+- (NSData *)changeset:(NSError **)outErr {
+    
+    if (!_session) {
+        if (outErr) {
+            *outErr = MSDBSessionError(SQLITE_MISUSE, @"The session is closed");
+        }
+        return nil;
+    }
+    
+    int length      = 0;
+    void *buffer    = NULL;
+    int rc          = sqlite3session_changeset(_session, &length, &buffer);
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"Could not extract a changeset: %s", sqlite3_errstr(rc));
+        if (outErr) {
+            *outErr = MSDBSessionError(rc, @"Could not extract a changeset");
+        }
+        return nil;
+    }
+    
+    return MSDBSessionDataWithBuffer(buffer, length);
+}
+
+- (NSData *)patchset:(NSError **)outErr {
+    
+    if (!_session) {
+        if (outErr) {
+            *outErr = MSDBSessionError(SQLITE_MISUSE, @"The session is closed");
+        }
+        return nil;
+    }
+    
+    int length      = 0;
+    void *buffer    = NULL;
+    int rc          = sqlite3session_patchset(_session, &length, &buffer);
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"Could not extract a patchset: %s", sqlite3_errstr(rc));
+        if (outErr) {
+            *outErr = MSDBSessionError(rc, @"Could not extract a patchset");
+        }
+        return nil;
+    }
+    
+    return MSDBSessionDataWithBuffer(buffer, length);
+}
+
+- (void)close {
+    
+    if (!_session) {
+        return;
+    }
+    
+    sqlite3session_delete(_session);
+    _session = 0x00;
+    
+    [_database sessionDidClose:self];
+    MSDBRelease(_database);
+    _database = nil;
+}
+
++ (NSData *)concatenateChangesets:(NSArray *)changesets error:(NSError **)outErr {
+    
+    sqlite3_changegroup *group = NULL;
+    int rc = sqlite3changegroup_new(&group);
+    
+    for (NSData *changeset in changesets) {
+        if (rc != SQLITE_OK) {
+            break;
+        }
+        rc = sqlite3changegroup_add(group, (int)[changeset length], (void *)[changeset bytes]);
+    }
+    
+    int length      = 0;
+    void *buffer    = NULL;
+    
+    if (rc == SQLITE_OK) {
+        rc = sqlite3changegroup_output(group, &length, &buffer);
+    }
+    
+    sqlite3changegroup_delete(group);
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"Could not concatenate changesets: %s", sqlite3_errstr(rc));
+        if (outErr) {
+            *outErr = MSDBSessionError(rc, @"Could not concatenate changesets");
+        }
+        return nil;
+    }
+    
+    return MSDBSessionDataWithBuffer(buffer, length);
+}
+
++ (NSData *)invertChangeset:(NSData *)changeset error:(NSError **)outErr {
+    
+    int length      = 0;
+    void *buffer    = NULL;
+    int rc          = sqlite3changeset_invert((int)[changeset length], [changeset bytes], &length, &buffer);
+    
+    if (rc != SQLITE_OK) {
+        MSDBLogError(@"Could not invert a changeset: %s", sqlite3_errstr(rc));
+        if (outErr) {
+            *outErr = MSDBSessionError(rc, @"Could not invert a changeset");
+        }
+        return nil;
+    }
+    
+    return MSDBSessionDataWithBuffer(buffer, length);
+}
+
+@end
+
+
+@implementation MSDBChangesetConflict
+
+@synthesize type=_type;
+@synthesize table=_table;
+@synthesize columnCount=_columnCount;
+@synthesize operation=_operation;
+@synthesize indirect=_indirect;
+@synthesize foreignKeyViolations=_foreignKeyViolations;
+
+- (instancetype)initWithIterator:(sqlite3_changeset_iter *)iterator type:(MSDBChangesetConflictType)type {
+    
+    self = [super init];
+    
+    if (self) {
+        
+        _iterator   = iterator;
+        _type       = type;
+        
+        if (type == MSDBChangesetConflictTypeForeignKey) {
+            // The iterator is past the last change; it only knows how many constraints fail.
+            sqlite3changeset_fk_conflicts(iterator, &_foreignKeyViolations);
+        }
+        else {
+            const char *table   = NULL;
+            int indirect        = 0;
+            
+            sqlite3changeset_op(iterator, &table, &_columnCount, &_operation, &indirect);
+            
+            _table      = table ? [[NSString alloc] initWithUTF8String:table] : nil;
+            _indirect   = indirect != 0;
+        }
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_table);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ type %d on %@, operation %d", [super description], _type, _table, _operation];
+}
+
+// The iterator belongs to sqlite3changeset_apply, and is gone once the handler returns.
+- (void)invalidate {
+    _iterator = 0x00;
+}
+
+- (BOOL)hasRow {
+    
+    if (!_iterator) {
+        MSDBLogWarning(@"Changeset conflict values can only be read inside the conflict handler");
+        return NO;
+    }
+    
+    return _type != MSDBChangesetConflictTypeForeignKey;
+}
+
+- (NSIndexSet *)primaryKeyColumns {
+    
+    NSMutableIndexSet *columns = [NSMutableIndexSet indexSet];
+    
+    if (![self hasRow]) {
+        return columns;
+    }
+    
+    unsigned char *primaryKey   = NULL;
+    int columnCount             = 0;
+    
+    if (sqlite3changeset_pk(_iterator, &primaryKey, &columnCount) == SQLITE_OK) {
+        for (int i = 0; i < columnCount; i++) {
+            if (primaryKey[i]) {
+                [columns addIndex:(NSUInteger)i];
+            }
+        }
+    }
+    
+    return columns;
+}
+
+- (id)valueBeforeChangeAtIndex:(int)columnIdx {
+    
+    sqlite3_value *value = NULL;
+    
+    if (![self hasRow] || _operation == SQLITE_INSERT || columnIdx < 0 || columnIdx >= _columnCount) {
+        return nil;
+    }
+    
+    return sqlite3changeset_old(_iterator, columnIdx, &value) == SQLITE_OK ? MSDBSessionObjectForValue(value) : nil;
+}
+
+- (id)valueAfterChangeAtIndex:(int)columnIdx {
+    
+    sqlite3_value *value = NULL;
+    
+    if (![self hasRow] || _operation == SQLITE_DELETE || columnIdx < 0 || columnIdx >= _columnCount) {
+        return nil;
+    }
+    
+    return sqlite3changeset_new(_iterator, columnIdx, &value) == SQLITE_OK ? MSDBSessionObjectForValue(value) : nil;
+}
+
+- (id)conflictingValueAtIndex:(int)columnIdx {
+    
+    sqlite3_value *value = NULL;
+    
+    if (![self hasRow] || (_type != MSDBChangesetConflictTypeData && _type != MSDBChangesetConflictTypeConflict) || columnIdx < 0 || columnIdx >= _columnCount) {
+        return nil;
+    }
+    
+    return sqlite3changeset_conflict(_iterator, columnIdx, &value) == SQLITE_OK ? MSDBSessionObjectForValue(value) : nil;
+}
+
+@end
+
+#endif
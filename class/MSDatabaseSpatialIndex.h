@@ -0,0 +1,113 @@
+//  MSDatabaseSpatialIndex.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "MSDatabase.h"
+
+
+/** Category of R*Tree spatial index helpers for `<MSDatabase>` class.
+ 
+ A spatial index is a 2-dimensional [R*Tree](https://www.sqlite.org/rtree.html) virtual table holding one bounding box per row of an ordinary table, kept in sync by triggers. A box query then descends the tree instead of scanning the table with four range predicates. Only the `rtree` module built into stock SQLite is used.
+ 
+ The columns of the table are given as an array of four names, in the order min X, max X, min Y, max Y. For points, repeat the coordinate columns:
+ 
+    [db createSpatialIndex:@"places_rtree" onTable:@"places" columns:@[@"lon", @"lon", @"lat", @"lat"] error:&err];
+ 
+    MSResultSet *rs = [db searchSpatialIndex:@"places_rtree" intersectingMinX:2.2 maxX:2.5 minY:48.8 maxY:48.9 limit:500];
+    while ([rs next]) {
+        sqlite_int64 placeID = [rs longLongIntForColumnIndex:0];
+    }
+ 
+ The R*Tree stores 32-bit floats, rounded outward, so results are candidates whose exact coordinates may fall just outside the query box. Re-check them against the table when that matters.
+ 
+ ### See also
+
+ - `<MSDatabase>`
+ */
+
+@interface MSDatabase (MSDatabaseSpatialIndex)
+
+///------------------------------
+/// @name Creating spatial indexes
+///------------------------------
+
+/** Create an R*Tree index over a table's coordinate columns, kept current by triggers.
+ 
+ Creates the R*Tree `indexName` with columns `id`, `minX`, `maxX`, `minY`, `maxY`, and `AFTER INSERT`, `AFTER UPDATE` and `AFTER DELETE` triggers on `tableName`. Rows with a `NULL` coordinate are left out of the index. If the index did not exist yet, existing rows are loaded with `<bulkLoadSpatialIndex:onTable:columns:error:>`.
+ 
+ @param indexName The name of the R*Tree table to create.
+ @param tableName The table whose rows are indexed; its `rowid` is the R*Tree `id`.
+ @param columns The names of the min X, max X, min Y and max Y columns of `tableName`.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)createSpatialIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns error:(NSError **)outErr;
+
+/** Drop an index created by `<createSpatialIndex:onTable:columns:error:>` together with its triggers.
+ 
+ @param indexName The name of the R*Tree table.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)dropSpatialIndex:(NSString *)indexName error:(NSError **)outErr;
+
+/** Reload an index from its table in Hilbert curve order.
+ 
+ An R*Tree filled in arbitrary order ends up with overlapping nodes, and a query has to descend into several of them. Inserting boxes sorted along a Hilbert curve through their centres puts neighbours into the same leaves, which gives tightly packed, barely overlapping nodes and fewer pages read per query.
+ 
+ Every row of the table is read and sorted in memory (about 48 bytes per row), then the index is cleared and the boxes inserted through a cached statement. All of it runs inside one savepoint, which joins the caller's transaction if there is one, so a failure leaves the index as it was.
+ 
+ @param indexName The name of the R*Tree table.
+ @param tableName The indexed table.
+ @param columns The names of the min X, max X, min Y and max Y columns, as passed when the index was created.
+ @param outErr Receives the error on failure; may be `nil`.
+ 
+ @return `YES` on success; `NO` on failure.
+ */
+
+- (BOOL)bulkLoadSpatialIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns error:(NSError **)outErr;
+
+///------------------
+/// @name Searching
+///------------------
+
+/** Rows whose box intersects a query box.
+ 
+ Runs through a cached statement. The result set has the single column `rowid`.
+ 
+ @param indexName The name of the R*Tree table.
+ @param minX Left edge of the query box.
+ @param maxX Right edge of the query box.
+ @param minY Bottom edge of the query box.
+ @param maxY Top edge of the query box.
+ @param limit Maximum number of rows; `0` for no limit.
+ 
+ @return `MSResultSet` of candidate rowids; `nil` on error.
+ */
+
+- (MSResultSet *)searchSpatialIndex:(NSString *)indexName intersectingMinX:(double)minX maxX:(double)maxX minY:(double)minY maxY:(double)maxY limit:(NSUInteger)limit;
+
+/** Rowids of the boxes nearest to a point, nearest first.
+ 
+ Searches a square of half-width `radius` around the point and doubles it until `count` candidates are found or the square covers the whole index, then widens the square once more to the distance of the farthest candidate so that no nearer box outside the square is missed. Distance is Euclidean, from the point to the closest edge of each box, in the units of the coordinates.
+ 
+ @param indexName The name of the R*Tree table.
+ @param x X coordinate of the point.
+ @param y Y coordinate of the point.
+ @param radius Half-width of the first square searched; pick roughly the expected distance to the `count`th neighbour.
+ @param count Number of rowids wanted.
+ 
+ @return Array of `NSNumber` rowids, at most `count` long; `nil` on error.
+ */
+
+- (NSArray *)rowidsNearestInSpatialIndex:(NSString *)indexName x:(double)x y:(double)y radius:(double)radius count:(NSUInteger)count;
+
+@end
@@ -0,0 +1,381 @@
+//  MSDatabaseSpatialIndex.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseSpatialIndex.h"
+#import "MSDatabaseAdditions.h"
+#import "MSResultSet.h"
+#import <math.h>
+
+@interface MSDatabase (PrivateStuff)
+- (NSError*)errorWithMessage:(NSString*)message;
+@end
+
+#define MSDBSpatialFetchBatchSize 1024
+#define MSDBSpatialHilbertOrder 65536
+
+typedef struct {
+    sqlite_int64    rowid;
+    double          box[4];     // minX, maxX, minY, maxY
+    uint64_t        key;
+} MSDBSpatialEntry;
+
+// Distance along a Hilbert curve filling an n x n grid, n a power of two.
+static uint64_t MSDBHilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+    
+    uint64_t d = 0;
+    
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        
+        uint32_t rx = (x & s) > 0;
+        uint32_t ry = (y & s) > 0;
+        
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            uint32_t t = x;
+            x = y;
+            y = t;
+        }
+    }
+    
+    return d;
+}
+
+static uint32_t MSDBSpatialGridCoordinate(double value, double min, double extent) {
+    if (extent <= 0) {
+        return 0;
+    }
+    double cell = (value - min) / extent * (MSDBSpatialHilbertOrder - 1);
+    return (uint32_t)fmin(fmax(cell, 0), MSDBSpatialHilbertOrder - 1);
+}
+
+static int MSDBSpatialEntryCompare(const void *a, const void *b) {
+    uint64_t ka = ((const MSDBSpatialEntry *)a)->key;
+    uint64_t kb = ((const MSDBSpatialEntry *)b)->key;
+    return ka < kb ? -1 : (ka > kb ? 1 : 0);
+}
+
+@implementation MSDatabase (MSDatabaseSpatialIndex)
+
+- (BOOL)spatialSetError:(NSError **)outErr {
+    if (outErr) {
+        *outErr = [self lastError];
+    }
+    return NO;
+}
+
+- (BOOL)checkSpatialColumns:(NSArray *)columns error:(NSError **)outErr {
+    
+    if ([columns count] == 4) {
+        return YES;
+    }
+    
+    MSDBLogWarning(@"A spatial index needs exactly four columns (minX, maxX, minY, maxY), got %@", columns);
+    if (outErr) {
+        *outErr = [self errorWithMessage:@"A spatial index needs exactly four columns"];
+    }
+    return NO;
+}
+
+- (BOOL)createSpatialIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns error:(NSError **)outErr {
+    
+    if (![self checkSpatialColumns:columns error:outErr]) {
+        return NO;
+    }
+    
+    NSString *idx   = MSDBQuoteIdentifier(indexName);
+    NSString *table = MSDBQuoteIdentifier(tableName);
+    
+    NSMutableArray *newValues   = [NSMutableArray arrayWithCapacity:4];
+    NSMutableArray *newNotNull  = [NSMutableArray arrayWithCapacity:4];
+    for (NSString *column in columns) {
+        NSString *value = [@"new." stringByAppendingString:MSDBQuoteIdentifier(column)];
+        [newValues addObject:value];
+        [newNotNull addObject:[value stringByAppendingString:@" IS NOT NULL"]];
+    }
+    NSString *values    = [newValues componentsJoinedByString:@", "];
+    NSString *notNull   = [newNotNull componentsJoinedByString:@" AND "];
+    BOOL existed        = [self tableExists:indexName];
+    
+    NSMutableString *sql = [NSMutableString string];
+    [sql appendFormat:@"CREATE VIRTUAL TABLE IF NOT EXISTS %@ USING rtree(id, minX, maxX, minY, maxY);\n", idx];
+    [sql appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER INSERT ON %@ WHEN %@ BEGIN INSERT OR REPLACE INTO %@ VALUES (new.rowid, %@); END;\n",
+     MSDBQuoteIdentifier([indexName stringByAppendingString:@"_ai"]), table, notNull, idx, values];
+    [sql appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER DELETE ON %@ BEGIN DELETE FROM %@ WHERE id = old.rowid; END;\n",
+     MSDBQuoteIdentifier([indexName stringByAppendingString:@"_ad"]), table, idx];
+    // A row whose coordinates become NULL drops out of the index; the second statement puts it back otherwise.
+    [sql appendFormat:@"CREATE TRIGGER IF NOT EXISTS %@ AFTER UPDATE ON %@ BEGIN DELETE FROM %@ WHERE id = old.rowid; INSERT OR REPLACE INTO %@ SELECT new.rowid, %@ WHERE %@; END;\n",
+     MSDBQuoteIdentifier([indexName stringByAppendingString:@"_au"]), table, idx, idx, values, notNull];
+    
+    NSString *savepoint = @"msdb_rtree_create";
+    if (![self startSavePointWithName:savepoint error:outErr]) {
+        return NO;
+    }
+    
+    BOOL success = [self executeStatements:sql];
+    NSError *err = success ? nil : [self lastError];
+    
+    if (success && !existed) {
+        success = [self bulkLoadSpatialIndex:indexName onTable:tableName columns:columns error:&err];
+    }
+    
+    if (!success) {
+        [self rollbackToSavePointWithName:savepoint error:nil];
+        [self releaseSavePointWithName:savepoint error:nil];
+        if (outErr) {
+            *outErr = err;
+        }
+        return NO;
+    }
+    
+    return [self releaseSavePointWithName:savepoint error:outErr];
+}
+
+- (BOOL)dropSpatialIndex:(NSString *)indexName error:(NSError **)outErr {
+    
+    NSMutableString *sql = [NSMutableString string];
+    for (NSString *suffix in [NSArray arrayWithObjects:@"_ai", @"_ad", @"_au", nil]) {
+        [sql appendFormat:@"DROP TRIGGER IF EXISTS %@;\n", MSDBQuoteIdentifier([indexName stringByAppendingString:suffix])];
+    }
+    [sql appendFormat:@"DROP TABLE IF EXISTS %@;\n", MSDBQuoteIdentifier(indexName)];
+    
+    if (![self executeStatements:sql]) {
+        return [self spatialSetError:outErr];
+    }
+    return YES;
+}
+
+// Every row of `sql`, sorted by the Hilbert index of each box centre; malloc'd, the caller frees it. NULL on failure.
+- (MSDBSpatialEntry *)sortedSpatialEntriesForQuery:(NSString *)sql count:(size_t *)outCount error:(NSError **)outErr {
+    
+    MSResultSet *rs = [self executeQuery:sql];
+    if (!rs) {
+        [self spatialSetError:outErr];
+        return NULL;
+    }
+    
+    static const MSDBFieldDescriptor fields[] = {
+        { 0, offsetof(MSDBSpatialEntry, rowid),  MSDBFieldTypeInt64,  MSDBFieldStorageArena },
+        { 1, offsetof(MSDBSpatialEntry, box[0]), MSDBFieldTypeDouble, MSDBFieldStorageArena },
+        { 2, offsetof(MSDBSpatialEntry, box[1]), MSDBFieldTypeDouble, MSDBFieldStorageArena },
+        { 3, offsetof(MSDBSpatialEntry, box[2]), MSDBFieldTypeDouble, MSDBFieldStorageArena },
+        { 4, offsetof(MSDBSpatialEntry, box[3]), MSDBFieldTypeDouble, MSDBFieldStorageArena },
+    };
+    
+    size_t capacity = MSDBSpatialFetchBatchSize;
+    size_t count    = 0;
+    MSDBSpatialEntry *entries = malloc(capacity * sizeof(MSDBSpatialEntry));
+    
+    NSInteger fetched = 0;
+    NSError *err = nil;
+    
+    while (entries && (fetched = [rs fillStructs:entries + count stride:sizeof(MSDBSpatialEntry) maxRows:MSDBSpatialFetchBatchSize descriptors:fields count:5 arena:NULL error:&err]) > 0) {
+        
+        count += (size_t)fetched;
+        
+        if (capacity - count < MSDBSpatialFetchBatchSize) {
+            capacity *= 2;
+            MSDBSpatialEntry *grown = realloc(entries, capacity * sizeof(MSDBSpatialEntry));
+            if (!grown) {
+                free(entries);
+            }
+            entries = grown;
+        }
+    }
+    
+    [rs close];
+    
+    if (!entries || fetched < 0) {
+        free(entries);
+        if (!entries) {
+            MSDBLogError(@"Out of memory reading spatial boxes");
+            err = [self errorWithMessage:@"Out of memory loading spatial index"];
+        }
+        if (outErr) {
+            *outErr = err;
+        }
+        return NULL;
+    }
+    
+    // Sort by the Hilbert index of each box centre, on a grid spanning the extent of all centres.
+    double minCX = INFINITY, maxCX = -INFINITY, minCY = INFINITY, maxCY = -INFINITY;
+    for (size_t i = 0; i < count; i++) {
+        double cx = (entries[i].box[0] + entries[i].box[1]) / 2;
+        double cy = (entries[i].box[2] + entries[i].box[3]) / 2;
+        minCX = fmin(minCX, cx);
+        maxCX = fmax(maxCX, cx);
+        minCY = fmin(minCY, cy);
+        maxCY = fmax(maxCY, cy);
+    }
+    
+    for (size_t i = 0; i < count; i++) {
+        double cx = (entries[i].box[0] + entries[i].box[1]) / 2;
+        double cy = (entries[i].box[2] + entries[i].box[3]) / 2;
+        entries[i].key = MSDBHilbertIndex(MSDBSpatialHilbertOrder,
+                                          MSDBSpatialGridCoordinate(cx, minCX, maxCX - minCX),
+                                          MSDBSpatialGridCoordinate(cy, minCY, maxCY - minCY));
+    }
+    
+    qsort(entries, count, sizeof(MSDBSpatialEntry), MSDBSpatialEntryCompare);
+    
+    *outCount = count;
+    return entries;
+}
+
+- (BOOL)bulkLoadSpatialIndex:(NSString *)indexName onTable:(NSString *)tableName columns:(NSArray *)columns error:(NSError **)outErr {
+    
+    if (![self checkSpatialColumns:columns error:outErr]) {
+        return NO;
+    }
+    
+    NSMutableArray *quoted  = [NSMutableArray arrayWithCapacity:4];
+    NSMutableArray *notNull = [NSMutableArray arrayWithCapacity:4];
+    for (NSString *column in columns) {
+        [quoted addObject:MSDBQuoteIdentifier(column)];
+        [notNull addObject:[MSDBQuoteIdentifier(column) stringByAppendingString:@" IS NOT NULL"]];
+    }
+    
+    NSString *selectSQL = [NSString stringWithFormat:@"SELECT rowid, %@ FROM %@ WHERE %@",
+                           [quoted componentsJoinedByString:@", "], MSDBQuoteIdentifier(tableName), [notNull componentsJoinedByString:@" AND "]];
+    NSString *idx       = MSDBQuoteIdentifier(indexName);
+    NSString *insertSQL = [NSString stringWithFormat:@"INSERT OR REPLACE INTO %@ VALUES (?, ?, ?, ?, ?)", idx];
+    
+    // Read, clear and insert under one savepoint: the boxes read cannot go stale through other writers' triggers before they are inserted, and a failure leaves the index as it was.
+    NSString *savepoint = @"msdb_rtree_load";
+    if (![self startSavePointWithName:savepoint error:outErr]) {
+        return NO;
+    }
+    
+    NSError *err    = nil;
+    size_t count    = 0;
+    MSDBSpatialEntry *entries = [self sortedSpatialEntriesForQuery:selectSQL count:&count error:&err];
+    
+    BOOL success = entries && [self executeUpdate:[NSString stringWithFormat:@"DELETE FROM %@", idx]];
+    
+    for (size_t i = 0; success && i < count; i++) {
+        
+        MSDBSpatialEntry *entry = &entries[i];
+        NSArray *arguments = [NSArray arrayWithObjects:[NSNumber numberWithLongLong:entry->rowid],
+                              [NSNumber numberWithDouble:entry->box[0]], [NSNumber numberWithDouble:entry->box[1]],
+                              [NSNumber numberWithDouble:entry->box[2]], [NSNumber numberWithDouble:entry->box[3]], nil];
+        
+        success = [self executeCachedUpdate:insertSQL withArgumentsInArray:arguments];
+    }
+    
+    free(entries);
+    
+    if (!success) {
+        if (!err) {
+            err = [self lastError];
+        }
+        [self rollbackToSavePointWithName:savepoint error:nil];
+        [self releaseSavePointWithName:savepoint error:nil];
+        if (outErr) {
+            *outErr = err;
+        }
+        return NO;
+    }
+    
+    return [self releaseSavePointWithName:savepoint error:outErr];
+}
+
+- (MSResultSet *)searchSpatialIndex:(NSString *)indexName intersectingMinX:(double)minX maxX:(double)maxX minY:(double)minY maxY:(double)maxY limit:(NSUInteger)limit {
+    
+    NSString *sql = [NSString stringWithFormat:@"SELECT id AS rowid FROM %@ WHERE minX <= ?2 AND maxX >= ?1 AND minY <= ?4 AND maxY >= ?3 LIMIT ?5",
+                     MSDBQuoteIdentifier(indexName)];
+    
+    return [self executeCachedQuery:sql withArgumentsInArray:[NSArray arrayWithObjects:[NSNumber numberWithDouble:minX], [NSNumber numberWithDouble:maxX], [NSNumber numberWithDouble:minY], [NSNumber numberWithDouble:maxY],
+                                                            [NSNumber numberWithLongLong:limit ? (long long)limit : -1LL], nil]];
+}
+
+// Up to `count` rowids in the square of half-width `radius` around the point, nearest first.
+- (NSArray *)rowidsInSpatialIndex:(NSString *)indexName x:(double)x y:(double)y radius:(double)radius count:(NSUInteger)count farthestDistance:(double *)farthest {
+    
+    NSString *sql = [NSString stringWithFormat:
+                     @"SELECT id, dx * dx + dy * dy AS d2 FROM (SELECT id, max(minX - ?1, ?1 - maxX, 0) AS dx, max(minY - ?2, ?2 - maxY, 0) AS dy FROM %@ "
+                     @"WHERE minX <= ?1 + ?3 AND maxX >= ?1 - ?3 AND minY <= ?2 + ?3 AND maxY >= ?2 - ?3) ORDER BY d2 LIMIT ?4",
+                     MSDBQuoteIdentifier(indexName)];
+    
+    MSResultSet *rs = [self executeCachedQuery:sql withArgumentsInArray:[NSArray arrayWithObjects:[NSNumber numberWithDouble:x], [NSNumber numberWithDouble:y], [NSNumber numberWithDouble:radius], [NSNumber numberWithUnsignedInteger:count], nil]];
+    if (!rs) {
+        return nil;
+    }
+    
+    NSMutableArray *rowids = [NSMutableArray arrayWithCapacity:count];
+    double d2 = 0;
+    
+    while ([rs next]) {
+        [rowids addObject:[NSNumber numberWithLongLong:[rs longLongIntForColumnIndex:0]]];
+        d2 = [rs doubleForColumnIndex:1];
+    }
+    
+    [rs close];
+    
+    *farthest = sqrt(d2);
+    
+    return rowids;
+}
+
+- (NSArray *)rowidsNearestInSpatialIndex:(NSString *)indexName x:(double)x y:(double)y radius:(double)radius count:(NSUInteger)count {
+    
+    if (!count) {
+        return [NSArray array];
+    }
+    
+    if (!(radius > 0)) {
+        radius = 1;
+    }
+    
+    BOOL haveExtent = NO;
+    double extent[4] = { 0, 0, 0, 0 };
+    
+    while (YES) {
+        
+        double farthest = 0;
+        NSArray *rowids = [self rowidsInSpatialIndex:indexName x:x y:y radius:radius count:count farthestDistance:&farthest];
+        
+        if (!rowids) {
+            return nil;
+        }
+        
+        if ([rowids count] >= count) {
+            // A box in a corner of the square can be farther than one just outside an edge.
+            if (farthest > radius) {
+                rowids = [self rowidsInSpatialIndex:indexName x:x y:y radius:farthest count:count farthestDistance:&farthest];
+            }
+            return rowids;
+        }
+        
+        if (!haveExtent) {
+            MSResultSet *rs = [self executeQuery:[NSString stringWithFormat:@"SELECT min(minX), max(maxX), min(minY), max(maxY) FROM %@", MSDBQuoteIdentifier(indexName)]];
+            if (!rs) {
+                return nil;
+            }
+            BOOL empty = ![rs next] || [rs columnIndexIsNull:0];
+            for (int i = 0; !empty && i < 4; i++) {
+                extent[i] = [rs doubleForColumnIndex:i];
+            }
+            [rs close];
+            if (empty) {
+                return rowids;
+            }
+            haveExtent = YES;
+        }
+        
+        if (x - radius <= extent[0] && x + radius >= extent[1] && y - radius <= extent[2] && y + radius >= extent[3]) {
+            return rowids;
+        }
+        
+        radius *= 2;
+    }
+}
+
+@end
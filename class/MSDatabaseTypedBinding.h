@@ -0,0 +1,386 @@
+//  MSDatabaseTypedBinding.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+#import "MSDatabase.h"
+
+/** Statement checkout for `msdb::Database`, the typed binding API for Objective-C++.
+
+ `executeUpdate:` and `executeQuery:` take their arguments as `id`, so each number is boxed in an `NSNumber` by the caller, and unboxed again by `bindObject:` by checking its class and `objCType`. In Objective-C++ files, `msdb::Database` binds each argument with the `sqlite3_bind_*` function its C++ type calls for, chosen at compile time, and reads rows back as `std::tuple`s of the types asked for:
+
+    #import "MSDatabaseTypedBinding.h"
+
+    msdb::Database typed(db);
+
+    typed.exec("insert into events (ts, kind, payload) values (?, ?, ?)", ts, kind, payload);
+
+    auto rows = typed.query<int64_t, double, std::string>("select id, ts, kind from events where ts > ?", since);
+    if (rows) {
+        for (const auto &[rowid, ts, kind] : *rows) { … }
+    }
+
+    typed.each<int64_t, std::string_view>("select id, kind from events", [&](int64_t rowid, std::string_view kind) {
+        …
+    });
+
+ Supported types are the integer, enum, floating point and `bool` types; `std::string`, `std::string_view`, `const char *` and `NSString *` for text; `std::vector<uint8_t>`, `MSDBBlobRef` and `NSData *` for blobs; `std::nullptr_t` for `NULL`; and `std::optional` of any of these, `std::nullopt` standing for `NULL`. Specialize `msdb::sql_type` to add others. Types that point into SQLite's row buffer, `std::string_view`, `const char *` and `MSDBBlobRef`, can only be read in `each`, and are valid until its callback returns.
+
+ Statements are prepared once and kept in the connection's statement cache, as by `<[MSDatabase executeCachedUpdate:withArgumentsInArray:]>`. Arguments are bound without being copied, since they outlive the statement's use. Errors are logged as by the rest of `MSDatabase`; read `<[MSDatabase lastError]>` for details. Needs C++17.
+
+ ### See also
+
+ - `<MSDatabase>`
+ - `<[MSResultSet fillStructs:stride:maxRows:descriptors:count:arena:error:]>`
+ */
+
+@interface MSDatabase (MSDatabaseTypedBinding)
+
+/** Take a cached statement, preparing it if needed, for `msdb::Database`.
+
+ @param sql The SQL, UTF-8.
+ @param count The number of arguments the caller will bind; must match the statement's parameters.
+
+ @return The statement, reset and marked in use; `nil` if the connection is busy, the SQL does not prepare, or `count` does not match.
+ */
+
+- (MSStatement *)checkOutStatementForQuery:(const char *)sql parameterCount:(int)count;
+
+/** Hand back a statement taken with `<checkOutStatementForQuery:parameterCount:>`; it is reset and its bindings cleared.
+
+ @param statement The statement.
+ @param rc The last result of binding or stepping it; logged if it is an error.
+ */
+
+- (void)checkInStatement:(MSStatement *)statement resultCode:(int)rc;
+
+@end
+
+#ifdef __cplusplus
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace msdb {
+
+/* How a C++ type is bound to a parameter and read from a column.
+   bind(stmt, idx, value) returns an SQLite result code; read(stmt, idx) returns the value; borrows is true
+   when the value read points into the row, and is only valid until the statement steps again. */
+template <class T, class Enable = void>
+struct sql_type;
+
+template <class T>
+struct sql_type<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, T value) { return sqlite3_bind_int64(stmt, idx, static_cast<sqlite3_int64>(value)); }
+    static T read(sqlite3_stmt *stmt, int idx) { return static_cast<T>(sqlite3_column_int64(stmt, idx)); }
+};
+
+template <class T>
+struct sql_type<T, std::enable_if_t<std::is_enum_v<T>>> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, T value) { return sqlite3_bind_int64(stmt, idx, static_cast<sqlite3_int64>(value)); }
+    static T read(sqlite3_stmt *stmt, int idx) { return static_cast<T>(sqlite3_column_int64(stmt, idx)); }
+};
+
+template <class T>
+struct sql_type<T, std::enable_if_t<std::is_floating_point_v<T>>> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, T value) { return sqlite3_bind_double(stmt, idx, static_cast<double>(value)); }
+    static T read(sqlite3_stmt *stmt, int idx) { return static_cast<T>(sqlite3_column_double(stmt, idx)); }
+};
+
+template <>
+struct sql_type<bool> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, bool value) { return sqlite3_bind_int(stmt, idx, value ? 1 : 0); }
+    static bool read(sqlite3_stmt *stmt, int idx) { return sqlite3_column_int(stmt, idx) != 0; }
+};
+
+template <>
+struct sql_type<std::nullptr_t> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, std::nullptr_t) { return sqlite3_bind_null(stmt, idx); }
+};
+
+template <>
+struct sql_type<std::string_view> {
+    static constexpr bool borrows = true;
+    static int bind(sqlite3_stmt *stmt, int idx, std::string_view value) {
+        // A null data pointer would bind NULL; an empty string must stay a string.
+        return sqlite3_bind_text64(stmt, idx, value.data() ? value.data() : "", value.size(), SQLITE_STATIC, SQLITE_UTF8);
+    }
+    static std::string_view read(sqlite3_stmt *stmt, int idx) {
+        const char *text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, idx));
+        return text ? std::string_view(text, static_cast<size_t>(sqlite3_column_bytes(stmt, idx))) : std::string_view();
+    }
+};
+
+template <>
+struct sql_type<std::string> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, const std::string &value) { return sql_type<std::string_view>::bind(stmt, idx, value); }
+    static std::string read(sqlite3_stmt *stmt, int idx) { return std::string(sql_type<std::string_view>::read(stmt, idx)); }
+};
+
+template <>
+struct sql_type<const char *> {
+    static constexpr bool borrows = true;
+    static int bind(sqlite3_stmt *stmt, int idx, const char *value) {
+        return value ? sqlite3_bind_text64(stmt, idx, value, std::strlen(value), SQLITE_STATIC, SQLITE_UTF8) : sqlite3_bind_null(stmt, idx);
+    }
+    static const char *read(sqlite3_stmt *stmt, int idx) { return reinterpret_cast<const char *>(sqlite3_column_text(stmt, idx)); }
+};
+
+template <>
+struct sql_type<char *> {
+    static constexpr bool borrows = true;
+    static int bind(sqlite3_stmt *stmt, int idx, const char *value) { return sql_type<const char *>::bind(stmt, idx, value); }
+};
+
+template <>
+struct sql_type<MSDBBlobRef> {
+    static constexpr bool borrows = true;
+    static int bind(sqlite3_stmt *stmt, int idx, const MSDBBlobRef &value) {
+        return value.bytes ? sqlite3_bind_blob(stmt, idx, value.bytes, value.length, SQLITE_STATIC) : sqlite3_bind_null(stmt, idx);
+    }
+    static MSDBBlobRef read(sqlite3_stmt *stmt, int idx) {
+        MSDBBlobRef blob;
+        blob.bytes  = sqlite3_column_blob(stmt, idx);
+        blob.length = sqlite3_column_bytes(stmt, idx);
+        return blob;
+    }
+};
+
+template <>
+struct sql_type<std::vector<uint8_t>> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, const std::vector<uint8_t> &value) {
+        // sqlite3_bind_blob binds NULL for a null pointer; an empty vector is an empty blob.
+        return sqlite3_bind_blob64(stmt, idx, value.empty() ? "" : static_cast<const void *>(value.data()), value.size(), SQLITE_STATIC);
+    }
+    static std::vector<uint8_t> read(sqlite3_stmt *stmt, int idx) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(sqlite3_column_blob(stmt, idx));
+        return std::vector<uint8_t>(bytes, bytes + sqlite3_column_bytes(stmt, idx));
+    }
+};
+
+template <>
+struct sql_type<NSString *> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, NSString *value) {
+        // UTF8String lives as long as the string or the autorelease pool, either way past the step.
+        return value ? sql_type<const char *>::bind(stmt, idx, [value UTF8String]) : sqlite3_bind_null(stmt, idx);
+    }
+    static NSString *read(sqlite3_stmt *stmt, int idx) {
+        const char *text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, idx));
+        return text ? [NSString stringWithUTF8String:text] : nil;
+    }
+};
+
+template <>
+struct sql_type<NSData *> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, NSData *value) {
+        return value ? sqlite3_bind_blob64(stmt, idx, [value length] ? [value bytes] : "", [value length], SQLITE_STATIC) : sqlite3_bind_null(stmt, idx);
+    }
+    static NSData *read(sqlite3_stmt *stmt, int idx) {
+        const void *bytes = sqlite3_column_blob(stmt, idx);
+        return bytes ? [NSData dataWithBytes:bytes length:static_cast<NSUInteger>(sqlite3_column_bytes(stmt, idx))] : nil;
+    }
+};
+
+template <class T>
+struct sql_type<std::optional<T>> {
+    static constexpr bool borrows = sql_type<T>::borrows;
+    static int bind(sqlite3_stmt *stmt, int idx, const std::optional<T> &value) {
+        return value ? sql_type<T>::bind(stmt, idx, *value) : sqlite3_bind_null(stmt, idx);
+    }
+    static std::optional<T> read(sqlite3_stmt *stmt, int idx) {
+        if (sqlite3_column_type(stmt, idx) == SQLITE_NULL) {
+            return std::nullopt;
+        }
+        return sql_type<T>::read(stmt, idx);
+    }
+};
+
+template <>
+struct sql_type<std::nullopt_t> {
+    static constexpr bool borrows = false;
+    static int bind(sqlite3_stmt *stmt, int idx, std::nullopt_t) { return sqlite3_bind_null(stmt, idx); }
+};
+
+namespace detail {
+    
+    // Argument types as the traits know them: string literals become const char *, references and const go.
+    template <class T>
+    using bound_type = std::decay_t<T>;
+    
+    template <class... Args>
+    inline int bind_all(sqlite3_stmt *stmt, const Args &... args) {
+        int rc  = SQLITE_OK;
+        int idx = 0;
+        (void)stmt;
+        (void)idx;
+        ((rc = (rc == SQLITE_OK ? sql_type<bound_type<Args>>::bind(stmt, ++idx, args) : rc)), ...);
+        return rc;
+    }
+    
+    template <class... T, size_t... I>
+    inline std::tuple<T...> read_row(sqlite3_stmt *stmt, std::index_sequence<I...>) {
+        (void)stmt;
+        return std::tuple<T...>(sql_type<T>::read(stmt, static_cast<int>(I))...);
+    }
+    
+    // A statement checked out of the connection's cache, handed back on every path, exceptions included. Retained
+    // meanwhile, since a callback that closes the connection or clears its cache would otherwise free it.
+    class lease {
+    public:
+        lease(MSDatabase *db, const char *sql, int parameterCount)
+            : db_(db), statement_([db checkOutStatementForQuery:sql parameterCount:parameterCount]), rc_(SQLITE_OK) {
+            MSDBRetain(statement_);
+        }
+        
+        ~lease() {
+            if (statement_) {
+                [db_ checkInStatement:statement_ resultCode:rc_];
+            }
+            MSDBRelease(statement_);
+        }
+        
+        lease(const lease &) = delete;
+        lease &operator=(const lease &) = delete;
+        
+        explicit operator bool() const { return statement_ != nil; }
+        sqlite3_stmt *get() const { return [statement_ statement]; }
+        
+        int result() const { return rc_; }
+        int set_result(int rc) { rc_ = rc; return rc; }
+        
+        bool has_columns(int count) const {
+            if (sqlite3_column_count(get()) >= count) {
+                return true;
+            }
+            MSDBLogError(@"Error: %d columns asked for, but the query returns %d (%s)", count, sqlite3_column_count(get()), sqlite3_sql(get()));
+            return false;
+        }
+    
+    private:
+        MSDatabase  *db_;
+        MSStatement *statement_;
+        int         rc_;
+    };
+
+} // namespace detail
+
+/* Typed binding over an MSDatabase connection; see MSDatabaseTypedBinding.h. Cheap to construct and copy,
+   it only holds the connection, which must be open and used from one thread at a time as usual. */
+class Database {
+public:
+    explicit Database(MSDatabase *db) : db_(db) {}
+    
+    MSDatabase *database() const { return db_; }
+    
+    /* Run a statement that returns no rows. Returns true once it has run to completion. */
+    template <class... Args>
+    bool exec(const char *sql, const Args &... args) const {
+        
+        detail::lease statement(db_, sql, static_cast<int>(sizeof...(Args)));
+        
+        if (!statement) {
+            return false;
+        }
+        
+        if (statement.set_result(detail::bind_all(statement.get(), args...)) != SQLITE_OK) {
+            return false;
+        }
+        
+        return statement.set_result(sqlite3_step(statement.get())) == SQLITE_DONE;
+    }
+    
+    /* Run a query and collect its rows, the first sizeof...(T) columns of each as a tuple. std::nullopt on error. */
+    template <class... T, class... Args>
+    std::optional<std::vector<std::tuple<T...>>> query(const char *sql, const Args &... args) const {
+        
+        static_assert(sizeof...(T) > 0, "query needs at least one column type");
+        static_assert(!(sql_type<T>::borrows || ...), "query keeps rows after stepping; read std::string or std::vector<uint8_t>, or use each");
+        
+        std::vector<std::tuple<T...>> rows;
+        
+        bool finished = each<T...>(sql, [&rows](const T &... values) {
+            rows.emplace_back(values...);
+        }, args...);
+        
+        if (!finished) {
+            return std::nullopt;
+        }
+        
+        return rows;
+    }
+    
+    /* Run a query and call f with the first sizeof...(T) columns of each row, as it is stepped to. If f returns
+       bool, false stops the query early. Returns true if every row was read, or f stopped early. */
+    template <class... T, class F, class... Args>
+    bool each(const char *sql, F &&f, const Args &... args) const {
+        
+        detail::lease statement(db_, sql, static_cast<int>(sizeof...(Args)));
+        
+        if (!statement || !statement.has_columns(static_cast<int>(sizeof...(T)))) {
+            return false;
+        }
+        
+        if (statement.set_result(detail::bind_all(statement.get(), args...)) != SQLITE_OK) {
+            return false;
+        }
+        
+        while (statement.set_result(sqlite3_step(statement.get())) == SQLITE_ROW) {
+            
+            auto row = detail::read_row<T...>(statement.get(), std::index_sequence_for<T...>());
+            
+            if constexpr (std::is_same_v<std::invoke_result_t<F &, T...>, bool>) {
+                if (!std::apply(f, std::move(row))) {
+                    statement.set_result(SQLITE_DONE);
+                    return true;
+                }
+            }
+            else {
+                std::apply(f, std::move(row));
+            }
+        }
+        
+        return statement.result() == SQLITE_DONE;
+    }
+    
+    /* The first column of the first row. std::nullopt if there is no row or on error. */
+    template <class T, class... Args>
+    std::optional<T> scalar(const char *sql, const Args &... args) const {
+        
+        static_assert(!sql_type<T>::borrows, "scalar keeps its value after stepping; read std::string or std::vector<uint8_t>");
+        
+        std::optional<T> value;
+        
+        each<T>(sql, [&value](const T &first) {
+            value = first;
+            return false;
+        }, args...);
+        
+        return value;
+    }
+
+private:
+    MSDatabase *db_;
+};
+
+} // namespace msdb
+
+#endif
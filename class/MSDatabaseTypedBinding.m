@@ -0,0 +1,104 @@
+//  MSDatabaseTypedBinding.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseTypedBinding.h"
+
+@interface MSDatabase ()
+- (MSStatement *)cachedStatementForQuery:(NSString *)query;
+- (void)setCachedStatement:(MSStatement *)statement forQuery:(NSString *)query;
+- (void)noteResultCode:(int)rc;
+- (void)warnInUse;
+- (BOOL)databaseExists;
+- (MSStatement *)newStatementWithHandle:(sqlite3_stmt *)pStmt;
+@end
+
+@implementation MSDatabase (MSDatabaseTypedBinding)
+
+- (MSStatement *)checkOutStatementForQuery:(const char *)sql parameterCount:(int)count {
+    
+    if (![self databaseExists]) {
+        return nil;
+    }
+    
+    if (_isExecutingStatement) {
+        [self warnInUse];
+        return nil;
+    }
+    
+    _isExecutingStatement = YES;
+    
+    if (_traceExecution) {
+        MSDBLogDebug(@"%@ typed statement: %s", self, sql);
+    }
+    
+    // Looked up without copying the SQL; only a statement new to the cache gets a copy as its key.
+    NSString *query = [[NSString alloc] initWithBytesNoCopy:(void *)sql length:strlen(sql) encoding:NSUTF8StringEncoding freeWhenDone:NO];
+    MSStatement *statement = [self cachedStatementForQuery:query];
+    MSDBRelease(query);
+    
+    if (statement) {
+        [statement reset];
+    }
+    else {
+        
+        sqlite3_stmt *pStmt = 0x00;
+        int rc = sqlite3_prepare_v2(_db, sql, -1, &pStmt, 0);
+        
+        if (SQLITE_OK != rc) {
+            [self noteResultCode:rc];
+            
+            if (_logsErrors) {
+                MSDBLogError(@"DB Error: %d \"%@\" preparing %s (%@)", [self lastErrorCode], [self lastErrorMessage], sql, _databasePath);
+            }
+            
+            if (_crashOnErrors) {
+                NSAssert(false, @"DB Error: %d \"%@\"", [self lastErrorCode], [self lastErrorMessage]);
+                abort();
+            }
+            
+            sqlite3_finalize(pStmt);
+            _isExecutingStatement = NO;
+            return nil;
+        }
+        
+        statement = [self newStatementWithHandle:pStmt];
+        [self setCachedStatement:statement forQuery:[NSString stringWithUTF8String:sql]];
+        MSDBRelease(statement);
+    }
+    
+    int queryCount = sqlite3_bind_parameter_count([statement statement]);
+    
+    if (count != queryCount) {
+        MSDBLogError(@"Error: the bind count (%d) is not correct for the # of variables in the query (%d) (%s) (typed)", count, queryCount, sql);
+        _isExecutingStatement = NO;
+        return nil;
+    }
+    
+    // Like a result set, the statement stays in use while it is stepped, but the connection is free for nested statements.
+    [statement setInUse:YES];
+    _isExecutingStatement = NO;
+    
+    return statement;
+}
+
+- (void)checkInStatement:(MSStatement *)statement resultCode:(int)rc {
+    
+    [self noteResultCode:rc];
+    
+    if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE && _logsErrors) {
+        MSDBLogError(@"Error calling sqlite3_step (%d: %s) eu: %s", rc, sqlite3_errmsg(_db), sqlite3_sql([statement statement]));
+    }
+    
+    // Bound arguments were not copied, and are about to go out of scope. A statement closed meanwhile, by close or clearCachedStatements, has none.
+    if ([statement statement]) {
+        sqlite3_clear_bindings([statement statement]);
+    }
+    [statement reset];
+    [statement setUseCount:[statement useCount] + 1];
+}
+
+@end
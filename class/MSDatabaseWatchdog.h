@@ -0,0 +1,143 @@
+//  MSDatabaseWatchdog.h
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import <Foundation/Foundation.h>
+
+@class MSDatabase;
+@class MSDatabaseCheckout;
+
+/** Block called by `<MSDatabaseWatchdog>` with each problem checkout. */
+
+typedef void (^MSDBWatchdogHandler)(MSDatabaseCheckout *checkout);
+
+/** Builds a call-site tag such as `@"Sync.m:120 -[Sync pull]"` for `inDatabaseTagged:block:` and `inTransactionTagged:block:`. */
+
+#define MSDBCallSiteTag [NSString stringWithFormat:@"%@:%d %s", [@__FILE__ lastPathComponent], __LINE__, __PRETTY_FUNCTION__]
+
+/** One use of a connection checked out of an `<MSDatabasePool>` or `<MSDatabaseQueue>`, as reported by `<MSDatabaseWatchdog>`. */
+
+@interface MSDatabaseCheckout : NSObject {
+    MSDatabase          *_database;
+    NSString            *_tag;
+    NSString            *_threadName;
+    NSTimeInterval      _startTime;
+    NSTimeInterval      _duration;
+    NSArray             *_openResultSetQueries;
+    BOOL                _finished;
+    BOOL                _reported;
+}
+
+/** The connection checked out */
+
+@property (atomic, readonly) MSDatabase *database;
+
+/** The call-site tag given at checkout; `nil` if none */
+
+@property (atomic, readonly) NSString *tag;
+
+/** Name, or description if unnamed, of the thread that checked the connection out */
+
+@property (atomic, readonly) NSString *threadName;
+
+/** Checkout time, as `timeIntervalSinceReferenceDate` */
+
+@property (atomic, readonly) NSTimeInterval startTime;
+
+/** How long the connection was, or so far has been, held */
+
+@property (atomic, readonly) NSTimeInterval duration;
+
+/** SQL of the result sets still open when the connection was handed back; empty while it is still held */
+
+@property (atomic, readonly) NSArray *openResultSetQueries;
+
+/** `NO` if the report is about a connection that is still checked out */
+
+@property (atomic, readonly) BOOL finished;
+
+@end
+
+
+/** Watches the checkouts of an `<MSDatabasePool>` or `<MSDatabaseQueue>` for connections held too long or handed back with open result sets.
+ 
+ A checkout that forgets to close a result set, or blocks on the network while holding a connection, starves every other caller of the pool or queue. The watchdog records when, where and on which thread each connection was checked out, and reports through its `<handler>`:
+ 
+ - once while the connection is still held, when a checkout passes `<longHoldThreshold>`, so a stuck caller is found while it is stuck;
+ - again when the connection comes back, with the total hold time;
+ - whenever a connection comes back with open result sets, with their SQL.
+ 
+ Pools and queues own a watchdog each; configure it through their `longHoldThreshold` and `watchdogHandler` properties.
+ 
+    pool.longHoldThreshold = 0.5;
+    [pool inDatabaseTagged:MSDBCallSiteTag block:^(MSDatabase *db) {
+        …
+    }];
+ 
+ ### See also
+ 
+ - `<MSDatabasePool>`
+ - `<MSDatabaseQueue>`
+ */
+
+@interface MSDatabaseWatchdog : NSObject {
+    NSString            *_name;
+    NSTimeInterval      _longHoldThreshold;
+    MSDBWatchdogHandler _handler;
+    
+    dispatch_queue_t    _queue;
+    dispatch_source_t   _timer;
+    NSMutableArray      *_checkouts;
+}
+
+/** Name of the pool or queue watched, used in log messages */
+
+@property (atomic, readonly) NSString *name;
+
+/** Holds longer than this many seconds are reported; `0`, the default, only reports open result sets.
+ 
+ While non-zero, a timer checks running checkouts every half threshold.
+ */
+
+@property (atomic, assign) NSTimeInterval longHoldThreshold;
+
+/** Called with each report; `nil` logs the report with `MSDBLogWarning`, so that it is dropped below the shared `<MSDatabaseLogger>`'s level or past its rate limit.
+ 
+ Reports about connections still held are delivered on a private queue, and must not use the connection. Reports about returned connections are delivered on the thread that returned it.
+ */
+
+@property (atomic, copy) MSDBWatchdogHandler handler;
+
+/** Create a watchdog.
+ 
+ @param name Name of the pool or queue watched, used in log messages.
+ 
+ @return The watchdog.
+ */
+
+- (instancetype)initWithName:(NSString *)name;
+
+/** Record that a connection was checked out.
+ 
+ @param db The connection.
+ @param tag Call-site tag; may be `nil`.
+ 
+ @return Token to pass to `<endCheckout:ofDatabase:>`; `nil` when `<longHoldThreshold>` is `0`.
+ */
+
+- (MSDatabaseCheckout *)beginCheckoutOfDatabase:(MSDatabase *)db tag:(NSString *)tag;
+
+/** Record that a connection is being handed back, and report a long hold or open result sets.
+ 
+ Call it on the thread that used the connection, before the connection becomes available to anyone else.
+ 
+ @param checkout The token returned by `<beginCheckoutOfDatabase:tag:>`; may be `nil`.
+ @param db The connection.
+ */
+
+- (void)endCheckout:(MSDatabaseCheckout *)checkout ofDatabase:(MSDatabase *)db;
+
+@end
@@ -0,0 +1,230 @@
+//  MSDatabaseWatchdog.m
+//  MSDatabase
+//
+//  Created by muser on 2023/5/15.
+//  Copyright © 2023 Mac. All rights reserved.
+//
+
+#import "MSDatabaseWatchdog.h"
+#import "MSDatabase.h"
+
+@interface MSDatabaseCheckout ()
+
+@property (atomic, assign) NSTimeInterval duration;
+@property (atomic, retain) NSArray *openResultSetQueries;
+@property (atomic, assign) BOOL finished;
+@property (atomic, assign) BOOL reported;
+
+- (instancetype)initWithDatabase:(MSDatabase *)db tag:(NSString *)tag;
+
+@end
+
+@implementation MSDatabaseCheckout
+
+@synthesize database=_database;
+@synthesize tag=_tag;
+@synthesize threadName=_threadName;
+@synthesize startTime=_startTime;
+@synthesize duration=_duration;
+@synthesize openResultSetQueries=_openResultSetQueries;
+@synthesize finished=_finished;
+@synthesize reported=_reported;
+
+- (instancetype)initWithDatabase:(MSDatabase *)db tag:(NSString *)tag {
+    
+    self = [super init];
+    
+    if (self) {
+        NSThread *thread        = [NSThread currentThread];
+        _database               = MSDBReturnRetained(db);
+        _tag                    = [tag copy];
+        _threadName             = [([[thread name] length] ? [thread name] : [thread description]) copy];
+        _startTime              = [NSDate timeIntervalSinceReferenceDate];
+        _openResultSetQueries   = MSDBReturnRetained([NSArray array]);
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_database);
+    MSDBRelease(_tag);
+    MSDBRelease(_threadName);
+    MSDBRelease(_openResultSetQueries);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"%@ %@ held %.3fs%@ by %@ on %@%@%@",
+            [super description], _database, [self duration], [self finished] ? @"" : @" so far", _tag ? _tag : @"(untagged)", _threadName,
+            [[self openResultSetQueries] count] ? @", open result sets: " : @"", [[self openResultSetQueries] componentsJoinedByString:@"; "]];
+}
+
+@end
+
+
+@implementation MSDatabaseWatchdog
+
+@synthesize name=_name;
+@synthesize handler=_handler;
+
+- (instancetype)initWithName:(NSString *)name {
+    
+    self = [super init];
+    
+    if (self) {
+        _name       = [name copy];
+        _queue      = dispatch_queue_create([[NSString stringWithFormat:@"MSDB.watchdog.%@", self] UTF8String], NULL);
+        _checkouts  = [[NSMutableArray alloc] init];
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    
+    if (_timer) {
+        // The timer fires on _queue, so once this returns no handler is running or will run.
+        dispatch_source_cancel(_timer);
+        dispatch_sync(_queue, ^{});
+        MSDBDispatchQueueRelease(_timer);
+        _timer = 0x00;
+    }
+    
+    if (_queue) {
+        MSDBDispatchQueueRelease(_queue);
+        _queue = 0x00;
+    }
+    
+    MSDBRelease(_name);
+    MSDBRelease(_handler);
+    MSDBRelease(_checkouts);
+    
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+- (NSTimeInterval)longHoldThreshold {
+    @synchronized (self) {
+        return _longHoldThreshold;
+    }
+}
+
+- (void)setLongHoldThreshold:(NSTimeInterval)longHoldThreshold {
+    
+    @synchronized (self) {
+        
+        _longHoldThreshold = longHoldThreshold;
+        
+        if (_timer) {
+            dispatch_source_cancel(_timer);
+            MSDBDispatchQueueRelease(_timer);
+            _timer = 0x00;
+        }
+        
+        if (longHoldThreshold <= 0) {
+            return;
+        }
+        
+        // Not retained: the timer would keep the watchdog alive. dealloc cancels it and drains _queue first.
+        __unsafe_unretained MSDatabaseWatchdog *unretainedSelf = self;
+        uint64_t interval = (uint64_t)(MAX(longHoldThreshold / 2, 0.01) * NSEC_PER_SEC);
+        
+        _timer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_timer(_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_timer, ^{
+            [unretainedSelf reportLongHolds];
+        });
+        dispatch_resume(_timer);
+    }
+}
+
+- (void)report:(MSDatabaseCheckout *)checkout {
+    
+    MSDBWatchdogHandler handler = [self handler];
+    
+    if (handler) {
+        handler(checkout);
+    }
+    else {
+        MSDBLogWarning(@"MSDB watchdog for %@: %@", _name, checkout);
+    }
+}
+
+// Runs on _queue.
+- (void)reportLongHolds {
+    
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSTimeInterval threshold = [self longHoldThreshold];
+    NSMutableArray *overdue = [NSMutableArray array];
+    
+    @synchronized (_checkouts) {
+        for (MSDatabaseCheckout *checkout in _checkouts) {
+            if (![checkout reported] && now - [checkout startTime] >= threshold) {
+                [checkout setReported:YES];
+                [checkout setDuration:now - [checkout startTime]];
+                [overdue addObject:checkout];
+            }
+        }
+    }
+    
+    for (MSDatabaseCheckout *checkout in overdue) {
+        [self report:checkout];
+    }
+}
+
+- (MSDatabaseCheckout *)beginCheckoutOfDatabase:(MSDatabase *)db tag:(NSString *)tag {
+    
+    if (!db || [self longHoldThreshold] <= 0) {
+        return nil;
+    }
+    
+    MSDatabaseCheckout *checkout = MSDBReturnAutoreleased([[MSDatabaseCheckout alloc] initWithDatabase:db tag:tag]);
+    
+    @synchronized (_checkouts) {
+        [_checkouts addObject:checkout];
+    }
+    
+    return checkout;
+}
+
+- (void)endCheckout:(MSDatabaseCheckout *)checkout ofDatabase:(MSDatabase *)db {
+    
+    NSArray *openQueries = [db hasOpenResultSets] ? [db queriesOfOpenResultSets] : nil;
+    BOOL longHold = NO;
+    
+    if (checkout) {
+        
+        @synchronized (_checkouts) {
+            [_checkouts removeObjectIdenticalTo:checkout];
+        }
+        
+        [checkout setDuration:[NSDate timeIntervalSinceReferenceDate] - [checkout startTime]];
+        [checkout setFinished:YES];
+        
+        NSTimeInterval threshold = [self longHoldThreshold];
+        longHold = threshold > 0 && [checkout duration] >= threshold;
+    }
+    
+    if (!longHold && ![openQueries count]) {
+        return;
+    }
+    
+    if (!checkout) {
+        // Not timed, but an open result set is still worth reporting.
+        checkout = MSDBReturnAutoreleased([[MSDatabaseCheckout alloc] initWithDatabase:db tag:nil]);
+        [checkout setFinished:YES];
+    }
+    
+    if (openQueries) {
+        [checkout setOpenResultSetQueries:openQueries];
+    }
+    
+    [self report:checkout];
+}
+
+@end
@@ -23,6 +23,70 @@
 @class MSDatabase;
 @class MSStatement;
 
+/** C type of a struct field filled by `<[MSResultSet fillStructs:stride:maxRows:descriptors:count:arena:error:]>`. */
+
+typedef NS_ENUM(int, MSDBFieldType) {
+    /** `int32_t`; `0` for `NULL`. */
+    MSDBFieldTypeInt32,
+    /** `int64_t`; `0` for `NULL`. */
+    MSDBFieldTypeInt64,
+    /** `double`; `0` for `NULL`. */
+    MSDBFieldTypeDouble,
+    /** `float`; `0` for `NULL`. */
+    MSDBFieldTypeFloat,
+    /** `BOOL`; `NO` for `NULL`. */
+    MSDBFieldTypeBool,
+    /** `const char *`, NUL terminated UTF-8; `NULL` for `NULL`. */
+    MSDBFieldTypeUTF8String,
+    /** `MSDBBlobRef`; `{NULL, 0}` for `NULL`. */
+    MSDBFieldTypeBlob,
+};
+
+/** How string and blob fields reference their bytes. */
+
+typedef NS_ENUM(int, MSDBFieldStorage) {
+    /** Copy the bytes into the caller's `MSDBArena`; they stay valid until the arena is reset. */
+    MSDBFieldStorageArena,
+    /** Point straight into SQLite's row buffer; valid only until the statement steps again, so only usable when filling one row at a time. */
+    MSDBFieldStorageBorrow,
+};
+
+/** A blob field: bytes and length. */
+
+typedef struct {
+    const void  *bytes;
+    int         length;
+} MSDBBlobRef;
+
+/** Maps one result column onto one field of a caller-defined struct. */
+
+typedef struct {
+    /** Zero-based index for column. */
+    int                 columnIdx;
+    /** Byte offset of the field in the struct, e.g. `offsetof(struct Event, ts)`. */
+    size_t              offset;
+    /** C type of the field. */
+    MSDBFieldType       type;
+    /** Ignored for numeric fields. */
+    MSDBFieldStorage    storage;
+} MSDBFieldDescriptor;
+
+/** Bump allocator that owns string and blob bytes copied by the struct decoding API. */
+
+typedef struct MSDBArena MSDBArena;
+
+/** Create an arena that allocates in blocks of `blockSize` bytes (`0` for 64 KB). */
+
+MSDBArena *MSDBArenaCreate(size_t blockSize);
+
+/** Invalidate everything copied into the arena, keeping one block for reuse. */
+
+void MSDBArenaReset(MSDBArena *arena);
+
+/** Free the arena and everything copied into it. */
+
+void MSDBArenaDestroy(MSDBArena *arena);
+
 /** Represents the results of executing a query on an `<MSDatabase>`.
  
  ### See also
@@ -30,12 +94,16 @@
  - `<MSDatabase>`
  */
 
-@interface MSResultSet : NSObject {
+@interface MSResultSet : NSObject <NSFastEnumeration> {
     MSDatabase          *_parentDB;
     MSStatement         *_statement;
     
     NSString            *_query;
     NSMutableDictionary *_columnNameToIndexMap;
+    
+    const MSDBFieldDescriptor *_validatedDescriptors;
+    int                 _validatedDescriptorCount;
+    size_t              _validatedStride;
 }
 
 ///-----------------
@@ -103,6 +171,41 @@
 
 - (BOOL)nextWithError:(NSError **)outErr;
 
+/** Decode the next rows straight into an array of C structs, without creating any Objective-C objects.
+ 
+ Each call steps the statement up to `maxRows` times and, for each row, writes the columns named by `descriptors` into the struct at `buffer + n * stride`. Fields not covered by a descriptor are left untouched.
+ 
+    struct Event { int64_t id; double ts; const char *kind; };
+    static const MSDBFieldDescriptor fields[] = {
+        { 0, offsetof(struct Event, id),   MSDBFieldTypeInt64,      MSDBFieldStorageArena },
+        { 1, offsetof(struct Event, ts),   MSDBFieldTypeDouble,     MSDBFieldStorageArena },
+        { 2, offsetof(struct Event, kind), MSDBFieldTypeUTF8String, MSDBFieldStorageArena },
+    };
+    
+    struct Event events[128];
+    MSDBArena *arena = MSDBArenaCreate(0);
+    int n;
+    while ((n = [rs fillStructs:events stride:sizeof(struct Event) maxRows:128 descriptors:fields count:3 arena:arena error:&err]) > 0) {
+        handle(events, n);
+        MSDBArenaReset(arena);
+    }
+    MSDBArenaDestroy(arena);
+ 
+ The descriptors are validated against `sqlite3_column_decltype` the first time a given descriptor array is used with this result set: integer and boolean fields need an `INTEGER` or `NUMERIC` affinity column, floating point fields a `REAL`, `INTEGER` or `NUMERIC` one, and string fields a `TEXT` one. Columns with no declared type (expressions) accept any field type; blob fields accept any column.
+ 
+ @param buffer Storage for at least `maxRows` structs.
+ @param stride `sizeof` the struct.
+ @param maxRows Maximum number of rows to decode in this call.
+ @param descriptors Column to field mapping. The array must stay unchanged while it is in use with this result set.
+ @param count Number of descriptors.
+ @param arena Receives copies of strings and blobs using `MSDBFieldStorageArena`; may be `NULL` if none do.
+ @param outErr Receives the error if validation or stepping fails; may be `nil`.
+ 
+ @return Number of rows decoded; `0` once the result set is exhausted (it is then closed); `-1` on error.
+ */
+
+- (int)fillStructs:(void *)buffer stride:(size_t)stride maxRows:(int)maxRows descriptors:(const MSDBFieldDescriptor *)descriptors count:(int)count arena:(MSDBArena *)arena error:(NSError **)outErr;
+
 /** Did the last call to `<next>` succeed in retrieving another row?
 
  @return `YES` if the last call to `<next>` succeeded in retrieving another record; `NO` if not.
@@ -114,6 +217,83 @@
 
 - (BOOL)hasAnotherRow;
 
+/** Enumerate the remaining rows, draining an autorelease pool every 256 rows.
+ 
+ @param block Called once per row, with this result set positioned on it. Set `*stop` to `YES` to end the enumeration early.
+ 
+ @return `NO` if stepping failed; `YES` otherwise, including when stopped early.
+ 
+ @see enumerateRowsWithAutoreleaseInterval:usingBlock:error:
+ */
+
+- (BOOL)enumerateRowsUsingBlock:(void (^)(MSResultSet *row, NSUInteger rowIdx, BOOL *stop))block;
+
+/** Enumerate the remaining rows, draining an autorelease pool every `interval` rows.
+ 
+ A `while ([rs next])` loop calling `<stringForColumn:>` or `<resultDictionary>` autoreleases a few objects per row, all kept until the caller's pool drains: over a million-row scan, that is gigabytes. Here the rows run inside a pool that is drained every `interval` rows, so the scan runs in constant memory without an `@autoreleasepool` of the caller's. Draining every row costs more than the rows themselves for cheap blocks; every few hundred rows the cost vanishes and memory stays small.
+ 
+    [rs enumerateRowsWithAutoreleaseInterval:256 usingBlock:^(MSResultSet *row, NSUInteger rowIdx, BOOL *stop) {
+        [index addName:[row stringForColumn:@"name"]];
+    } error:&err];
+ 
+ Objects the block keeps must be retained, as in any autorelease pool: strong references do this under ARC.
+ 
+ @param interval Rows per autorelease pool; `0` counts as `1`.
+ @param block Called once per row, with this result set positioned on it. Set `*stop` to `YES` to end the enumeration early.
+ @param outErr Receives the error if stepping fails; may be `nil`.
+ 
+ @return `NO` if stepping failed; `YES` otherwise, including when stopped early.
+ 
+ @warning The result set is closed when this method returns.
+ */
+
+- (BOOL)enumerateRowsWithAutoreleaseInterval:(NSUInteger)interval usingBlock:(void (^)(MSResultSet *row, NSUInteger rowIdx, BOOL *stop))block error:(NSError **)outErr;
+
+/** Fast enumeration over the remaining rows.
+ 
+ Each iteration steps to the next row and hands out the result set itself, positioned on that row; no row object is allocated. Unlike `<enumerateRowsUsingBlock:>`, no autorelease pool is drained: over many rows, wrap the loop body in an `@autoreleasepool` of your own.
+ 
+    for (MSResultSet *row in [db executeQuery:@"select name from users"]) {
+        @autoreleasepool {
+            [names addObject:[row stringForColumn:@"name"]];
+        }
+    }
+ 
+ The result set is closed when the rows run out; after a `break`, it stays open on the current row. Stepping errors end the loop; they are logged, as by `<next>`.
+ 
+ @param state The enumeration state.
+ @param buffer Receives the row object.
+ @param len Size of `buffer`.
+ 
+ @return `1` while there is a row; `0` at the end.
+ */
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])buffer count:(NSUInteger)len;
+
+/** Enumerate the remaining rows while a background thread reads ahead.
+ 
+ A producer thread steps the statement and decodes rows into batches of `batchSize`, keeping at most `depth` batches in a bounded ring buffer, while the calling thread runs `block` on the batches already decoded. CPU-heavy row processing therefore overlaps with SQLite stepping and decoding.
+ 
+ Each row is handed to `block` as an `NSArray` of column values, in column order, decoded as by `<objectForColumnIndex:>`; use `<columnIndexForName:>` to find a column's position. The block runs inside its own autorelease pool.
+ 
+    MSResultSet *rs = [db executeQuery:@"select id, payload from events"];
+    int payloadIdx = [rs columnIndexForName:@"payload"];
+    [rs enumerateRowsWithPrefetchBatchSize:256 depth:4 usingBlock:^(NSArray *row, NSUInteger rowIdx, BOOL *stop) {
+        process(row[payloadIdx]);
+    } error:&err];
+ 
+ @param batchSize Number of rows decoded per batch.
+ @param depth Maximum number of decoded batches waiting for the caller.
+ @param block Called once per row on the calling thread. Set `*stop` to `YES` to end the enumeration early.
+ @param outErr Receives the error if stepping fails; may be `nil`.
+ 
+ @return `NO` if stepping failed or the database was busy with another statement; `YES` otherwise, including when stopped early.
+ 
+ @warning The producer thread owns the connection for the whole scan: `block` must not use this result set or its `<MSDatabase>` (doing so trips the "currently in use" check). The result set is closed when this method returns.
+ */
+
+- (BOOL)enumerateRowsWithPrefetchBatchSize:(NSUInteger)batchSize depth:(NSUInteger)depth usingBlock:(void (^)(NSArray *row, NSUInteger rowIdx, BOOL *stop))block error:(NSError **)outErr;
+
 ///---------------------------------------------
 /// @name Retrieving information from result set
 ///---------------------------------------------
@@ -312,6 +492,66 @@
 
 - (NSData*)dataForColumnIndex:(int)columnIdx;
 
+/** Result set object for column, decoded with the codec registered for `cls`.
+ 
+ @param cls The class of object expected. A codec for it must have been registered with `<[MSDatabase registerTypeCodecForClass:binder:decoder:]>`.
+ @param columnIdx Zero-based index for column.
+ 
+ @return The decoded object; `nil` if the column is `NULL` or no decoder is registered for `cls`.
+ */
+
+- (id)objectOfClass:(Class)cls forColumnIndex:(int)columnIdx;
+
+/** Result set object for column, decoded with the codec registered for `cls`.
+ 
+ @param cls The class of object expected.
+ @param columnName `NSString` value of the name of the column.
+ 
+ @return The decoded object; `nil` if the column is `NULL` or no decoder is registered for `cls`.
+ */
+
+- (id)objectOfClass:(Class)cls forColumn:(NSString*)columnName;
+
+/** Result set `NSUUID` value for column.
+ 
+ Reads 16-byte blobs as written by `<[MSDatabase registerUUIDTypeCodec]>`, as well as the textual form.
+ 
+ @param columnIdx Zero-based index for column.
+ 
+ @return `NSUUID` value of the result set's column; `nil` if `NULL` or not a UUID.
+ */
+
+- (NSUUID*)UUIDForColumnIndex:(int)columnIdx;
+
+/** Result set `NSUUID` value for column.
+ 
+ @param columnName `NSString` value of the name of the column.
+ 
+ @return `NSUUID` value of the result set's column; `nil` if `NULL` or not a UUID.
+ */
+
+- (NSUUID*)UUIDForColumn:(NSString*)columnName;
+
+/** Result set `NSDecimalNumber` value for column.
+ 
+ Integers are unscaled with the scale given to `<[MSDatabase registerDecimalNumberTypeCodecWithScale:]>`; without that codec they are read with a scale of `0`.
+ 
+ @param columnIdx Zero-based index for column.
+ 
+ @return `NSDecimalNumber` value of the result set's column; `nil` if `NULL`.
+ */
+
+- (NSDecimalNumber*)decimalNumberForColumnIndex:(int)columnIdx;
+
+/** Result set `NSDecimalNumber` value for column.
+ 
+ @param columnName `NSString` value of the name of the column.
+ 
+ @return `NSDecimalNumber` value of the result set's column; `nil` if `NULL`.
+ */
+
+- (NSDecimalNumber*)decimalNumberForColumn:(NSString*)columnName;
+
 /** Result set `(const unsigned char *)` value for column.
 
  @param columnName `NSString` value of the name of the column.
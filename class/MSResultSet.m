@@ -11,8 +11,304 @@
 
 @interface MSDatabase ()
 - (void)resultSetDidClose:(MSResultSet *)resultSet;
+- (BOOL)beginExclusiveStatementUse;
+- (void)endExclusiveStatementUse;
+- (void)noteResultCode:(int)rc;
+- (void)recycleStatement:(MSStatement *)statement;
 @end
 
+// Rows stepped per autorelease pool by enumerateRowsUsingBlock:.
+static const NSUInteger MSDBRowAutoreleaseInterval = 256;
+
+/* Bounded single-producer/single-consumer ring of row batches used by
+   enumerateRowsWithPrefetchBatchSize:depth:usingBlock:error: */
+@interface MSDBRowBatchRing : NSObject {
+    NSCondition     *_condition;
+    NSMutableArray  *_slots;
+    NSUInteger      _capacity;
+    NSUInteger      _head;
+    NSUInteger      _count;
+    BOOL            _finished;
+    BOOL            _cancelled;
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+- (BOOL)pushBatch:(NSArray *)batch;
+- (NSArray *)popBatch;
+- (void)finish;
+- (void)cancel;
+- (BOOL)isCancelled;
+
+@end
+
+@implementation MSDBRowBatchRing
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity {
+    
+    self = [super init];
+    
+    if (self) {
+        _condition  = [[NSCondition alloc] init];
+        _capacity   = capacity;
+        _slots      = [[NSMutableArray alloc] initWithCapacity:capacity];
+        
+        for (NSUInteger i = 0; i < capacity; i++) {
+            [_slots addObject:[NSNull null]];
+        }
+    }
+    
+    return self;
+}
+
+- (void)dealloc {
+    MSDBRelease(_condition);
+    MSDBRelease(_slots);
+#if ! __has_feature(objc_arc)
+    [super dealloc];
+#endif
+}
+
+// Blocks while the ring is full. Returns NO if the consumer cancelled.
+- (BOOL)pushBatch:(NSArray *)batch {
+    
+    [_condition lock];
+    
+    while (_count == _capacity && !_cancelled) {
+        [_condition wait];
+    }
+    
+    if (_cancelled) {
+        [_condition unlock];
+        return NO;
+    }
+    
+    [_slots replaceObjectAtIndex:(_head + _count) % _capacity withObject:batch];
+    _count++;
+    
+    [_condition signal];
+    [_condition unlock];
+    
+    return YES;
+}
+
+// Blocks while the ring is empty. Returns nil once the producer has finished and the ring is drained.
+- (NSArray *)popBatch {
+    
+    [_condition lock];
+    
+    while (_count == 0 && !_finished) {
+        [_condition wait];
+    }
+    
+    NSArray *batch = nil;
+    
+    if (_count > 0) {
+        batch = [_slots objectAtIndex:_head];
+        MSDBRetain(batch);
+        MSDBAutorelease(batch);
+        [_slots replaceObjectAtIndex:_head withObject:[NSNull null]];
+        _head = (_head + 1) % _capacity;
+        _count--;
+        
+        [_condition signal];
+    }
+    
+    [_condition unlock];
+    
+    return batch;
+}
+
+- (void)finish {
+    [_condition lock];
+    _finished = YES;
+    [_condition broadcast];
+    [_condition unlock];
+}
+
+- (void)cancel {
+    [_condition lock];
+    _cancelled = YES;
+    [_condition broadcast];
+    [_condition unlock];
+}
+
+- (BOOL)isCancelled {
+    [_condition lock];
+    BOOL cancelled = _cancelled;
+    [_condition unlock];
+    return cancelled;
+}
+
+@end
+
+
+#pragma mark Struct decoding arena
+
+typedef struct MSDBArenaBlock {
+    struct MSDBArenaBlock   *next;
+    size_t                  capacity;
+    size_t                  used;
+    char                    bytes[];
+} MSDBArenaBlock;
+
+struct MSDBArena {
+    MSDBArenaBlock  *blocks;
+    size_t          blockSize;
+};
+
+MSDBArena *MSDBArenaCreate(size_t blockSize) {
+    
+    MSDBArena *arena = calloc(1, sizeof(MSDBArena));
+    
+    if (arena) {
+        arena->blockSize = blockSize ? blockSize : 64 * 1024;
+    }
+    
+    return arena;
+}
+
+void MSDBArenaReset(MSDBArena *arena) {
+    
+    if (!arena || !arena->blocks) {
+        return;
+    }
+    
+    // Keep the newest (and largest) block around for the next batch.
+    MSDBArenaBlock *block = arena->blocks->next;
+    
+    while (block) {
+        MSDBArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    
+    arena->blocks->next = NULL;
+    arena->blocks->used = 0;
+}
+
+void MSDBArenaDestroy(MSDBArena *arena) {
+    
+    if (!arena) {
+        return;
+    }
+    
+    MSDBArenaReset(arena);
+    free(arena->blocks);
+    free(arena);
+}
+
+static void *MSDBArenaCopy(MSDBArena *arena, const void *bytes, size_t length, BOOL terminate) {
+    
+    size_t needed = (length + (terminate ? 1 : 0) + 7) & ~(size_t)7;
+    MSDBArenaBlock *block = arena->blocks;
+    
+    if (!block || block->capacity - block->used < needed) {
+        
+        size_t capacity = MAX(arena->blockSize, needed);
+        
+        if (block && block->used == 0) {
+            // An empty block that is too small; replace it rather than chain it.
+            arena->blocks = block->next;
+            free(block);
+        }
+        
+        block = malloc(sizeof(MSDBArenaBlock) + capacity);
+        
+        if (!block) {
+            return NULL;
+        }
+        
+        block->capacity = capacity;
+        block->used     = 0;
+        block->next     = arena->blocks;
+        arena->blocks   = block;
+    }
+    
+    char *p = block->bytes + block->used;
+    block->used += needed;
+    
+    if (length) {
+        memcpy(p, bytes, length);
+    }
+    
+    if (terminate) {
+        p[length] = '\0';
+    }
+    
+    return p;
+}
+
+// Column affinities, as derived from a declared type by SQLite (https://www.sqlite.org/datatype3.html).
+enum {
+    MSDBAffinityUnknown = 0,    // no declared type: an expression column
+    MSDBAffinityInteger,
+    MSDBAffinityText,
+    MSDBAffinityBlob,
+    MSDBAffinityReal,
+    MSDBAffinityNumeric,
+};
+
+static int MSDBAffinityForDeclaredType(const char *declaredType) {
+    
+    if (!declaredType) {
+        return MSDBAffinityUnknown;
+    }
+    
+    if (strcasestr(declaredType, "INT")) {
+        return MSDBAffinityInteger;
+    }
+    
+    if (strcasestr(declaredType, "CHAR") || strcasestr(declaredType, "CLOB") || strcasestr(declaredType, "TEXT")) {
+        return MSDBAffinityText;
+    }
+    
+    if (!declaredType[0] || strcasestr(declaredType, "BLOB")) {
+        return MSDBAffinityBlob;
+    }
+    
+    if (strcasestr(declaredType, "REAL") || strcasestr(declaredType, "FLOA") || strcasestr(declaredType, "DOUB")) {
+        return MSDBAffinityReal;
+    }
+    
+    return MSDBAffinityNumeric;
+}
+
+static BOOL MSDBFieldTypeAcceptsAffinity(MSDBFieldType type, int affinity) {
+    
+    // Columns without a usable affinity can hold anything.
+    if (affinity == MSDBAffinityUnknown || affinity == MSDBAffinityBlob) {
+        return YES;
+    }
+    
+    switch (type) {
+        case MSDBFieldTypeInt32:
+        case MSDBFieldTypeInt64:
+        case MSDBFieldTypeBool:
+            return affinity == MSDBAffinityInteger || affinity == MSDBAffinityNumeric;
+        case MSDBFieldTypeDouble:
+        case MSDBFieldTypeFloat:
+            return affinity == MSDBAffinityReal || affinity == MSDBAffinityInteger || affinity == MSDBAffinityNumeric;
+        case MSDBFieldTypeUTF8String:
+            return affinity == MSDBAffinityText;
+        case MSDBFieldTypeBlob:
+            return YES;
+    }
+    
+    return NO;
+}
+
+static size_t MSDBFieldTypeSize(MSDBFieldType type) {
+    switch (type) {
+        case MSDBFieldTypeInt32:        return sizeof(int32_t);
+        case MSDBFieldTypeInt64:        return sizeof(int64_t);
+        case MSDBFieldTypeDouble:       return sizeof(double);
+        case MSDBFieldTypeFloat:        return sizeof(float);
+        case MSDBFieldTypeBool:         return sizeof(BOOL);
+        case MSDBFieldTypeUTF8String:   return sizeof(const char *);
+        case MSDBFieldTypeBlob:         return sizeof(MSDBBlobRef);
+    }
+    return 0;
+}
 
 @implementation MSResultSet
 @synthesize query=_query;
@@ -52,6 +348,8 @@
 
 - (void)close {
     [_statement reset];
+    // An uncached statement belongs to this result set alone; the connection takes it over.
+    [_parentDB recycleStatement:_statement];
     MSDBRelease(_statement);
     _statement = nil;
     
@@ -116,7 +414,7 @@
         return MSDBReturnAutoreleased([dict copy]);
     }
     else {
-        NSLog(@"Warning: There seem to be no columns in this set.");
+        MSDBLogWarning(@"There seem to be no columns in this set.");
     }
     
     return nil;
@@ -144,7 +442,7 @@
         return dict;
     }
     else {
-        NSLog(@"Warning: There seem to be no columns in this set.");
+        MSDBLogWarning(@"There seem to be no columns in this set.");
     }
     
     return nil;
@@ -162,8 +460,8 @@
     int rc = sqlite3_step([_statement statement]);
     
     if (SQLITE_BUSY == rc || SQLITE_LOCKED == rc) {
-        NSLog(@"%s:%d Database busy (%@)", __FUNCTION__, __LINE__, [_parentDB databasePath]);
-        NSLog(@"Database busy");
+        [_parentDB noteResultCode:rc];
+        MSDBLogInfo(@"Database busy (%@)", [_parentDB databasePath]);
         if (outErr) {
             *outErr = [_parentDB lastError];
         }
@@ -172,14 +470,14 @@
         // all is well, let's return.
     }
     else if (SQLITE_ERROR == rc) {
-        NSLog(@"Error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
+        MSDBLogError(@"Error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
         if (outErr) {
             *outErr = [_parentDB lastError];
         }
     }
     else if (SQLITE_MISUSE == rc) {
         // uh oh.
-        NSLog(@"Error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
+        MSDBLogError(@"Error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
         if (outErr) {
             if (_parentDB) {
                 *outErr = [_parentDB lastError];
@@ -195,7 +493,7 @@
     }
     else {
         // wtf?
-        NSLog(@"Unknown error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
+        MSDBLogError(@"Unknown error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
         if (outErr) {
             *outErr = [_parentDB lastError];
         }
@@ -209,6 +507,356 @@
     return (rc == SQLITE_ROW);
 }
 
+- (BOOL)enumerateRowsUsingBlock:(void (^)(MSResultSet *row, NSUInteger rowIdx, BOOL *stop))block {
+    return [self enumerateRowsWithAutoreleaseInterval:MSDBRowAutoreleaseInterval usingBlock:block error:nil];
+}
+
+- (BOOL)enumerateRowsWithAutoreleaseInterval:(NSUInteger)interval usingBlock:(void (^)(MSResultSet *row, NSUInteger rowIdx, BOOL *stop))block error:(NSError **)outErr {
+    
+    NSParameterAssert(block);
+    
+    interval = MAX(interval, (NSUInteger)1);
+    
+    // The block may drop the caller's last reference.
+    MSDBRetain(self);
+    
+    NSUInteger rowIdx   = 0;
+    BOOL stop           = NO;
+    BOOL more           = YES;
+    NSError *stepError  = nil;
+    
+    while (more && !stop) {
+        @autoreleasepool {
+            
+            for (NSUInteger i = 0; i < interval; i++) {
+                
+                NSError *err = nil;
+                
+                if (![self nextWithError:&err]) {
+                    // Taken out of the pool about to drain.
+                    stepError = MSDBReturnRetained(err);
+                    more = NO;
+                    break;
+                }
+                
+                block(self, rowIdx++, &stop);
+                
+                if (stop) {
+                    break;
+                }
+            }
+        }
+    }
+    
+    if (stepError && outErr) {
+        *outErr = stepError;
+    }
+    
+    MSDBAutorelease(stepError);
+    
+    [self close];
+    
+    MSDBRelease(self);
+    
+    return stepError == nil;
+}
+
+- (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])buffer count:(NSUInteger)len {
+    
+    if (state->state == 0) {
+        state->state        = 1;
+        state->mutationsPtr = &state->extra[0]; // rows are stepped, never mutated
+    }
+    
+    if (len == 0 || ![self next]) {
+        return 0;
+    }
+    
+    buffer[0]       = self;
+    state->itemsPtr = buffer;
+    
+    return 1;
+}
+
+- (BOOL)enumerateRowsWithPrefetchBatchSize:(NSUInteger)batchSize depth:(NSUInteger)depth usingBlock:(void (^)(NSArray *row, NSUInteger rowIdx, BOOL *stop))block error:(NSError **)outErr {
+    
+    NSParameterAssert(block);
+    
+    MSDatabase *db = _parentDB;
+    
+    if (!_statement || ![db beginExclusiveStatementUse]) {
+        if (outErr) {
+            NSDictionary* errorMessage = [NSDictionary dictionaryWithObject:@"result set is closed or its database is in use" forKey:NSLocalizedDescriptionKey];
+            *outErr = [NSError errorWithDomain:@"MSDatabase" code:SQLITE_MISUSE userInfo:errorMessage];
+        }
+        return NO;
+    }
+    
+    batchSize = MAX(batchSize, (NSUInteger)1);
+    depth     = MAX(depth, (NSUInteger)1);
+    
+    // Build the name map here, so that columnIndexForName: never races the producer.
+    [self columnNameToIndexMap];
+    
+    sqlite3_stmt *pStmt             = [_statement statement];
+    int columnCount                 = sqlite3_column_count(pStmt);
+    MSDBRowBatchRing *ring          = [[MSDBRowBatchRing alloc] initWithCapacity:depth];
+    dispatch_semaphore_t finished   = dispatch_semaphore_create(0);
+    
+    __block int stepResult          = SQLITE_ROW;
+    __block NSError *stepError      = nil;
+    
+    MSDBRetain(self);
+    
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        
+        int rc = SQLITE_ROW;
+        
+        while (rc == SQLITE_ROW && ![ring isCancelled]) {
+            @autoreleasepool {
+                
+                NSMutableArray *batch = [NSMutableArray arrayWithCapacity:batchSize];
+                
+                while ([batch count] < batchSize && (rc = sqlite3_step(pStmt)) == SQLITE_ROW) {
+                    
+                    NSMutableArray *row = [[NSMutableArray alloc] initWithCapacity:(NSUInteger)columnCount];
+                    
+                    for (int columnIdx = 0; columnIdx < columnCount; columnIdx++) {
+                        [row addObject:[self objectForColumnIndex:columnIdx]];
+                    }
+                    
+                    [batch addObject:row];
+                    MSDBRelease(row);
+                }
+                
+                if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+                    stepError = MSDBReturnRetained([db lastError]);
+                }
+                
+                if ([batch count] && ![ring pushBatch:batch]) {
+                    break;
+                }
+            }
+        }
+        
+        stepResult = rc;
+        
+        [ring finish];
+        dispatch_semaphore_signal(finished);
+    });
+    
+    NSUInteger rowIdx = 0;
+    BOOL stop = NO;
+    
+    while (!stop) {
+        @autoreleasepool {
+            
+            NSArray *batch = [ring popBatch];
+            
+            if (!batch) {
+                break;
+            }
+            
+            for (NSArray *row in batch) {
+                @autoreleasepool {
+                    block(row, rowIdx++, &stop);
+                }
+                
+                if (stop) {
+                    break;
+                }
+            }
+        }
+    }
+    
+    if (stop) {
+        [ring cancel];
+    }
+    
+    // The connection belongs to the producer until it has stopped stepping.
+    dispatch_semaphore_wait(finished, DISPATCH_TIME_FOREVER);
+    MSDBDispatchQueueRelease(finished);
+    MSDBRelease(ring);
+    
+    [db endExclusiveStatementUse];
+    
+    BOOL success = (stepResult == SQLITE_ROW || stepResult == SQLITE_DONE);
+    
+    if (!success) {
+        [db noteResultCode:stepResult];
+        MSDBLogError(@"Error calling sqlite3_step (%d: %@) rs", stepResult, [stepError localizedDescription]);
+        
+        if (outErr) {
+            *outErr = stepError;
+        }
+    }
+    
+    MSDBAutorelease(stepError);
+    
+    [self close];
+    
+    MSDBRelease(self);
+    
+    return success;
+}
+
+- (BOOL)validateFieldDescriptors:(const MSDBFieldDescriptor *)descriptors count:(int)count stride:(size_t)stride error:(NSError **)outErr {
+    
+    sqlite3_stmt *pStmt = [_statement statement];
+    int columnCount     = sqlite3_column_count(pStmt);
+    NSString *problem   = nil;
+    int code            = SQLITE_MISMATCH;
+    
+    for (int i = 0; i < count && !problem; i++) {
+        
+        const MSDBFieldDescriptor *descriptor = &descriptors[i];
+        
+        if (descriptor->columnIdx < 0 || descriptor->columnIdx >= columnCount) {
+            problem = [NSString stringWithFormat:@"descriptor %d names column %d, but the result set has %d columns", i, descriptor->columnIdx, columnCount];
+            code    = SQLITE_RANGE;
+        }
+        else if (descriptor->offset + MSDBFieldTypeSize(descriptor->type) > stride) {
+            problem = [NSString stringWithFormat:@"descriptor %d writes past the end of a %lu byte struct", i, (unsigned long)stride];
+            code    = SQLITE_RANGE;
+        }
+        else {
+            const char *declaredType = sqlite3_column_decltype(pStmt, descriptor->columnIdx);
+            
+            if (!MSDBFieldTypeAcceptsAffinity(descriptor->type, MSDBAffinityForDeclaredType(declaredType))) {
+                problem = [NSString stringWithFormat:@"descriptor %d: column '%s' is declared as %s, which does not match field type %d",
+                           i, sqlite3_column_name(pStmt, descriptor->columnIdx), declaredType, descriptor->type];
+            }
+        }
+    }
+    
+    if (problem) {
+        MSDBLogError(@"Error: %@ (%@)", problem, _query);
+        
+        if (outErr) {
+            *outErr = [NSError errorWithDomain:@"MSDatabase" code:code userInfo:[NSDictionary dictionaryWithObject:problem forKey:NSLocalizedDescriptionKey]];
+        }
+        
+        return NO;
+    }
+    
+    return YES;
+}
+
+- (int)fillStructs:(void *)buffer stride:(size_t)stride maxRows:(int)maxRows descriptors:(const MSDBFieldDescriptor *)descriptors count:(int)count arena:(MSDBArena *)arena error:(NSError **)outErr {
+    
+    sqlite3_stmt *pStmt = [_statement statement];
+    
+    if (!pStmt) {
+        return 0;
+    }
+    
+    // The offsets were checked against the stride too: a smaller one needs checking again.
+    if (descriptors != _validatedDescriptors || count != _validatedDescriptorCount || stride != _validatedStride) {
+        
+        if (![self validateFieldDescriptors:descriptors count:count stride:stride error:outErr]) {
+            return -1;
+        }
+        
+        _validatedDescriptors       = descriptors;
+        _validatedDescriptorCount   = count;
+        _validatedStride            = stride;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        
+        if (descriptors[i].type != MSDBFieldTypeUTF8String && descriptors[i].type != MSDBFieldTypeBlob) {
+            continue;
+        }
+        
+        NSString *problem = nil;
+        
+        if (descriptors[i].storage == MSDBFieldStorageBorrow && maxRows > 1) {
+            problem = @"borrowed strings and blobs are only valid until the next step; decode one row at a time";
+        }
+        else if (descriptors[i].storage == MSDBFieldStorageArena && !arena) {
+            problem = @"an arena is required to copy strings and blobs";
+        }
+        
+        if (problem) {
+            if (outErr) {
+                *outErr = [NSError errorWithDomain:@"MSDatabase" code:SQLITE_MISUSE userInfo:[NSDictionary dictionaryWithObject:problem forKey:NSLocalizedDescriptionKey]];
+            }
+            return -1;
+        }
+    }
+    
+    int rows = 0;
+    
+    while (rows < maxRows) {
+        
+        int rc = sqlite3_step(pStmt);
+        
+        if (rc == SQLITE_DONE) {
+            [self close];
+            break;
+        }
+        
+        if (rc != SQLITE_ROW) {
+            [_parentDB noteResultCode:rc];
+            MSDBLogError(@"Error calling sqlite3_step (%d: %s) rs", rc, sqlite3_errmsg([_parentDB sqliteHandle]));
+            if (outErr) {
+                *outErr = [_parentDB lastError];
+            }
+            [self close];
+            return -1;
+        }
+        
+        char *row = (char *)buffer + (size_t)rows * stride;
+        
+        for (int i = 0; i < count; i++) {
+            
+            const MSDBFieldDescriptor *descriptor = &descriptors[i];
+            void *field = row + descriptor->offset;
+            int columnIdx = descriptor->columnIdx;
+            
+            switch (descriptor->type) {
+                case MSDBFieldTypeInt32:
+                    *(int32_t *)field = sqlite3_column_int(pStmt, columnIdx);
+                    break;
+                case MSDBFieldTypeInt64:
+                    *(int64_t *)field = sqlite3_column_int64(pStmt, columnIdx);
+                    break;
+                case MSDBFieldTypeDouble:
+                    *(double *)field = sqlite3_column_double(pStmt, columnIdx);
+                    break;
+                case MSDBFieldTypeFloat:
+                    *(float *)field = (float)sqlite3_column_double(pStmt, columnIdx);
+                    break;
+                case MSDBFieldTypeBool:
+                    *(BOOL *)field = (sqlite3_column_int(pStmt, columnIdx) != 0);
+                    break;
+                case MSDBFieldTypeUTF8String: {
+                    const char *text = (const char *)sqlite3_column_text(pStmt, columnIdx);
+                    if (text && descriptor->storage == MSDBFieldStorageArena) {
+                        text = MSDBArenaCopy(arena, text, (size_t)sqlite3_column_bytes(pStmt, columnIdx), YES);
+                    }
+                    *(const char **)field = text;
+                    break;
+                }
+                case MSDBFieldTypeBlob: {
+                    MSDBBlobRef blob;
+                    blob.bytes  = sqlite3_column_blob(pStmt, columnIdx);
+                    blob.length = sqlite3_column_bytes(pStmt, columnIdx);
+                    if (blob.bytes && descriptor->storage == MSDBFieldStorageArena) {
+                        blob.bytes = MSDBArenaCopy(arena, blob.bytes, (size_t)blob.length, NO);
+                    }
+                    *(MSDBBlobRef *)field = blob;
+                    break;
+                }
+            }
+        }
+        
+        rows++;
+    }
+    
+    return rows;
+}
+
 - (BOOL)hasAnotherRow {
     return sqlite3_errcode([_parentDB sqliteHandle]) == SQLITE_ROW;
 }
@@ -222,7 +870,7 @@
         return [n intValue];
     }
     
-    NSLog(@"Warning: I could not find the column named '%@'.", columnName);
+    MSDBLogWarning(@"I could not find the column named '%@'.", columnName);
     
     return -1;
 }
@@ -277,12 +925,60 @@
     return sqlite3_column_double([_statement statement], columnIdx);
 }
 
+// The original NSString or NSData for a value stored by MSDB's column compression, or nil if
+// the column does not hold a compressed value.
+- (id)decompressedObjectForColumnIndex:(int)columnIdx {
+    
+    if (![_parentDB decompressesValues] || sqlite3_column_type([_statement statement], columnIdx) != SQLITE_BLOB) {
+        return nil;
+    }
+    
+    const void *bytes = sqlite3_column_blob([_statement statement], columnIdx);
+    int length = sqlite3_column_bytes([_statement statement], columnIdx);
+    
+    if (!MSDBCompressedValueKind(bytes, length)) {
+        return nil;
+    }
+    
+    int kind, originalLength;
+    unsigned char *original = MSDBDecompressBytes(bytes, length, &kind, &originalLength);
+    
+    if (!original) {
+        MSDBLogWarning(@"column %d holds a corrupt compressed value.", columnIdx);
+        return nil;
+    }
+    
+    id result;
+    
+    if (kind == 't') {
+        result = MSDBReturnAutoreleased([[NSString alloc] initWithBytes:original length:(NSUInteger)originalLength encoding:NSUTF8StringEncoding]);
+    }
+    else {
+        result = [NSData dataWithBytes:original length:(NSUInteger)originalLength];
+    }
+    
+    sqlite3_free(original);
+    
+    return result;
+}
+
 - (NSString*)stringForColumnIndex:(int)columnIdx {
     
     if (sqlite3_column_type([_statement statement], columnIdx) == SQLITE_NULL || (columnIdx < 0)) {
         return nil;
     }
     
+    id decompressed = [self decompressedObjectForColumnIndex:columnIdx];
+    
+    if ([decompressed isKindOfClass:[NSData class]]) {
+        NSString *s = [[NSString alloc] initWithData:decompressed encoding:NSUTF8StringEncoding];
+        return MSDBReturnAutoreleased(s);
+    }
+    
+    if (decompressed) {
+        return decompressed;
+    }
+    
     const char *c = (const char *)sqlite3_column_text([_statement statement], columnIdx);
     
     if (!c) {
@@ -303,11 +999,15 @@
 
 - (NSDate*)dateForColumnIndex:(int)columnIdx {
     
-    if (sqlite3_column_type([_statement statement], columnIdx) == SQLITE_NULL || (columnIdx < 0)) {
-        return nil;
+    if (!_parentDB) {
+        if (sqlite3_column_type([_statement statement], columnIdx) == SQLITE_NULL || (columnIdx < 0)) {
+            return nil;
+        }
+        
+        return [NSDate dateWithTimeIntervalSince1970:[self doubleForColumnIndex:columnIdx]];
     }
     
-    return [_parentDB hasDateFormatter] ? [_parentDB dateFromString:[self stringForColumnIndex:columnIdx]] : [NSDate dateWithTimeIntervalSince1970:[self doubleForColumnIndex:columnIdx]];
+    return [_parentDB dateFromStatement:[_statement statement] column:columnIdx];
 }
 
 
@@ -321,6 +1021,12 @@
         return nil;
     }
     
+    id decompressed = [self decompressedObjectForColumnIndex:columnIdx];
+    
+    if (decompressed) {
+        return [decompressed isKindOfClass:[NSString class]] ? [decompressed dataUsingEncoding:NSUTF8StringEncoding] : decompressed;
+    }
+    
     const char *dataBuffer = sqlite3_column_blob([_statement statement], columnIdx);
     int dataSize = sqlite3_column_bytes([_statement statement], columnIdx);
 
@@ -351,6 +1057,77 @@
 }
 
 
+- (id)objectOfClass:(Class)cls forColumnIndex:(int)columnIdx {
+    
+    if (sqlite3_column_type([_statement statement], columnIdx) == SQLITE_NULL || (columnIdx < 0)) {
+        return nil;
+    }
+    
+    MSDBTypeDecoderBlock decoder = [_parentDB typeDecoderForClass:cls];
+    
+    return decoder ? decoder([_statement statement], columnIdx) : nil;
+}
+
+- (id)objectOfClass:(Class)cls forColumn:(NSString*)columnName {
+    return [self objectOfClass:cls forColumnIndex:[self columnIndexForName:columnName]];
+}
+
+- (NSUUID*)UUIDForColumnIndex:(int)columnIdx {
+    
+    int columnType = sqlite3_column_type([_statement statement], columnIdx);
+    
+    if (columnType == SQLITE_NULL || (columnIdx < 0)) {
+        return nil;
+    }
+    
+    MSDBTypeDecoderBlock decoder = [_parentDB typeDecoderForClass:[NSUUID class]];
+    
+    if (decoder) {
+        return decoder([_statement statement], columnIdx);
+    }
+    
+    if (columnType == SQLITE_BLOB && sqlite3_column_bytes([_statement statement], columnIdx) == (int)sizeof(uuid_t)) {
+        return MSDBReturnAutoreleased([[NSUUID alloc] initWithUUIDBytes:sqlite3_column_blob([_statement statement], columnIdx)]);
+    }
+    
+    NSString *s = [self stringForColumnIndex:columnIdx];
+    
+    if (!s) {
+        return nil;
+    }
+    
+    return MSDBReturnAutoreleased([[NSUUID alloc] initWithUUIDString:s]);
+}
+
+- (NSUUID*)UUIDForColumn:(NSString*)columnName {
+    return [self UUIDForColumnIndex:[self columnIndexForName:columnName]];
+}
+
+- (NSDecimalNumber*)decimalNumberForColumnIndex:(int)columnIdx {
+    
+    int columnType = sqlite3_column_type([_statement statement], columnIdx);
+    
+    if (columnType == SQLITE_NULL || (columnIdx < 0)) {
+        return nil;
+    }
+    
+    MSDBTypeDecoderBlock decoder = [_parentDB typeDecoderForClass:[NSDecimalNumber class]];
+    
+    if (decoder) {
+        return decoder([_statement statement], columnIdx);
+    }
+    
+    if (columnType == SQLITE_INTEGER) {
+        return [NSDecimalNumber decimalNumberWithString:[NSString stringWithFormat:@"%lld", [self longLongIntForColumnIndex:columnIdx]]];
+    }
+    
+    return [NSDecimalNumber decimalNumberWithString:[self stringForColumnIndex:columnIdx]];
+}
+
+- (NSDecimalNumber*)decimalNumberForColumn:(NSString*)columnName {
+    return [self decimalNumberForColumnIndex:[self columnIndexForName:columnName]];
+}
+
 - (BOOL)columnIndexIsNull:(int)columnIdx {
     return sqlite3_column_type([_statement statement], columnIdx) == SQLITE_NULL;
 }
@@ -384,7 +1161,11 @@
         returnValue = [NSNumber numberWithDouble:[self doubleForColumnIndex:columnIdx]];
     }
     else if (columnType == SQLITE_BLOB) {
-        returnValue = [self dataForColumnIndex:columnIdx];
+        returnValue = [self decompressedObjectForColumnIndex:columnIdx];
+        
+        if (!returnValue) {
+            returnValue = [self dataForColumnIndex:columnIdx];
+        }
     }
     else {
         //default to a string for everything else